@@ -0,0 +1,261 @@
+#include "attention.h"
+#include "base.h"
+#include "node.h"
+#include "parallel.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+namespace Deep
+{
+namespace Attention
+{
+namespace
+{
+using StridedMap = Eigen::Map<T, 0, Eigen::OuterStride<>>;
+using ConstStridedMap = Eigen::Map<const T, 0, Eigen::OuterStride<>>;
+
+/* x [B, L * E] to the feature-major tokens [E, B * L]. */
+T toTokens(const T &x, Eigen::Index embed)
+{
+    const Eigen::Index B { x.rows() };
+    const Eigen::Index L { x.cols() / embed };
+    T tokens(embed, B * L);
+    // Step t of every sample, every L-th column from column t.
+    for (Eigen::Index t=0; t<L; ++t)
+        StridedMap(tokens.data() + t * embed, embed, B, Eigen::OuterStride<>(L * embed))
+            = x.middleCols(t * embed, embed).transpose();
+    return tokens;
+}
+
+/* Inverse of toTokens, [E, B * L] to [B, L * E]. */
+T fromTokens(const T &tokens, Eigen::Index batch)
+{
+    const Eigen::Index E { tokens.rows() };
+    const Eigen::Index L { tokens.cols() / batch };
+    T x(batch, L * E);
+    for (Eigen::Index t=0; t<L; ++t)
+        x.middleCols(t * E, E) = ConstStridedMap(tokens.data() + t * E, E, batch, Eigen::OuterStride<>(L * E)).transpose();
+    return x;
+}
+
+Eigen::Index tileCount(const Cache &cache)
+{
+    return (cache.length + cache.block - 1) / cache.block;
+}
+
+/* Attention of every head into cache.outputs and cache.logSumExp, one
+task per sample, head and tile of queries. */
+void tiledForward(Cache &cache)
+{
+    const Eigen::Index E { cache.qkv.rows() / 3 };
+    const Eigen::Index d { E / cache.heads };
+    const Eigen::Index L { cache.length };
+    const Eigen::Index tiles { tileCount(cache) };
+    const double scale { 1.0 / std::sqrt(static_cast<double>(d)) };
+    const T &qkv { cache.qkv };
+    cache.outputs.resize(E, cache.batch * L);
+    cache.logSumExp.resize(cache.heads, cache.batch * L);
+    Parallel::parallelFor(cache.batch * cache.heads * tiles, 4 * d * L * cache.block, [&](Eigen::Index begin, Eigen::Index end){
+        T probs {};
+        T acc {};
+        Eigen::ArrayXd rowMax {};
+        Eigen::ArrayXd rowSum {};
+        Eigen::ArrayXd newMax {};
+        Eigen::ArrayXd rescale {};
+        for (Eigen::Index item=begin; item<end; ++item)
+        {
+            const Eigen::Index b { item / (cache.heads * tiles) };
+            const Eigen::Index h { (item / tiles) % cache.heads };
+            const Eigen::Index q0 { b * L + (item % tiles) * cache.block };
+            const Eigen::Index nq { std::min(cache.block, b * L + L - q0) };
+            const auto Q = qkv.block(h * d, q0, d, nq);
+            rowMax.setConstant(nq, -std::numeric_limits<double>::infinity());
+            rowSum.setZero(nq);
+            acc.setZero(d, nq);
+            for (Eigen::Index k0=b*L; k0<b*L+L; k0+=cache.block)
+            {
+                const Eigen::Index nk { std::min(cache.block, b * L + L - k0) };
+                probs.noalias() = scale * Q.transpose() * qkv.block(E + h * d, k0, d, nk);
+                // Rescale what was summed so far to the new maximum of each row.
+                newMax = rowMax.max(probs.rowwise().maxCoeff().array());
+                rescale = (rowMax - newMax).exp();
+                probs = (probs.colwise() - newMax.matrix()).array().exp();
+                rowSum = rescale * rowSum + probs.rowwise().sum().array();
+                acc.array().rowwise() *= rescale.transpose();
+                acc.noalias() += qkv.block(2 * E + h * d, k0, d, nk) * probs.transpose();
+                rowMax.swap(newMax);
+            }
+            cache.outputs.block(h * d, q0, d, nq) = acc.array().rowwise() / rowSum.transpose();
+            cache.logSumExp.block(h, q0, 1, nq) = (rowMax + rowSum.log()).transpose();
+        }
+    });
+}
+
+/* Gradient of qkv given the gradient of the head outputs [E, B * L], one
+task per sample and head, which owns the columns and rows it writes. The
+probabilities of every tile are rebuilt from the saved log-sum-exp. */
+void tiledBackward(Cache &cache, const T &outputsGradient)
+{
+    const Eigen::Index E { cache.qkv.rows() / 3 };
+    const Eigen::Index d { E / cache.heads };
+    const Eigen::Index L { cache.length };
+    const double scale { 1.0 / std::sqrt(static_cast<double>(d)) };
+    const T &qkv { cache.qkv };
+    T &qkvGradient { cache.qkvGradient };
+    qkvGradient.setZero(3 * E, cache.batch * L);
+    Parallel::parallelFor(cache.batch * cache.heads, 10 * d * L * L, [&](Eigen::Index begin, Eigen::Index end){
+        T probs {};
+        T probsGradient {};
+        for (Eigen::Index item=begin; item<end; ++item)
+        {
+            const Eigen::Index b { item / cache.heads };
+            const Eigen::Index h { item % cache.heads };
+            // Softmax backward needs rowsum(dP * P) = rowsum(dO * O) of every query.
+            const Eigen::RowVectorXd outputDot { outputsGradient.block(h * d, b * L, d, L)
+                .cwiseProduct(cache.outputs.block(h * d, b * L, d, L)).colwise().sum() };
+            for (Eigen::Index k0=b*L; k0<b*L+L; k0+=cache.block)
+            {
+                const Eigen::Index nk { std::min(cache.block, b * L + L - k0) };
+                const auto K = qkv.block(E + h * d, k0, d, nk);
+                const auto V = qkv.block(2 * E + h * d, k0, d, nk);
+                auto dK = qkvGradient.block(E + h * d, k0, d, nk);
+                auto dV = qkvGradient.block(2 * E + h * d, k0, d, nk);
+                for (Eigen::Index q0=b*L; q0<b*L+L; q0+=cache.block)
+                {
+                    const Eigen::Index nq { std::min(cache.block, b * L + L - q0) };
+                    const auto Q = qkv.block(h * d, q0, d, nq);
+                    const auto dO = outputsGradient.block(h * d, q0, d, nq);
+                    probs.noalias() = scale * Q.transpose() * K;
+                    probs = (probs.colwise() - cache.logSumExp.row(h).segment(q0, nq).transpose()).array().exp();
+                    dV.noalias() += dO * probs;
+                    probsGradient.noalias() = dO.transpose() * V;
+                    probsGradient.colwise() -= outputDot.segment(q0 - b * L, nq).transpose();
+                    probsGradient = probsGradient.cwiseProduct(probs) * scale;
+                    qkvGradient.block(h * d, q0, d, nq).noalias() += K * probsGradient.transpose();
+                    dK.noalias() += Q * probsGradient;
+                }
+            }
+        }
+    });
+}
+}
+
+Cache::Cache(Eigen::Index batchSize, Eigen::Index sequenceLength, Eigen::Index numHeads, Eigen::Index blockSize):
+    batch(batchSize), length(sequenceLength), heads(numHeads), block(blockSize),
+    qkv(), outputs(), logSumExp(), mutex(), pending(0), qkvGradient()
+{
+}
+
+T Cache::gradient(Node &node, size_t operand, const T &fromGradient)
+{
+    const Eigen::Index E { node.nextNodes[3]->data.rows() };
+    // The output projection only needs the saved head outputs.
+    if (operand == 3)
+        return Parallel::matmul(toTokens(fromGradient, E), outputs.transpose());
+    if (operand == 4)
+        return toTokens(fromGradient, E).rowwise().sum();
+    // Concurrent operands wait for the first one to run the tiles.
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pending == 0)
+    {
+        node.checkVersion(3);
+        tiledBackward(*this, Parallel::matmul(node.nextNodes[3]->data.transpose(), toTokens(fromGradient, E)));
+        for (size_t i=0; i<3; ++i)
+            pending += node.nextNodes[i]->gradientFunction != gradFn::none ? 1 : 0;
+    }
+    T toGradient {};
+    if (operand == 0)
+    {
+        node.checkVersion(1);
+        toGradient = fromTokens(Parallel::matmul(node.nextNodes[1]->data.transpose(), qkvGradient), batch);
+    }
+    else if (operand == 1)
+    {
+        node.checkVersion(0);
+        toGradient = Parallel::matmul(qkvGradient, toTokens(node.nextNodes[0]->data, E).transpose());
+    }
+    else
+        toGradient = qkvGradient.rowwise().sum();
+    if (--pending <= 0)
+    {
+        pending = 0;
+        T().swap(qkvGradient);
+    }
+    return toGradient;
+}
+}
+
+std::shared_ptr<Node> multiHeadAttention(std::shared_ptr<Node> x, std::shared_ptr<Node> Win,
+    std::shared_ptr<Node> bIn, std::shared_ptr<Node> Wout, std::shared_ptr<Node> bOut,
+    int numHeads, int block)
+{
+    for (const std::shared_ptr<Node> &operand: {x, Win, bIn, Wout, bOut})
+        operand->materialize();
+    const Eigen::Index E { Wout->data.rows() };
+    if (numHeads <= 0 || block <= 0)
+        throw std::invalid_argument("Number of heads and block size must both be positive.");
+    if (E == 0 || E % numHeads != 0)
+        throw std::invalid_argument("The number of heads must divide the embedding dimension.");
+    if (Wout->data.cols() != E || Win->data.rows() != 3 * E || Win->data.cols() != E)
+        throw std::invalid_argument("Weights of attention must be [3 * E, E] and [E, E].");
+    if (bIn->data.rows() != 3 * E || bIn->data.cols() != 1 || bOut->data.rows() != E || bOut->data.cols() != 1)
+        throw std::invalid_argument("Biases of attention must be [3 * E, 1] and [E, 1].");
+    if (x->data.cols() == 0 || x->data.cols() % E != 0)
+        throw std::invalid_argument("Input of attention must be [B, L * " + std::to_string(E) + "], got "
+            + std::to_string(x->data.cols()) + " columns.");
+    const Eigen::Index B { x->data.rows() };
+    std::shared_ptr<Attention::Cache> cache { std::make_shared<Attention::Cache>(B, x->data.cols() / E, numHeads, block) };
+    // Queries, keys and values of every token in one GEMM.
+    cache->qkv = Parallel::matmul(Win->data, Attention::toTokens(x->data, E));
+    cache->qkv.colwise() += bIn->data.col(0);
+    Attention::tiledForward(*cache);
+    T y { Parallel::matmul(Wout->data, cache->outputs) };
+    y.colwise() += bOut->data.col(0);
+
+    std::shared_ptr<Node> out { std::make_shared<Node>(
+        Attention::fromTokens(y, B),
+        false,
+        std::vector<std::shared_ptr<Node>> {x, Win, bIn, Wout, bOut},
+        gradFn::attentionBackward
+    ) };
+    // Not recording, nothing will rebuild the tiles.
+    if (out->gradientFunction != gradFn::none)
+        out->saved = cache;
+    return out;
+}
+
+MultiHeadAttention::MultiHeadAttention(int embed_dim, int num_heads, int block_size, bool requires_grad):
+    embed(embed_dim), heads(num_heads), block(block_size),
+    weightsIn(nullptr), biasesIn(nullptr), weightsOut(nullptr), biasesOut(nullptr)
+{
+    if (embed_dim <= 0 || num_heads <= 0 || block_size <= 0)
+        throw std::invalid_argument("Embedding dimension, number of heads and block size must all be positive. ");
+    if (embed_dim % num_heads != 0)
+        throw std::invalid_argument("The number of heads must divide the embedding dimension. ");
+    gradFn mode { requires_grad ? gradFn::accumulateGrad : gradFn::none };
+    // Same uniform initialization as FullyConnected, over the embedding dimension.
+    std::uniform_real_distribution<double> weightDis(-std::pow(embed, -0.5), std::pow(embed, -0.5));
+    auto draw = [&](Eigen::Index rows){
+        return std::make_shared<Node>(T(T::NullaryExpr(rows, embed, [&](){return weightDis(Deep::gen);})), mode);
+    };
+    weightsIn = draw(3 * embed);
+    weightsOut = draw(embed);
+    biasesIn = std::make_shared<Node>(T(T::Zero(3 * embed, 1)), mode);
+    biasesOut = std::make_shared<Node>(T(T::Zero(embed, 1)), mode);
+}
+
+NSP MultiHeadAttention::forward(NSP in)
+{
+    return multiHeadAttention(in, weightsIn, biasesIn, weightsOut, biasesOut, heads, block);
+}
+
+std::vector<NSP> MultiHeadAttention::params()
+{
+    return std::vector<NSP> {weightsIn, biasesIn, weightsOut, biasesOut};
+}
+}
@@ -0,0 +1,81 @@
+/* Multi-head self-attention over batches of sequences, [B, L * E] like
+the recurrent layers, computed in tiles so that the [L, L] scores of a head
+are never stored. For a tile of queries, the forward walks the tiles of keys
+with an online softmax: it keeps the running maximum and sum of every query
+row, rescaling the partial output whenever the maximum grows, and only
+keeps the log-sum-exp of every row for the backward. The backward rebuilds
+the probabilities of each tile from it, so memory is linear in L, and the
+tiles of queries, keys, values and scores of a head, a few blocks of
+[d, block] doubles, stay in L2.
+Tokens are stored feature-major, [E, B * L] with column b * L + t being
+step t of sample b, so the tile of a head is a contiguous range of columns. */
+#ifndef ATTENTION_H
+#define ATTENTION_H
+#include "base.h"
+#include "node.h"
+#include <Eigen/Dense>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Deep
+{
+namespace Attention
+{
+/* Kept by the forward of an attentionBackward node for its backward. */
+struct Cache: SavedState
+{
+    Eigen::Index batch;
+    Eigen::Index length;
+    Eigen::Index heads;
+    Eigen::Index block;
+    // Projected queries, keys and values [3 * E, B * L].
+    T qkv;
+    // Output of every head before the output projection [E, B * L].
+    T outputs;
+    // Log-sum-exp of the scores of every query row [heads, B * L].
+    T logSumExp;
+    /* Gradient of qkv, computed by the first of x, Win and bIn asking for
+    its gradient, released once they have all been served. */
+    std::mutex mutex;
+    int pending;
+    T qkvGradient;
+    Cache(Eigen::Index batchSize, Eigen::Index sequenceLength, Eigen::Index numHeads, Eigen::Index blockSize);
+    /* Gradient passed to operand of the attentionBackward node, whose
+    operands are x, Win, bIn, Wout and bOut. The tiles are rebuilt once,
+    for the first of x, Win and bIn asking. */
+    T gradient(Node &node, size_t operand, const T &fromGradient) override;
+};
+}
+
+/* Self-attention of x [B, L * E] as in PyTorch's nn.MultiheadAttention,
+Win [3 * E, E] and bIn [3 * E, 1] project the queries, keys and values,
+Wout [E, E] and bOut [E, 1] the concatenated heads. Scores are tiled by
+block queries and keys. Returns [B, L * E]. Throws std::invalid_argument
+for other shapes or if numHeads doesn't divide E. */
+std::shared_ptr<Node> multiHeadAttention(std::shared_ptr<Node> x, std::shared_ptr<Node> Win,
+    std::shared_ptr<Node> bIn, std::shared_ptr<Node> Wout, std::shared_ptr<Node> bOut,
+    int numHeads, int block = 64);
+
+class MultiHeadAttention: public Layer
+{
+    private:
+        int embed;
+        int heads;
+        int block;
+    public:
+        // [3 * E, E] and [3 * E, 1], the queries, keys and values stacked.
+        NSP weightsIn;
+        NSP biasesIn;
+        // [E, E] and [E, 1].
+        NSP weightsOut;
+        NSP biasesOut;
+        /* Weights initialized like FullyConnected, zero biases. */
+        MultiHeadAttention(int embed_dim, int num_heads, int block_size = 64, bool requires_grad = true);
+        /* in [B, L * embed_dim], returns [B, L * embed_dim]. */
+        NSP forward(NSP in) override;
+        std::vector<NSP> params() override;
+};
+}
+
+#endif
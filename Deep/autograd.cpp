@@ -0,0 +1,180 @@
+#include "autograd.h"
+#include "node.h"
+#include "parallel.h"
+#include <Eigen/Dense>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace Deep::Autograd
+{
+namespace
+{
+/* Bookkeeping for one node reachable from the root. */
+struct NodeState
+{
+    explicit NodeState(std::shared_ptr<Node> n):
+        node(n), mutex(), pendingConsumers(0), gradient(), hasGradient(false), operandsLeft(0) {}
+    NodeState(const NodeState&) = delete;
+    NodeState& operator=(const NodeState&) = delete;
+    // Keeps the node alive until it ran, backward may release the edges to it.
+    std::shared_ptr<Node> node;
+    std::mutex mutex;
+    // Consumers which haven't sent their gradient yet, guarded by mutex.
+    int pendingConsumers;
+    // Sum of the gradients received so far, guarded by mutex until ready.
+    T gradient;
+    bool hasGradient;
+    // Operand tasks still reading gradient, the last one frees it
+    // and releases the node.
+    std::atomic<int> operandsLeft;
+};
+
+using StateMap = std::unordered_map<Node*, std::unique_ptr<NodeState>>;
+
+/* Only nodes with a backward function pass gradients further. */
+bool propagates(const Node *node)
+{
+    return node->gradientFunction != gradFn::none && node->gradientFunction != gradFn::accumulateGrad;
+}
+
+class Executor
+{
+    public:
+        Executor(Parallel::WorkStealingPool &workPool, StateMap &nodeStates, bool retain):
+            pool(workPool), states(nodeStates), retainGraph(retain) {}
+
+        /* Hand a gradient to node, schedule its operands once every consumer reported. */
+        void deliver(Node *node, T fromGradient)
+        {
+            NodeState &state { *states.at(node) };
+            if (node->gradientFunction == gradFn::accumulateGrad)
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                node->accumulate(fromGradient);
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                if (state.hasGradient)
+                    state.gradient += fromGradient;
+                else
+                    state.gradient = std::move(fromGradient);
+                state.hasGradient = true;
+                if (--state.pendingConsumers > 0)
+                    return;
+            }
+            std::vector<size_t> operands {};
+            for (size_t i=0; i<node->nextNodes.size(); ++i)
+            {
+                if (node->nextNodes[i]->gradientFunction != gradFn::none)
+                    operands.push_back(i);
+            }
+            state.operandsLeft = static_cast<int>(operands.size());
+            NodeState *statePtr { &state };
+            for (size_t i: operands)
+            {
+                // Looked up now, the last operand task may release the edges.
+                Node *next { node->nextNodes[i].get() };
+                pool.spawn([this, statePtr, i, next]{
+                    T toGradient {};
+                    const bool sparse { statePtr->node->sparseOperand(i) };
+                    if (sparse)
+                    {
+                        std::lock_guard<std::mutex> lock(states.at(next)->mutex);
+                        statePtr->node->accumulateSparse(i, statePtr->gradient);
+                    }
+                    else
+                        toGradient = statePtr->node->gradientFor(i, statePtr->gradient);
+                    if (--statePtr->operandsLeft == 0)
+                    {
+                        T().swap(statePtr->gradient);
+                        if (!retainGraph)
+                            statePtr->node->releaseGraph();
+                        statePtr->node.reset();
+                    }
+                    if (!sparse)
+                        deliver(next, std::move(toGradient));
+                });
+            }
+            if (operands.empty())
+            {
+                if (!retainGraph)
+                    node->releaseGraph();
+                state.node.reset();
+            }
+        }
+
+    private:
+        Parallel::WorkStealingPool &pool;
+        StateMap &states;
+        const bool retainGraph;
+};
+
+std::mutex poolMutex;
+std::shared_ptr<Parallel::WorkStealingPool> backwardPool;
+
+/* Shared pool, sized like the intra-op pool. */
+std::shared_ptr<Parallel::WorkStealingPool> pool()
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+    const int numThreads { Parallel::getNumThreads() };
+    if (backwardPool == nullptr || backwardPool->size() != numThreads)
+        backwardPool = std::make_shared<Parallel::WorkStealingPool>(numThreads);
+    return backwardPool;
+}
+}
+
+void backward(std::shared_ptr<Node> root, const T &fromGradient, bool retainGraph)
+{
+    if (root->gradientFunction == gradFn::none)
+        return;
+    assert((root->data.rows() == fromGradient.rows())
+        && "Gradient doesn't have the same number of rows as data.");
+    assert((root->data.cols() == fromGradient.cols())
+        && "Gradient doesn't have the same number of cols as data.");
+    // Find the nodes gradients flow into, and count their consumers.
+    StateMap states {};
+    states[root.get()] = std::unique_ptr<NodeState>(new NodeState(root));
+    states[root.get()]->pendingConsumers = 1; // The caller.
+    std::vector<Node*> stack {root.get()};
+    while (!stack.empty())
+    {
+        Node *curr { stack.back() };
+        stack.pop_back();
+        if (!propagates(curr))
+            continue;
+        if (curr->graphReleased)
+            throw std::runtime_error("Trying to backward through a released graph, "
+                "use retainGraph = true for the first backward.");
+        for (const std::shared_ptr<Node> &next: curr->nextNodes)
+        {
+            if (next->gradientFunction == gradFn::none)
+                continue;
+            std::unique_ptr<NodeState> &state { states[next.get()] };
+            if (state == nullptr)
+            {
+                state.reset(new NodeState(next));
+                stack.push_back(next.get());
+            }
+            ++state->pendingConsumers;
+        }
+    }
+    std::shared_ptr<Parallel::WorkStealingPool> workPool { pool() };
+    Executor executor(*workPool, states, retainGraph);
+    workPool->run([&executor, &root, &fromGradient]{
+        executor.deliver(root.get(), fromGradient);
+    });
+}
+
+void backward(std::shared_ptr<Node> root, bool retainGraph)
+{
+    assert(root->data.size() == 1 && "Backward without parameter should be used "
+        "on a node with a scalar data (i.e., 1x1 matrix.)");
+    backward(root, T::Ones(1, 1), retainGraph);
+}
+}
@@ -0,0 +1,25 @@
+/* Parallel backward executor.
+Node::backward recurses through the graph one operand at a time. Here
+each node waits until all of its consumers have reported, sums what they
+sent, then computes the gradient of every operand as a separate task on
+a work-stealing pool. Independent branches and the per-operand GEMMs of
+a node (e.g. the bias, input and weight gradients of addMm) run
+concurrently. Gradients reaching a node are accumulated under a per-node
+lock, so shared nodes and leaves are updated race-free. Because incoming
+gradients are summed in completion order, results may differ from
+Node::backward in the last bits. */
+#ifndef AUTOGRAD_H
+#define AUTOGRAD_H
+#include "node.h"
+#include <Eigen/Dense>
+#include <memory>
+
+namespace Deep::Autograd
+{
+/* Same as root->backward(fromGradient, retainGraph), leaves accumulate their gradients. */
+void backward(std::shared_ptr<Node> root, const T &fromGradient, bool retainGraph = false);
+/* Same as root->backward(1.0, retainGraph), root must hold a scalar. */
+void backward(std::shared_ptr<Node> root, bool retainGraph = false);
+}
+
+#endif
@@ -18,13 +18,18 @@ inline bool fileExist (const std::string& name) {
 namespace Deep
 {
 // Using random_device is not stable, might have to change this later.
-std::mt19937 gen(std::random_device{}());
+thread_local std::mt19937 gen(std::random_device{}());
 
 std::vector<NSP> Layer::params()
 {
     throw std::invalid_argument("Please implement parameters in derived classes.");
 }
 
+std::vector<NSP> Layer::buffers()
+{
+    return std::vector<NSP> {};
+}
+
 NSP Layer::forward([[maybe_unused]] NSP in)
 {
     throw std::invalid_argument("Please implement forward pass in derived classes.");
@@ -53,6 +58,18 @@ std::vector<std::pair<std::string, NSP>> Model::namedParameters()
     return ret;
 }
 
+std::vector<std::pair<std::string, NSP>> Model::namedBuffers()
+{
+    std::vector<std::pair<std::string, NSP>> ret {};
+    for (auto it=layers.begin(); it!=layers.end(); ++it)
+    {
+        std::vector<NSP> bufs { (*it).second->buffers() };
+        for (size_t i=0; i<bufs.size(); ++i)
+            ret.push_back(std::pair<std::string, NSP> {(*it).first + ".buffer" + std::to_string(i + 1), bufs[i]});
+    }
+    return ret;
+}
+
 void Model::showParametersInfo()
 {
     std::cout << "Printing Model Parameters Information:\n";
@@ -82,6 +99,8 @@ std::vector<NSP> Model::parameters()
 void Model::saveStateDict(std::string modelPath)
 {
     std::vector<std::pair<std::string, NSP>> NP {namedParameters()};
+    for (const std::pair<std::string, NSP> &buffer: namedBuffers())
+        NP.push_back(buffer);
     json modelStateDict {};
     for (auto p: NP)
     {
@@ -103,6 +122,8 @@ void Model::loadStateDict(std::string modelPath)
     // std::cout << object << '\n';
 
     std::vector<std::pair<std::string, NSP>> NP {namedParameters()};
+    for (const std::pair<std::string, NSP> &buffer: namedBuffers())
+        NP.push_back(buffer);
     /* Using shared pointer feature, we load the eigen matrix into the named parameters. 
     Throws an error if one of the model's key cannot be found from the json file. */
     for (auto pair: NP)
@@ -20,7 +20,8 @@ inline bool fileExist (const std::string& name);
 
 namespace Deep
 {
-extern std::mt19937 gen;
+/* Every thread has its own generator, seed it to make a thread reproducible. */
+extern thread_local std::mt19937 gen;
 /* All layer types should inherited from Layer class. 
 Layer is the base class of all layers that have parameters.
 Ex: Fully Connected Layer should be derived from Layer,
@@ -32,6 +33,9 @@ class Layer
 {
     public:
         virtual std::vector<NSP> params();
+        /* State which is not trained but saved with the parameters,
+        such as running statistics. None by default. */
+        virtual std::vector<NSP> buffers();
         virtual NSP forward(NSP in);
         virtual ~Layer() = default;
 };
@@ -45,11 +49,13 @@ class Model
         std::unordered_map<std::string, std::unique_ptr<Layer>> layers;
         Model();
         std::vector<std::pair<std::string, NSP>> namedParameters();
+        /* Buffers of every layer, named layer.buffer1, layer.buffer2, ... */
+        std::vector<std::pair<std::string, NSP>> namedBuffers();
         void showParametersInfo();
         std::vector<NSP> parameters();
-        // Save model's parameters into a path.
+        // Save model's parameters and buffers into a path.
         void saveStateDict(std::string modelPath);
-        // Load model's parameters from a path.
+        // Load model's parameters and buffers from a path.
         void loadStateDict(std::string modelPath);
         virtual NSP forward(NSP in);
         virtual ~Model() = default;
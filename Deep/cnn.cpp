@@ -0,0 +1,320 @@
+#include "cnn.h"
+#include "base.h"
+#include "node.h"
+#include "parallel.h"
+#include <Eigen/Dense>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+namespace Deep
+{
+int ConvGeometry::outHeight() const
+{
+    return (height + 2 * padding - kernel) / stride + 1;
+}
+
+int ConvGeometry::outWidth() const
+{
+    return (width + 2 * padding - kernel) / stride + 1;
+}
+
+void ConvGeometry::validate() const
+{
+    if (channels <= 0 || height <= 0 || width <= 0 || kernel <= 0 || stride <= 0 || padding < 0)
+        throw std::invalid_argument("Channels, image size, kernel size and stride must be positive, "
+            "padding non-negative.");
+    if (height + 2 * padding < kernel || width + 2 * padding < kernel)
+        throw std::invalid_argument("Kernel size " + std::to_string(kernel) + " is larger than the padded "
+            + std::to_string(height) + "x" + std::to_string(width) + " image.");
+}
+
+T ConvGeometry::toMatrix() const
+{
+    T m(1, 6);
+    m << channels, height, width, kernel, stride, padding;
+    return m;
+}
+
+ConvGeometry ConvGeometry::fromMatrix(const T &m)
+{
+    return ConvGeometry { static_cast<int>(m(0, 0)), static_cast<int>(m(0, 1)), static_cast<int>(m(0, 2)),
+        static_cast<int>(m(0, 3)), static_cast<int>(m(0, 4)), static_cast<int>(m(0, 5)) };
+}
+
+const T& im2col(const T &x, const ConvGeometry &g)
+{
+    // Reused by every call of the thread, allocating only when shapes grow.
+    thread_local T samplesBuffer {};
+    thread_local T columnsBuffer {};
+    // Workers of the pool have their own thread_local buffers, they read
+    // the ones of the calling thread through these references.
+    T &samples { samplesBuffer };
+    T &columns { columnsBuffer };
+    const int H { g.height };
+    const int W { g.width };
+    const int k { g.kernel };
+    const int outW { g.outWidth() };
+    const Eigen::Index P { static_cast<Eigen::Index>(g.outHeight()) * outW };
+    // One sample per column, so a patch reads contiguous image rows.
+    samples = x.transpose();
+    columns.resize(static_cast<Eigen::Index>(g.channels) * k * k, x.rows() * P);
+    Parallel::parallelFor(columns.cols(), columns.rows(), [&](Eigen::Index begin, Eigen::Index end){
+        for (Eigen::Index col=begin; col<end; ++col)
+        {
+            const double *image { samples.col(col / P).data() };
+            const int oh { static_cast<int>(col % P) / outW };
+            const int ow { static_cast<int>(col % P) % outW };
+            double *dst { columns.col(col).data() };
+            for (int c=0; c<g.channels; ++c)
+            {
+                for (int ki=0; ki<k; ++ki)
+                {
+                    const int h { oh * g.stride + ki - g.padding };
+                    for (int kj=0; kj<k; ++kj)
+                    {
+                        const int w { ow * g.stride + kj - g.padding };
+                        *dst++ = (h >= 0 && h < H && w >= 0 && w < W) ? image[(c * H + h) * W + w] : 0.0;
+                    }
+                }
+            }
+        }
+    });
+    return columns;
+}
+
+T col2im(const T &columns, const ConvGeometry &g, Eigen::Index batch)
+{
+    const int H { g.height };
+    const int W { g.width };
+    const int k { g.kernel };
+    const int outW { g.outWidth() };
+    const Eigen::Index P { static_cast<Eigen::Index>(g.outHeight()) * outW };
+    T samples { T::Zero(static_cast<Eigen::Index>(g.channels) * H * W, batch) };
+    // Patches of a sample only overlap each other, so samples are independent.
+    Parallel::parallelFor(batch, P * columns.rows(), [&](Eigen::Index begin, Eigen::Index end){
+        for (Eigen::Index b=begin; b<end; ++b)
+        {
+            double *image { samples.col(b).data() };
+            for (Eigen::Index p=0; p<P; ++p)
+            {
+                const int oh { static_cast<int>(p) / outW };
+                const int ow { static_cast<int>(p) % outW };
+                const double *src { columns.col(b * P + p).data() };
+                for (int c=0; c<g.channels; ++c)
+                {
+                    for (int ki=0; ki<k; ++ki)
+                    {
+                        const int h { oh * g.stride + ki - g.padding };
+                        for (int kj=0; kj<k; ++kj, ++src)
+                        {
+                            const int w { ow * g.stride + kj - g.padding };
+                            if (h >= 0 && h < H && w >= 0 && w < W)
+                                image[(c * H + h) * W + w] += *src;
+                        }
+                    }
+                }
+            }
+        }
+    });
+    return samples.transpose();
+}
+
+T toChannelRows(const T &y, int channels)
+{
+    const Eigen::Index B { y.rows() };
+    const Eigen::Index P { y.cols() / channels };
+    T rows(channels, B * P);
+    Parallel::parallelFor(B, y.cols(), [&](Eigen::Index begin, Eigen::Index end){
+        for (Eigen::Index b=begin; b<end; ++b)
+        {
+            for (Eigen::Index p=0; p<P; ++p)
+            {
+                for (Eigen::Index o=0; o<channels; ++o)
+                    rows(o, b * P + p) = y(b, o * P + p);
+            }
+        }
+    });
+    return rows;
+}
+
+T fromChannelRows(const T &rows, Eigen::Index batch)
+{
+    const Eigen::Index channels { rows.rows() };
+    const Eigen::Index P { rows.cols() / batch };
+    T y(batch, channels * P);
+    Parallel::parallelFor(batch, rows.rows() * P, [&](Eigen::Index begin, Eigen::Index end){
+        for (Eigen::Index b=begin; b<end; ++b)
+        {
+            for (Eigen::Index p=0; p<P; ++p)
+            {
+                for (Eigen::Index o=0; o<channels; ++o)
+                    y(b, o * P + p) = rows(o, b * P + p);
+            }
+        }
+    });
+    return y;
+}
+
+std::shared_ptr<Node> conv2d(std::shared_ptr<Node> x, std::shared_ptr<Node> W,
+    std::shared_ptr<Node> b, const ConvGeometry &g)
+{
+    g.validate();
+    x->materialize();
+    if (x->data.cols() != static_cast<Eigen::Index>(g.channels) * g.height * g.width)
+        throw std::invalid_argument("Input of conv2d must be [B, C * H * W], got "
+            + std::to_string(x->data.cols()) + " columns.");
+    if (W->data.cols() != static_cast<Eigen::Index>(g.channels) * g.kernel * g.kernel)
+        throw std::invalid_argument("Weights of conv2d must be [outC, C * k * k].");
+    if (b != nullptr && (b->data.rows() != W->data.rows() || b->data.cols() != 1))
+        throw std::invalid_argument("Biases of conv2d must be [outC, 1].");
+    // The whole batch in a single GEMM, [outC, C * k * k] * [C * k * k, B * P].
+    T rows { Parallel::matmul(W->data, im2col(x->data, g)) };
+    if (b != nullptr)
+        rows.colwise() += b->data.col(0);
+    std::vector<std::shared_ptr<Node>> operands { x, W };
+    if (b != nullptr)
+        operands.push_back(b);
+    std::shared_ptr<Node> out { std::make_shared<Node>(
+        fromChannelRows(rows, x->data.rows()),
+        false,
+        operands,
+        gradFn::conv2dBackward
+    ) };
+    out->savedTensors = { g.toMatrix() };
+    return out;
+}
+
+std::shared_ptr<Node> maxPool2d(std::shared_ptr<Node> x, const ConvGeometry &g)
+{
+    g.validate();
+    if (2 * g.padding > g.kernel)
+        throw std::invalid_argument("Padding of maxPool2d must be at most half the kernel size.");
+    x->materialize();
+    const T &in { x->data };
+    if (in.cols() != static_cast<Eigen::Index>(g.channels) * g.height * g.width)
+        throw std::invalid_argument("Input of maxPool2d must be [B, C * H * W], got "
+            + std::to_string(in.cols()) + " columns.");
+    const int outH { g.outHeight() };
+    const int outW { g.outWidth() };
+    const Eigen::Index P { static_cast<Eigen::Index>(outH) * outW };
+    T out(in.rows(), g.channels * P);
+    // Column of x holding each maximum, exact as doubles.
+    T argmax(in.rows(), g.channels * P);
+    Parallel::parallelFor(in.rows(), in.cols(), [&](Eigen::Index begin, Eigen::Index end){
+        for (int c=0; c<g.channels; ++c)
+        {
+            for (int oh=0; oh<outH; ++oh)
+            {
+                for (int ow=0; ow<outW; ++ow)
+                {
+                    const Eigen::Index j { c * P + oh * outW + ow };
+                    for (Eigen::Index b=begin; b<end; ++b)
+                    {
+                        double best { -std::numeric_limits<double>::infinity() };
+                        Eigen::Index bestIndex { -1 };
+                        for (int ki=0; ki<g.kernel; ++ki)
+                        {
+                            const int h { oh * g.stride + ki - g.padding };
+                            if (h < 0 || h >= g.height)
+                                continue;
+                            for (int kj=0; kj<g.kernel; ++kj)
+                            {
+                                const int w { ow * g.stride + kj - g.padding };
+                                if (w < 0 || w >= g.width)
+                                    continue;
+                                const Eigen::Index i { (static_cast<Eigen::Index>(c) * g.height + h) * g.width + w };
+                                // NaN propagates like in the other reductions.
+                                if (bestIndex < 0 || in(b, i) > best || std::isnan(in(b, i)))
+                                {
+                                    best = in(b, i);
+                                    bestIndex = i;
+                                }
+                            }
+                        }
+                        out(b, j) = best;
+                        argmax(b, j) = static_cast<double>(bestIndex);
+                    }
+                }
+            }
+        }
+    });
+    std::shared_ptr<Node> outPtr { std::make_shared<Node>(
+        out,
+        false,
+        std::vector<std::shared_ptr<Node>> {x},
+        gradFn::maxPool2dBackward
+    ) };
+    outPtr->savedTensors = { g.toMatrix(), argmax };
+    return outPtr;
+}
+
+Conv2D::Conv2D(int in_channel, int out_channel, int kernel_size, int height, int width,
+    int stride, int padding, bool use_bias, bool requires_grad):
+    useBias(use_bias), requiresGrad(requires_grad), out_c(out_channel),
+    geometry { in_channel, height, width, kernel_size, stride, padding },
+    weights(nullptr), biases(nullptr)
+{
+    if (out_channel <= 0)
+        throw std::invalid_argument("Input channel and output channel must both be positive. ");
+    geometry.validate();
+    gradFn mode { requiresGrad ? gradFn::accumulateGrad : gradFn::none };
+    // Same uniform initialization as FullyConnected, over the fan-in of a patch.
+    const int fanIn { in_channel * kernel_size * kernel_size };
+    double xavierGap { std::pow(fanIn, -0.5) };
+    std::uniform_real_distribution<double> weightDis(-xavierGap, xavierGap);
+    Eigen::MatrixXd weightsData = Eigen::MatrixXd::NullaryExpr(out_c, fanIn,
+        [&](){return weightDis(Deep::gen);}
+    );
+    weights = std::make_shared<Node>(weightsData, mode);
+    if (useBias)
+        biases = std::make_shared<Node>(Eigen::MatrixXd::Zero(out_c, 1), mode);
+}
+
+NSP Conv2D::forward(NSP in)
+{
+    /* input (in) of shape [B, in_c * height * width],
+    output of shape [B, out_c * outHeight() * outWidth()]. */
+    return conv2d(in, weights, biases, geometry);
+}
+
+std::vector<NSP> Conv2D::params()
+{
+    std::vector<NSP> ret {weights};
+    if (useBias) ret.push_back(biases);
+    return ret;
+}
+
+int Conv2D::outHeight() const
+{
+    return geometry.outHeight();
+}
+
+int Conv2D::outWidth() const
+{
+    return geometry.outWidth();
+}
+
+MaxPool2D::MaxPool2D(int channels, int height, int width, int kernel_size, int stride, int padding):
+    geometry { channels, height, width, kernel_size, stride > 0 ? stride : kernel_size, padding }
+{
+    geometry.validate();
+}
+
+NSP MaxPool2D::forward(NSP in)
+{
+    return maxPool2d(in, geometry);
+}
+
+int MaxPool2D::outHeight() const
+{
+    return geometry.outHeight();
+}
+
+int MaxPool2D::outWidth() const
+{
+    return geometry.outWidth();
+}
+}
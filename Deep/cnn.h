@@ -0,0 +1,88 @@
+/* Convolution and pooling over image batches.
+Nodes stay 2D: an image batch is [B, C * H * W], each row one sample
+flattened channel by channel, then row by row (the NCHW order).
+Conv2D lowers the convolution to one GEMM over the im2col matrix of the
+whole batch, whose backward scatters back with col2im. MaxPool2D keeps
+the position of every maximum, so its backward is a scatter. */
+#ifndef CNN_H
+#define CNN_H
+#include "base.h"
+#include "node.h"
+#include <Eigen/Dense>
+#include <vector>
+
+namespace Deep
+{
+/* Shape of a sliding window over a [C, H, W] image, square kernels. */
+struct ConvGeometry
+{
+    int channels;
+    int height;
+    int width;
+    int kernel;
+    int stride;
+    int padding;
+    int outHeight() const;
+    int outWidth() const;
+    /* Throws std::invalid_argument unless the window fits the padded image. */
+    void validate() const;
+    /* Round trip through a [1, 6] matrix, kept in savedTensors. */
+    T toMatrix() const;
+    static ConvGeometry fromMatrix(const T &m);
+};
+
+/* Patches of x [B, C * H * W] as the columns of a [C * k * k, B * outH * outW]
+matrix, column b * outH * outW + p being patch p of sample b. Zero padded.
+The matrix is a buffer of the calling thread, overwritten by the next call. */
+const T& im2col(const T &x, const ConvGeometry &g);
+/* Adjoint of im2col, sum the columns back into a [B, C * H * W] batch. */
+T col2im(const T &columns, const ConvGeometry &g, Eigen::Index batch);
+
+/* Layout of the im2col GEMM output, [channels, B * P] with rows of
+patches, to and from the node layout [B, channels * P]. */
+T toChannelRows(const T &y, int channels);
+T fromChannelRows(const T &rows, Eigen::Index batch);
+
+/* x [B, C * H * W], W [outC, C * k * k], b [outC, 1] or nullptr.
+Returns [B, outC * outH * outW]. */
+std::shared_ptr<Node> conv2d(std::shared_ptr<Node> x, std::shared_ptr<Node> W,
+    std::shared_ptr<Node> b, const ConvGeometry &g);
+/* Max over every window of every channel, padding never wins. */
+std::shared_ptr<Node> maxPool2d(std::shared_ptr<Node> x, const ConvGeometry &g);
+
+class Conv2D: public Layer
+{
+    private:
+        bool useBias;
+        bool requiresGrad;
+        int out_c;
+        ConvGeometry geometry;
+    public:
+        // [out_c, in_c * k * k], the layout of PyTorch's weight.view(out_c, -1).
+        NSP weights;
+        NSP biases;
+        /* Inputs are [B, in_c * height * width] batches. */
+        Conv2D(int in_channel, int out_channel, int kernel_size, int height, int width,
+            int stride = 1, int padding = 0, bool use_bias = true, bool requires_grad = true);
+        NSP forward(NSP in) override;
+        std::vector<NSP> params() override;
+        int outHeight() const;
+        int outWidth() const;
+};
+
+/* Has no parameter, so it is not a Layer, hold it next to the layers
+of a Model and call it in forward like relu. */
+class MaxPool2D
+{
+    private:
+        ConvGeometry geometry;
+    public:
+        /* stride defaults to kernel_size, non-overlapping windows. */
+        MaxPool2D(int channels, int height, int width, int kernel_size, int stride = 0, int padding = 0);
+        NSP forward(NSP in);
+        int outHeight() const;
+        int outWidth() const;
+};
+}
+
+#endif
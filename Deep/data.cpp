@@ -0,0 +1,105 @@
+#include "data.h"
+#include "base.h"
+#include <Eigen/Dense>
+#include <sstream>
+#include <fstream>
+#include <numeric>
+#include <algorithm>
+
+namespace Deep::Data
+{
+std::vector<std::string> split(std::string s, char sep)
+{
+    std::stringstream ss( s );
+    std::vector<std::string> result {};
+
+    while( ss.good() )
+    {
+        std::string substr;
+        getline( ss, substr, sep );
+        result.push_back( substr );
+    }
+    return result;
+}   
+
+std::vector<Eigen::MatrixXd> loadData(std::string filepath)
+{
+    // Count number of rows
+    int rowCount { 0 };
+    std::ifstream file;
+    file.open(filepath);
+    std::string line;
+    getline(file, line); // ignore header
+    while (getline(file, line))
+        ++rowCount;
+    file.close();
+    
+    Eigen::MatrixXd feature(rowCount, 11);
+    Eigen::MatrixXd label(rowCount, 1);
+    file.open(filepath);
+    getline(file, line); // ignore header
+    for (int i=0; i<rowCount; ++i)
+    {
+        getline(file, line);
+        std::vector<std::string> tokens {split(line)};
+        for (int j=1; j<12; ++j)
+        {
+            feature(i, j-1) = std::stod(tokens[j]);
+        }
+        label(i, 0) = std::stod(tokens[12]);
+    }
+    file.close();
+
+    return {feature, label};
+}
+
+std::vector<Eigen::MatrixXd> selectRows(const std::vector<Eigen::MatrixXd> &dataset, const std::vector<int> &indices)
+{
+    std::vector<Eigen::MatrixXd> ret {};
+    for (const Eigen::MatrixXd &thisData: dataset)
+        ret.push_back(thisData(indices, Eigen::all));
+    return ret;
+}
+
+DataLoader1D::DataLoader1D(std::vector<Eigen::MatrixXd> dataset, int batchsize, bool shuf):
+    DataLoader1D(std::make_shared<const std::vector<Eigen::MatrixXd>>(std::move(dataset)), batchsize, shuf) {}
+
+DataLoader1D::DataLoader1D(std::shared_ptr<const std::vector<Eigen::MatrixXd>> dataset, int batchsize, bool shuf):
+    allData(dataset), batchSize(batchsize), shuffle(shuf), 
+    length(static_cast<int>((*dataset)[0].rows())), counter(0),
+    perm(std::vector<int>(length))
+{
+    resetPermutation();
+}
+
+void DataLoader1D::resetPermutation()
+{
+    std::iota(perm.begin(), perm.end(), 0);
+    if (shuffle)
+        std::shuffle(perm.begin(), perm.end(), Deep::gen);
+}
+
+std::vector<Eigen::MatrixXd> DataLoader1D::nextBatch()
+{
+    int initial = counter*batchSize;
+    std::vector<int> indices(
+        perm.begin()+initial, 
+        perm.begin()+std::min(initial+batchSize, length)
+    );
+    ++counter;
+
+    // Perform indexing            
+    return selectRows(*allData, indices);
+}
+
+bool DataLoader1D::hasNext()
+{
+    return (counter * batchSize) < length;
+}
+
+void DataLoader1D::reInitialize()
+{
+    resetPermutation();
+    counter = 0;
+}
+}
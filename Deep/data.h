@@ -0,0 +1,42 @@
+/* Dataset utilities shared by the executables, 
+such as CSV loading and a minibatch loader. */
+#ifndef DATA_H
+#define DATA_H
+#include <Eigen/Dense>
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace Deep::Data
+{
+/* Split a string by a separator character. */
+std::vector<std::string> split(std::string s, char sep = ',');
+/* Load the Wine Quality CSV file, return {feature [N, 11], label [N, 1]}. */
+std::vector<Eigen::MatrixXd> loadData(std::string filepath);
+/* Rows of every matrix in dataset picked by indices. */
+std::vector<Eigen::MatrixXd> selectRows(const std::vector<Eigen::MatrixXd> &dataset, const std::vector<int> &indices);
+
+/* Iterate over a dataset of batched 1D inputs in minibatches. 
+Every matrix in dataset should have the same number of rows.
+Loaders constructed from the same shared dataset read it without copying,
+shuffling uses the generator of the calling thread. */
+class DataLoader1D 
+{
+    public:
+        std::shared_ptr<const std::vector<Eigen::MatrixXd>> allData;
+        const int batchSize;
+        const bool shuffle; 
+        const int length;
+        int counter;
+        std::vector<int> perm;
+        DataLoader1D(std::vector<Eigen::MatrixXd> dataset, int batchsize = 1, bool shuf = true);
+        DataLoader1D(std::shared_ptr<const std::vector<Eigen::MatrixXd>> dataset, int batchsize = 1, bool shuf = true);
+        void resetPermutation();
+        std::vector<Eigen::MatrixXd> nextBatch();
+        bool hasNext();
+        /* Refresh the dataloader into its initial state, ready to resample again. */
+        void reInitialize();
+};
+}
+
+#endif
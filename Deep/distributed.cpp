@@ -0,0 +1,525 @@
+#include "distributed.h"
+#include "base.h"
+#include "node.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Deep::Dist
+{
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+Clock::time_point deadlineAfter(double seconds)
+{
+    return Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+std::runtime_error systemError(const std::string &what)
+{
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+void checkRank(int rank, int size)
+{
+    if (size <= 0 || rank < 0 || rank >= size)
+        throw std::invalid_argument("Rank must be within [0, size) and size positive.");
+}
+
+int modulo(int a, int n)
+{
+    return ((a % n) + n) % n;
+}
+
+constexpr size_t cacheLine { 64 };
+
+size_t roundUp(size_t bytes)
+{
+    return (bytes + cacheLine - 1) / cacheLine * cacheLine;
+}
+}
+
+/* Segment layout: the header, then one channel per rank, channel r
+carrying the values rank r sends to rank r + 1. */
+struct SharedMemoryTransport::Header
+{
+    std::atomic<uint32_t> ready;
+    std::atomic<uint32_t> attached;
+    uint64_t size;
+    uint64_t capacity;
+    uint64_t nonce;
+};
+
+/* Single producer, single consumer ring buffer of capacity doubles
+following the struct. head and tail only grow, on separate cache lines. */
+struct SharedMemoryTransport::Channel
+{
+    alignas(cacheLine) std::atomic<uint64_t> head; // Written by the producer.
+    alignas(cacheLine) std::atomic<uint64_t> tail; // Written by the consumer.
+    double* values()
+    {
+        return reinterpret_cast<double*>(reinterpret_cast<char*>(this) + roundUp(sizeof(Channel)));
+    }
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+    "Shared memory channels need lock-free atomics, which work across processes.");
+
+SharedMemoryTransport::SharedMemoryTransport(std::string name, int rank, int size, uint64_t nonce,
+    size_t capacity, double timeoutSeconds):
+    myRank(rank), worldSize(size), channelCapacity(capacity),
+    mappedBytes(roundUp(sizeof(Header)) + static_cast<size_t>(size) * roundUp(sizeof(Channel) + capacity * sizeof(double))),
+    mapping(nullptr), timeout(timeoutSeconds)
+{
+    checkRank(rank, size);
+    if (name.size() < 2 || name[0] != '/' || name.find('/', 1) != std::string::npos)
+        throw std::invalid_argument("Shared memory names look like \"/name\", got " + name);
+    if (capacity == 0)
+        throw std::invalid_argument("Channel capacity must be positive.");
+    const Clock::time_point deadline { deadlineAfter(timeoutSeconds) };
+    Header *header { nullptr };
+    if (rank == 0)
+    {
+        shm_unlink(name.c_str()); // Left over by a crashed run.
+        const int fd { shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600) };
+        if (fd < 0)
+            throw systemError("Cannot create shared memory " + name);
+        if (ftruncate(fd, static_cast<off_t>(mappedBytes)) != 0)
+        {
+            close(fd);
+            shm_unlink(name.c_str());
+            throw systemError("Cannot size shared memory " + name);
+        }
+        mapping = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = nullptr;
+            shm_unlink(name.c_str());
+            throw systemError("Cannot map shared memory " + name);
+        }
+        header = static_cast<Header*>(mapping);
+        new (&header->attached) std::atomic<uint32_t>(0);
+        header->size = static_cast<uint64_t>(size);
+        header->capacity = capacity;
+        header->nonce = nonce;
+        for (int i=0; i<size; ++i)
+            new (channel(i)) Channel();
+        for (int i=0; i<size; ++i)
+        {
+            channel(i)->head.store(0, std::memory_order_relaxed);
+            channel(i)->tail.store(0, std::memory_order_relaxed);
+        }
+        header->ready.store(1, std::memory_order_release);
+    }
+    else
+    {
+        /* Wait for rank 0 to create and initialize the segment of this run.
+        A segment left over by a crashed run may still be there under the
+        same name until rank 0 replaces it, its nonce tells them apart. */
+        while (true)
+        {
+            const int fd { shm_open(name.c_str(), O_RDWR, 0) };
+            struct stat info;
+            if (fd >= 0 && fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) == mappedBytes)
+            {
+                mapping = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                close(fd);
+                if (mapping == MAP_FAILED)
+                {
+                    mapping = nullptr;
+                    throw systemError("Cannot map shared memory " + name);
+                }
+                header = static_cast<Header*>(mapping);
+                if (header->ready.load(std::memory_order_acquire) == 1 && header->nonce == nonce)
+                    break;
+                munmap(mapping, mappedBytes);
+                mapping = nullptr;
+            }
+            else if (fd >= 0)
+                close(fd);
+            if (Clock::now() > deadline)
+                throw std::runtime_error("Timed out attaching to shared memory " + name
+                    + ", is rank 0 running with the same size, capacity and nonce?");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    header->attached.fetch_add(1, std::memory_order_acq_rel);
+    if (rank == 0)
+    {
+        // Everyone holds a mapping once attached, the name is not needed anymore.
+        while (header->attached.load(std::memory_order_acquire) != static_cast<uint32_t>(size))
+        {
+            if (Clock::now() > deadline)
+            {
+                munmap(mapping, mappedBytes);
+                shm_unlink(name.c_str());
+                throw std::runtime_error("Timed out waiting for every rank to attach to " + name);
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        shm_unlink(name.c_str());
+    }
+}
+
+SharedMemoryTransport::~SharedMemoryTransport()
+{
+    if (mapping != nullptr)
+        munmap(mapping, mappedBytes);
+}
+
+int SharedMemoryTransport::rank() const
+{
+    return myRank;
+}
+
+int SharedMemoryTransport::size() const
+{
+    return worldSize;
+}
+
+SharedMemoryTransport::Channel* SharedMemoryTransport::channel(int index)
+{
+    char *base { static_cast<char*>(mapping) + roundUp(sizeof(Header)) };
+    return reinterpret_cast<Channel*>(base + static_cast<size_t>(index) * roundUp(sizeof(Channel) + channelCapacity * sizeof(double)));
+}
+
+void SharedMemoryTransport::exchange(const double *toNext, size_t sendCount, double *fromPrevious, size_t recvCount)
+{
+    Channel *out { channel(myRank) };
+    Channel *in { channel(modulo(myRank - 1, worldSize)) };
+    double *outValues { out->values() };
+    const double *inValues { in->values() };
+    size_t sent { 0 };
+    size_t received { 0 };
+    // Nothing tells a rank that crashed from a slow one, so give up after timeout without progress.
+    Clock::time_point deadline { deadlineAfter(timeout) };
+    while (sent < sendCount || received < recvCount)
+    {
+        bool progressed { false };
+        if (sent < sendCount)
+        {
+            const uint64_t head { out->head.load(std::memory_order_relaxed) };
+            const uint64_t tail { out->tail.load(std::memory_order_acquire) };
+            const size_t n { std::min(channelCapacity - static_cast<size_t>(head - tail), sendCount - sent) };
+            if (n > 0)
+            {
+                // The free space may wrap around the end of the buffer.
+                const size_t start { static_cast<size_t>(head % channelCapacity) };
+                const size_t first { std::min(n, channelCapacity - start) };
+                std::memcpy(outValues + start, toNext + sent, first * sizeof(double));
+                std::memcpy(outValues, toNext + sent + first, (n - first) * sizeof(double));
+                out->head.store(head + n, std::memory_order_release);
+                sent += n;
+                progressed = true;
+            }
+        }
+        if (received < recvCount)
+        {
+            const uint64_t tail { in->tail.load(std::memory_order_relaxed) };
+            const uint64_t head { in->head.load(std::memory_order_acquire) };
+            const size_t n { std::min(static_cast<size_t>(head - tail), recvCount - received) };
+            if (n > 0)
+            {
+                const size_t start { static_cast<size_t>(tail % channelCapacity) };
+                const size_t first { std::min(n, channelCapacity - start) };
+                std::memcpy(fromPrevious + received, inValues + start, first * sizeof(double));
+                std::memcpy(fromPrevious + received + first, inValues, (n - first) * sizeof(double));
+                in->tail.store(tail + n, std::memory_order_release);
+                received += n;
+                progressed = true;
+            }
+        }
+        if (progressed)
+            deadline = deadlineAfter(timeout);
+        else if (Clock::now() > deadline)
+        {
+            throw std::runtime_error("Rank " + std::to_string(myRank) + " made no progress exchanging with its neighbours for "
+                + std::to_string(timeout) + "s, has another rank failed?");
+        }
+        else
+            std::this_thread::yield();
+    }
+}
+
+TcpTransport::TcpTransport(int rank, int size, int basePort, std::string nextHost, double timeoutSeconds):
+    myRank(rank), worldSize(size), nextFd(-1), previousFd(-1)
+{
+    checkRank(rank, size);
+    if (basePort <= 0 || basePort + size > 65536)
+        throw std::invalid_argument("Ports basePort to basePort + size - 1 must be valid TCP ports.");
+    const Clock::time_point deadline { deadlineAfter(timeoutSeconds) };
+    const int listenFd { socket(AF_INET, SOCK_STREAM, 0) };
+    if (listenFd < 0)
+        throw systemError("Cannot create a socket");
+    const int one { 1 };
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(static_cast<uint16_t>(basePort + rank));
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listenFd, 1) != 0)
+    {
+        close(listenFd);
+        throw systemError("Cannot listen on port " + std::to_string(basePort + rank));
+    }
+
+    // Connect to the next rank, retrying until it listens.
+    addrinfo hints {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *next { nullptr };
+    const std::string nextPort { std::to_string(basePort + (rank + 1) % size) };
+    if (getaddrinfo(nextHost.c_str(), nextPort.c_str(), &hints, &next) != 0 || next == nullptr)
+    {
+        close(listenFd);
+        throw std::runtime_error("Cannot resolve " + nextHost);
+    }
+    while (nextFd < 0)
+    {
+        nextFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (nextFd >= 0 && connect(nextFd, next->ai_addr, next->ai_addrlen) == 0)
+            break;
+        if (nextFd >= 0)
+            close(nextFd);
+        nextFd = -1;
+        if (Clock::now() > deadline)
+        {
+            freeaddrinfo(next);
+            close(listenFd);
+            throw std::runtime_error("Timed out connecting to " + nextHost + ":" + nextPort);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    freeaddrinfo(next);
+
+    // Then accept the previous rank, which may still be retrying.
+    pollfd waiting { listenFd, POLLIN, 0 };
+    const long remaining { std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count() };
+    if (poll(&waiting, 1, static_cast<int>(std::max(remaining, 0L))) == 1)
+        previousFd = accept(listenFd, nullptr, nullptr);
+    close(listenFd);
+    if (previousFd < 0)
+    {
+        close(nextFd);
+        throw std::runtime_error("Timed out waiting for rank " + std::to_string(modulo(rank - 1, size)) + " to connect.");
+    }
+    for (int fd: {nextFd, previousFd})
+    {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+TcpTransport::~TcpTransport()
+{
+    close(nextFd);
+    close(previousFd);
+}
+
+int TcpTransport::rank() const
+{
+    return myRank;
+}
+
+int TcpTransport::size() const
+{
+    return worldSize;
+}
+
+void TcpTransport::exchange(const double *toNext, size_t sendCount, double *fromPrevious, size_t recvCount)
+{
+    const char *out { reinterpret_cast<const char*>(toNext) };
+    char *in { reinterpret_cast<char*>(fromPrevious) };
+    size_t outLeft { sendCount * sizeof(double) };
+    size_t inLeft { recvCount * sizeof(double) };
+    while (outLeft > 0 || inLeft > 0)
+    {
+        pollfd fds[2];
+        nfds_t count { 0 };
+        if (outLeft > 0)
+            fds[count++] = pollfd { nextFd, POLLOUT, 0 };
+        if (inLeft > 0)
+            fds[count++] = pollfd { previousFd, POLLIN, 0 };
+        if (poll(fds, count, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw systemError("poll failed");
+        }
+        for (nfds_t i=0; i<count; ++i)
+        {
+            if (fds[i].revents == 0)
+                continue;
+            if (fds[i].fd == nextFd)
+            {
+                const ssize_t n { send(nextFd, out, outLeft, MSG_NOSIGNAL) };
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    throw systemError("Sending to rank " + std::to_string((myRank + 1) % worldSize) + " failed");
+                if (n > 0)
+                {
+                    out += n;
+                    outLeft -= static_cast<size_t>(n);
+                }
+            }
+            else
+            {
+                const ssize_t n { recv(previousFd, in, inLeft, 0) };
+                if (n == 0)
+                    throw std::runtime_error("Rank " + std::to_string(modulo(myRank - 1, worldSize)) + " closed the connection.");
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    throw systemError("Receiving from rank " + std::to_string(modulo(myRank - 1, worldSize)) + " failed");
+                if (n > 0)
+                {
+                    in += n;
+                    inLeft -= static_cast<size_t>(n);
+                }
+            }
+        }
+    }
+}
+
+ProcessGroup::ProcessGroup(std::unique_ptr<Transport> transport): link(std::move(transport))
+{
+    if (link == nullptr)
+        throw std::invalid_argument("ProcessGroup needs a transport.");
+}
+
+int ProcessGroup::rank() const
+{
+    return link->rank();
+}
+
+int ProcessGroup::size() const
+{
+    return link->size();
+}
+
+void ProcessGroup::allReduce(std::vector<double> &data)
+{
+    const int n { size() };
+    const int r { rank() };
+    if (n == 1 || data.empty())
+        return;
+    const size_t L { data.size() };
+    // Chunk c is [begin(c), begin(c + 1)), sizes differ by at most one.
+    auto begin = [L, n](int c){ return L * static_cast<size_t>(c) / static_cast<size_t>(n); };
+    auto length = [&begin](int c){ return begin(c + 1) - begin(c); };
+    std::vector<double> incoming(L / static_cast<size_t>(n) + 1);
+    // Reduce-scatter, after step s chunk r - s - 1 holds the sum of s + 2 ranks.
+    for (int s=0; s<n-1; ++s)
+    {
+        const int sendChunk { modulo(r - s, n) };
+        const int recvChunk { modulo(r - s - 1, n) };
+        link->exchange(data.data() + begin(sendChunk), length(sendChunk), incoming.data(), length(recvChunk));
+        double *target { data.data() + begin(recvChunk) };
+        for (size_t i=0; i<length(recvChunk); ++i)
+            target[i] += incoming[i];
+    }
+    // All-gather, rank r starts with the complete chunk r + 1.
+    for (int s=0; s<n-1; ++s)
+    {
+        const int sendChunk { modulo(r + 1 - s, n) };
+        const int recvChunk { modulo(r - s, n) };
+        link->exchange(data.data() + begin(sendChunk), length(sendChunk),
+            data.data() + begin(recvChunk), length(recvChunk));
+    }
+}
+
+void ProcessGroup::broadcast(std::vector<double> &data, int root)
+{
+    const int n { size() };
+    const int r { rank() };
+    checkRank(root, n);
+    // Down the ring in pieces, so a rank forwards while the next ones still receive.
+    const size_t piece { 1 << 14 };
+    for (size_t offset=0; offset<data.size(); offset+=piece)
+    {
+        const size_t count { std::min(piece, data.size() - offset) };
+        if (r != root)
+            link->exchange(nullptr, 0, data.data() + offset, count);
+        if ((r + 1) % n != root)
+            link->exchange(data.data() + offset, count, nullptr, 0);
+    }
+}
+
+std::vector<std::pair<std::string, NSP>> sortedParameters(Model &model)
+{
+    std::vector<std::pair<std::string, NSP>> params { model.namedParameters() };
+    std::sort(params.begin(), params.end(), [](const std::pair<std::string, NSP> &a, const std::pair<std::string, NSP> &b){
+        return a.first < b.first;
+    });
+    return params;
+}
+
+void ProcessGroup::allReduceGradients(Model &model)
+{
+    const std::vector<std::pair<std::string, NSP>> params { sortedParameters(model) };
+    size_t total { 0 };
+    for (const std::pair<std::string, NSP> &p: params)
+        total += static_cast<size_t>(p.second->data.size());
+    std::vector<double> flat(total, 0.0);
+    size_t offset { 0 };
+    for (const std::pair<std::string, NSP> &p: params)
+    {
+        // Parameters backward didn't reach contribute zeros, sparse ones are densified.
+        T dense {};
+        const T &gradient { p.second->sparseGradient ? (dense = p.second->denseGradient()) : p.second->gradient };
+        if (gradient.size() != 0)
+            std::copy(gradient.data(), gradient.data() + gradient.size(), flat.begin() + static_cast<long>(offset));
+        offset += static_cast<size_t>(p.second->data.size());
+    }
+    allReduce(flat);
+    const double scale { 1.0 / size() };
+    offset = 0;
+    for (const std::pair<std::string, NSP> &p: params)
+    {
+        T &gradient { p.second->gradient };
+        gradient.resize(p.second->data.rows(), p.second->data.cols());
+        if (p.second->sparseGradient)
+        {
+            p.second->sparseColumns.clear();
+            p.second->sparseValues.resize(p.second->data.rows(), 0);
+        }
+        for (Eigen::Index i=0; i<gradient.size(); ++i)
+            gradient(i) = scale * flat[offset + static_cast<size_t>(i)];
+        offset += static_cast<size_t>(gradient.size());
+    }
+}
+
+void ProcessGroup::broadcastParameters(Model &model, int root)
+{
+    std::vector<std::pair<std::string, NSP>> tensors { sortedParameters(model) };
+    std::vector<std::pair<std::string, NSP>> buffers { model.namedBuffers() };
+    std::sort(buffers.begin(), buffers.end(), [](const std::pair<std::string, NSP> &a, const std::pair<std::string, NSP> &b){
+        return a.first < b.first;
+    });
+    tensors.insert(tensors.end(), buffers.begin(), buffers.end());
+    std::vector<double> flat {};
+    for (const std::pair<std::string, NSP> &p: tensors)
+        flat.insert(flat.end(), p.second->data.data(), p.second->data.data() + p.second->data.size());
+    broadcast(flat, root);
+    size_t offset { 0 };
+    for (const std::pair<std::string, NSP> &p: tensors)
+    {
+        T &data { p.second->data };
+        std::copy(flat.begin() + static_cast<long>(offset), flat.begin() + static_cast<long>(offset) + data.size(), data.data());
+        offset += static_cast<size_t>(data.size());
+    }
+}
+}
@@ -0,0 +1,123 @@
+/* Data-parallel training across processes, every process holding its
+own Model replica. A ProcessGroup averages the gradients of the replicas
+with a ring all-reduce between backward and the optimizer step, and
+broadcasts the initial weights so every replica starts the same:
+
+    Deep::Dist::ProcessGroup group(std::unique_ptr<Deep::Dist::Transport>(
+        new Deep::Dist::SharedMemoryTransport("/deep-run", rank, worldSize, nonce)));
+    group.broadcastParameters(model);
+    ...
+    LPtr->backward();
+    group.allReduceGradients(model);
+    optimizer.step();
+
+Ranks are arranged in a ring, rank r only sends to rank r + 1 and
+receives from rank r - 1 (mod size), so a Transport is a pair of links.
+SharedMemoryTransport links processes of one machine through POSIX
+shared memory, TcpTransport through TCP sockets, on the loopback
+interface or across machines. */
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+#include "base.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Deep::Dist
+{
+class Transport
+{
+    public:
+        virtual int rank() const = 0;
+        virtual int size() const = 0;
+        /* Send sendCount values to the next rank while receiving recvCount
+        values from the previous one, returning once both are done. Either
+        count can be zero. Sending and receiving progress together, so a
+        ring where every rank exchanges at once cannot deadlock. */
+        virtual void exchange(const double *toNext, size_t sendCount, double *fromPrevious, size_t recvCount) = 0;
+        virtual ~Transport() = default;
+};
+
+/* Ring buffers in a POSIX shared memory segment, one per link. Rank 0
+creates the segment, the others attach to it by name, which must be
+unique to the run ("/name", see shm_open). The name is unlinked once
+every rank attached, so nothing is left behind in /dev/shm. Every rank
+is given the same nonce, drawn anew for each run: rank 0 writes it in
+the segment and the others only attach to a segment holding it, never
+to one a crashed run left under the same name. */
+class SharedMemoryTransport: public Transport
+{
+    public:
+        /* capacity: doubles buffered per link, larger messages stream through.
+        Throws std::runtime_error if the segment cannot be set up within timeoutSeconds,
+        and exchange() if it makes no progress for as long. */
+        SharedMemoryTransport(std::string name, int rank, int size, uint64_t nonce,
+            size_t capacity = 1 << 16, double timeoutSeconds = 30.0);
+        SharedMemoryTransport(const SharedMemoryTransport&) = delete;
+        SharedMemoryTransport& operator=(const SharedMemoryTransport&) = delete;
+        ~SharedMemoryTransport() override;
+        int rank() const override;
+        int size() const override;
+        void exchange(const double *toNext, size_t sendCount, double *fromPrevious, size_t recvCount) override;
+    private:
+        struct Header;
+        struct Channel;
+        int myRank;
+        int worldSize;
+        size_t channelCapacity;
+        size_t mappedBytes;
+        void *mapping;
+        double timeout;
+        Channel *channel(int index);
+};
+
+/* One TCP connection per link. Rank r listens on basePort + r and
+connects to nextHost:basePort + r + 1 (mod size), nextHost being the
+machine of the next rank, "127.0.0.1" when every rank runs locally.
+Throws std::runtime_error if the ring isn't connected within timeoutSeconds. */
+class TcpTransport: public Transport
+{
+    public:
+        TcpTransport(int rank, int size, int basePort, std::string nextHost = "127.0.0.1", double timeoutSeconds = 30.0);
+        TcpTransport(const TcpTransport&) = delete;
+        TcpTransport& operator=(const TcpTransport&) = delete;
+        ~TcpTransport() override;
+        int rank() const override;
+        int size() const override;
+        void exchange(const double *toNext, size_t sendCount, double *fromPrevious, size_t recvCount) override;
+    private:
+        int myRank;
+        int worldSize;
+        int nextFd;
+        int previousFd;
+};
+
+class ProcessGroup
+{
+    public:
+        explicit ProcessGroup(std::unique_ptr<Transport> transport);
+        int rank() const;
+        int size() const;
+        /* Sum data over all ranks, every rank gets the same result.
+        Reduce-scatter then all-gather around the ring, each rank sends
+        2 * (size - 1) / size of data whatever the number of ranks. */
+        void allReduce(std::vector<double> &data);
+        /* Overwrite data with the one of root, which every rank must size the same. */
+        void broadcast(std::vector<double> &data, int root = 0);
+        /* Average the gradients of the replicas in a single all-reduce
+        over the flattened gradients, parameters ordered by name. */
+        void allReduceGradients(Model &model);
+        /* Copy the parameters and buffers of root to every replica. */
+        void broadcastParameters(Model &model, int root = 0);
+    private:
+        std::unique_ptr<Transport> link;
+};
+
+/* Parameters of a model sorted by name, the order every rank flattens them in. */
+std::vector<std::pair<std::string, NSP>> sortedParameters(Model &model);
+}
+
+#endif
@@ -0,0 +1,138 @@
+#include "ensemble.h"
+#include "base.h"
+#include "nn.h"
+#include "node.h"
+#include "parallel.h"
+#include "trace.h"
+#include <Eigen/Dense>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Deep::Ensemble
+{
+StackedEnsemble::StackedEnsemble(const std::vector<Model*> &models, const Eigen::MatrixXd &sample):
+    members(static_cast<int>(models.size())), stack(), meanFolded(false), meanWeights(), meanBiases()
+{
+    if (models.empty())
+        throw std::invalid_argument("An ensemble needs at least one member.");
+    const Eigen::Index K { members };
+    for (size_t k=0; k<models.size(); ++k)
+    {
+        const std::vector<TracedAffine> traced { traceAffineStack(*models[k], sample) };
+        if (k == 0)
+        {
+            for (const TracedAffine &t: traced)
+            {
+                const Eigen::MatrixXd &W { t.layer->weights->data };
+                stack.push_back(StackedLayer {W.cols(), W.rows(), t.reluAfter,
+                    Eigen::MatrixXd::Zero(W.cols(), K * W.rows()), Eigen::RowVectorXd::Zero(K * W.rows())});
+            }
+        }
+        if (traced.size() != stack.size())
+            throw std::invalid_argument("Member " + std::to_string(k) + " doesn't have the layers of the first member.");
+        for (size_t i=0; i<traced.size(); ++i)
+        {
+            StackedLayer &layer { stack[i] };
+            const FullyConnected &fc { *traced[i].layer };
+            const Eigen::MatrixXd &W { fc.weights->data };
+            if (W.rows() != layer.out_c || W.cols() != layer.in_c || traced[i].reluAfter != layer.relu)
+                throw std::invalid_argument("Member " + std::to_string(k) + " doesn't have the layers of the first member.");
+            layer.weights.middleCols(static_cast<Eigen::Index>(k) * layer.out_c, layer.out_c) = W.transpose();
+            if (fc.biases != nullptr)
+                layer.biases.segment(static_cast<Eigen::Index>(k) * layer.out_c, layer.out_c) = fc.biases->data.col(0).transpose();
+        }
+    }
+
+    // mean_k(x_k W_k^T + b_k) = [x_1 ... x_K] [W_1 ... W_K]^T / K + mean_k(b_k),
+    // with x_k = x for every member when the last layer is also the first.
+    const StackedLayer &last { stack.back() };
+    meanFolded = !last.relu;
+    if (!meanFolded)
+        return;
+    const bool sharedInput { stack.size() == 1 };
+    meanWeights.setZero(sharedInput ? last.in_c : K * last.in_c, last.out_c);
+    meanBiases.setZero(last.out_c);
+    for (Eigen::Index k=0; k<K; ++k)
+    {
+        const Eigen::MatrixXd block { last.weights.middleCols(k * last.out_c, last.out_c) / static_cast<double>(K) };
+        if (sharedInput)
+            meanWeights += block;
+        else
+            meanWeights.middleRows(k * last.in_c, last.in_c) = block;
+        meanBiases += last.biases.segment(k * last.out_c, last.out_c) / static_cast<double>(K);
+    }
+}
+
+int StackedEnsemble::size() const
+{
+    return members;
+}
+
+Eigen::MatrixXd StackedEnsemble::apply(const StackedLayer &layer, const Eigen::MatrixXd &in, bool sharedInput) const
+{
+    const Eigen::Index K { members };
+    const Eigen::Index i { layer.in_c };
+    const Eigen::Index o { layer.out_c };
+    Eigen::MatrixXd out(in.rows(), K * o);
+    Parallel::parallelFor(in.rows(), K * i * o, [&](Eigen::Index begin, Eigen::Index end){
+        const Eigen::Index n { end - begin };
+        if (sharedInput)
+            out.middleRows(begin, n).noalias() = in.middleRows(begin, n) * layer.weights;
+        else
+        {
+            for (Eigen::Index k=0; k<K; ++k)
+                out.block(begin, k * o, n, o).noalias() = in.block(begin, k * i, n, i) * layer.weights.middleCols(k * o, o);
+        }
+        out.middleRows(begin, n).rowwise() += layer.biases;
+        if (layer.relu)
+            out.middleRows(begin, n) = out.middleRows(begin, n).cwiseMax(0.0);
+    });
+    return out;
+}
+
+Eigen::MatrixXd StackedEnsemble::hidden(const Eigen::MatrixXd &in) const
+{
+    if (in.cols() != stack[0].in_c)
+        throw std::invalid_argument("The input has " + std::to_string(in.cols()) + " columns, the ensemble expects "
+            + std::to_string(stack[0].in_c) + ".");
+    Eigen::MatrixXd x {};
+    for (size_t l=0; l+1<stack.size(); ++l)
+        x = apply(stack[l], l == 0 ? in : x, l == 0);
+    return x;
+}
+
+Eigen::MatrixXd StackedEnsemble::forwardAll(const Eigen::MatrixXd &in) const
+{
+    Eigen::MatrixXd x { hidden(in) };
+    return apply(stack.back(), stack.size() == 1 ? in : x, stack.size() == 1);
+}
+
+Eigen::MatrixXd StackedEnsemble::forwardMean(const Eigen::MatrixXd &in) const
+{
+    const StackedLayer &last { stack.back() };
+    if (!meanFolded)
+    {
+        const Eigen::MatrixXd all { forwardAll(in) };
+        Eigen::MatrixXd mean { Eigen::MatrixXd::Zero(in.rows(), last.out_c) };
+        for (Eigen::Index k=0; k<members; ++k)
+            mean += all.middleCols(k * last.out_c, last.out_c);
+        return mean / static_cast<double>(members);
+    }
+    const Eigen::MatrixXd h { hidden(in) };
+    const Eigen::MatrixXd &x { stack.size() == 1 ? in : h };
+    Eigen::MatrixXd out(in.rows(), last.out_c);
+    Parallel::parallelFor(in.rows(), meanWeights.size(), [&](Eigen::Index begin, Eigen::Index end){
+        out.middleRows(begin, end - begin).noalias() = x.middleRows(begin, end - begin) * meanWeights;
+        out.middleRows(begin, end - begin).rowwise() += meanBiases;
+    });
+    return out;
+}
+
+NSP StackedEnsemble::forward(NSP in)
+{
+    in->materialize();
+    return std::make_shared<Node>(forwardMean(in->data), gradFn::none);
+}
+}
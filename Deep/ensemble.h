@@ -0,0 +1,66 @@
+/* Inference over an ensemble of K models of the same sequential
+FullyConnected architecture, such as copies of a model trained with
+different seeds. The weights of the members are stacked per layer, so
+each layer runs as one pass over the batch instead of K:
+- the first layer reads the shared input once, through a single wide GEMM
+  against the weights of every member side by side, [in_c, K * out_c],
+- later layers are block-diagonal, member k only reads the columns of
+  member k, so the zero blocks are skipped,
+- for the mean of the members, the last layer is a single GEMM against
+  the member weights stacked vertically and divided by K, which sums the
+  members while producing the output.
+Bias and ReLU are applied to each row block right after its GEMM. */
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+#include "base.h"
+#include <Eigen/Dense>
+#include <vector>
+
+namespace Deep::Ensemble
+{
+class StackedEnsemble: public Model
+{
+    public:
+        /* Trace every member on a sample batch, see traceSequential. The
+        members must have the same layer names, shapes and ReLUs, and
+        only FullyConnected and Identity layers, otherwise
+        std::invalid_argument is thrown. The weights are copied, the
+        members can be released afterwards. */
+        StackedEnsemble(const std::vector<Model*> &members, const Eigen::MatrixXd &sample);
+        /* Number of members. */
+        int size() const;
+        /* Outputs of every member side by side [B, K * out_c], member k
+        in the columns [k * out_c, (k + 1) * out_c). */
+        Eigen::MatrixXd forwardAll(const Eigen::MatrixXd &in) const;
+        /* Mean of the member outputs [B, out_c]. */
+        Eigen::MatrixXd forwardMean(const Eigen::MatrixXd &in) const;
+        /* forwardMean, the output node does not track gradient. */
+        NSP forward(NSP in) override;
+
+    private:
+        struct StackedLayer
+        {
+            Eigen::Index in_c;
+            Eigen::Index out_c;
+            bool relu;
+            // [in_c, K * out_c], block k holds the transposed weights of member k.
+            Eigen::MatrixXd weights;
+            // [1, K * out_c]
+            Eigen::RowVectorXd biases;
+        };
+        int members;
+        std::vector<StackedLayer> stack;
+        // Last layer with the mean folded in, unused when it ends with a ReLU.
+        bool meanFolded;
+        Eigen::MatrixXd meanWeights;
+        Eigen::RowVectorXd meanBiases;
+
+        /* One layer over the batch, sharedInput when in is [B, in_c]
+        rather than one block per member [B, K * in_c]. */
+        Eigen::MatrixXd apply(const StackedLayer &layer, const Eigen::MatrixXd &in, bool sharedInput) const;
+        /* Every layer but the last one. */
+        Eigen::MatrixXd hidden(const Eigen::MatrixXd &in) const;
+};
+}
+
+#endif
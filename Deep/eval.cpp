@@ -0,0 +1,170 @@
+#include "eval.h"
+#include "nn.h"
+#include "node.h"
+#include "parallel.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Deep::Eval
+{
+Metrics::Metrics(int minClassLabel, int maxClassLabel):
+    rows(0), correct(0), correctOffOne(0), squaredError(0.0), absoluteError(0.0),
+    minClass(minClassLabel), confusion(), seconds(0.0)
+{
+    if (maxClassLabel < minClassLabel)
+        throw std::invalid_argument("maxClass must be at least minClass.");
+    const Eigen::Index classes { maxClassLabel - minClassLabel + 1 };
+    confusion.setZero(classes, classes);
+}
+
+void Metrics::add(const Eigen::MatrixXd &prediction, const Eigen::MatrixXd &label)
+{
+    if (prediction.rows() != label.rows() || prediction.cols() != 1 || label.cols() != 1)
+        throw std::invalid_argument("Predictions and labels must both be [B, 1].");
+    const long maxIndex { static_cast<long>(confusion.rows()) - 1 };
+    for (Eigen::Index i=0; i<label.rows(); ++i)
+    {
+        const double error { prediction(i, 0) - label(i, 0) };
+        squaredError += error * error;
+        absoluteError += std::abs(error);
+        // Round the output to a class, then compare with the integer label.
+        const double rounded { std::round(prediction(i, 0)) };
+        const double diff { std::abs(rounded - label(i, 0)) };
+        if (diff < 0.5)
+            ++correct;
+        if (diff < 1.5)
+            ++correctOffOne;
+        const long truth { static_cast<long>(label(i, 0)) - minClass };
+        if (truth < 0 || truth > maxIndex)
+            throw std::invalid_argument("Label " + std::to_string(label(i, 0)) + " is out of the class range.");
+        const long predicted { std::min(std::max(static_cast<long>(rounded) - minClass, 0L), maxIndex) };
+        ++confusion(truth, predicted);
+    }
+    rows += label.rows();
+}
+
+void Metrics::merge(const Metrics &other)
+{
+    if (other.minClass != minClass || other.confusion.rows() != confusion.rows())
+        throw std::invalid_argument("Cannot merge metrics over different class ranges.");
+    rows += other.rows;
+    correct += other.correct;
+    correctOffOne += other.correctOffOne;
+    squaredError += other.squaredError;
+    absoluteError += other.absoluteError;
+    confusion += other.confusion;
+}
+
+double Metrics::accuracy() const
+{
+    return 100.0 * static_cast<double>(correct) / static_cast<double>(rows);
+}
+
+double Metrics::accuracyOffOne() const
+{
+    return 100.0 * static_cast<double>(correctOffOne) / static_cast<double>(rows);
+}
+
+double Metrics::mse() const
+{
+    return squaredError / static_cast<double>(rows);
+}
+
+double Metrics::mae() const
+{
+    return absoluteError / static_cast<double>(rows);
+}
+
+double Metrics::rowsPerSecond() const
+{
+    return static_cast<double>(rows) / seconds;
+}
+
+std::unordered_map<std::string, double> Metrics::summary() const
+{
+    return std::unordered_map<std::string, double> {
+        {"rows", static_cast<double>(rows)},
+        {"accuracy", accuracy()},
+        {"accuracyOffOne", accuracyOffOne()},
+        {"mse", mse()},
+        {"mae", mae()},
+        {"seconds", seconds},
+        {"rowsPerSecond", rowsPerSecond()}
+    };
+}
+
+namespace
+{
+/* Every BatchNorm1d of a model in eval mode while the guard lives, each
+gets back the mode it had. */
+class EvalModeGuard
+{
+    public:
+        explicit EvalModeGuard(Model &model): previous()
+        {
+            for (auto it=model.layers.begin(); it!=model.layers.end(); ++it)
+            {
+                BatchNorm1d *bn { dynamic_cast<BatchNorm1d*>(it->second.get()) };
+                if (bn == nullptr)
+                    continue;
+                previous.push_back({bn, bn->training});
+                bn->training = false;
+            }
+        }
+        ~EvalModeGuard()
+        {
+            for (const std::pair<BatchNorm1d*, bool> &p: previous)
+                p.first->training = p.second;
+        }
+        EvalModeGuard(const EvalModeGuard&) = delete;
+        EvalModeGuard& operator=(const EvalModeGuard&) = delete;
+    private:
+        std::vector<std::pair<BatchNorm1d*, bool>> previous;
+};
+}
+
+Metrics evaluate(Model &model, const Eigen::MatrixXd &features, const Eigen::MatrixXd &labels, EvalOptions options)
+{
+    if (features.rows() != labels.rows())
+        throw std::invalid_argument("Features and labels must have the same number of rows.");
+    if (options.batchSize <= 0 || options.numShards < 0)
+        throw std::invalid_argument("Batch size must be positive and number of shards non-negative.");
+    const auto t1 = std::chrono::steady_clock::now();
+    const Eigen::Index N { features.rows() };
+    const Eigen::Index batchSize { options.batchSize };
+    const Eigen::Index shards { std::max<Eigen::Index>(1, std::min<Eigen::Index>(N,
+        options.numShards > 0 ? options.numShards : Parallel::getNumThreads())) };
+    std::vector<Metrics> partial(static_cast<size_t>(shards), Metrics(options.minClass, options.maxClass));
+    // Shards would otherwise update the running statistics concurrently.
+    const EvalModeGuard evalMode(model);
+    // Each shard is worth a chunk of its own.
+    Parallel::parallelFor(shards, Parallel::getGrainSize(), [&](Eigen::Index begin, Eigen::Index end){
+        NoGradGuard noGrad;
+        for (Eigen::Index shard=begin; shard<end; ++shard)
+        {
+            const Eigen::Index first { N * shard / shards };
+            const Eigen::Index last { N * (shard + 1) / shards };
+            for (Eigen::Index row=first; row<last; row+=batchSize)
+            {
+                const Eigen::Index n { std::min(batchSize, last - row) };
+                NSP in { std::make_shared<Node>(features.middleRows(row, n)) };
+                NSP out { model.forward(in) };
+                out->materialize();
+                partial[static_cast<size_t>(shard)].add(out->data, labels.middleRows(row, n));
+            }
+        }
+    });
+    // Merged in shard order, the sums don't depend on the thread timing.
+    Metrics total(options.minClass, options.maxClass);
+    for (const Metrics &m: partial)
+        total.merge(m);
+    total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+    return total;
+}
+}
@@ -0,0 +1,64 @@
+/* Batched evaluation of a regressor whose outputs are rounded to class
+labels, such as the wine quality model. The rows are split in contiguous
+shards run on the thread pool, each going through Model::forward in
+batches under a NoGradGuard and adding to its own Metrics, which are
+merged in shard order at the end. Nothing but the current batch is kept,
+so evaluating a million-row holdout set costs the memory of a batch per
+shard. Model::forward must be safe to call concurrently, which holds for
+models that only read their layers in forward. BatchNorm1d layers are put
+in eval mode for the duration, so they use and keep their running
+statistics, then get their previous mode back. */
+#ifndef EVAL_H
+#define EVAL_H
+#include "base.h"
+#include <Eigen/Dense>
+#include <string>
+#include <unordered_map>
+
+namespace Deep::Eval
+{
+struct EvalOptions
+{
+    int batchSize {256};
+    // 0 uses one shard per thread of the pool.
+    int numShards {0};
+    // Range of the labels, rows and columns of the confusion matrix.
+    int minClass {0};
+    int maxClass {10};
+};
+
+/* Sums over the rows seen so far, every ratio is derived from them. */
+struct Metrics
+{
+    long rows;
+    long correct;
+    long correctOffOne;
+    double squaredError;
+    double absoluteError;
+    int minClass;
+    /* confusion(label - minClass, prediction - minClass) counts the rows of
+    a label predicted as a class, predictions are clamped to the range. */
+    Eigen::Matrix<long, Eigen::Dynamic, Eigen::Dynamic> confusion;
+    double seconds;
+
+    Metrics(int minClassLabel, int maxClassLabel);
+    /* Add a batch of raw predictions and labels [B, 1]. Throws
+    std::invalid_argument for labels out of [minClass, maxClass]. */
+    void add(const Eigen::MatrixXd &prediction, const Eigen::MatrixXd &label);
+    void merge(const Metrics &other);
+    // In percent, like the accuracies printed by the executables.
+    double accuracy() const;
+    double accuracyOffOne() const;
+    double mse() const;
+    double mae() const;
+    double rowsPerSecond() const;
+    /* Every scalar above by name, e.g. "accuracy", "mse". */
+    std::unordered_map<std::string, double> summary() const;
+};
+
+/* Metrics of model over features [N, in_c] and labels [N, 1]. */
+Metrics evaluate(Model &model, const Eigen::MatrixXd &features, const Eigen::MatrixXd &labels,
+    EvalOptions options = EvalOptions());
+}
+
+#endif
@@ -0,0 +1,138 @@
+#include "export.h"
+#include "base.h"
+#include "nn.h"
+#include "trace.h"
+#include <Eigen/Dense>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Deep::Export
+{
+namespace
+{
+bool isIdentifier(const std::string &name)
+{
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0])))
+        return false;
+    for (char c: name)
+    {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+            return false;
+    }
+    return true;
+}
+
+/* A constexpr array of values, eight per line. */
+void writeArray(std::ostringstream &out, const std::string &arrayName, const std::vector<double> &values)
+{
+    out << "alignas(64) constexpr double " << arrayName << "[" << values.size() << "] = {";
+    for (size_t i=0; i<values.size(); ++i)
+    {
+        if (!std::isfinite(values[i]))
+            throw std::invalid_argument("Cannot export the non-finite value " + std::to_string(values[i])
+                + " of " + arrayName + ".");
+        out << (i % 8 == 0 ? "\n    " : " ") << values[i] << (i + 1 < values.size() ? "," : "");
+    }
+    out << "\n};\n";
+}
+}
+
+void exportHeader(Model &model, const Eigen::MatrixXd &sample, const std::string &headerPath, const std::string &name)
+{
+    if (!isIdentifier(name))
+        throw std::invalid_argument(name + " is not a C++ identifier.");
+    const std::vector<TracedAffine> traced { traceAffineStack(model, sample) };
+    std::vector<Eigen::Index> sizes { traced[0].layer->weights->data.cols() };
+    for (const TracedAffine &t: traced)
+    {
+        if (t.layer->weights->data.cols() != sizes.back())
+            throw std::invalid_argument("Layer " + t.name + " doesn't take the outputs of the layer before it.");
+        sizes.push_back(t.layer->weights->data.rows());
+    }
+    const size_t L { traced.size() };
+
+    std::ostringstream out {};
+    // 17 significant digits read back as the same double.
+    out << std::setprecision(std::numeric_limits<double>::max_digits10);
+    std::string guard { name };
+    for (char &c: guard)
+        c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    out << "/* Generated by Deep::Export::exportHeader, a stack of " << L << " FullyConnected layers\n"
+        << "from " << sizes.front() << " inputs to " << sizes.back() << " outputs. Standard C++11 only. */\n"
+        << "#ifndef " << guard << "_EXPORTED_H\n"
+        << "#define " << guard << "_EXPORTED_H\n"
+        << "#include <cstddef>\n\n"
+        << "namespace " << name << "\n{\n"
+        << "constexpr std::size_t inputSize { " << sizes.front() << " };\n"
+        << "constexpr std::size_t outputSize { " << sizes.back() << " };\n\n"
+        << "namespace detail\n{\n";
+    for (size_t l=0; l<L; ++l)
+    {
+        const FullyConnected &fc { *traced[l].layer };
+        const Eigen::MatrixXd &W { fc.weights->data };
+        std::vector<double> weights {};
+        weights.reserve(static_cast<size_t>(W.size()));
+        for (Eigen::Index o=0; o<W.rows(); ++o)
+        {
+            for (Eigen::Index i=0; i<W.cols(); ++i)
+                weights.push_back(W(o, i));
+        }
+        std::vector<double> biases(static_cast<size_t>(W.rows()), 0.0);
+        if (fc.biases != nullptr)
+            Eigen::Map<Eigen::VectorXd>(biases.data(), W.rows()) = fc.biases->data.col(0);
+        out << "// " << traced[l].name << ", row-major [" << W.rows() << ", " << W.cols() << "] weights"
+            << (traced[l].reluAfter ? " followed by a ReLU" : "") << ".\n";
+        writeArray(out, "weights" + std::to_string(l), weights);
+        writeArray(out, "biases" + std::to_string(l), biases);
+        out << "\n";
+    }
+    out << "/* y = W x + b with the sizes known at compile time, so the loops are\n"
+        << "unrolled and vectorized, the ReLU is applied when storing y. */\n"
+        << "template <std::size_t In, std::size_t Out, bool Relu>\n"
+        << "inline void affine(const double *W, const double *b, const double *x, double *y)\n"
+        << "{\n"
+        << "    for (std::size_t o=0; o<Out; ++o)\n"
+        << "    {\n"
+        << "        double acc { 0.0 };\n"
+        << "        for (std::size_t i=0; i<In; ++i)\n"
+        << "            acc += W[o * In + i] * x[i];\n"
+        << "        acc += b[o];\n"
+        << "        y[o] = (Relu && acc < 0.0) ? 0.0 : acc;\n"
+        << "    }\n"
+        << "}\n"
+        << "}\n\n"
+        << "/* One row of inputSize values into outputSize values. */\n"
+        << "inline void predict(const double *in, double *out)\n"
+        << "{\n";
+    for (size_t l=0; l+1<L; ++l)
+        out << "    alignas(64) double h" << l << "[" << sizes[l + 1] << "];\n";
+    for (size_t l=0; l<L; ++l)
+    {
+        out << "    detail::affine<" << sizes[l] << ", " << sizes[l + 1] << ", " << (traced[l].reluAfter ? "true" : "false")
+            << ">(detail::weights" << l << ", detail::biases" << l << ", "
+            << (l == 0 ? std::string("in") : "h" + std::to_string(l - 1)) << ", "
+            << (l + 1 == L ? std::string("out") : "h" + std::to_string(l)) << ");\n";
+    }
+    out << "}\n\n"
+        << "/* rows rows of inputSize values, stored one after the other. */\n"
+        << "inline void predict(const double *in, double *out, std::size_t rows)\n"
+        << "{\n"
+        << "    for (std::size_t r=0; r<rows; ++r)\n"
+        << "        predict(in + r * inputSize, out + r * outputSize);\n"
+        << "}\n"
+        << "}\n\n"
+        << "#endif\n";
+
+    std::ofstream file(headerPath);
+    file << out.str();
+    if (!file)
+        throw std::runtime_error("Cannot write " + headerPath + ".");
+}
+}
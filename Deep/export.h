@@ -0,0 +1,31 @@
+/* Export of a trained sequential FullyConnected model to a standalone
+C++11 header, for deployments that shouldn't link Eigen, nlohmann json
+or Boost nor read a state dict at startup. The weights become constexpr
+arrays aligned to cache lines, and the forward pass is generated as a
+chain of affine calls whose sizes are template arguments, so the
+compiler unrolls and vectorizes them, with the ReLU fused into the store
+of each output. The header only includes <cstddef>. */
+#ifndef EXPORT_H
+#define EXPORT_H
+#include "base.h"
+#include <Eigen/Dense>
+#include <string>
+
+namespace Deep::Export
+{
+/* Write the model as namespace name of the header at headerPath, name
+must be a C++ identifier. The header provides
+- inputSize and outputSize,
+- predict(const double *in, double *out) for one row,
+- predict(const double *in, double *out, std::size_t rows) for rows
+  stored one after the other,
+with the weights printed to 17 significant digits, which read back as
+the same doubles, so outputs only differ from model.forward by the order
+of the sums. The model must be a stack of FullyConnected layers, fold
+BatchNorm1d layers first (see traceAffineStack). Throws std::invalid_argument otherwise or for
+non-finite weights, std::runtime_error if the file cannot be written. */
+void exportHeader(Model &model, const Eigen::MatrixXd &sample, const std::string &headerPath,
+    const std::string &name = "model");
+}
+
+#endif
@@ -0,0 +1,160 @@
+/* Compile-time fixed-size FullyConnected layers for small models of
+known shape. Weights live in Eigen fixed-size matrices, so the compiler
+can unroll and vectorize the small dimensions, and single-row inference
+runs without any heap allocation. These are inference-only copies
+loaded from a trained model. Header only as everything is a template. */
+#ifndef FIXED_H
+#define FIXED_H
+#include "base.h"
+#include "nn.h"
+#include "trace.h"
+#include <Eigen/Dense>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+namespace Deep::Fixed
+{
+template <int In, int Out>
+class FixedFullyConnected
+{
+    static_assert(In > 0 && Out > 0, "Input channel and output channel must both be positive.");
+    public:
+        using Input = Eigen::Matrix<double, In, 1>;
+        using Output = Eigen::Matrix<double, Out, 1>;
+        /* Batched inputs are stored one sample per column, [In, B]. */
+        using BatchInput = Eigen::Matrix<double, In, Eigen::Dynamic>;
+        using BatchOutput = Eigen::Matrix<double, Out, Eigen::Dynamic>;
+
+        Eigen::Matrix<double, Out, In> weights;
+        Output biases;
+
+        FixedFullyConnected(): weights(Eigen::Matrix<double, Out, In>::Zero()), biases(Output::Zero()) {}
+
+        /* Copy the parameters of a trained FullyConnected layer. */
+        void load(FullyConnected &fc)
+        {
+            if (fc.weights->data.rows() != Out || fc.weights->data.cols() != In)
+                throw std::invalid_argument("FullyConnected layer shape doesn't match the fixed layer.");
+            weights = fc.weights->data;
+            biases = (fc.biases != nullptr) ? Output(fc.biases->data.col(0)) : Output::Zero();
+        }
+
+        /* Single sample forward, no heap allocation. */
+        template <bool Relu>
+        Output forward(const Input &x) const
+        {
+            Output y { biases };
+            y.noalias() += weights * x;
+            if (Relu)
+                y = y.cwiseMax(0.0);
+            return y;
+        }
+
+        template <bool Relu>
+        BatchOutput forward(const BatchInput &x) const
+        {
+            BatchOutput y { biases.replicate(1, x.cols()) };
+            y.noalias() += weights * x;
+            if (Relu)
+                y = y.cwiseMax(0.0);
+            return y;
+        }
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/* Multilayer perceptron with ReLU between layers,
+FixedMLP<11, 64, 64, 32, 1> has the shape of 11->64->64->32->1. */
+template <int... Dims>
+class FixedMLP;
+
+template <int In, int Out>
+class FixedMLP<In, Out>
+{
+    public:
+        using Input = Eigen::Matrix<double, In, 1>;
+        using Output = Eigen::Matrix<double, Out, 1>;
+        using BatchInput = Eigen::Matrix<double, In, Eigen::Dynamic>;
+        using BatchOutput = Eigen::Matrix<double, Out, Eigen::Dynamic>;
+        static constexpr int numLayers { 1 };
+
+        FixedFullyConnected<In, Out> layer;
+
+        FixedMLP(): layer() {}
+
+        Output forward(const Input &x) const
+        {
+            return layer.template forward<false>(x);
+        }
+        BatchOutput forward(const BatchInput &x) const
+        {
+            return layer.template forward<false>(x);
+        }
+        /* Load layers from names[index], names[index+1], ... */
+        void load(Model &model, const std::vector<std::string> &names, size_t index = 0)
+        {
+            FullyConnected *fc { dynamic_cast<FullyConnected*>(model.layers.at(names.at(index)).get()) };
+            if (fc == nullptr)
+                throw std::invalid_argument("Layer " + names[index] + " is not FullyConnected.");
+            layer.load(*fc);
+        }
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+template <int In, int Hidden, int... Rest>
+class FixedMLP<In, Hidden, Rest...>
+{
+    public:
+        using Input = Eigen::Matrix<double, In, 1>;
+        using Output = typename FixedMLP<Hidden, Rest...>::Output;
+        using BatchInput = Eigen::Matrix<double, In, Eigen::Dynamic>;
+        using BatchOutput = typename FixedMLP<Hidden, Rest...>::BatchOutput;
+        static constexpr int numLayers { 1 + FixedMLP<Hidden, Rest...>::numLayers };
+
+        FixedFullyConnected<In, Hidden> head;
+        FixedMLP<Hidden, Rest...> tail;
+
+        FixedMLP(): head(), tail() {}
+
+        Output forward(const Input &x) const
+        {
+            return tail.forward(head.template forward<true>(x));
+        }
+        BatchOutput forward(const BatchInput &x) const
+        {
+            return tail.forward(head.template forward<true>(x));
+        }
+        void load(Model &model, const std::vector<std::string> &names, size_t index = 0)
+        {
+            FullyConnected *fc { dynamic_cast<FullyConnected*>(model.layers.at(names.at(index)).get()) };
+            if (fc == nullptr)
+                throw std::invalid_argument("Layer " + names[index] + " is not FullyConnected.");
+            head.load(*fc);
+            tail.load(model, names, index + 1);
+        }
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/* Load a fixed MLP from a trained model, the layer order is found by
+tracing, and it must have ReLU after every layer but the last. */
+template <int In, int... Rest>
+void loadFixedMLP(FixedMLP<In, Rest...> &mlp, Model &model)
+{
+    std::vector<TracedLayer> traced { traceSequential(model, Eigen::MatrixXd::Zero(1, In)) };
+    if (static_cast<int>(traced.size()) != FixedMLP<In, Rest...>::numLayers)
+        throw std::invalid_argument("The model has a different number of layers than the fixed MLP.");
+    std::vector<std::string> names {};
+    for (size_t i=0; i<traced.size(); ++i)
+    {
+        if (traced[i].reluAfter != (i + 1 < traced.size()))
+            throw std::invalid_argument("The fixed MLP expects ReLU after every layer but the last.");
+        names.push_back(traced[i].name);
+    }
+    mlp.load(model, names);
+}
+}
+
+#endif
@@ -0,0 +1,40 @@
+#include "fold.h"
+#include "base.h"
+#include "nn.h"
+#include "trace.h"
+#include <Eigen/Dense>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+namespace Deep::Fold
+{
+int foldBatchNorm(Model &model, const Eigen::MatrixXd &sample)
+{
+    setTraining(model, false);
+    const std::vector<TracedLayer> traced { traceSequential(model, sample) };
+    int folded { 0 };
+    for (size_t i=0; i+1<traced.size(); ++i)
+    {
+        FullyConnected *fc { dynamic_cast<FullyConnected*>(model.layers[traced[i].name].get()) };
+        BatchNorm1d *bn { dynamic_cast<BatchNorm1d*>(model.layers[traced[i + 1].name].get()) };
+        if (fc == nullptr || bn == nullptr || traced[i].reluAfter)
+            continue;
+        const Eigen::MatrixXd &W { fc->weights->data };
+        const Eigen::ArrayXd scale { bn->gamma->data.col(0).array() 
+            / (bn->runningVar->data.col(0).array() + bn->epsilon()).sqrt() };
+        Eigen::ArrayXd bias { Eigen::ArrayXd::Zero(W.rows()) };
+        if (fc->biases != nullptr)
+            bias = fc->biases->data.col(0).array();
+        std::unique_ptr<FullyConnected> fused { new FullyConnected(static_cast<int>(W.cols()), static_cast<int>(W.rows())) };
+        fused->weights->data = scale.matrix().asDiagonal() * W;
+        fused->biases->data = (scale * (bias - bn->runningMean->data.col(0).array()) 
+            + bn->beta->data.col(0).array()).matrix();
+        model.layers[traced[i].name] = std::move(fused);
+        model.layers[traced[i + 1].name] = std::unique_ptr<Layer>(new Identity());
+        ++folded;
+        ++i; // The Identity cannot start another pair.
+    }
+    return folded;
+}
+}
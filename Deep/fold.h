@@ -0,0 +1,22 @@
+/* Export pass folding BatchNorm1d layers into the FullyConnected layer
+feeding them, for inference. With s = gamma / sqrt(runningVar + eps),
+BatchNorm(x * W^T + b) = x * (diag(s) W)^T + s * (b - runningMean) + beta,
+so the folded model runs one affine GEMM per pair and no normalization. */
+#ifndef FOLD_H
+#define FOLD_H
+#include "base.h"
+#include <Eigen/Dense>
+
+namespace Deep::Fold
+{
+/* Trace the model on a sample batch, then fold every BatchNorm1d that
+directly consumes a FullyConnected output (no ReLU in between) into it.
+The FullyConnected layer is replaced by one with the folded weights and
+biases, the BatchNorm1d by an Identity. Every BatchNorm1d is put in eval
+mode first, the result matches the eval mode output of the model.
+The model must be a sequential stack, see traceSequential.
+Returns the number of folded BatchNorm1d layers. */
+int foldBatchNorm(Model &model, const Eigen::MatrixXd &sample);
+}
+
+#endif
@@ -0,0 +1,269 @@
+#include "fusion.h"
+#include "node.h"
+#include "parallel.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+namespace Deep::Fusion
+{
+namespace
+{
+thread_local bool lazy { false };
+
+// Coefficients handled at once by a task, the registers of a slice stay in cache.
+constexpr Eigen::Index sliceSize { 4096 };
+
+Block reg(int r, const std::vector<Block> &operands, const std::vector<Eigen::ArrayXXd> &values)
+{
+    return r < 0 ? operands[static_cast<size_t>(-r-1)] : Block(values[static_cast<size_t>(r)]);
+}
+
+template <typename Dest>
+void applyStep(const Step &step, const Block &lhs, const Block &rhs, Dest &&dest)
+{
+    switch (step.op)
+    {
+        case Op::relu:
+            dest = lhs.max(0.0);
+            break;
+        case Op::add:
+            dest = lhs + rhs;
+            break;
+        case Op::subtract:
+            dest = lhs - rhs;
+            break;
+    }
+}
+
+/* Compute the registers of the first count steps into values. */
+void runSteps(const std::vector<Step> &program, const std::vector<Block> &operands, size_t count,
+    std::vector<Eigen::ArrayXXd> &values)
+{
+    if (values.size() < count)
+        values.resize(count);
+    for (size_t s=0; s<count; ++s)
+    {
+        const Step &step { program[s] };
+        applyStep(step, reg(step.lhs, operands, values), reg(step.rhs, operands, values), values[s]);
+    }
+}
+
+void checkSameShape(const std::vector<const Eigen::MatrixXd*> &in)
+{
+    for (const Eigen::MatrixXd *m: in)
+    {
+        if (m->rows() != in[0]->rows() || m->cols() != in[0]->cols())
+            throw std::invalid_argument("Element-wise operands must have the same shape.");
+    }
+}
+
+/* Gradients of every operand of a deferred node, computed by the first
+of them asking, released once they have all been served. */
+struct Backward: SavedState
+{
+    std::mutex mutex {};
+    int pending {0};
+    std::vector<T> gradients {};
+    T gradient(Node &node, size_t operand, const T &fromGradient) override;
+};
+
+T Backward::gradient(Node &node, size_t operand, const T &fromGradient)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pending == 0)
+    {
+        std::vector<const Eigen::MatrixXd*> operands {};
+        for (size_t i=0; i<node.nextNodes.size(); ++i)
+        {
+            node.checkVersion(i);
+            operands.push_back(&node.nextNodes[i]->data);
+            pending += node.nextNodes[i]->gradientFunction != gradFn::none ? 1 : 0;
+        }
+        gradients = Fusion::gradients(node.program, operands, fromGradient);
+    }
+    T toGradient { std::move(gradients[operand]) };
+    if (--pending <= 0)
+    {
+        pending = 0;
+        gradients.clear();
+    }
+    return toGradient;
+}
+
+Eigen::Index rowsOf(const Node &x)
+{
+    return x.deferred ? x.nextNodes[0]->data.rows() : x.data.rows();
+}
+
+Eigen::Index colsOf(const Node &x)
+{
+    return x.deferred ? x.nextNodes[0]->data.cols() : x.data.cols();
+}
+}
+
+const char* ToString(Op op)
+{
+    switch (op)
+    {
+        case Op::relu: return "relu";
+        case Op::add: return "add";
+        case Op::subtract: return "subtract";
+    }
+    return "[Unknown Op]";
+}
+
+LazyGuard::LazyGuard(): previous(lazy)
+{
+    lazy = true;
+}
+
+LazyGuard::~LazyGuard()
+{
+    lazy = previous;
+}
+
+bool isLazy()
+{
+    return lazy;
+}
+
+std::shared_ptr<Node> defer(Op op, std::shared_ptr<Node> a, std::shared_ptr<Node> b)
+{
+    if (op == Op::relu)
+        b = a;
+    if (rowsOf(*a) != rowsOf(*b) || colsOf(*a) != colsOf(*b))
+        throw std::invalid_argument(std::string("Operands of ") + ToString(op) + " must have the same shape.");
+    std::vector<std::shared_ptr<Node>> operands {};
+    std::vector<Step> program {};
+    auto operandRegister = [&operands](const std::shared_ptr<Node> &x){
+        const auto it = std::find(operands.begin(), operands.end(), x);
+        if (it == operands.end())
+        {
+            operands.push_back(x);
+            return -static_cast<int>(operands.size());
+        }
+        return -static_cast<int>(it - operands.begin()) - 1;
+    };
+    // Register holding the value of x, inlining its program when it is deferred.
+    auto registerOf = [&](const std::shared_ptr<Node> &x){
+        if (!x->deferred || x->graphReleased || program.size() + x->program.size() + 1 > maxSteps)
+        {
+            x->materialize();
+            return operandRegister(x);
+        }
+        std::vector<int> inner {};
+        for (size_t i=0; i<x->nextNodes.size(); ++i)
+        {
+            x->checkVersion(i);
+            inner.push_back(operandRegister(x->nextNodes[i]));
+        }
+        const int offset { static_cast<int>(program.size()) };
+        for (Step step: x->program)
+        {
+            step.lhs = step.lhs < 0 ? inner[static_cast<size_t>(-step.lhs-1)] : step.lhs + offset;
+            step.rhs = step.rhs < 0 ? inner[static_cast<size_t>(-step.rhs-1)] : step.rhs + offset;
+            program.push_back(step);
+        }
+        return static_cast<int>(program.size()) - 1;
+    };
+    const int lhs { registerOf(a) };
+    const int rhs { a == b ? lhs : registerOf(b) };
+    program.push_back(Step {op, lhs, rhs});
+    std::shared_ptr<Node> out { std::make_shared<Node>(T(), false, operands, gradFn::fusedBackward) };
+    out->program = std::move(program);
+    out->deferred = true;
+    if (isGradEnabled())
+        out->saved = std::make_shared<Backward>();
+    return out;
+}
+
+void run(const std::vector<Step> &program, const std::vector<Block> &operands,
+    std::vector<Eigen::ArrayXXd> &values, Eigen::Ref<Eigen::ArrayXXd> out)
+{
+    const size_t last { program.size() - 1 };
+    runSteps(program, operands, last, values);
+    const Step &step { program[last] };
+    applyStep(step, reg(step.lhs, operands, values), reg(step.rhs, operands, values), out);
+}
+
+Eigen::MatrixXd evaluate(const std::vector<Step> &program, const std::vector<const Eigen::MatrixXd*> &operands)
+{
+    checkSameShape(operands);
+    Eigen::MatrixXd out(operands[0]->rows(), operands[0]->cols());
+    Parallel::parallelFor(out.size(), static_cast<Eigen::Index>(program.size()), [&](Eigen::Index begin, Eigen::Index end){
+        std::vector<Eigen::ArrayXXd> values {};
+        for (Eigen::Index b=begin; b<end; b+=sliceSize)
+        {
+            const Eigen::Index e { std::min(end, b + sliceSize) };
+            std::vector<Block> in {};
+            for (const Eigen::MatrixXd *m: operands)
+                in.push_back(Parallel::flat(*m, b, e));
+            run(program, in, values, Parallel::flat(out, b, e));
+        }
+    });
+    return out;
+}
+
+std::vector<Eigen::MatrixXd> gradients(const std::vector<Step> &program,
+    const std::vector<const Eigen::MatrixXd*> &operands, const Eigen::MatrixXd &fromGradient)
+{
+    std::vector<Eigen::MatrixXd> toGradients(operands.size(), Eigen::MatrixXd(fromGradient.rows(), fromGradient.cols()));
+    const size_t last { program.size() - 1 };
+    // Only relu reads values, sums and differences route the gradient as is.
+    const bool masked { std::any_of(program.begin(), program.end(), [](const Step &step){
+        return step.op == Op::relu;
+    }) };
+    Parallel::parallelFor(fromGradient.size(), 2 * static_cast<Eigen::Index>(program.size()), [&](Eigen::Index begin, Eigen::Index end){
+        std::vector<Eigen::ArrayXXd> values {};
+        std::vector<Eigen::ArrayXXd> grads(program.size());
+        for (Eigen::Index b=begin; b<end; b+=sliceSize)
+        {
+            const Eigen::Index e { std::min(end, b + sliceSize) };
+            std::vector<Block> in {};
+            for (const Eigen::MatrixXd *m: operands)
+                in.push_back(Parallel::flat(*m, b, e));
+            if (masked)
+                runSteps(program, in, last, values);
+            std::vector<Eigen::Map<Eigen::ArrayXd>> out {};
+            for (Eigen::MatrixXd &g: toGradients)
+            {
+                out.push_back(Parallel::flat(g, b, e));
+                out.back().setZero();
+            }
+            for (size_t s=0; s<last; ++s)
+                grads[s].setZero(e - b, 1);
+            grads[last] = Parallel::flat(fromGradient, b, e);
+            auto send = [&](int r, double sign, const Eigen::ArrayXXd &g){
+                if (r >= 0)
+                    grads[static_cast<size_t>(r)] += sign * g;
+                else
+                    out[static_cast<size_t>(-r-1)] += sign * g.col(0);
+            };
+            // Steps only read earlier registers, so going backwards every
+            // gradient is complete before it is sent further.
+            for (size_t s=program.size(); s-->0;)
+            {
+                const Step &step { program[s] };
+                switch (step.op)
+                {
+                    case Op::relu:
+                        send(step.lhs, 1.0, (reg(step.lhs, in, values) > 0.0).select(grads[s], 0.0));
+                        break;
+                    case Op::add:
+                        send(step.lhs, 1.0, grads[s]);
+                        send(step.rhs, 1.0, grads[s]);
+                        break;
+                    case Op::subtract:
+                        send(step.lhs, 1.0, grads[s]);
+                        send(step.rhs, -1.0, grads[s]);
+                        break;
+                }
+            }
+        }
+    });
+    return toGradients;
+}
+}
@@ -0,0 +1,90 @@
+/* Lazy element-wise expressions for autograd nodes.
+While a LazyGuard lives, +, - and relu don't compute anything: they
+return a deferred node holding a small program over the operands of the
+whole expression, e.g. relu(x * W) + x is one node reading x * W and x.
+The first op needing the values (a GEMM, a reduction, an op which isn't
+element-wise) materializes it in a single pass, without a buffer per op.
+Backward goes through the same program once for all operands,
+recomputing the relu masks on the fly instead of keeping them. The
+programs and their interpreter are shared with the fused kernels of
+Graph.
+
+    {
+        Deep::Fusion::LazyGuard lazy;
+        NSP y { Deep::relu(xPtr * wPtr) + xPtr };
+        NSP L { Deep::sum(y) };  // y is computed here
+        L->backward();
+    }
+
+The data of a deferred node is empty until materialize() is called on it. */
+#ifndef FUSION_H
+#define FUSION_H
+#include <Eigen/Dense>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace Deep
+{
+class Node;
+}
+
+namespace Deep::Fusion
+{
+enum class Op { relu, add, subtract };
+
+const char* ToString(Op op);
+
+/* One instruction of a program: r < 0 reads operand -r-1, r >= 0 the
+result of step r. relu has rhs == lhs. The value of the program is its
+last step. */
+struct Step
+{
+    Op op;
+    int lhs;
+    int rhs;
+};
+
+using Block = Eigen::Ref<const Eigen::ArrayXXd>;
+
+/* Longest program of a deferred node. Operands which would make it
+longer are materialized instead of inlined, so expressions reusing a
+deferred node many times, such as t = t + relu(t), stay linear. */
+constexpr size_t maxSteps { 32 };
+
+/* Element-wise ops of the calling thread are deferred while a guard
+lives, guards nest. */
+class LazyGuard
+{
+    public:
+        LazyGuard();
+        LazyGuard(const LazyGuard&) = delete;
+        LazyGuard& operator=(const LazyGuard&) = delete;
+        ~LazyGuard();
+    private:
+        bool previous;
+};
+
+/* Whether element-wise ops of the calling thread are deferred. */
+bool isLazy();
+
+/* Deferred node for a op b, b is ignored by relu. Deferred operands are
+inlined, so the node reads no other deferred node. Throws
+std::invalid_argument if the operands don't have the same shape. */
+std::shared_ptr<Node> defer(Op op, std::shared_ptr<Node> a, std::shared_ptr<Node> b = nullptr);
+
+/* Run program over blocks of the same shape, the steps before the last
+into values, kept between calls to reuse their buffers, the last one
+straight to out, which may be one of the operands. */
+void run(const std::vector<Step> &program, const std::vector<Block> &operands,
+    std::vector<Eigen::ArrayXXd> &values, Eigen::Ref<Eigen::ArrayXXd> out);
+/* Value of program over operands of the same shape, in a single pass.
+Throws std::invalid_argument if their shapes differ. */
+Eigen::MatrixXd evaluate(const std::vector<Step> &program, const std::vector<const Eigen::MatrixXd*> &operands);
+/* Gradients reaching every operand given the one of the value of
+program, in a single pass recomputing the relu inputs. */
+std::vector<Eigen::MatrixXd> gradients(const std::vector<Step> &program,
+    const std::vector<const Eigen::MatrixXd*> &operands, const Eigen::MatrixXd &fromGradient);
+}
+
+#endif
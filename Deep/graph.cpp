@@ -0,0 +1,733 @@
+#include "graph.h"
+#include "node.h"
+#include "parallel.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace Deep::Graph
+{
+const char* ToString(Op op)
+{
+    switch (op)
+    {
+        case Op::input: return "input";
+        case Op::parameter: return "parameter";
+        case Op::constant: return "constant";
+        case Op::transpose: return "transpose";
+        case Op::matMul: return "matMul";
+        case Op::addMm: return "addMm";
+        case Op::relu: return "relu";
+        case Op::add: return "add";
+        case Op::subtract: return "subtract";
+        case Op::sum: return "sum";
+        case Op::mse: return "mse";
+        case Op::crossEntropy: return "crossEntropy";
+        case Op::fused: return "fused";
+    }
+    return "[Unknown Op]";
+}
+
+namespace
+{
+constexpr int notInlined { std::numeric_limits<int>::min() };
+
+GraphNode makeNode(Op op, std::vector<int> inputs = {})
+{
+    return GraphNode {op, std::move(inputs), false, false, {}, Eigen::MatrixXd(), nullptr, -1};
+}
+
+bool isLeaf(Op op)
+{
+    return op == Op::input || op == Op::parameter || op == Op::constant;
+}
+
+bool isElementwise(Op op)
+{
+    return op == Op::relu || op == Op::add || op == Op::subtract || op == Op::fused;
+}
+
+bool isGemm(Op op)
+{
+    return op == Op::matMul || op == Op::addMm;
+}
+
+/* Op of the program step of a relu, add or subtract node. */
+Fusion::Op elementwiseOp(Op op)
+{
+    switch (op)
+    {
+        case Op::relu: return Fusion::Op::relu;
+        case Op::add: return Fusion::Op::add;
+        case Op::subtract: return Fusion::Op::subtract;
+        default:
+            throw std::logic_error(std::string(ToString(op)) + " is not an element-wise op.");
+    }
+}
+
+/* Number of inputs read by the GEMM itself, the rest feed its epilogue. */
+size_t gemmArity(Op op)
+{
+    return op == Op::addMm ? 3 : 2;
+}
+
+std::vector<int> distinct(std::vector<int> indices)
+{
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    return indices;
+}
+
+/* Number of distinct nodes reading each node, an output counts as one. */
+std::vector<int> consumerCounts(const CapturedGraph &graph)
+{
+    std::vector<int> counts(graph.nodes.size(), 0);
+    for (const GraphNode &node: graph.nodes)
+    {
+        for (int in: distinct(node.inputs))
+            ++counts[static_cast<size_t>(in)];
+    }
+    for (int out: graph.outputs)
+        ++counts[static_cast<size_t>(out)];
+    return counts;
+}
+
+/* Keep the flagged nodes, renumbering the edges. */
+void compact(CapturedGraph &graph, const std::vector<bool> &keep)
+{
+    std::vector<int> newIndex(graph.nodes.size(), -1);
+    std::vector<GraphNode> kept {};
+    for (size_t i=0; i<graph.nodes.size(); ++i)
+    {
+        if (!keep[i])
+            continue;
+        newIndex[i] = static_cast<int>(kept.size());
+        kept.push_back(std::move(graph.nodes[i]));
+    }
+    for (GraphNode &node: kept)
+    {
+        for (int &in: node.inputs)
+            in = newIndex[static_cast<size_t>(in)];
+    }
+    for (int &out: graph.outputs)
+        out = newIndex[static_cast<size_t>(out)];
+    graph.nodes = std::move(kept);
+}
+
+/* Erase the candidates nobody reads anymore, then what only they read. */
+void eraseUnused(CapturedGraph &graph, std::vector<int> candidates)
+{
+    std::vector<int> consumers { consumerCounts(graph) };
+    std::vector<bool> keep(graph.nodes.size(), true);
+    while (!candidates.empty())
+    {
+        const size_t i { static_cast<size_t>(candidates.back()) };
+        candidates.pop_back();
+        if (!keep[i] || consumers[i] > 0 || graph.nodes[i].op == Op::input)
+            continue;
+        keep[i] = false;
+        for (int in: distinct(graph.nodes[i].inputs))
+        {
+            --consumers[static_cast<size_t>(in)];
+            candidates.push_back(in);
+        }
+    }
+    compact(graph, keep);
+}
+
+/* Make every reader of node from read node to instead, to < from. */
+void replaceUses(CapturedGraph &graph, int from, int to)
+{
+    for (size_t i=static_cast<size_t>(from)+1; i<graph.nodes.size(); ++i)
+        std::replace(graph.nodes[i].inputs.begin(), graph.nodes[i].inputs.end(), from, to);
+    std::replace(graph.outputs.begin(), graph.outputs.end(), from, to);
+}
+
+void checkSameShape(const std::vector<const Eigen::MatrixXd*> &in)
+{
+    for (const Eigen::MatrixXd *m: in)
+    {
+        if (m->rows() != in[0]->rows() || m->cols() != in[0]->cols())
+            throw std::invalid_argument("Element-wise operands must have the same shape.");
+    }
+}
+
+/* op(A) * op(B) (+ bias) by row blocks, each block goes through the
+epilogue while it is still in cache. */
+template <typename LHS, typename RHS>
+Eigen::MatrixXd gemm(const LHS &a, const RHS &b, const Eigen::MatrixXd *bias,
+    const std::vector<Fusion::Step> &epilogue, const std::vector<const Eigen::MatrixXd*> &extras)
+{
+    if (a.cols() != b.rows() || (bias != nullptr && bias->rows() != b.cols()))
+        throw std::invalid_argument("GEMM operands have incompatible shapes.");
+    Eigen::MatrixXd out(a.rows(), b.cols());
+    for (const Eigen::MatrixXd *extra: extras)
+    {
+        if (extra->rows() != out.rows() || extra->cols() != out.cols())
+            throw std::invalid_argument("Element-wise operands must have the same shape.");
+    }
+    Parallel::parallelFor(out.rows(), a.cols() * b.cols(), [&](Eigen::Index begin, Eigen::Index end){
+        const Eigen::Index n { end - begin };
+        auto block = out.middleRows(begin, n);
+        block.noalias() = a.middleRows(begin, n) * b;
+        if (bias != nullptr)
+            block.rowwise() += bias->col(0).transpose();
+        if (epilogue.empty())
+            return;
+        std::vector<Fusion::Block> operands {block.array()};
+        for (const Eigen::MatrixXd *extra: extras)
+            operands.push_back(extra->middleRows(begin, n).array());
+        std::vector<Eigen::ArrayXXd> values {};
+        Fusion::run(epilogue, operands, values, block.array());
+    });
+    return out;
+}
+
+Eigen::MatrixXd runGemm(const GraphNode &node, const std::vector<const Eigen::MatrixXd*> &in)
+{
+    const size_t arity { gemmArity(node.op) };
+    const Eigen::MatrixXd *bias { node.op == Op::addMm ? in[0] : nullptr };
+    const Eigen::MatrixXd &a { *in[arity - 2] };
+    const Eigen::MatrixXd &b { *in[arity - 1] };
+    const std::vector<const Eigen::MatrixXd*> extras(in.begin() + static_cast<std::ptrdiff_t>(arity), in.end());
+    if (node.transposeA && node.transposeB)
+        return gemm(a.transpose(), b.transpose(), bias, node.program, extras);
+    if (node.transposeA)
+        return gemm(a.transpose(), b, bias, node.program, extras);
+    if (node.transposeB)
+        return gemm(a, b.transpose(), bias, node.program, extras);
+    return gemm(a, b, bias, node.program, extras);
+}
+
+/* Value of a non-leaf node given the values of its inputs. */
+Eigen::MatrixXd evaluate(const GraphNode &node, const std::vector<const Eigen::MatrixXd*> &in)
+{
+    switch (node.op)
+    {
+        case Op::transpose:
+            return in[0]->transpose();
+        case Op::matMul:
+        case Op::addMm:
+            return runGemm(node, in);
+        case Op::relu:
+            return Fusion::evaluate({{Fusion::Op::relu, -1, -1}}, in);
+        case Op::add:
+        case Op::subtract:
+            return Fusion::evaluate({{elementwiseOp(node.op), -1, -2}}, in);
+        case Op::fused:
+            return Fusion::evaluate(node.program, in);
+        case Op::sum:
+        {
+            Eigen::MatrixXd result(1, 1);
+            result << in[0]->sum();
+            return result;
+        }
+        case Op::mse:
+        {
+            checkSameShape(in);
+            Eigen::MatrixXd result(1, 1);
+            result << (*in[0] - *in[1]).array().square().mean();
+            return result;
+        }
+        case Op::crossEntropy:
+        {
+            const Eigen::MatrixXd &logits { *in[0] };
+            const Eigen::MatrixXd &labels { *in[1] };
+            if (labels.rows() != logits.rows())
+                throw std::invalid_argument("Labels and logits must have the same number of rows.");
+            double total { 0.0 };
+            for (Eigen::Index i=0; i<logits.rows(); ++i)
+            {
+                const double rowMax { logits.row(i).maxCoeff() };
+                total += rowMax + std::log((logits.row(i).array() - rowMax).exp().sum())
+                    - logits(i, static_cast<Eigen::Index>(labels(i, 0)));
+            }
+            Eigen::MatrixXd result(1, 1);
+            result << total / static_cast<double>(logits.rows());
+            return result;
+        }
+        default:
+            throw std::logic_error(std::string("Cannot evaluate ") + ToString(node.op) + '.');
+    }
+}
+
+Op opOf(gradFn fn)
+{
+    switch (fn)
+    {
+        case gradFn::transposeBackward: return Op::transpose;
+        case gradFn::matMulBackward: return Op::matMul;
+        case gradFn::reluBackward: return Op::relu;
+        case gradFn::sumBackward: return Op::sum;
+        case gradFn::addBackward: return Op::add;
+        case gradFn::addMmBackward: return Op::addMm;
+        case gradFn::addMmTBackward: return Op::addMm;
+        case gradFn::subtractBackward: return Op::subtract;
+        case gradFn::mseBackward: return Op::mse;
+        case gradFn::crossEntropyBackward: return Op::crossEntropy;
+        case gradFn::fusedBackward: return Op::fused;
+        default: throw std::invalid_argument(std::string("Cannot capture ") + Deep::ToString(fn) + '.');
+    }
+}
+
+/* Append curr, whose operands are captured already. */
+int captureNode(Node *curr, const std::unordered_map<const Node*, int> &index, std::vector<GraphNode> &nodes)
+{
+    if (curr->gradientFunction == gradFn::accumulateGrad)
+    {
+        GraphNode node { makeNode(Op::parameter) };
+        node.source = curr->shared_from_this();
+        nodes.push_back(std::move(node));
+    }
+    else if (curr->gradientFunction == gradFn::none)
+    {
+        GraphNode node { makeNode(Op::constant) };
+        node.value = curr->data;
+        nodes.push_back(std::move(node));
+    }
+    else
+    {
+        GraphNode node { makeNode(opOf(curr->gradientFunction)) };
+        for (const NSP &next: curr->nextNodes)
+            node.inputs.push_back(index.at(next.get()));
+        // affineT reads its [out_c, in_c] weights transposed.
+        node.transposeB = curr->gradientFunction == gradFn::addMmTBackward;
+        if (node.op == Op::crossEntropy)
+        {
+            // The labels are saved by the op, not an operand.
+            GraphNode labels { makeNode(Op::constant) };
+            labels.value = curr->savedTensors[0];
+            node.inputs.push_back(static_cast<int>(nodes.size()));
+            nodes.push_back(std::move(labels));
+        }
+        // Deferred expressions keep their program.
+        node.program = curr->program;
+        nodes.push_back(std::move(node));
+    }
+    return static_cast<int>(nodes.size()) - 1;
+}
+}
+
+CapturedGraph::CapturedGraph(const std::vector<NSP> &inputs, const std::vector<NSP> &outputNodes, NSP root):
+    nodes(), outputs(), numInputs(static_cast<int>(inputs.size()))
+{
+    std::unordered_map<const Node*, int> index {};
+    for (size_t i=0; i<inputs.size(); ++i)
+    {
+        if (!index.insert({inputs[i].get(), static_cast<int>(i)}).second)
+            throw std::invalid_argument("The same node is given twice as input.");
+        GraphNode node { makeNode(Op::input) };
+        node.inputIndex = static_cast<int>(i);
+        nodes.push_back(std::move(node));
+    }
+    // Post-order depth first, a node is appended once its operands are.
+    std::vector<std::pair<Node*, bool>> stack {};
+    if (root != nullptr)
+        stack.push_back({root.get(), false});
+    for (auto it=outputNodes.rbegin(); it!=outputNodes.rend(); ++it)
+        stack.push_back({it->get(), false});
+    while (!stack.empty())
+    {
+        Node *curr { stack.back().first };
+        const bool expanded { stack.back().second };
+        stack.pop_back();
+        if (index.find(curr) != index.end())
+            continue;
+        if (expanded)
+        {
+            index[curr] = captureNode(curr, index, nodes);
+            continue;
+        }
+        if (curr->graphReleased)
+            throw std::invalid_argument("Cannot capture a graph released by backward, "
+                "capture before backward or use retainGraph = true.");
+        stack.push_back({curr, true});
+        for (auto it=curr->nextNodes.rbegin(); it!=curr->nextNodes.rend(); ++it)
+        {
+            if (index.find(it->get()) == index.end())
+                stack.push_back({it->get(), false});
+        }
+    }
+    for (const NSP &out: outputNodes)
+        outputs.push_back(index.at(out.get()));
+}
+
+std::vector<Eigen::MatrixXd> CapturedGraph::run(const std::vector<Eigen::MatrixXd> &inputs) const
+{
+    if (static_cast<int>(inputs.size()) != numInputs)
+        throw std::invalid_argument("Expected " + std::to_string(numInputs) + " inputs, got "
+            + std::to_string(inputs.size()) + '.');
+    std::vector<Eigen::MatrixXd> values(nodes.size());
+    std::vector<const Eigen::MatrixXd*> refs(nodes.size(), nullptr);
+    // Reads left of every value, intermediate values are freed after their last one.
+    std::vector<int> readsLeft(nodes.size(), 0);
+    for (const GraphNode &node: nodes)
+    {
+        for (int in: node.inputs)
+            ++readsLeft[static_cast<size_t>(in)];
+    }
+    for (int out: outputs)
+        ++readsLeft[static_cast<size_t>(out)];
+    for (size_t i=0; i<nodes.size(); ++i)
+    {
+        const GraphNode &node { nodes[i] };
+        switch (node.op)
+        {
+            case Op::input:
+                refs[i] = &inputs[static_cast<size_t>(node.inputIndex)];
+                break;
+            case Op::parameter:
+                refs[i] = &node.source->data;
+                break;
+            case Op::constant:
+                refs[i] = &node.value;
+                break;
+            default:
+            {
+                std::vector<const Eigen::MatrixXd*> in {};
+                for (int j: node.inputs)
+                    in.push_back(refs[static_cast<size_t>(j)]);
+                values[i] = evaluate(node, in);
+                refs[i] = &values[i];
+                for (int j: node.inputs)
+                {
+                    if (--readsLeft[static_cast<size_t>(j)] == 0)
+                        Eigen::MatrixXd().swap(values[static_cast<size_t>(j)]);
+                }
+            }
+        }
+    }
+    std::vector<Eigen::MatrixXd> ret {};
+    for (int out: outputs)
+        ret.push_back(*refs[static_cast<size_t>(out)]);
+    return ret;
+}
+
+Eigen::MatrixXd CapturedGraph::run(const Eigen::MatrixXd &input) const
+{
+    return run(std::vector<Eigen::MatrixXd> {input})[0];
+}
+
+int CapturedGraph::size() const
+{
+    return static_cast<int>(nodes.size());
+}
+
+int CapturedGraph::count(Op op) const
+{
+    return static_cast<int>(std::count_if(nodes.begin(), nodes.end(),
+        [op](const GraphNode &node){ return node.op == op; }));
+}
+
+void CapturedGraph::print() const
+{
+    for (size_t i=0; i<nodes.size(); ++i)
+    {
+        const GraphNode &node { nodes[i] };
+        std::cout << i << ": " << ToString(node.op) << '(';
+        for (size_t k=0; k<node.inputs.size(); ++k)
+            std::cout << (k ? ", " : "") << node.inputs[k];
+        std::cout << ')';
+        if (node.transposeA)
+            std::cout << " transposeA";
+        if (node.transposeB)
+            std::cout << " transposeB";
+        if (!node.program.empty())
+            std::cout << ' ' << node.program.size() << " element-wise steps";
+        std::cout << '\n';
+    }
+}
+
+void eliminateDeadNodes(CapturedGraph &graph)
+{
+    std::vector<bool> keep(graph.nodes.size(), false);
+    for (int out: graph.outputs)
+        keep[static_cast<size_t>(out)] = true;
+    // Inputs precede their readers, so one backward sweep marks everything needed.
+    for (size_t i=graph.nodes.size(); i-- > 0;)
+    {
+        if (graph.nodes[i].op == Op::input)
+            keep[i] = true;
+        if (!keep[i])
+            continue;
+        for (int in: graph.nodes[i].inputs)
+            keep[static_cast<size_t>(in)] = true;
+    }
+    compact(graph, keep);
+}
+
+void foldConstants(CapturedGraph &graph)
+{
+    std::vector<int> candidates {};
+    for (GraphNode &node: graph.nodes)
+    {
+        if (isLeaf(node.op))
+            continue;
+        bool constant { true };
+        std::vector<const Eigen::MatrixXd*> in {};
+        for (int j: node.inputs)
+        {
+            const GraphNode &operand { graph.nodes[static_cast<size_t>(j)] };
+            constant = constant && operand.op == Op::constant;
+            in.push_back(&operand.value);
+        }
+        if (!constant)
+            continue;
+        Eigen::MatrixXd value { evaluate(node, in) };
+        candidates.insert(candidates.end(), node.inputs.begin(), node.inputs.end());
+        node = makeNode(Op::constant);
+        node.value = std::move(value);
+    }
+    eraseUnused(graph, candidates);
+}
+
+void foldTransposes(CapturedGraph &graph)
+{
+    std::vector<int> candidates {};
+    for (size_t i=0; i<graph.nodes.size(); ++i)
+    {
+        GraphNode &node { graph.nodes[i] };
+        if (node.op == Op::transpose)
+        {
+            const GraphNode &operand { graph.nodes[static_cast<size_t>(node.inputs[0])] };
+            if (operand.op == Op::transpose)
+            {
+                replaceUses(graph, static_cast<int>(i), operand.inputs[0]);
+                candidates.push_back(static_cast<int>(i));
+            }
+            continue;
+        }
+        if (!isGemm(node.op))
+            continue;
+        const size_t arity { gemmArity(node.op) };
+        bool *flags[] { &node.transposeA, &node.transposeB };
+        for (size_t k=0; k<2; ++k)
+        {
+            int &in { node.inputs[arity - 2 + k] };
+            const GraphNode &operand { graph.nodes[static_cast<size_t>(in)] };
+            if (operand.op != Op::transpose)
+                continue;
+            candidates.push_back(in);
+            in = operand.inputs[0];
+            *flags[k] = !*flags[k];
+        }
+    }
+    eraseUnused(graph, candidates);
+}
+
+void eliminateDuplicates(CapturedGraph &graph)
+{
+    std::unordered_map<std::string, std::vector<int>> seen {};
+    std::vector<int> candidates {};
+    for (size_t i=0; i<graph.nodes.size(); ++i)
+    {
+        const GraphNode &node { graph.nodes[i] };
+        if (node.op == Op::input || node.op == Op::parameter)
+            continue;
+        std::vector<int> inputs { node.inputs };
+        // Addition commutes.
+        if (node.op == Op::add)
+            std::sort(inputs.begin(), inputs.end());
+        std::ostringstream key {};
+        key << static_cast<int>(node.op) << ' ' << node.transposeA << node.transposeB
+            << ' ' << node.value.rows() << 'x' << node.value.cols() << ':';
+        for (int in: inputs)
+            key << in << ',';
+        key << ';';
+        for (const Fusion::Step &step: node.program)
+            key << static_cast<int>(step.op) << ' ' << step.lhs << ' ' << step.rhs << ',';
+        std::vector<int> &bucket { seen[key.str()] };
+        int match { -1 };
+        for (int j: bucket)
+        {
+            if (node.op != Op::constant || graph.nodes[static_cast<size_t>(j)].value == node.value)
+            {
+                match = j;
+                break;
+            }
+        }
+        if (match < 0)
+        {
+            bucket.push_back(static_cast<int>(i));
+            continue;
+        }
+        replaceUses(graph, static_cast<int>(i), match);
+        candidates.push_back(static_cast<int>(i));
+    }
+    eraseUnused(graph, candidates);
+}
+
+void fuseElementwise(CapturedGraph &graph)
+{
+    std::vector<GraphNode> &nodes { graph.nodes };
+    std::vector<int> consumers { consumerCounts(graph) };
+    std::vector<bool> isOutput(nodes.size(), false);
+    for (int out: graph.outputs)
+        isOutput[static_cast<size_t>(out)] = true;
+    // A producer can be inlined when its only reader is the node being fused.
+    auto inlinable = [&](int j, Op kind){
+        return nodes[static_cast<size_t>(j)].op == kind && consumers[static_cast<size_t>(j)] == 1
+            && !isOutput[static_cast<size_t>(j)];
+    };
+    std::vector<int> candidates {};
+
+    // Grow every element-wise node into the chain of producers only it reads.
+    for (size_t i=0; i<nodes.size(); ++i)
+    {
+        GraphNode &node { nodes[i] };
+        if (!isElementwise(node.op))
+            continue;
+        if (node.op != Op::fused)
+        {
+            node.program = {{elementwiseOp(node.op), -1, node.op == Op::relu ? -1 : -2}};
+            node.op = Op::fused;
+        }
+        bool changed { true };
+        while (changed)
+        {
+            changed = false;
+            std::vector<int> inputs {};
+            std::vector<Fusion::Step> steps {};
+            auto inputReg = [&inputs](int j){
+                auto it = std::find(inputs.begin(), inputs.end(), j);
+                if (it == inputs.end())
+                    it = inputs.insert(it, j);
+                return -static_cast<int>(it - inputs.begin()) - 1;
+            };
+            // Register holding the result of each inlined operand.
+            std::vector<int> inlined(node.inputs.size(), notInlined);
+            std::vector<int> producers {};
+            for (size_t p=0; p<node.inputs.size(); ++p)
+            {
+                const int j { node.inputs[p] };
+                if (!inlinable(j, Op::fused))
+                    continue;
+                const size_t first { static_cast<size_t>(std::find(node.inputs.begin(), node.inputs.end(), j) - node.inputs.begin()) };
+                if (first < p)
+                {
+                    inlined[p] = inlined[first];
+                    continue;
+                }
+                const GraphNode &producer { nodes[static_cast<size_t>(j)] };
+                const int offset { static_cast<int>(steps.size()) };
+                for (const Fusion::Step &step: producer.program)
+                {
+                    auto map = [&](int r){
+                        return r < 0 ? inputReg(producer.inputs[static_cast<size_t>(-r-1)]) : r + offset;
+                    };
+                    steps.push_back({step.op, map(step.lhs), map(step.rhs)});
+                }
+                inlined[p] = static_cast<int>(steps.size()) - 1;
+                producers.push_back(j);
+            }
+            if (producers.empty())
+                break;
+            const int offset { static_cast<int>(steps.size()) };
+            for (const Fusion::Step &step: node.program)
+            {
+                auto map = [&](int r){
+                    if (r >= 0)
+                        return r + offset;
+                    const size_t p { static_cast<size_t>(-r-1) };
+                    return inlined[p] != notInlined ? inlined[p] : inputReg(node.inputs[p]);
+                };
+                steps.push_back({step.op, map(step.lhs), map(step.rhs)});
+            }
+            // The producers stop reading their inputs, the node reads the union.
+            for (int j: producers)
+            {
+                for (int in: distinct(nodes[static_cast<size_t>(j)].inputs))
+                    --consumers[static_cast<size_t>(in)];
+                candidates.push_back(j);
+            }
+            for (int in: distinct(node.inputs))
+                --consumers[static_cast<size_t>(in)];
+            for (int in: distinct(inputs))
+                ++consumers[static_cast<size_t>(in)];
+            node.inputs = std::move(inputs);
+            node.program = std::move(steps);
+            changed = true;
+        }
+    }
+
+    // Move fused kernels into the GEMM they read, when only they read it
+    // and their other operands are ready before it.
+    for (size_t i=0; i<nodes.size(); ++i)
+    {
+        GraphNode &node { nodes[i] };
+        if (node.op != Op::fused)
+            continue;
+        for (int g: distinct(node.inputs))
+        {
+            GraphNode &producer { nodes[static_cast<size_t>(g)] };
+            if (!isGemm(producer.op) || !producer.program.empty() || consumers[static_cast<size_t>(g)] != 1
+                || isOutput[static_cast<size_t>(g)])
+                continue;
+            std::vector<int> extras {};
+            for (int in: distinct(node.inputs))
+            {
+                if (in != g)
+                    extras.push_back(in);
+            }
+            if (!extras.empty() && extras.back() > g)
+                continue;
+            auto map = [&](int r){
+                if (r >= 0)
+                    return r;
+                const int j { node.inputs[static_cast<size_t>(-r-1)] };
+                if (j == g)
+                    return -1;
+                return -static_cast<int>(std::find(extras.begin(), extras.end(), j) - extras.begin()) - 2;
+            };
+            for (const Fusion::Step &step: node.program)
+                producer.program.push_back({step.op, map(step.lhs), map(step.rhs)});
+            producer.inputs.insert(producer.inputs.end(), extras.begin(), extras.end());
+            consumers[static_cast<size_t>(g)] = consumers[i];
+            replaceUses(graph, static_cast<int>(i), g);
+            node.inputs.clear();
+            candidates.push_back(static_cast<int>(i));
+            break;
+        }
+    }
+    eraseUnused(graph, candidates);
+}
+
+PassManager::PassManager(): passes() {}
+
+PassManager& PassManager::add(std::string name, Pass pass)
+{
+    passes.push_back({std::move(name), std::move(pass)});
+    return *this;
+}
+
+std::vector<PassReport> PassManager::run(CapturedGraph &graph, bool verbose) const
+{
+    std::vector<PassReport> reports {};
+    for (const std::pair<std::string, Pass> &pass: passes)
+    {
+        const int before { graph.size() };
+        pass.second(graph);
+        reports.push_back({pass.first, before, graph.size()});
+        if (verbose)
+            std::cout << pass.first << ": " << before << " -> " << graph.size()
+                << " nodes (" << before - graph.size() << " removed).\n";
+    }
+    return reports;
+}
+
+PassManager PassManager::defaultPipeline()
+{
+    PassManager manager {};
+    manager.add("eliminateDeadNodes", eliminateDeadNodes)
+        .add("foldConstants", foldConstants)
+        .add("foldTransposes", foldTransposes)
+        .add("eliminateDuplicates", eliminateDuplicates)
+        .add("fuseElementwise", fuseElementwise);
+    return manager;
+}
+}
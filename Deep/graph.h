@@ -0,0 +1,107 @@
+/* Graph capture and optimization passes for inference.
+A CapturedGraph records the ops of a Node DAG once, then replays them
+on new inputs. Passes rewrite it before it runs: transposes feeding a
+GEMM become operand flags, single-consumer chains of element-wise ops
+become one fused kernel (the epilogue of their GEMM when there is one),
+duplicate nodes are merged, subgraphs of constants are evaluated once
+and nodes the outputs don't depend on are dropped. Replays do not
+track gradients. */
+#ifndef GRAPH_H
+#define GRAPH_H
+#include "base.h"
+#include "fusion.h"
+#include "node.h"
+#include <Eigen/Dense>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Deep::Graph
+{
+enum class Op { input, parameter, constant, transpose, matMul, addMm,
+    relu, add, subtract, sum, mse, crossEntropy, fused };
+
+const char* ToString(Op op);
+
+struct GraphNode
+{
+    Op op;
+    // Indices of the nodes this one reads, always smaller than its own.
+    std::vector<int> inputs;
+    /* GEMM operand flags, op(A) * op(B) with A, B the matMul inputs
+    or the x, W inputs of addMm. */
+    bool transposeA;
+    bool transposeB;
+    /* fused: operands are the inputs. matMul, addMm: an epilogue whose
+    operand 0 is the GEMM result and the others the inputs past the GEMM ones.
+    Same programs as deferred nodes, run by the same interpreter. */
+    std::vector<Fusion::Step> program;
+    // Value of constant nodes.
+    Eigen::MatrixXd value;
+    // Parameters are read from this node each run, so they follow training.
+    NSP source;
+    // Position of input nodes in the argument of run().
+    int inputIndex;
+};
+
+class CapturedGraph
+{
+    public:
+        /* Nodes in topological order. */
+        std::vector<GraphNode> nodes;
+        std::vector<int> outputs;
+        /* Capture everything outputs depend on, and what root depends on
+        if given, such as the loss of a training step. inputs become
+        placeholders fed by run(), accumulateGrad leaves parameters and
+        other leaves constants, including labels. Throws std::invalid_argument
+        if backward already released the graph. */
+        CapturedGraph(const std::vector<NSP> &inputs, const std::vector<NSP> &outputs, NSP root = nullptr);
+        /* Evaluate the outputs for new inputs, given in the order of capture. */
+        std::vector<Eigen::MatrixXd> run(const std::vector<Eigen::MatrixXd> &inputs) const;
+        Eigen::MatrixXd run(const Eigen::MatrixXd &input) const;
+        int size() const;
+        /* Number of nodes of a kind. */
+        int count(Op op) const;
+        /* Show one line per node. */
+        void print() const;
+    private:
+        int numInputs;
+};
+
+/* Drop nodes no output depends on, inputs are kept. */
+void eliminateDeadNodes(CapturedGraph &graph);
+/* Evaluate ops whose inputs are all constants into constants. */
+void foldConstants(CapturedGraph &graph);
+/* Turn transpose inputs of GEMMs into operand flags, and cancel
+transposes of transposes. */
+void foldTransposes(CapturedGraph &graph);
+/* Merge nodes computing the same op on the same inputs, and equal constants. */
+void eliminateDuplicates(CapturedGraph &graph);
+/* Fuse chains of relu, add and subtract into single-pass kernels,
+and into the GEMM producing them when it has no other consumer. */
+void fuseElementwise(CapturedGraph &graph);
+
+struct PassReport
+{
+    std::string name;
+    int nodesBefore;
+    int nodesAfter;
+};
+
+class PassManager
+{
+    public:
+        using Pass = std::function<void(CapturedGraph&)>;
+        PassManager();
+        PassManager& add(std::string name, Pass pass);
+        /* Run the passes in order, reporting the size of graph around each. */
+        std::vector<PassReport> run(CapturedGraph &graph, bool verbose = false) const;
+        /* Every pass above, in an order where each one feeds the next. */
+        static PassManager defaultPipeline();
+    private:
+        std::vector<std::pair<std::string, Pass>> passes;
+};
+}
+
+#endif
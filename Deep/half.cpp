@@ -0,0 +1,297 @@
+#include "half.h"
+#include "nn.h"
+#include "node.h"
+#include "parallel.h"
+#include <nlohmann/json.hpp>
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <cassert>
+
+namespace Deep::Half
+{
+namespace
+{
+inline uint32_t bitsOf(float x)
+{
+    uint32_t u;
+    std::memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+inline float floatOf(uint32_t u)
+{
+    float x;
+    std::memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+struct Bf16Decoder
+{
+    float operator()(uint16_t h) const { return fromBf16(h); }
+};
+
+struct Fp16Decoder
+{
+    float operator()(uint16_t h) const { return fromFp16(h); }
+};
+
+/* Depth padded to a multiple of 8, the number of partial sums of dot. */
+constexpr int lanes { 8 };
+inline int paddedDepth(int K)
+{
+    return (K + lanes - 1) / lanes * lanes;
+}
+
+/* Eight independent partial sums, so the loop vectorizes without
+reassociating a single float accumulator. */
+template <typename Scalar, typename Decoder>
+inline float dot(const float *x, const Scalar *w, int Kp, Decoder decoder)
+{
+    float acc[lanes] {};
+    for (int k=0; k<Kp; k+=lanes)
+    {
+        for (int j=0; j<lanes; ++j)
+            acc[j] += x[k + j] * decoder(w[k + j]);
+    }
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+/* Number of decoded weight rows kept in cache while the batch sweeps them. */
+constexpr int blockRows { 32 };
+/* Batches up to this size decode the weights in registers, larger ones
+decode a block of rows once and reuse it for every input row. */
+constexpr int registerDecodeBatch { 4 };
+
+struct FloatDecoder
+{
+    float operator()(float x) const { return x; }
+};
+
+/* C[B, N] = X[B, Kp] * W[N, Kp]^T with row-major float X and C. Output
+channels are split across threads, so every thread reads its share of
+the 16-bit weights once per call. */
+template <typename Decoder>
+void gemmHalf(const float *X, const uint16_t *W, float *C, int B, int N, int Kp, Decoder decoder)
+{
+    Parallel::parallelFor(N, static_cast<Eigen::Index>(B) * Kp, [&](Eigen::Index begin, Eigen::Index end){
+        if (B <= registerDecodeBatch)
+        {
+            for (Eigen::Index o=begin; o<end; ++o)
+            {
+                for (int i=0; i<B; ++i)
+                    C[i * N + o] = dot(X + static_cast<Eigen::Index>(i) * Kp, W + o * Kp, Kp, decoder);
+            }
+            return;
+        }
+        std::vector<float> block(static_cast<size_t>(blockRows) * static_cast<size_t>(Kp));
+        for (Eigen::Index first=begin; first<end; first+=blockRows)
+        {
+            const Eigen::Index last { std::min<Eigen::Index>(first + blockRows, end) };
+            for (Eigen::Index o=first; o<last; ++o)
+            {
+                float *row { block.data() + (o - first) * Kp };
+                const uint16_t *w { W + o * Kp };
+                for (int k=0; k<Kp; ++k)
+                    row[k] = decoder(w[k]);
+            }
+            for (int i=0; i<B; ++i)
+            {
+                const float *x { X + static_cast<Eigen::Index>(i) * Kp };
+                for (Eigen::Index o=first; o<last; ++o)
+                    C[i * N + o] = dot(x, block.data() + (o - first) * Kp, Kp, FloatDecoder());
+            }
+        }
+    });
+}
+}
+
+const char* ToString(Format format)
+{
+    return format == Format::bf16 ? "bf16" : "fp16";
+}
+
+Format formatFromString(const std::string &name)
+{
+    if (name == "bf16")
+        return Format::bf16;
+    if (name == "fp16")
+        return Format::fp16;
+    throw std::invalid_argument("Unknown 16-bit format " + name + ", use bf16 or fp16.");
+}
+
+uint16_t toBf16(float x)
+{
+    uint32_t f { bitsOf(x) };
+    // Keep NaN a NaN, truncation could clear all its mantissa bits.
+    if ((f & 0x7fffffffu) > 0x7f800000u)
+        return static_cast<uint16_t>((f >> 16) | 0x40u);
+    f += 0x7fffu + ((f >> 16) & 1u);
+    return static_cast<uint16_t>(f >> 16);
+}
+
+float fromBf16(uint16_t h)
+{
+    return floatOf(static_cast<uint32_t>(h) << 16);
+}
+
+uint16_t toFp16(float x)
+{
+    // Bit tricks from F. Giesen, "half <-> float conversions".
+    const uint32_t f32Infinity { 255u << 23 };
+    const uint32_t f16Max { (127u + 16u) << 23 };
+    const uint32_t denormMagic { ((127u - 15u) + (23u - 10u) + 1u) << 23 };
+    uint32_t f { bitsOf(x) };
+    const uint32_t sign { f & 0x80000000u };
+    f ^= sign;
+    uint32_t o { 0 };
+    if (f >= f16Max)
+        o = (f > f32Infinity) ? 0x7e00u : 0x7c00u;
+    else if (f < (113u << 23))
+    {
+        // Subnormal or zero, let the float addition round the mantissa.
+        o = bitsOf(floatOf(f) + floatOf(denormMagic)) - denormMagic;
+    }
+    else
+    {
+        const uint32_t mantissaOdd { (f >> 13) & 1u };
+        f -= 112u << 23; // Rebias the exponent from 127 to 15.
+        f += 0xfffu + mantissaOdd;
+        o = f >> 13;
+    }
+    return static_cast<uint16_t>(o | (sign >> 16));
+}
+
+float fromFp16(uint16_t h)
+{
+    const uint32_t shiftedExponent { 0x7c00u << 13 };
+    uint32_t o { (static_cast<uint32_t>(h) & 0x7fffu) << 13 };
+    const uint32_t exponent { shiftedExponent & o };
+    o += (127u - 15u) << 23;
+    if (exponent == shiftedExponent)
+        o += (128u - 16u) << 23; // Infinity or NaN.
+    else if (exponent == 0)
+        o = bitsOf(floatOf(o + (1u << 23)) - floatOf(113u << 23)); // Zero or subnormal.
+    return floatOf(o | ((static_cast<uint32_t>(h) & 0x8000u) << 16));
+}
+
+uint16_t encode(float x, Format format)
+{
+    return format == Format::bf16 ? toBf16(x) : toFp16(x);
+}
+
+float decode(uint16_t h, Format format)
+{
+    return format == Format::bf16 ? fromBf16(h) : fromFp16(h);
+}
+
+HalfFullyConnected::HalfFullyConnected(FullyConnected &fc, Format storage, bool half_activations, bool fuse_relu):
+    in_c(static_cast<int>(fc.weights->data.cols())), out_c(static_cast<int>(fc.weights->data.rows())),
+    format(storage), halfActivations(half_activations), fuseRelu(fuse_relu),
+    hWeights(static_cast<size_t>(out_c) * static_cast<size_t>(paddedDepth(in_c)), 0),
+    bias(Eigen::VectorXf::Zero(out_c))
+{
+    const Eigen::MatrixXd &W { fc.weights->data };
+    const size_t Kp { static_cast<size_t>(paddedDepth(in_c)) };
+    for (int o=0; o<out_c; ++o)
+    {
+        for (int k=0; k<in_c; ++k)
+            hWeights[static_cast<size_t>(o) * Kp + static_cast<size_t>(k)] = encode(static_cast<float>(W(o, k)), format);
+    }
+    if (fc.biases != nullptr)
+        bias = fc.biases->data.col(0).cast<float>();
+}
+
+Eigen::MatrixXd HalfFullyConnected::forward(const Eigen::MatrixXd &in)
+{
+    using RowMajorXf = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+    assert(in.cols() == in_c && "Input data dimension doesn't match FC Layer's in_c.");
+    const int B { static_cast<int>(in.rows()) };
+    const int Kp { paddedDepth(in_c) };
+    // Float input rows padded with zeros to Kp.
+    std::vector<float> X(static_cast<size_t>(B) * static_cast<size_t>(Kp), 0.0f);
+    Eigen::Map<RowMajorXf, 0, Eigen::OuterStride<>> xMap(X.data(), B, in_c, Eigen::OuterStride<>(Kp));
+    xMap = in.cast<float>();
+    if (halfActivations)
+        xMap = xMap.unaryExpr([this](float x){ return decode(encode(x, format), format); });
+    std::vector<float> C(static_cast<size_t>(B) * static_cast<size_t>(out_c));
+    if (format == Format::bf16)
+        gemmHalf(X.data(), hWeights.data(), C.data(), B, out_c, Kp, Bf16Decoder());
+    else
+        gemmHalf(X.data(), hWeights.data(), C.data(), B, out_c, Kp, Fp16Decoder());
+
+    // Bias and ReLU while widening to double.
+    Eigen::Map<const RowMajorXf> cMap(C.data(), B, out_c);
+    Eigen::MatrixXd out { (cMap.rowwise() + bias.transpose()).cast<double>() };
+    if (fuseRelu)
+        out = out.cwiseMax(0.0);
+    return out;
+}
+
+NSP HalfFullyConnected::forward(NSP in)
+{
+    in->materialize();
+    return std::make_shared<Node>(forward(in->data), gradFn::none);
+}
+
+std::vector<NSP> HalfFullyConnected::params()
+{
+    return std::vector<NSP> {};
+}
+
+size_t HalfFullyConnected::weightBytes()
+{
+    return static_cast<size_t>(in_c) * static_cast<size_t>(out_c) * sizeof(uint16_t);
+}
+
+void convertModel(Model &model, Format format, bool halfActivations)
+{
+    for (auto it=model.layers.begin(); it!=model.layers.end(); ++it)
+    {
+        FullyConnected *fc { dynamic_cast<FullyConnected*>(it->second.get()) };
+        if (fc == nullptr)
+            continue; // Only FullyConnected layers are converted.
+        it->second = std::unique_ptr<Layer>(new HalfFullyConnected(*fc, format, halfActivations));
+    }
+}
+
+void saveHalfStateDict(Model &model, std::string modelPath, Format format)
+{
+    json modelStateDict {};
+    for (const std::pair<std::string, NSP> &p: model.namedParameters())
+    {
+        const Eigen::MatrixXd &data { p.second->data };
+        std::vector<uint16_t> bits(static_cast<size_t>(data.size()));
+        for (Eigen::Index i=0; i<data.size(); ++i)
+            bits[static_cast<size_t>(i)] = encode(static_cast<float>(data(i)), format);
+        modelStateDict[p.first] = json{{"format", ToString(format)}, {"row", data.rows()}, {"bits", bits}};
+    }
+    std::ofstream file(modelPath);
+    file << modelStateDict;
+}
+
+void loadHalfStateDict(Model &model, std::string modelPath)
+{
+    std::ifstream file(modelPath);
+    if (!file)
+        throw std::invalid_argument("The model path provided doesn't exist. ");
+    json object = json::parse(file);
+    for (const std::pair<std::string, NSP> &p: model.namedParameters())
+    {
+        if (!object.contains(p.first))
+            throw std::invalid_argument("Error occurred during loading state dict into the model. "
+                "Key not found from file: " + p.first);
+        const json &entry { object.at(p.first) };
+        const Format format { formatFromString(entry.at("format").get<std::string>()) };
+        const std::vector<uint16_t> bits { entry.at("bits").get<std::vector<uint16_t>>() };
+        const Eigen::Index rows { entry.at("row").get<Eigen::Index>() };
+        Eigen::MatrixXd &data { p.second->data };
+        if (rows != data.rows() || static_cast<Eigen::Index>(bits.size()) != data.size())
+            throw std::invalid_argument("Shape of " + p.first + " doesn't match the model.");
+        for (Eigen::Index i=0; i<data.size(); ++i)
+            data(i) = decode(bits[static_cast<size_t>(i)], format);
+    }
+}
+}
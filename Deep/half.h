@@ -0,0 +1,69 @@
+/* 16-bit weight storage of FullyConnected layers for inference.
+Small-batch inference is bound by reading the weights, storing them as
+bfloat16 (8 exponent bits, 7 mantissa bits) or IEEE half (5 exponent
+bits, 10 mantissa bits) quarters the bytes read compared to double.
+The GEMM decodes the weights to float in registers and accumulates in
+float, bias and ReLU are applied when writing the double output. */
+#ifndef HALF_H
+#define HALF_H
+#include "base.h"
+#include "nn.h"
+#include <Eigen/Dense>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Deep::Half
+{
+enum class Format { bf16, fp16 };
+
+const char* ToString(Format format);
+/* Inverse of ToString, throws std::invalid_argument on unknown names. */
+Format formatFromString(const std::string &name);
+
+/* Round to nearest even, overflows to infinity, NaN stays NaN. */
+uint16_t toBf16(float x);
+uint16_t toFp16(float x);
+/* Exact conversions back. */
+float fromBf16(uint16_t h);
+float fromFp16(uint16_t h);
+uint16_t encode(float x, Format format);
+float decode(uint16_t h, Format format);
+
+/* Inference only replacement of a FullyConnected layer,
+the output node does not track gradient. */
+class HalfFullyConnected: public Layer
+{
+    private:
+        int in_c;
+        int out_c;
+        Format format;
+        bool halfActivations;
+        bool fuseRelu;
+        // Row-major [out_c, in_c] weights, rows padded with zeros to a multiple of 8.
+        std::vector<uint16_t> hWeights;
+        Eigen::VectorXf bias;
+    public:
+        /* With half_activations, inputs are rounded to the same format
+        before the product, as if they had been stored in 16 bits. */
+        HalfFullyConnected(FullyConnected &fc, Format storage, bool half_activations = false, bool fuse_relu = false);
+        NSP forward(NSP in) override;
+        Eigen::MatrixXd forward(const Eigen::MatrixXd &in);
+        /* No trainable parameters. */
+        std::vector<NSP> params() override;
+        /* Bytes used by the 16-bit weights, padding excluded. */
+        size_t weightBytes();
+};
+
+/* Replace every FullyConnected layer of a model in place. */
+void convertModel(Model &model, Format format, bool halfActivations = false);
+
+/* Save the parameters of a model as 16-bit values, each entry holds
+{"format", "row", "bits"} where bits are the column-major encoded values. */
+void saveHalfStateDict(Model &model, std::string modelPath, Format format);
+/* Load a state dict written by saveHalfStateDict, decoding the values
+exactly, so converting the model afterwards loses nothing more. */
+void loadHalfStateDict(Model &model, std::string modelPath);
+}
+
+#endif
@@ -0,0 +1,200 @@
+#include "hogwild.h"
+#include "data.h"
+#include "node.h"
+#include "utility.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+namespace Deep::Hogwild
+{
+namespace
+{
+/* Parameters sorted by name, so every replica flattens them alike. */
+std::vector<NSP> orderedParameters(Model &model)
+{
+    std::vector<std::pair<std::string, NSP>> named { model.namedParameters() };
+    std::sort(named.begin(), named.end(), [](const std::pair<std::string, NSP> &a, const std::pair<std::string, NSP> &b){
+        return a.first < b.first;
+    });
+    std::vector<NSP> params {};
+    for (const std::pair<std::string, NSP> &p: named)
+        params.push_back(p.second);
+    return params;
+}
+
+size_t countValues(const std::vector<NSP> &params)
+{
+    size_t total { 0 };
+    for (const NSP &p: params)
+        total += static_cast<size_t>(p->data.size());
+    return total;
+}
+}
+
+SharedParameters::SharedParameters(Model &model):
+    values(countValues(orderedParameters(model))), updateCount(0)
+{
+    size_t i { 0 };
+    for (const NSP &p: orderedParameters(model))
+    {
+        for (Eigen::Index j=0; j<p->data.size(); ++j)
+            values[i++].store(p->data.data()[j], std::memory_order_relaxed);
+    }
+}
+
+void SharedParameters::read(Model &replica) const
+{
+    const std::vector<NSP> params { orderedParameters(replica) };
+    if (countValues(params) != values.size())
+        throw std::invalid_argument("The replica doesn't have the parameters of the shared model.");
+    size_t i { 0 };
+    for (const NSP &p: params)
+    {
+        double *dst { p->data.data() };
+        for (Eigen::Index j=0; j<p->data.size(); ++j)
+            dst[j] = values[i++].load(std::memory_order_relaxed);
+    }
+}
+
+void SharedParameters::subtract(double lr, const std::vector<double> &step)
+{
+    // A load and a store rather than a compare-and-swap loop: a racing
+    // update of the same coefficient may be lost, never torn.
+    for (size_t i=0; i<values.size(); ++i)
+        values[i].store(values[i].load(std::memory_order_relaxed) - lr * step[i], std::memory_order_relaxed);
+    updateCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+long SharedParameters::updates() const
+{
+    return updateCount.load(std::memory_order_relaxed);
+}
+
+size_t SharedParameters::size() const
+{
+    return values.size();
+}
+
+HogwildReport train(Model &model, const std::function<std::unique_ptr<Model>()> &makeReplica,
+    const std::vector<Eigen::MatrixXd> &dataset, HogwildOptions options)
+{
+    if (options.numThreads <= 0 || options.batchSize <= 0 || options.epochs <= 0 || options.lr <= 0.0)
+        throw std::invalid_argument("Threads, batch size, epochs and learning rate must be positive.");
+    const int N { static_cast<int>(dataset[0].rows()) };
+    if (N < options.batchSize)
+        throw std::invalid_argument("The dataset is smaller than a batch.");
+    // Every batch is full, the last rows of an epoch's shuffle are left out.
+    const long batchesPerEpoch { N / options.batchSize };
+    const long totalBatches { batchesPerEpoch * options.epochs };
+
+    // The shuffles of every epoch, drawn up front so the workers only share a counter.
+    std::mt19937 shuffleGen(options.seed);
+    std::vector<std::vector<int>> perms(static_cast<size_t>(options.epochs), std::vector<int>(static_cast<size_t>(N)));
+    for (std::vector<int> &perm: perms)
+    {
+        std::iota(perm.begin(), perm.end(), 0);
+        std::shuffle(perm.begin(), perm.end(), shuffleGen);
+    }
+
+    SharedParameters shared(model);
+    std::vector<std::unique_ptr<Model>> replicas {};
+    for (int t=0; t<options.numThreads; ++t)
+        replicas.push_back(makeReplica());
+    std::atomic<long> nextBatch { 0 };
+    std::atomic<long> dropped { 0 };
+    std::atomic<long> maxStaleness { 0 };
+    std::vector<std::vector<double>> lossSums(static_cast<size_t>(options.numThreads),
+        std::vector<double>(static_cast<size_t>(options.epochs), 0.0));
+    std::mutex errorMutex;
+    std::exception_ptr error {};
+
+    auto worker = [&](int t){
+        Model &replica { *replicas[static_cast<size_t>(t)] };
+        const std::vector<NSP> params { orderedParameters(replica) };
+        std::vector<double> velocity(shared.size(), 0.0);
+        bool first { true };
+        std::vector<int> rows(static_cast<size_t>(options.batchSize));
+        for (long b=nextBatch++; b<totalBatches; b=nextBatch++)
+        {
+            const long epoch { b / batchesPerEpoch };
+            const long offset { (b % batchesPerEpoch) * options.batchSize };
+            const std::vector<int> &perm { perms[static_cast<size_t>(epoch)] };
+            std::copy(perm.begin() + offset, perm.begin() + offset + options.batchSize, rows.begin());
+            const std::vector<Eigen::MatrixXd> batch { Data::selectRows(dataset, rows) };
+
+            const long readAt { shared.updates() };
+            shared.read(replica);
+            for (const NSP &p: params)
+                p->zeroGrad();
+            NSP loss { MSE(replica.forward(std::make_shared<Node>(batch[0])), batch[1]) };
+            loss->backward();
+            lossSums[static_cast<size_t>(t)][static_cast<size_t>(epoch)] += loss->data(0, 0);
+
+            const long staleness { shared.updates() - readAt };
+            long seen { maxStaleness.load() };
+            while (staleness > seen && !maxStaleness.compare_exchange_weak(seen, staleness)) {}
+            if (options.maxStaleness >= 0 && staleness > options.maxStaleness)
+            {
+                ++dropped;
+                continue;
+            }
+            // Same update as Optim::SGD, v = momentum * v + g, p -= lr * v.
+            size_t i { 0 };
+            for (const NSP &p: params)
+            {
+                T dense {};
+                const T &gradient { p->sparseGradient ? (dense = p->denseGradient()) : p->gradient };
+                const double *g { gradient.data() };
+                for (Eigen::Index j=0; j<gradient.size(); ++j, ++i)
+                    velocity[i] = first ? g[j] : options.momentum * velocity[i] + g[j];
+            }
+            first = false;
+            shared.subtract(options.lr, velocity);
+        }
+    };
+    auto guarded = [&](int t){
+        try
+        {
+            worker(t);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error)
+                error = std::current_exception();
+            // Let the other workers run out of batches.
+            nextBatch = totalBatches;
+        }
+    };
+
+    const auto t1 = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads {};
+    for (int t=1; t<options.numThreads; ++t)
+        threads.push_back(std::thread(guarded, t));
+    guarded(0);
+    for (std::thread &thread: threads)
+        thread.join();
+    const double seconds { std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count() };
+    if (error)
+        std::rethrow_exception(error);
+
+    shared.read(model);
+    HogwildReport report { totalBatches, dropped.load(), maxStaleness.load(), seconds,
+        static_cast<double>(totalBatches * options.batchSize) / seconds, {} };
+    for (int e=0; e<options.epochs; ++e)
+    {
+        double sum { 0.0 };
+        for (const std::vector<double> &sums: lossSums)
+            sum += sums[static_cast<size_t>(e)];
+        report.epochLoss.push_back(sum / static_cast<double>(batchesPerEpoch));
+    }
+    return report;
+}
+}
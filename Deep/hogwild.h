@@ -0,0 +1,78 @@
+/* Asynchronous lock-free SGD (Hogwild) across threads of one process.
+The parameters live in a SharedParameters buffer of atomics. Every worker
+thread owns a replica of the model, and each step it:
+- copies the shared parameters into the replica with relaxed loads,
+- takes the next batch from a shared atomic counter,
+- runs forward and backward on its private graph,
+- writes its SGD step back with relaxed loads and stores.
+No lock is taken. Concurrent steps on the same coefficient may overwrite
+each other, which Hogwild accepts by design.
+
+A step is stale when other workers applied updates between its read and
+its write. Steps staler than maxStaleness are dropped instead of applied. */
+#ifndef HOGWILD_H
+#define HOGWILD_H
+#include "base.h"
+#include <Eigen/Dense>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Deep::Hogwild
+{
+/* Parameters of a model flattened into atomics, ordered by name. */
+class SharedParameters
+{
+    public:
+        explicit SharedParameters(Model &model);
+        SharedParameters(const SharedParameters&) = delete;
+        SharedParameters& operator=(const SharedParameters&) = delete;
+        /* Copy the current values into the parameters of a model of the same architecture. */
+        void read(Model &replica) const;
+        /* values -= lr * step, step flattened like the parameters. Not atomic as a whole. */
+        void subtract(double lr, const std::vector<double> &step);
+        /* Number of subtract() calls so far. */
+        long updates() const;
+        size_t size() const;
+    private:
+        std::vector<std::atomic<double>> values;
+        std::atomic<long> updateCount;
+};
+
+struct HogwildOptions
+{
+    int numThreads {4};
+    int batchSize {64};
+    int epochs {1};
+    double lr {5e-5};
+    double momentum {0.9};
+    // Negative applies every step whatever its staleness.
+    long maxStaleness {-1};
+    unsigned seed {0};
+};
+
+struct HogwildReport
+{
+    long steps;
+    long droppedSteps;
+    // Largest number of updates applied between a read and its write.
+    long maxObservedStaleness;
+    double seconds;
+    double rowsPerSecond;
+    // Mean loss of the applied and dropped steps of every epoch.
+    std::vector<double> epochLoss;
+};
+
+/* Train model on dataset {features, labels} with the MSE loss.
+makeReplica builds models of the architecture of model, one per worker;
+it is called on the calling thread before the workers start. Every
+worker keeps its own momentum, like an SGD optimizer per thread. The
+trained parameters are copied back into model. */
+HogwildReport train(Model &model, const std::function<std::unique_ptr<Model>()> &makeReplica,
+    const std::vector<Eigen::MatrixXd> &dataset, HogwildOptions options = HogwildOptions());
+}
+
+#endif
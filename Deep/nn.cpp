@@ -47,12 +47,13 @@ NSP Deep::FullyConnected::forward(NSP in)
     input (in) assumed to be of shape [B, in_c]
     output will be of shape [B, out_c].
     */  
+    in->materialize();
     assert(in->data.cols() == in_c && "Input data dimension doesn't match FC Layer's in_c.");
 
     NSP out;
     if (useBias)
     {
-        out = Deep::affine(biases, in, weights->transpose());
+        out = Deep::affineT(biases, in, weights);
     }
     else
     {
@@ -68,3 +69,95 @@ std::vector<NSP> Deep::FullyConnected::params()
     if (useBias) ret.push_back(biases);
     return ret;
 }
+
+
+Deep::BatchNorm1d::BatchNorm1d(int num_features, double momentum_value, double epsilon, bool requires_grad):
+    channels(num_features), momentum(momentum_value), eps(epsilon), training(true),
+    gamma(nullptr), beta(nullptr), runningMean(nullptr), runningVar(nullptr)
+{
+    if (num_features <= 0)
+        throw std::invalid_argument("Number of features must be positive. ");
+    if (momentum_value < 0 || momentum_value > 1 || epsilon <= 0)
+        throw std::invalid_argument("Momentum must be within 0 to 1 and epsilon positive. ");
+    gradFn mode { requires_grad ? gradFn::accumulateGrad : gradFn::none };
+    gamma = std::make_shared<Deep::Node>(Eigen::MatrixXd::Ones(channels, 1), mode);
+    beta = std::make_shared<Deep::Node>(Eigen::MatrixXd::Zero(channels, 1), mode);
+    runningMean = std::make_shared<Deep::Node>(Eigen::MatrixXd::Zero(channels, 1), gradFn::none);
+    runningVar = std::make_shared<Deep::Node>(Eigen::MatrixXd::Ones(channels, 1), gradFn::none);
+}
+
+NSP Deep::BatchNorm1d::forward(NSP in)
+{
+    /* input (in) and output of shape [B, channels]. */
+    in->materialize();
+    assert(in->data.cols() == channels && "Input data dimension doesn't match BatchNorm1d's channels.");
+    if (!training)
+        return Deep::batchNormEval(in, gamma, beta, runningMean->data, runningVar->data, eps);
+    Eigen::MatrixXd mean {};
+    Eigen::MatrixXd var {};
+    NSP out { Deep::batchNorm(in, gamma, beta, mean, var, eps) };
+    const double B { static_cast<double>(in->data.rows()) };
+    runningMean->data = (1.0 - momentum) * runningMean->data + momentum * mean;
+    runningVar->data = (1.0 - momentum) * runningVar->data + momentum * B / (B - 1.0) * var;
+    return out;
+}
+
+std::vector<NSP> Deep::BatchNorm1d::params()
+{
+    return std::vector<NSP> {gamma, beta};
+}
+
+std::vector<NSP> Deep::BatchNorm1d::buffers()
+{
+    return std::vector<NSP> {runningMean, runningVar};
+}
+
+double Deep::BatchNorm1d::epsilon() const
+{
+    return eps;
+}
+
+NSP Deep::Identity::forward(NSP in)
+{
+    return in;
+}
+
+std::vector<NSP> Deep::Identity::params()
+{
+    return std::vector<NSP> {};
+}
+
+Deep::Embedding::Embedding(int num_embeddings, int embedding_dim, bool sparse, bool requires_grad):
+    num(num_embeddings), dim(embedding_dim), weights(nullptr)
+{
+    if (num_embeddings <= 0 || embedding_dim <= 0)
+        throw std::invalid_argument("Number of embeddings and embedding dimension must both be positive. ");
+    std::normal_distribution<double> weightDis(0.0, 1.0);
+    Eigen::MatrixXd weightsData = Eigen::MatrixXd::NullaryExpr(dim, num,
+        [&](){return weightDis(Deep::gen);}
+    );
+    weights = std::make_shared<Deep::Node>(weightsData, requires_grad ? gradFn::accumulateGrad : gradFn::none);
+    if (sparse && requires_grad)
+        weights->setSparseGradient();
+}
+
+NSP Deep::Embedding::forward(NSP in)
+{
+    in->materialize();
+    return embedding(weights, in->data);
+}
+
+std::vector<NSP> Deep::Embedding::params()
+{
+    return std::vector<NSP> {weights};
+}
+
+void Deep::setTraining(Model &model, bool training)
+{
+    for (auto it=model.layers.begin(); it!=model.layers.end(); ++it)
+    {
+        BatchNorm1d *bn { dynamic_cast<BatchNorm1d*>(it->second.get()) };
+        if (bn != nullptr)
+            bn->training = training;
+    }
+}
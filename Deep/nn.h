@@ -32,6 +32,61 @@ class FullyConnected: public Layer
         /* Get pointers to the weights */
         std::vector<NSP> params() override;
 };
+
+/* Normalizes each of the C columns of a [B, C] batch, then scales and
+shifts it by the trained gamma and beta. In training mode it uses the
+batch statistics and updates the running ones, with
+running = (1 - momentum) * running + momentum * batch (unbiased variance).
+In eval mode it uses the running statistics. */
+class BatchNorm1d: public Layer
+{
+    private:
+        int channels;
+        double momentum;
+        double eps;
+    public:
+        bool training;
+        NSP gamma;
+        NSP beta;
+        NSP runningMean;
+        NSP runningVar;
+        BatchNorm1d(int num_features, double momentum_value = 0.1, double epsilon = 1e-5, bool requires_grad = true);
+        NSP forward(NSP in) override;
+        /* gamma and beta. */
+        std::vector<NSP> params() override;
+        /* runningMean and runningVar, saved in state dicts. */
+        std::vector<NSP> buffers() override;
+        double epsilon() const;
+};
+
+/* Passes its input through, stands in for layers folded into others. */
+class Identity: public Layer
+{
+    public:
+        NSP forward(NSP in) override;
+        std::vector<NSP> params() override;
+};
+
+/* Maps integer ids to trained vectors. The table is stored [embedding_dim,
+num_embeddings], so the vector of an id is a contiguous column. The input
+holds ids [B, k] and the output is [B, k * embedding_dim], see embedding.
+With sparse, the backward records the gradient of the columns that were
+read rather than of the whole table, and Optim::SGD updates only those. */
+class Embedding: public Layer
+{
+    private:
+        int num;
+        int dim;
+    public:
+        NSP weights;
+        /* Weights drawn from N(0, 1). */
+        Embedding(int num_embeddings, int embedding_dim, bool sparse = true, bool requires_grad = true);
+        NSP forward(NSP in) override;
+        std::vector<NSP> params() override;
+};
+
+/* Switch every BatchNorm1d of a model to training or eval mode. */
+void setTraining(Model &model, bool training);
 }
 
 #endif
\ No newline at end of file
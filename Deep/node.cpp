@@ -1,11 +1,17 @@
 #include "node.h"
+#include "parallel.h"
+#include "cnn.h"
+#include "fusion.h"
 #include <svg.hpp>
 #include <Eigen/Dense>
 #include <vector>
 #include <iostream>
 #include <set>
 #include <unordered_map>
+#include <unordered_set>
+#include <fstream>
 #include <cmath>
+#include <stdexcept>
 
 using T = Eigen::MatrixXd;
 using NSP = std::shared_ptr<Deep::Node>;
@@ -35,12 +41,19 @@ namespace Deep
 
 svg::Polygon svgUtility::getLink(svg::Point fromPoint, svg::Point toPoint, int nodeW, int nodeH)
 {
-    constexpr double sqrt2by2 { 0.707107 };
     svg::Polygon arrow(Stroke(.5, Color::Blue));
+    for (const svg::Point &point: getLinkPoints(fromPoint, toPoint, nodeW, nodeH))
+        arrow << point;
+    return arrow;
+}
+
+std::vector<svg::Point> svgUtility::getLinkPoints(svg::Point fromPoint, svg::Point toPoint, int nodeW, int nodeH)
+{
+    constexpr double sqrt2by2 { 0.707107 };
     int wingLen {nodeH / 2}; // Length of arrow wings
     /* Guard no operation */
     if (fromPoint.x == toPoint.x && fromPoint.y == toPoint.y)
-        return arrow;
+        return {};
     svg::Point exactFrom {};
     svg::Point exactTo {};
     if (fromPoint.y < toPoint.y)
@@ -76,8 +89,7 @@ svg::Polygon svgUtility::getLink(svg::Point fromPoint, svg::Point toPoint, int n
         static_cast<int>(exactTo.y + sqrt2by2 * (0.5*vec.x-vec.y))
     );
 
-    arrow << exactFrom << exactTo << leftWing << exactTo << rightWing << exactTo << exactFrom;
-    return arrow;
+    return {exactFrom, exactTo, leftWing, exactTo, rightWing, exactTo, exactFrom};
 }
 
 std::ostream& operator<<(std::ostream& out, const gradFn gf){
@@ -85,11 +97,40 @@ std::ostream& operator<<(std::ostream& out, const gradFn gf){
     return out;
 }
 
+static thread_local bool gradEnabled { true };
+
+NoGradGuard::NoGradGuard(): previous(gradEnabled)
+{
+    gradEnabled = false;
+}
+
+NoGradGuard::~NoGradGuard()
+{
+    gradEnabled = previous;
+}
+
+bool isGradEnabled()
+{
+    return gradEnabled;
+}
+
 Node::Node(T x, bool isleaf, std::vector<std::shared_ptr<Node>> nextnodes, gradFn gradfn):
-    data(x), gradient(T{}), isLeaf(isleaf), nextNodes(nextnodes), gradientFunction(gradfn)
+    data(std::move(x)), gradient(T{}), isLeaf(isleaf), nextNodes(std::move(nextnodes)), gradientFunction(gradfn),
+    savedTensors(), version(0), savedVersions(), graphReleased(false), program(), deferred(false),
+    sparseGradient(false), sparseColumns(), sparseValues(), saved(nullptr)
 {
-    // zero-initialize gradient
-    gradient = T::Zero(x.rows(), x.cols());
+    // Deferred nodes read their operands later, they are dropped with them.
+    if (!gradEnabled && !isLeaf && gradientFunction != gradFn::fusedBackward)
+    {
+        isLeaf = true;
+        nextNodes.clear();
+        gradientFunction = gradFn::none;
+    }
+    // zero-initialize gradient, only leaves accumulate into it.
+    if (gradientFunction == gradFn::accumulateGrad)
+        gradient = T::Zero(data.rows(), data.cols());
+    for (const std::shared_ptr<Node> &next: nextNodes)
+        savedVersions.push_back(next->version);
     // if isleaf is true, verify gradfn is accumulateGrad. 
     // else throw and error.
     if (isleaf && (gradientFunction != Deep::gradFn::accumulateGrad) 
@@ -111,24 +152,71 @@ Node::Node(T x, bool isleaf, std::vector<std::shared_ptr<Node>> nextnodes, gradF
 Node::Node(T x, gradFn gradfn): 
     Node(x, true, std::vector<std::shared_ptr<Node>>{}, gradfn) {}
 
+Node::~Node()
+{
+    // Destroying a long chain through nested destructors would overflow
+    // the stack, take over the edges of nodes only owned here instead.
+    std::vector<std::shared_ptr<Node>> orphans { std::move(nextNodes) };
+    while (!orphans.empty())
+    {
+        std::shared_ptr<Node> curr { std::move(orphans.back()) };
+        orphans.pop_back();
+        if (curr.use_count() == 1)
+        {
+            for (std::shared_ptr<Node> &next: curr->nextNodes)
+                orphans.push_back(std::move(next));
+            curr->nextNodes.clear();
+        }
+    }
+}
+
 std::vector<int> Node::shape()
 {
-    return std::vector<int> { static_cast<int>(data.rows()), static_cast<int>(data.cols()) };
+    // Operands of a deferred node all have its shape.
+    const T &m { deferred ? nextNodes[0]->data : data };
+    return std::vector<int> { static_cast<int>(m.rows()), static_cast<int>(m.cols()) };
 }
 
 int Node::size()
 {
-    return static_cast<int>(data.size());
+    const std::vector<int> dims { shape() };
+    return dims[0] * dims[1];
+}
+
+void Node::materialize()
+{
+    if (version > 0 && !deferred && data.size() == 0)
+        throw std::runtime_error("The data of this node has been taken by an in-place operation.");
+    if (!deferred)
+        return;
+    if (graphReleased)
+        throw std::runtime_error("Cannot materialize a deferred node whose graph backward released.");
+    std::vector<const T*> operands {};
+    for (size_t i=0; i<nextNodes.size(); ++i)
+    {
+        checkVersion(i);
+        operands.push_back(&nextNodes[i]->data);
+    }
+    data = Fusion::evaluate(program, operands);
+    deferred = false;
 }
 
 void Node::zeroGrad()
 {
-    gradient.fill(0.0);
+    // A dense gradient reaching a sparse leaf is only kept until the next
+    // step, so the following ones take the sparse path again.
+    if (sparseGradient)
+        T().swap(gradient);
+    else
+        gradient.fill(0.0);
+    sparseColumns.clear();
+    sparseValues.resize(data.rows(), 0);
 }
 
 /* Overloading operators */
 std::shared_ptr<Node> Node::transpose()
 {
+    materialize();
     std::shared_ptr<Node> nodePtr(
         std::make_shared<Node>(
             this -> data.transpose(),
@@ -144,9 +232,12 @@ std::shared_ptr<Node> Node::transpose()
 /* Class ReLU */
 std::shared_ptr<Node> Node::relu()
 {
-    Eigen::MatrixXd x { this->data };
-    x = x.unaryExpr([](double num){
-        return (num>0) ? num : 0.0;
+    if (Fusion::isLazy())
+        return Fusion::defer(Fusion::Op::relu, shared_from_this());
+    materialize();
+    Eigen::MatrixXd x(data.rows(), data.cols());
+    Parallel::parallelFor(x.size(), 1, [&](Eigen::Index begin, Eigen::Index end){
+        Parallel::flat(x, begin, end) = Parallel::flat(data, begin, end).max(0.0);
     });
     std::shared_ptr<Node> nodePtr(
         std::make_shared<Node>(
@@ -160,10 +251,44 @@ std::shared_ptr<Node> Node::relu()
 }
 
 
+T Node::takeData(long references)
+{
+    if (gradientFunction == gradFn::accumulateGrad)
+        throw std::invalid_argument("An in-place operation cannot overwrite a leaf that requires gradient.");
+    // Not counting the pointer shared_from_this() returns.
+    if (shared_from_this().use_count() - 1 > references)
+        throw std::invalid_argument("An in-place operation cannot overwrite a node which is still used elsewhere.");
+    materialize();
+    ++version;
+    // Only leaves accumulate into gradient, so the donor doesn't need one either.
+    T().swap(gradient);
+    return std::move(data);
+}
+
+std::shared_ptr<Node> Node::relu_()
+{
+    // Deferred, relu doesn't need a buffer of its own.
+    if (Fusion::isLazy())
+        return relu();
+    T x { takeData() };
+    Parallel::parallelFor(x.size(), 1, [&x](Eigen::Index begin, Eigen::Index end){
+        Parallel::flat(x, begin, end) = Parallel::flat(x, begin, end).max(0.0);
+    });
+    return std::make_shared<Node>(
+        std::move(x),
+        false,
+        std::vector<std::shared_ptr<Node>> {shared_from_this()},
+        gradFn::reluBackward
+    );
+}
+
 std::shared_ptr<Node> Node::sum()
 {
+    materialize();
     Eigen::MatrixXd summation(1,1);
-    summation << this -> data.sum();
+    summation << Parallel::parallelSum(data.size(), 1, [this](Eigen::Index begin, Eigen::Index end){
+        return Parallel::flat(data, begin, end).sum();
+    });
     std::shared_ptr<Node> nodePtr(
         std::make_shared<Node>(
             summation,
@@ -176,89 +301,366 @@ std::shared_ptr<Node> Node::sum()
 }
 
 
-void Node::backward(T fromGradient)
+void Node::accumulate(const T &fromGradient)
+{
+    if (gradient.size() == 0)
+        gradient = fromGradient;
+    else
+        gradient += fromGradient;
+}
+
+void Node::setSparseGradient()
+{
+    if (gradientFunction != gradFn::accumulateGrad)
+        throw std::invalid_argument("Only accumulateGrad leaves keep a gradient.");
+    sparseGradient = true;
+    zeroGrad();
+}
+
+void Node::accumulateColumns(const std::vector<Eigen::Index> &columns, const T &values)
+{
+    assert(values.rows() == data.rows() && values.cols() == static_cast<Eigen::Index>(columns.size()));
+    const Eigen::Index old { sparseValues.cols() };
+    sparseValues.conservativeResize(data.rows(), old + values.cols());
+    sparseValues.rightCols(values.cols()) = values;
+    sparseColumns.insert(sparseColumns.end(), columns.begin(), columns.end());
+}
+
+T Node::denseGradient()
+{
+    T dense { gradient.size() == 0 ? T(T::Zero(data.rows(), data.cols())) : gradient };
+    for (size_t i=0; i<sparseColumns.size(); ++i)
+        dense.col(sparseColumns[i]) += sparseValues.col(static_cast<Eigen::Index>(i));
+    return dense;
+}
+
+bool Node::sparseOperand(size_t operand)
+{
+    return gradientFunction == gradFn::embeddingBackward && nextNodes[operand]->sparseGradient;
+}
+
+void Node::accumulateSparse(size_t operand, const T &fromGradient)
+{
+    assert(sparseOperand(operand));
+    // Block j of fromGradient holds the vectors of column j of the ids, see embedding.
+    const T &ids { savedTensors[0] };
+    const Eigen::Index D { nextNodes[operand]->data.rows() };
+    std::vector<Eigen::Index> columns {};
+    columns.reserve(static_cast<size_t>(ids.size()));
+    T values(D, ids.size());
+    for (Eigen::Index j=0; j<ids.cols(); ++j)
+    {
+        values.middleCols(j * ids.rows(), ids.rows()) = fromGradient.middleCols(j * D, D).transpose();
+        for (Eigen::Index b=0; b<ids.rows(); ++b)
+            columns.push_back(static_cast<Eigen::Index>(ids(b, j)));
+    }
+    nextNodes[operand]->accumulateColumns(columns, values);
+}
+
+void Node::releaseGraph()
+{
+    nextNodes.clear();
+    savedTensors.clear();
+    savedVersions.clear();
+    saved.reset();
+    graphReleased = true;
+}
+
+void Node::backward(T fromGradient, bool retainGraph)
 {
     /* Refuse if gradfn is none. */
     if (this->gradientFunction == gradFn::none)
         return ;
-    /* gradient should have the same shape as data */
-    assert((this->data.rows() == fromGradient.rows()) 
+    /* gradient should have the same shape as data, 
+    unless an in-place op has taken the data over. */
+    assert((this->data.size() == 0 || this->data.rows() == fromGradient.rows()) 
         && "Gradient doesn't have the same number of rows as data.");
-    assert((this->data.cols() == fromGradient.cols()) 
+    assert((this->data.size() == 0 || this->data.cols() == fromGradient.cols()) 
         && "Gradient doesn't have the same number of cols as data.");
     
     // First solve accumulate Grad, which is a leaf node.
     if (this->gradientFunction == gradFn::accumulateGrad)
     {
-        gradient += fromGradient;
+        accumulate(fromGradient);
         return;
     }
-    // For other, get the shape of first next node.
+    /* Every node runs once, after all of its consumers sent their gradient,
+    so it can be released right after. The map holds a reference to the 
+    nodes still waiting, the others die as soon as nobody else holds them. */
+    struct Pending
+    {
+        Pending(std::shared_ptr<Node> n = nullptr, int c = 0): node(n), consumers(c), gradient() {}
+        std::shared_ptr<Node> node;
+        int consumers;
+        T gradient;
+    };
+    std::unordered_map<Node*, Pending> pending {};
+    pending[this] = Pending(shared_from_this(), 1);
+    std::vector<Node*> stack {this};
+    while (!stack.empty())
+    {
+        Node *curr { stack.back() };
+        stack.pop_back();
+        if (curr->graphReleased)
+            throw std::runtime_error("Trying to backward through a released graph, "
+                "use retainGraph = true for the first backward.");
+        for (const std::shared_ptr<Node> &next: curr->nextNodes)
+        {
+            // Nodes which don't require gradient are not worth computing for.
+            if (next->gradientFunction == gradFn::none)
+                continue;
+            if (pending.find(next.get()) == pending.end())
+            {
+                pending[next.get()] = Pending(next);
+                if (next->gradientFunction != gradFn::accumulateGrad)
+                    stack.push_back(next.get());
+            }
+            ++pending[next.get()].consumers;
+        }
+    }
+    std::vector<Node*> ready {};
+    auto deliver = [&pending, &ready](Node *node, T nodeGradient){
+        if (node->gradientFunction == gradFn::accumulateGrad)
+        {
+            node->accumulate(nodeGradient);
+            return;
+        }
+        Pending &entry { pending.at(node) };
+        if (entry.gradient.size() == 0)
+            entry.gradient = std::move(nodeGradient);
+        else
+            entry.gradient += nodeGradient;
+        if (--entry.consumers == 0)
+            ready.push_back(node);
+    };
+    deliver(this, std::move(fromGradient));
+    while (!ready.empty())
+    {
+        Node *curr { ready.back() };
+        ready.pop_back();
+        Pending &entry { pending.at(curr) };
+        const T currGradient { std::move(entry.gradient) };
+        for (size_t i=0; i<curr->nextNodes.size(); ++i)
+        {
+            if (curr->nextNodes[i]->gradientFunction == gradFn::none)
+                continue;
+            if (curr->sparseOperand(i))
+                curr->accumulateSparse(i, currGradient);
+            else
+                deliver(curr->nextNodes[i].get(), curr->gradientFor(i, currGradient));
+        }
+        if (!retainGraph)
+            curr->releaseGraph();
+        pending.erase(curr);
+    }
+}
+
+void Node::checkVersion(size_t operand)
+{
+    if (this->nextNodes[operand]->version != this->savedVersions[operand])
+        throw std::runtime_error(std::string("An input needed by ") + ToString(this->gradientFunction)
+            + " has been modified by an in-place operation.");
+}
+
+T Node::gradientFor(size_t operand, const T &fromGradient)
+{
     switch (this->gradientFunction)
     { 
-        /* temporary toGradient destroyed after switch, so it is not stored.
-        I should think of a way for user to retain gradients. TODO */ 
         case gradFn::transposeBackward:
         {
-            this->nextNodes[0]->backward(fromGradient.transpose());
-            break;
+            return fromGradient.transpose();
         }
         case gradFn::matMulBackward:
         {
-            T data1 { this->nextNodes[0]->data };
-            T data2 { this->nextNodes[1]->data };
-            this->nextNodes[0]->backward(fromGradient * data2.transpose());
-            this->nextNodes[1]->backward(data1.transpose() * fromGradient);
-            break;
+            checkVersion(1 - operand);
+            const T &data1 { this->nextNodes[0]->data };
+            const T &data2 { this->nextNodes[1]->data };
+            if (operand == 0)
+                return Parallel::matmul(fromGradient, data2.transpose());
+            return Parallel::matmul(data1.transpose(), fromGradient);
         }
         case gradFn::reluBackward:
         {
-            T mask { this->nextNodes[0]->data };
-            mask = mask.unaryExpr([](double num){
-                return static_cast<double>(num>0);
+            /* Apply the mask of positive outputs, which are the positive inputs,
+            without materializing it. Using the output lets relu_ overwrite its input. */
+            if (this->version != 0)
+                throw std::runtime_error("The output of reluBackward has been modified by an in-place operation.");
+            const T &input { this->data };
+            T toGradient(input.rows(), input.cols());
+            Parallel::parallelFor(toGradient.size(), 1, [&](Eigen::Index begin, Eigen::Index end){
+                Parallel::flat(toGradient, begin, end) = (Parallel::flat(input, begin, end) > 0.0)
+                    .select(Parallel::flat(fromGradient, begin, end), 0.0);
             });
-            this->nextNodes[0]->backward(fromGradient.cwiseProduct(mask));
-            break;
+            return toGradient;
         }
         case gradFn::sumBackward:
         {
-            T toGradient{ this->nextNodes[0]->data };
             /* sumBackward node must contains a scalar [1,1] matrix. */
-            toGradient.fill(fromGradient(0,0));
-            this->nextNodes[0]->backward(toGradient);
-            break;
+            checkVersion(0);
+            return T::Constant(this->nextNodes[0]->data.rows(), 
+                this->nextNodes[0]->data.cols(), fromGradient(0,0));
         } 
         case gradFn::addBackward:
         {
             /* Simple propagate the gradient to the 
             next two components. */
-            this->nextNodes[0]->backward(fromGradient);
-            this->nextNodes[1]->backward(fromGradient);
-            break;
+            return fromGradient;
         }
         case gradFn::addMmBackward:
         {
-            this->nextNodes[0]->backward(fromGradient.colwise().sum().transpose());
-            this->nextNodes[1]->backward(fromGradient * this->nextNodes[2]->data.transpose());
-            this->nextNodes[2]->backward(this->nextNodes[1]->data.transpose() * fromGradient);
-            break;
+            if (operand == 0)
+                return fromGradient.colwise().sum().transpose();
+            checkVersion(operand == 1 ? 2 : 1);
+            if (operand == 1)
+                return Parallel::matmul(fromGradient, this->nextNodes[2]->data.transpose());
+            return Parallel::matmul(this->nextNodes[1]->data.transpose(), fromGradient);
+        }
+        case gradFn::addMmTBackward:
+        {
+            // this = b + x * W^T, so dx = g * W and dW = g^T * x, both in W's own layout.
+            if (operand == 0)
+                return fromGradient.colwise().sum().transpose();
+            checkVersion(operand == 1 ? 2 : 1);
+            if (operand == 1)
+                return Parallel::matmul(fromGradient, this->nextNodes[2]->data);
+            return Parallel::matmul(fromGradient.transpose(), this->nextNodes[1]->data);
+        }
+        case gradFn::embeddingBackward:
+        {
+            // Dense scatter-add of the gradient blocks into the table columns.
+            const T &ids { this->savedTensors[0] };
+            const Eigen::Index D { this->nextNodes[0]->data.rows() };
+            T toGradient { T::Zero(D, this->nextNodes[0]->data.cols()) };
+            for (Eigen::Index j=0; j<ids.cols(); ++j)
+            {
+                for (Eigen::Index b=0; b<ids.rows(); ++b)
+                    toGradient.col(static_cast<Eigen::Index>(ids(b, j))) += fromGradient.block(b, j * D, 1, D).transpose();
+            }
+            return toGradient;
         }
         case gradFn::subtractBackward:
         {
-            this->nextNodes[0]->backward(fromGradient);
-            this->nextNodes[1]->backward(-fromGradient);
-            break;
+            if (operand == 0)
+                return fromGradient;
+            return -fromGradient;
         }
         case gradFn::mseBackward:
         {
+            checkVersion(0);
+            checkVersion(1);
             const int N { this->nextNodes[0]->size() };
-            /* Gradient for the left Node */
-            T leftGradient { (2.0/N) * (this->nextNodes[0]->data - this->nextNodes[1]->data) };
-            leftGradient = fromGradient(0,0) * leftGradient;
+            const T &left { this->nextNodes[0]->data };
+            const T &right { this->nextNodes[1]->data };
             /* For MSE, rightGradient is the negative of leftGradient. */            
-            this->nextNodes[0]->backward(leftGradient);
-            this->nextNodes[1]->backward(-leftGradient);
-            break;
+            const double scale { ((operand == 0) ? 2.0 : -2.0) * fromGradient(0,0) / N };
+            T toGradient(left.rows(), left.cols());
+            Parallel::parallelFor(toGradient.size(), 2, [&](Eigen::Index begin, Eigen::Index end){
+                Parallel::flat(toGradient, begin, end) = scale
+                    * (Parallel::flat(left, begin, end) - Parallel::flat(right, begin, end));
+            });
+            return toGradient;
+        }
+        case gradFn::crossEntropyBackward:
+        {
+            /* (softmax - onehot) / B, the labels index into each row. */
+            checkVersion(0);
+            const T &logits { this->nextNodes[0]->data };
+            const T &labels { this->savedTensors[0] };
+            const T &logSumExp { this->savedTensors[1] };
+            const double scale { fromGradient(0,0) / static_cast<double>(logits.rows()) };
+            T toGradient(logits.rows(), logits.cols());
+            Parallel::parallelFor(logits.rows(), 2 * logits.cols(), [&](Eigen::Index begin, Eigen::Index end){
+                const Eigen::Index n { end - begin };
+                toGradient.middleRows(begin, n) = scale * (logits.middleRows(begin, n).colwise() 
+                    - logSumExp.col(0).segment(begin, n)).array().exp().matrix();
+                for (Eigen::Index i=begin; i<end; ++i)
+                    toGradient(i, static_cast<Eigen::Index>(labels(i, 0))) -= scale;
+            });
+            return toGradient;
+        }
+        case gradFn::conv2dBackward:
+        {
+            /* The gradient of the GEMM output has one row per output channel,
+            the inputs are x, W and optionally b. */
+            const ConvGeometry g { ConvGeometry::fromMatrix(this->savedTensors[0]) };
+            const T &weights { this->nextNodes[1]->data };
+            const T rowsGradient { toChannelRows(fromGradient, static_cast<int>(weights.rows())) };
+            if (operand == 2)
+                return rowsGradient.rowwise().sum();
+            if (operand == 0)
+            {
+                checkVersion(1);
+                return col2im(Parallel::matmul(weights.transpose(), rowsGradient), g, fromGradient.rows());
+            }
+            // Rebuilding the columns costs a gather, keeping them k * k times the input.
+            checkVersion(0);
+            return Parallel::matmul(rowsGradient, im2col(this->nextNodes[0]->data, g).transpose());
+        }
+        case gradFn::maxPool2dBackward:
+        {
+            /* Scatter to the saved argmax, overlapping windows may share one. */
+            const ConvGeometry g { ConvGeometry::fromMatrix(this->savedTensors[0]) };
+            const T &argmax { this->savedTensors[1] };
+            T toGradient { T::Zero(argmax.rows(), static_cast<Eigen::Index>(g.channels) * g.height * g.width) };
+            Parallel::parallelFor(argmax.rows(), argmax.cols(), [&](Eigen::Index begin, Eigen::Index end){
+                for (Eigen::Index j=0; j<argmax.cols(); ++j)
+                {
+                    for (Eigen::Index b=begin; b<end; ++b)
+                        toGradient(b, static_cast<Eigen::Index>(argmax(b, j))) += fromGradient(b, j);
+                }
+            });
+            return toGradient;
+        }
+        case gradFn::batchNormBackward:
+        {
+            /* Inputs are x, gamma and beta, xhat is rebuilt from x and the
+            saved mean and inverse standard deviation. */
+            if (operand == 2)
+                return fromGradient.colwise().sum().transpose();
+            checkVersion(0);
+            const T &x { this->nextNodes[0]->data };
+            const T &mean { this->savedTensors[0] };
+            const T &invStd { this->savedTensors[1] };
+            const bool batchStats { this->savedTensors[2](0, 0) != 0.0 };
+            const Eigen::Index B { x.rows() };
+            T toGradient(operand == 1 ? x.cols() : B, operand == 1 ? 1 : x.cols());
+            if (operand == 0)
+                checkVersion(1);
+            Parallel::parallelFor(x.cols(), 4 * B, [&](Eigen::Index begin, Eigen::Index end){
+                for (Eigen::Index j=begin; j<end; ++j)
+                {
+                    const double scale { this->nextNodes[1]->data(j, 0) * invStd(j, 0) };
+                    if (operand == 0 && !batchStats)
+                    {
+                        toGradient.col(j) = scale * fromGradient.col(j);
+                        continue;
+                    }
+                    const Eigen::ArrayXd xhat { (x.col(j).array() - mean(j, 0)) * invStd(j, 0) };
+                    if (operand == 1)
+                    {
+                        toGradient(j, 0) = (fromGradient.col(j).array() * xhat).sum();
+                        continue;
+                    }
+                    /* The statistics depend on the whole column:
+                    scale * (dy - mean(dy) - xhat * mean(dy * xhat)). */
+                    const double dyMean { fromGradient.col(j).mean() };
+                    const double dyXhatMean { (fromGradient.col(j).array() * xhat).mean() };
+                    toGradient.col(j) = (scale * (fromGradient.col(j).array() - dyMean - xhat * dyXhatMean)).matrix();
+                }
+            });
+            return toGradient;
+        }
+        case gradFn::lstmBackward:
+        case gradFn::gruBackward:
+        case gradFn::attentionBackward:
+        case gradFn::fusedBackward:
+        {
+            /* Backward through time, the attention tiles or the fused
+            program, run once for the first operand asking. */
+            if (this->saved == nullptr)
+                throw std::runtime_error(std::string("The state saved by ") + ToString(this->gradientFunction)
+                    + " has been released.");
+            return this->saved->gradient(*this, operand, fromGradient);
         }
         default:
             std::cout << "The backward function for " 
@@ -269,16 +671,15 @@ void Node::backward(T fromGradient)
                 " See the last error message above."
             );
     }
-
 }
 
-void Node::backward(double fromGradient)
+void Node::backward(double fromGradient, bool retainGraph)
 {
     assert(this->data.size() == 1 && "Backward without parameter should be used "
         "on a node with a scalar data (i.e., 1x1 matrix.)");
     Eigen::MatrixXd dummy(1,1);
     dummy << fromGradient;
-    this->backward(dummy);
+    this->backward(dummy, retainGraph);
 }
 
 void Node::backward()
@@ -294,6 +695,67 @@ std::ostream& operator<< (std::ostream &out, const std::shared_ptr<Node>& node)
     return out;    
 }
 
+namespace
+{
+/* Nodes reachable from root grouped by their distance to it, each node
+in the first layer it is met, in the order of nextNodes. */
+std::vector<std::vector<const Node*>> graphLayers(const Node *root)
+{
+    std::vector<std::vector<const Node*>> layers {{root}};
+    std::unordered_set<const Node*> visited {root};
+    while (true)
+    {
+        std::vector<const Node*> children {};
+        for (const Node *parent: layers.back())
+        {
+            for (const std::shared_ptr<Node> &next: parent->nextNodes)
+            {
+                if (visited.insert(next.get()).second)
+                    children.push_back(next.get());
+            }
+        }
+        if (children.empty())
+            break;
+        layers.push_back(std::move(children));
+    }
+    return layers;
+}
+
+std::string nodeLabel(const Node *node)
+{
+    return std::string(ToString(node->gradientFunction)) 
+        + " (row=" + std::to_string(node->data.rows())
+        + ",col=" + std::to_string(node->data.cols()) + ")";
+}
+
+/* Same markup as the svg shapes, written straight to out, as svg.hpp 
+formats every attribute through its own stringstream. The layout is on
+an integer grid, printing integers also keeps large graphs out of the
+scientific notation doubles would switch to. */
+long long pixel(double coordinate)
+{
+    return std::llround(coordinate);
+}
+
+void writeNode(std::ostream &out, const Point &topLeft, int w, int h, const std::string &label)
+{
+    out << "\t<rect x=\"" << pixel(topLeft.x) << "\" y=\"" << pixel(topLeft.y) 
+        << "\" width=\"" << w << "\" height=\"" << h 
+        << "\" fill=\"rgb(255,255,255)\" stroke-width=\"3\" stroke=\"rgb(0,0,0)\" />\n"
+        << "\t<text x=\"" << pixel(topLeft.x) + w/8 << "\" y=\"" << pixel(topLeft.y) + h/2 
+        << "\" fill=\"rgb(0,0,0)\" font-size=\"12\" font-family=\"Verdana\" >" 
+        << label << "</text>\n";
+}
+
+void writeLink(std::ostream &out, const Point &fromPoint, const Point &toPoint, int w, int h)
+{
+    out << "\t<polygon points=\"";
+    for (const Point &point: svgUtility::getLinkPoints(fromPoint, toPoint, w, h))
+        out << pixel(point.x) << ',' << pixel(point.y) << ' ';
+    out << "\" fill=\"none\" stroke-width=\"0.5\" stroke=\"rgb(0,0,255)\" />\n";
+}
+}
+
 int Node::descendents(int level, bool verbose)
 {   
     if (level == 0 && verbose)
@@ -302,43 +764,33 @@ int Node::descendents(int level, bool verbose)
         std::cout << "Numbers in parentheses shows how many pointers are "
             "referencing the node.\n";
     }
-        
-        
-    if (verbose)
-        std::cout << std::string(level * 4, '=') 
-            << level << ": " 
-            << this->gradientFunction 
-            /* minus use count by 1 because 
-            this function creates a temporary copy of this. */
-            << " (" << shared_from_this().use_count() - 1
-            << ", [" << this << ']'
-            << ")\n";
-    
-    if (this->nextNodes.size() == 0){ return 1; }
-
-    for (const std::shared_ptr<Node>& nodePtr: this->nextNodes)
-    {
-        nodePtr->descendents(level+1, verbose);
-    }
-    // Calculate number of nodes using DFS
-    std::set<std::shared_ptr<Node>> visited {};
-    std::vector<std::shared_ptr<Node>> stack {shared_from_this()};
-    while (stack.size() > 0)
+    // Depth first with an explicit stack, nodes met again are printed 
+    // but not expanded, so both the count and the output stay linear.
+    std::unordered_set<const Node*> visited {};
+    std::vector<std::pair<Node*, int>> stack {{this, level}};
+    while (!stack.empty())
     {
-        std::shared_ptr<Node> curr {stack.back()};
+        Node *curr { stack.back().first };
+        const int currLevel { stack.back().second };
         stack.pop_back();
-        if (visited.find(curr) == visited.end())
+        const bool firstVisit { visited.insert(curr).second };
+        if (verbose)
+            std::cout << std::string(static_cast<size_t>(currLevel) * 4, '=') 
+                << currLevel << ": " 
+                << curr->gradientFunction 
+                /* minus use count by 1 because 
+                this creates a temporary copy of curr. */
+                << " (" << curr->shared_from_this().use_count() - 1
+                << ", [" << curr << ']'
+                << (firstVisit ? ")\n" : ", shown above)\n");
+        if (!firstVisit)
+            continue;
+        for (auto it=curr->nextNodes.rbegin(); it!=curr->nextNodes.rend(); ++it)
         {
-            visited.insert(curr);
-
-            for (std::shared_ptr<Node> nextNode: curr->nextNodes)
-            {
-                if (visited.find(nextNode) == visited.end())
-                    stack.push_back(nextNode);
-            }
+            if (verbose || visited.find(it->get()) == visited.end())
+                stack.push_back({it->get(), currLevel + 1});
         }
     }
-
     return static_cast<int>(visited.size());
 }
 
@@ -347,52 +799,47 @@ int Node::descendents(bool verbose)
     return Node::descendents(0, verbose);
 }
 
-void Node::visualizeGraph(std::string path)
+void Node::exportDot(std::ostream &out)
 {
-    int maxNode { 1 }; // Maximum number of nodes in a layer.
-    int numLayers { 0 };
-    // Create row structures
-    std::vector<std::vector<NSP>> structure {{shared_from_this()}};
+    // Nodes are numbered and written as they are discovered, nothing
+    // but the ids is kept in memory.
+    std::unordered_map<const Node*, size_t> ids {{this, 0}};
+    std::vector<const Node*> queue {this};
+    out << "digraph backward {\n    node [shape=box];\n";
+    for (size_t head=0; head<queue.size(); ++head)
     {
-    std::set<NSP> visited {shared_from_this()};
-    while (true)
-    {
-        // Exhaust all children 
-        std::vector<NSP> par {structure.back()};
-        std::vector<NSP> children {};
-        for (NSP p: par)
+        const Node *curr { queue[head] };
+        out << "    n" << head << " [label=\"" << nodeLabel(curr) << "\"];\n";
+        for (const std::shared_ptr<Node> &next: curr->nextNodes)
         {
-            auto nextnodes { p->nextNodes };
-            std::vector<NSP> uniqueNextNodes {};
-            for (NSP nextnode: nextnodes)
-            {
-                if (visited.find(nextnode) == visited.end())
-                {
-                    uniqueNextNodes.push_back(nextnode);
-                    visited.insert(nextnode);
-                }
-            }
-            children.insert(children.end(), uniqueNextNodes.begin(), uniqueNextNodes.end());
+            auto inserted = ids.insert({next.get(), queue.size()});
+            if (inserted.second)
+                queue.push_back(next.get());
+            out << "    n" << head << " -> n" << inserted.first->second << ";\n";
         }
-        const int nChildren { static_cast<int>(children.size()) };
-        if (nChildren == 0)
-            break;
-        maxNode = std::max(maxNode, nChildren);
-        structure.push_back(children);
     }
+    out << "}\n";
+}
+
+void Node::exportDot(std::string path)
+{
+    std::ofstream out(path);
+    if (!out)
+        throw std::runtime_error("Cannot open " + path + " for writing.");
+    exportDot(out);
+}
+
+void Node::visualizeGraph(std::string path)
+{
+    const std::vector<std::vector<const Node*>> layers { graphLayers(this) };
+    const int numLayers { static_cast<int>(layers.size()) };
+    size_t maxNode { 1 }; // Maximum number of nodes in a layer.
+    size_t numNodes { 0 };
+    for (const std::vector<const Node*> &layer: layers)
+    {
+        maxNode = std::max(maxNode, layer.size());
+        numNodes += layer.size();
     }
-    
-    numLayers = static_cast<int>(structure.size());
-
-    // Show result
-    // for (std::vector<NSP> alayer: structure)
-    // {
-    //     for (NSP anode: alayer)
-    //     {
-    //         std::cout << anode -> gradientFunction << ' ';
-    //     }
-    //     std::cout << '\n';
-    // }
 
     // Plot into SVG
     /* Use rectangle with height and width (h, w) to represent a node.
@@ -403,62 +850,48 @@ void Node::visualizeGraph(std::string path)
     int gapW {50}; // Horizontal gap between two nodes
     int margin {30}; // Margin space of four borders
     int marginT {margin}, marginB {margin}, marginL {margin}, marginR {margin};
-    int svgWidth {marginL + marginR + maxNode * (w + gapW) - gapW};
-    int svgHeight {marginT + marginB + numLayers * (h + gapH) - gapH};
-    // This map record the location (x,y) of each NSP.
-    std::unordered_map<NSP, Point> locator {};
-    Dimensions dimensions(svgWidth, svgHeight);
-    Document graph(path, Layout(dimensions, Layout::TopLeft));
-
-    {
+    const long long svgWidth {marginL + marginR + static_cast<long long>(maxNode) * (w + gapW) - gapW};
+    const long long svgHeight {marginT + marginB + static_cast<long long>(numLayers) * (h + gapH) - gapH};
+    // Elements are written to the file layer by layer instead of 
+    // building the whole document in memory.
+    std::ofstream out(path);
+    if (!out)
+        throw std::runtime_error("Cannot open " + path + " for writing.");
+    out << "<?xml version=\"1.0\" standalone=\"no\"?>\n<svg "
+        << attribute("width", svgWidth, "px") << attribute("height", svgHeight, "px")
+        << attribute("xmlns", "http://www.w3.org/2000/svg") << attribute("version", "1.1") << ">\n";
     // Add border
-    Polygon border(Stroke(1, Color::Green));
-    border << Point(0, 0) << Point(dimensions.width, 0)
-        << Point(dimensions.width, dimensions.height) << Point(0, dimensions.height);
-    graph << border;
+    out << "\t<polygon points=\"0,0 " << svgWidth << ",0 " << svgWidth << ',' << svgHeight 
+        << " 0," << svgHeight << " \" fill=\"none\" stroke-width=\"1\" stroke=\"rgb(0,128,0)\" />\n";
 
-    
-    }
-
-    // Add nodes
+    // Add nodes, recording the location (x,y) of each.
+    std::unordered_map<const Node*, Point> locator {};
+    locator.reserve(numNodes);
     for (int level=0; level<numLayers; ++level)
     {
-        const int y { marginT + level * (h + gapH) };
-        const std::vector<NSP> thisLayer { structure[level] };
-        const int thisLayerN { static_cast<int>(thisLayer.size()) };
-        const int xBase { marginL + (maxNode - thisLayerN) * (w + gapW) / 2 };
-        for (int nodeInd=0; nodeInd<thisLayerN; ++nodeInd)
+        const long long y { marginT + static_cast<long long>(level) * (h + gapH) };
+        const std::vector<const Node*> &thisLayer { layers[static_cast<size_t>(level)] };
+        const long long xBase { marginL + static_cast<long long>(maxNode - thisLayer.size()) * (w + gapW) / 2 };
+        for (size_t nodeInd=0; nodeInd<thisLayer.size(); ++nodeInd)
         {
-            NSP thisNode {thisLayer[nodeInd]};
-            const int x { xBase + nodeInd * (w+gapW) };
-            const int textX { x + w/8 };
-            const int textY { y + h/2 };
-            std::string dimensionStr {};
-            dimensionStr += " (row=" + std::to_string(thisNode->data.rows())
-                         + ",col=" + std::to_string(thisNode->data.cols()) + ")";
-            graph << Rectangle(Point(x, y), w, h, Color::White, Stroke(3, Color::Black));
-            graph << Text(Point(textX, textY), ToString(thisNode->gradientFunction) + dimensionStr,
-                Color::Black);
-            locator[thisNode] = Point(x,y);
+            const Node *thisNode {thisLayer[nodeInd]};
+            const long long x { xBase + static_cast<long long>(nodeInd) * (w+gapW) };
+            locator[thisNode] = Point(static_cast<double>(x), static_cast<double>(y));
+            writeNode(out, locator[thisNode], w, h, nodeLabel(thisNode));
         }
     }
 
     // Add links by referring to locator
-    for (std::unordered_map<NSP, Point>::iterator it=locator.begin(); 
-        it!=locator.end(); ++it)
+    for (const std::vector<const Node*> &layer: layers)
     {
-        NSP fromThisNSP {(*it).first};
-        Point fromThisPoint {(*it).second};
-        for (NSP toThisNSP: fromThisNSP -> nextNodes)
+        for (const Node *fromThisNode: layer)
         {
-            graph << svgUtility::getLink(fromThisPoint, locator[toThisNSP], w, h);
+            const Point fromThisPoint { locator[fromThisNode] };
+            for (const std::shared_ptr<Node> &toThisNode: fromThisNode->nextNodes)
+                writeLink(out, fromThisPoint, locator[toThisNode.get()], w, h);
         }
     }
-
-
-
-
-    graph.save();
+    out << elemEnd("svg");
 }
 
 }
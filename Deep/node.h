@@ -4,6 +4,7 @@
 #include <nlohmann/json.hpp>
 #include <Eigen/Dense>
 #include <boost/preprocessor.hpp> // For enum to string.
+#include "fusion.h"
 #include <vector>
 #include <iostream>
 #include <memory>
@@ -49,7 +50,10 @@ namespace Deep
 
 DEFINE_ENUM_WITH_STRING_CONVERSIONS(gradFn, (none)(accumulateGrad)(transposeBackward)
     (matMulBackward)(reluBackward)(sumBackward)
-    (addBackward)(addMmBackward)(subtractBackward)(mseBackward));
+    (addBackward)(addMmBackward)(subtractBackward)(mseBackward)
+    (crossEntropyBackward)(conv2dBackward)(maxPool2dBackward)(batchNormBackward)
+    (fusedBackward)(addMmTBackward)(embeddingBackward)(lstmBackward)(gruBackward)
+    (attentionBackward));
 
 namespace svgUtility
 {
@@ -57,8 +61,42 @@ namespace svgUtility
 dimension of nodes (nodeW, nodeH),
 accurately create a polygon object that connects two Points. */
 svg::Polygon getLink(svg::Point fromPoint, svg::Point toPoint, int nodeW, int nodeH);
+/* Vertices of the polygon returned by getLink, empty if both Points coincide. */
+std::vector<svg::Point> getLinkPoints(svg::Point fromPoint, svg::Point toPoint, int nodeW, int nodeH);
 };
 
+/* While a guard lives, ops of the calling thread don't record the graph:
+their results are nodes without gradient function nor operands, so
+intermediate results are freed as soon as the next op has read them.
+Deferred nodes (see fusion.h) still hold their operands until they are
+materialized. Guards nest. */
+class NoGradGuard
+{
+    public:
+        NoGradGuard();
+        NoGradGuard(const NoGradGuard&) = delete;
+        NoGradGuard& operator=(const NoGradGuard&) = delete;
+        ~NoGradGuard();
+    private:
+        bool previous;
+};
+
+class Node;
+
+/* State an op keeps on its output node for the backward besides
+savedTensors, such as the activations of every step of a recurrent
+layer. The op implements its gradient here, so node.cpp dispatches
+to it without depending on the op's translation unit. */
+struct SavedState
+{
+    virtual ~SavedState() = default;
+    /* Gradient passed to node.nextNodes[operand], see Node::gradientFor. */
+    virtual T gradient(Node &node, size_t operand, const T &fromGradient) = 0;
+};
+
+/* False while a NoGradGuard of the calling thread lives. */
+bool isGradEnabled();
+
 class Node : public std::enable_shared_from_this<Node>
 {
     public: 
@@ -67,51 +105,131 @@ class Node : public std::enable_shared_from_this<Node>
         bool isLeaf;
         std::vector<std::shared_ptr<Node>> nextNodes;
         gradFn gradientFunction;
+        /* Extra tensors an op keeps for its backward besides the data
+        of nextNodes, e.g. labels and log-sum-exp of crossEntropyBackward. */
+        std::vector<T> savedTensors;
+        /* Bumped every time an in-place op takes over data, the versions of
+        nextNodes are saved when this node is created, so backward can refuse
+        to use operands which have been overwritten since. */
+        unsigned version;
+        std::vector<unsigned> savedVersions;
+        /* Set once backward has released nextNodes and savedTensors. */
+        bool graphReleased;
+        /* Element-wise program over nextNodes of a fusedBackward node, see fusion.h.
+        While deferred is set, data is empty and the program hasn't run yet. */
+        std::vector<Fusion::Step> program;
+        bool deferred;
+        /* Set on accumulateGrad leaves whose gradient is column-sparse, such
+        as embedding tables. Ops that read a few columns (see embedding)
+        accumulate into sparseColumns and sparseValues instead of gradient,
+        which stays empty: column sparseColumns[i] of the dense gradient
+        would get sparseValues.col(i) added. Columns may repeat. Other ops
+        keep passing dense gradients to such a leaf. */
+        bool sparseGradient;
+        std::vector<Eigen::Index> sparseColumns;
+        T sparseValues;
+        /* Set by ops such as lstm, multiHeadAttention or deferred
+        element-wise expressions, whose backward
+        is SavedState::gradient. Released with the graph. */
+        std::shared_ptr<SavedState> saved;
         /* Constructor. 
-        Gradient must be zero-initialized, same shape as data.
+        Gradient of accumulateGrad leaves is zero-initialized, same shape
+        as data, other nodes leave it empty as they never store gradients.
         isLeaf should be used based on situation, 
         if isLeaf is true, gradFn will be accumulateGrad. 
         gradientFunction used to govern backward() behavior.
+        Under a NoGradGuard, non-leaf nodes become leaves with gradFn none.
         */
         Node(T x, bool isleaf = true, 
             std::vector<std::shared_ptr<Node>> nextnodes = std::vector<std::shared_ptr<Node>>{}, 
             gradFn gradfn = gradFn::none);
         /* Overloading constructor for convenience */
         Node(T x, gradFn gradfn);
-        /* Shape of the contained matrix (can be (M,N)) */
+        /* Releases nextNodes iteratively, so deep graphs can be freed. */
+        ~Node();
+        /* Shape of the contained matrix (can be (M,N)), 
+        also known before a deferred node is materialized. */
         std::vector<int> shape();
         /* Size, or number of elements in a matrix (can be M*N) */
         int size();
 
-        /* Clear gradient */
+        /* Run the program of a deferred node into data, in a single pass.
+        Does nothing if the node isn't deferred. Throws std::runtime_error if
+        an operand has been overwritten in-place or the graph released, and
+        if the data of this node has been taken by an in-place op. Every op
+        calls it on its operands before reading them. */
+        void materialize();
+
+        /* Clear gradient, sparse leaves drop their dense one altogether. */
         void zeroGrad();
 
         /* Overload transpose */
         std::shared_ptr<Node> transpose();
         /* ReLU */
         std::shared_ptr<Node> relu();
+        /* In-place ReLU, the result takes over the buffer of this node,
+        which must be a temporary not used afterwards: throws
+        std::invalid_argument if anything but the caller's pointer holds it. */
+        std::shared_ptr<Node> relu_();
         /* Sum */
         std::shared_ptr<Node> sum();
         
 
         /* Backward */
-        /* Backward for intermediate nodes. */
-        void backward(T fromGradient);
+        /* Backward for intermediate nodes. 
+        Unless retainGraph is true, every node releases its nextNodes and
+        savedTensors once its gradient has been propagated, so the graph 
+        is freed during backward and a second backward through it throws. */
+        void backward(T fromGradient, bool retainGraph = false);
+        /* Gradient passed to nextNodes[operand], given the gradient
+        of this node. Doesn't recurse nor touch any state, but what ops
+        keeping a SavedState share between their operands. */
+        T gradientFor(size_t operand, const T &fromGradient);
+        /* Throw if the data of nextNodes[operand] has been overwritten 
+        by an in-place op since this node was created. */
+        void checkVersion(size_t operand);
+        /* Throw if this node cannot give its buffer to an in-place op, 
+        then bump its version and return the buffer. references is the
+        number of shared_ptrs the calling op holds, any other owner, a
+        variable of the caller or a node using it, means it's still shared. */
+        T takeData(long references = 1);
+        /* Add to gradient, allocating it on first use. */
+        void accumulate(const T &fromGradient);
+        /* Keep the gradient of this leaf column-sparse from now on, see sparseGradient. */
+        void setSparseGradient();
+        /* Add values.col(i) to column columns[i] of the sparse gradient. */
+        void accumulateColumns(const std::vector<Eigen::Index> &columns, const T &values);
+        /* The sparse gradient scattered into a matrix shaped like data,
+        plus gradient if a dense one was accumulated too. */
+        T denseGradient();
+        /* Whether nextNodes[operand] takes its gradient from accumulateSparse
+        rather than gradientFor: a sparse leaf read by an embeddingBackward node. */
+        bool sparseOperand(size_t operand);
+        /* Add the gradient of nextNodes[operand] to its sparse gradient. */
+        void accumulateSparse(size_t operand, const T &fromGradient);
+        /* Drop the edges and buffers only needed by backward. */
+        void releaseGraph();
         /* Backward for Loss, use a double, non-unit gradient. */
-        void backward(double fromGradient);
+        void backward(double fromGradient, bool retainGraph = false);
         /* Backward for Loss, they typically uses default gradient of 1. */
         void backward();
 
 
         /* Overload << */
         friend std::ostream& operator<< (std::ostream &out, const std::shared_ptr<Node>& nodePtr);
-        /* Show descendents (only their gradfn),
+        /* Show descendents (only their gradfn), nodes reachable
+        through several paths are expanded once,
         return the total number of nodes */
         int descendents(int level = 0, bool verbose = false);
         int descendents(bool verbose);
 
-        /* Visualize descendents */
+        /* Visualize descendents, one layer of the SVG per distance
+        from this node. */
         void visualizeGraph(std::string path);
+        /* Write descendents as a Graphviz DOT digraph, 
+        render with e.g. `dot -Tsvg graph.dot -o graph.svg`. */
+        void exportDot(std::ostream &out);
+        void exportDot(std::string path);
 };
 
 }
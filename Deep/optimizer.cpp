@@ -1,7 +1,10 @@
 #include "base.h"
 #include "optimizer.h"
+#include "node.h"
+#include <algorithm>
 #include <memory>
 #include <cassert>
+#include <numeric>
 #include <vector>
 
 
@@ -9,7 +12,7 @@
 namespace Deep::Optim
 {
 Optimizer::Optimizer(std::vector<std::pair<std::string, NSP>> namedParams):
-    namedParameters(namedParams)
+    namedParameters(namedParams), masks(std::unordered_map<std::string, MAT>{})
 {
 }
 
@@ -23,6 +26,17 @@ void Optimizer::zeroGrad()
     }
 }
 
+void Optimizer::setMasks(std::unordered_map<std::string, MAT> newMasks)
+{
+    masks = newMasks;
+    for (std::pair<std::string, NSP> namedParam: namedParameters)
+    {
+        auto mask { masks.find(namedParam.first) };
+        if (mask != masks.end())
+            namedParam.second->data = namedParam.second->data.cwiseProduct(mask->second);
+    }
+}
+
 void Optimizer::step()
 {
     throw std::invalid_argument("Please implement gradient step for your optimizer.");
@@ -37,6 +51,46 @@ SGD::SGD(std::vector<std::pair<std::string, NSP>> namedParams, double learningRa
     assert((momentumValue >= 0) && (momentumValue <= 1) && "Momentum should be a decimal number within 0 to 1.");
 }
 
+MAT SGD::denseGradient(Node &param)
+{
+    if (!param.sparseGradient)
+        return param.gradient;
+    return param.denseGradient();
+}
+
+bool SGD::sparseStep(const std::pair<std::string, NSP> &namedParam)
+{
+    Node &param { *namedParam.second };
+    // A dense gradient from other ops takes the dense path, with the sparse one added.
+    if (!param.sparseGradient || param.gradient.size() != 0)
+        return false;
+    MAT &velocity { prevParameters[namedParam.first] };
+    if (velocity.size() == 0)
+        velocity.setZero(param.data.rows(), param.data.cols());
+    // Sum the values of repeated columns first, each column is stepped once.
+    const std::vector<Eigen::Index> &columns { param.sparseColumns };
+    std::vector<size_t> order(columns.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&columns](size_t a, size_t b){ return columns[a] < columns[b]; });
+    auto mask { masks.find(namedParam.first) };
+    for (size_t i=0; i<order.size();)
+    {
+        const Eigen::Index c { columns[order[i]] };
+        // New velocity of column c, written back once it is complete.
+        Eigen::VectorXd v { momentum * velocity.col(c) };
+        for (; i<order.size() && columns[order[i]] == c; ++i)
+            v += param.sparseValues.col(static_cast<Eigen::Index>(order[i]));
+        param.data.col(c) -= lr * v;
+        if (mask != masks.end())
+        {
+            param.data.col(c) = param.data.col(c).cwiseProduct(mask->second.col(c));
+            v = v.cwiseProduct(mask->second.col(c));
+        }
+        velocity.col(c) = v;
+    }
+    return true;
+}
+
 /* This function can be optimized, as it now uses two linear passes.
 It is actually possible to use single linear pass but it will result in 
 code duplication. Need to measure to see if need to optimize it. */
@@ -48,7 +102,8 @@ void SGD::step()
         // First time stepping
         for (std::pair<std::string, NSP> namedParam: namedParameters)
         {
-            prevParameters[namedParam.first] = namedParam.second->gradient;
+            if (!sparseStep(namedParam))
+                prevParameters[namedParam.first] = denseGradient(*namedParam.second);
         }
     }
     else
@@ -56,14 +111,24 @@ void SGD::step()
         // Second time stepping and later
         for (std::pair<std::string, NSP> namedParam: namedParameters)
         {
-            prevParameters[namedParam.first] = momentum * prevParameters[namedParam.first]
-                + namedParam.second->gradient;
+            if (!sparseStep(namedParam))
+                prevParameters[namedParam.first] = momentum * prevParameters[namedParam.first]
+                    + denseGradient(*namedParam.second);
         }        
     }
     // Update parameters
     for (std::pair<std::string, NSP> namedParam: namedParameters)
     {
+        if (namedParam.second->sparseGradient && namedParam.second->gradient.size() == 0)
+            continue;
         namedParam.second->data -= lr * prevParameters[namedParam.first];
+        // Keep pruned entries at zero, including their momentum.
+        auto mask { masks.find(namedParam.first) };
+        if (mask != masks.end())
+        {
+            namedParam.second->data = namedParam.second->data.cwiseProduct(mask->second);
+            prevParameters[namedParam.first] = prevParameters[namedParam.first].cwiseProduct(mask->second);
+        }
     }        
 }
 
@@ -15,10 +15,15 @@ class Optimizer
 {
     public: 
         std::vector<std::pair<std::string, NSP>> namedParameters;
+        /* Optional {0, 1} masks keyed by parameter name, masked entries 
+        stay zero after every step (used for pruning). */
+        std::unordered_map<std::string, MAT> masks;
         /* Constructor */
         Optimizer(std::vector<std::pair<std::string, NSP>> namedParams);
         /* Zerograd, should be the same for every type of optimizer. */
         void zeroGrad();
+        /* Replace the masks, masked entries of the parameters are zeroed immediately. */
+        void setMasks(std::unordered_map<std::string, MAT> newMasks);
         /* Optimizer Step */
         virtual void step();
         virtual ~Optimizer();
@@ -32,8 +37,20 @@ class SGD: public Optimizer
         /* Not storing previous params as NSP to make memory more efficient. */
         std::unordered_map<std::string, MAT> prevParameters;
         SGD(std::vector<std::pair<std::string, NSP>> namedParams, double learningRate=1e-5, double momentumValue=0.9);
+        /* Parameters with a sparse gradient (see Node::setSparseGradient)
+        only step the columns that got a gradient, so a step costs the
+        batch rather than the table. Their momentum is lazy: the velocity
+        of a column only decays on the steps it is hit. With momentum 0 the
+        update is the same as the dense one. */
         void step() override;
         // ~SGD() override = default;
+
+    private:
+        /* The gradient of param as a dense matrix. */
+        static MAT denseGradient(Node &param);
+        /* Momentum and parameter update of the columns hit by a sparse
+        gradient, returns false for parameters taking the dense path. */
+        bool sparseStep(const std::pair<std::string, NSP> &namedParam);
 };
 
 }
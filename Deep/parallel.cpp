@@ -0,0 +1,355 @@
+#include "parallel.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+
+namespace Deep::Parallel
+{
+// Set on the pool workers, a kernel called from within a parallel block runs serially.
+static thread_local bool insideWorker { false };
+
+ThreadPool::ThreadPool(int threads):
+    numThreads(threads), workers(), tasks(), tasksMutex(), tasksCv(), stopping(false)
+{
+    if (numThreads <= 0)
+        throw std::invalid_argument("Number of threads must be positive.");
+    for (int i=1; i<numThreads; ++i)
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        stopping = true;
+    }
+    tasksCv.notify_all();
+    for (std::thread &worker: workers)
+        worker.join();
+}
+
+int ThreadPool::size()
+{
+    return numThreads;
+}
+
+void ThreadPool::workerLoop()
+{
+    insideWorker = true;
+    std::unique_lock<std::mutex> lock(tasksMutex);
+    while (true)
+    {
+        tasksCv.wait(lock, [this]{ return stopping || !tasks.empty(); });
+        if (tasks.empty())
+            return;
+        std::function<void()> task { std::move(tasks.front()) };
+        tasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+bool ThreadPool::runPendingTask()
+{
+    std::function<void()> task {};
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        if (tasks.empty())
+            return false;
+        task = std::move(tasks.front());
+        tasks.pop_front();
+    }
+    const bool wasInside { insideWorker };
+    insideWorker = true;
+    task();
+    insideWorker = wasInside;
+    return true;
+}
+
+void ThreadPool::run(Eigen::Index n, int numChunks, const Range &fn)
+{
+    numChunks = static_cast<int>(std::min<Eigen::Index>(numChunks, n));
+    if (numChunks <= 1)
+    {
+        fn(0, n);
+        return;
+    }
+    // Owned jointly by the tasks, so the last decrement never touches a dead frame.
+    struct Job
+    {
+        explicit Job(int chunks): remaining(chunks), errorMutex(), error() {}
+        std::atomic<int> remaining;
+        std::mutex errorMutex;
+        std::exception_ptr error;
+    };
+    std::shared_ptr<Job> job { std::make_shared<Job>(numChunks) };
+    auto runChunk = [job, n, numChunks, &fn](int chunk){
+        const Eigen::Index begin { n * chunk / numChunks };
+        const Eigen::Index end { n * (chunk + 1) / numChunks };
+        try
+        {
+            fn(begin, end);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(job->errorMutex);
+            if (!job->error)
+                job->error = std::current_exception();
+        }
+        --job->remaining;
+    };
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        for (int chunk=1; chunk<numChunks; ++chunk)
+            tasks.push_back([runChunk, chunk]{ runChunk(chunk); });
+    }
+    tasksCv.notify_all();
+    runChunk(0);
+    // Help with queued work instead of sleeping, so concurrent callers
+    // sharing the pool cannot starve each other.
+    while (job->remaining.load() > 0)
+    {
+        if (!runPendingTask())
+            std::this_thread::yield();
+    }
+    if (job->error)
+        std::rethrow_exception(job->error);
+}
+
+// Index of the deque owned by this thread in the pool it works for.
+static thread_local WorkStealingPool *currentPool { nullptr };
+static thread_local int currentWorker { 0 };
+
+WorkStealingPool::WorkStealingPool(int poolThreads):
+    numThreads(poolThreads), queues(), threads(), runMutex(), sleepMutex(), sleepCv(),
+    queued(0), unfinished(0), stopping(false), errorMutex(), error()
+{
+    if (numThreads <= 0)
+        throw std::invalid_argument("Number of threads must be positive.");
+    for (int i=0; i<numThreads; ++i)
+        queues.push_back(std::unique_ptr<Worker>(new Worker()));
+    for (int i=1; i<numThreads; ++i)
+        threads.push_back(std::thread(&WorkStealingPool::workerLoop, this, i));
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    sleepCv.notify_all();
+    for (std::thread &thread: threads)
+        thread.join();
+}
+
+int WorkStealingPool::size()
+{
+    return numThreads;
+}
+
+void WorkStealingPool::spawn(std::function<void()> task)
+{
+    const int index { (currentPool == this) ? currentWorker : 0 };
+    ++unfinished;
+    {
+        std::lock_guard<std::mutex> lock(queues[static_cast<size_t>(index)]->mutex);
+        queues[static_cast<size_t>(index)]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        ++queued;
+    }
+    sleepCv.notify_one();
+}
+
+bool WorkStealingPool::pop(int index, std::function<void()> &task)
+{
+    // Newest own task first, it is the most likely to be in cache.
+    {
+        Worker &own { *queues[static_cast<size_t>(index)] };
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            std::lock_guard<std::mutex> sleepLock(sleepMutex);
+            --queued;
+            return true;
+        }
+    }
+    // Otherwise steal the oldest task of another worker.
+    for (int offset=1; offset<numThreads; ++offset)
+    {
+        Worker &victim { *queues[static_cast<size_t>((index + offset) % numThreads)] };
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            std::lock_guard<std::mutex> sleepLock(sleepMutex);
+            --queued;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::execute(std::function<void()> &task)
+{
+    try
+    {
+        task();
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (!error)
+            error = std::current_exception();
+    }
+    task = nullptr;
+    if (--unfinished == 0)
+    {
+        // Wake the caller of run(), which waits for the last task.
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        sleepCv.notify_all();
+    }
+}
+
+void WorkStealingPool::workerLoop(int index)
+{
+    currentPool = this;
+    currentWorker = index;
+    std::function<void()> task {};
+    while (true)
+    {
+        if (pop(index, task))
+        {
+            execute(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepCv.wait(lock, [this]{ return stopping || queued > 0; });
+        if (stopping)
+            return;
+    }
+}
+
+void WorkStealingPool::run(std::function<void()> root)
+{
+    std::lock_guard<std::mutex> runLock(runMutex);
+    WorkStealingPool *previousPool { currentPool };
+    const int previousWorker { currentWorker };
+    currentPool = this;
+    currentWorker = 0;
+    error = nullptr;
+    spawn(std::move(root));
+    std::function<void()> task {};
+    while (true)
+    {
+        if (pop(0, task))
+        {
+            execute(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepCv.wait(lock, [this]{ return queued > 0 || unfinished == 0; });
+        if (unfinished == 0)
+            break;
+    }
+    currentPool = previousPool;
+    currentWorker = previousWorker;
+    if (error)
+        std::rethrow_exception(error);
+}
+
+static int defaultNumThreads()
+{
+    const char *env { std::getenv("DEEP_NUM_THREADS") };
+    if (env != nullptr && std::atoi(env) > 0)
+        return std::atoi(env);
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+static std::mutex poolMutex;
+static std::shared_ptr<ThreadPool> globalPool;
+static std::atomic<long> grainSize { 32768 };
+
+static std::shared_ptr<ThreadPool> pool()
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+    if (globalPool == nullptr)
+        globalPool = std::make_shared<ThreadPool>(defaultNumThreads());
+    return globalPool;
+}
+
+void setNumThreads(int numThreads)
+{
+    if (numThreads <= 0)
+        throw std::invalid_argument("Number of threads must be positive.");
+    std::shared_ptr<ThreadPool> newPool { std::make_shared<ThreadPool>(numThreads) };
+    std::lock_guard<std::mutex> lock(poolMutex);
+    // Kernels still running on the old pool keep it alive until they finish.
+    globalPool = newPool;
+}
+
+int getNumThreads()
+{
+    return pool()->size();
+}
+
+void setGrainSize(long grain)
+{
+    if (grain <= 0)
+        throw std::invalid_argument("Grain size must be positive.");
+    grainSize = grain;
+}
+
+long getGrainSize()
+{
+    return grainSize;
+}
+
+/* Number of chunks worth splitting the work into. */
+static int numChunksFor(Eigen::Index n, Eigen::Index costPerItem, int numThreads)
+{
+    if (insideWorker || numThreads <= 1 || n <= 1)
+        return 1;
+    const double cost { static_cast<double>(n) * static_cast<double>(std::max<Eigen::Index>(costPerItem, 1)) };
+    const double chunks { cost / static_cast<double>(grainSize.load()) };
+    const double maxChunks { static_cast<double>(std::min<Eigen::Index>(n, numThreads)) };
+    return static_cast<int>(std::max(1.0, std::min(chunks, maxChunks)));
+}
+
+void parallelFor(Eigen::Index n, Eigen::Index costPerItem, const Range &fn)
+{
+    if (n <= 0)
+        return;
+    std::shared_ptr<ThreadPool> p { pool() };
+    p->run(n, numChunksFor(n, costPerItem, p->size()), fn);
+}
+
+double parallelSum(Eigen::Index n, Eigen::Index costPerItem, const std::function<double(Eigen::Index, Eigen::Index)> &partial)
+{
+    if (n <= 0)
+        return 0.0;
+    std::shared_ptr<ThreadPool> p { pool() };
+    const int numChunks { numChunksFor(n, costPerItem, p->size()) };
+    std::vector<double> sums(static_cast<size_t>(numChunks), 0.0);
+    // Block c starts at floor(n * c / numChunks) and numChunks <= n,
+    // so rounding begin * numChunks / n up gives back c.
+    p->run(n, numChunks, [&](Eigen::Index begin, Eigen::Index end){
+        const size_t chunk { static_cast<size_t>((begin * numChunks + n - 1) / n) };
+        sums[chunk] = partial(begin, end);
+    });
+    double ret { 0.0 };
+    for (double s: sums)
+        ret += s;
+    return ret;
+}
+}
@@ -0,0 +1,134 @@
+/* Library owned thread pool for intra-op parallelism.
+Large GEMMs are split by row blocks of their output, element-wise and
+reduction kernels by contiguous segments of the flattened matrices.
+Work below a size threshold stays on the calling thread, so small ops
+don't pay for synchronization. */
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#include <Eigen/Dense>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <exception>
+
+namespace Deep::Parallel
+{
+using Range = std::function<void(Eigen::Index, Eigen::Index)>;
+
+class ThreadPool
+{
+    public:
+        /* numThreads counts the calling thread, so numThreads - 1 workers are spawned. */
+        explicit ThreadPool(int numThreads);
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+        ~ThreadPool();
+        int size();
+        /* Call fn(begin, end) over [0, n) split in numChunks contiguous blocks,
+        block 0 runs on the calling thread. Blocks until every block is done,
+        the first exception thrown by a block is rethrown. */
+        void run(Eigen::Index n, int numChunks, const Range &fn);
+
+    private:
+        const int numThreads;
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        std::mutex tasksMutex;
+        std::condition_variable tasksCv;
+        bool stopping;
+
+        void workerLoop();
+        /* Run one queued task if there is any, return false otherwise. */
+        bool runPendingTask();
+};
+
+/* Pool for irregular task graphs, where tasks spawn more tasks.
+Every worker owns a deque, it pushes and pops its own tasks at the back
+and steals from the front of the others' when it runs out of work. */
+class WorkStealingPool
+{
+    public:
+        /* numThreads counts the thread calling run(). */
+        explicit WorkStealingPool(int numThreads);
+        WorkStealingPool(const WorkStealingPool&) = delete;
+        WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+        ~WorkStealingPool();
+        int size();
+        /* Run root and every task it spawns, the calling thread works too.
+        Returns once all of them are done, the first exception thrown by a
+        task is rethrown. One run() at a time per pool. */
+        void run(std::function<void()> root);
+        /* Queue a task, to be called from within a running task. */
+        void spawn(std::function<void()> task);
+
+    private:
+        struct Worker
+        {
+            Worker(): mutex(), tasks() {}
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+        const int numThreads;
+        std::vector<std::unique_ptr<Worker>> queues; // queues[0] belongs to the caller of run().
+        std::vector<std::thread> threads;
+        std::mutex runMutex;
+        std::mutex sleepMutex;
+        std::condition_variable sleepCv;
+        long queued; // Tasks in the deques, guarded by sleepMutex.
+        std::atomic<long> unfinished;
+        bool stopping;
+        std::mutex errorMutex;
+        std::exception_ptr error;
+
+        void workerLoop(int index);
+        bool pop(int index, std::function<void()> &task);
+        void execute(std::function<void()> &task);
+};
+
+/* Number of threads used by the kernels, 1 disables parallelism.
+Defaults to the DEEP_NUM_THREADS environment variable if set,
+otherwise to the number of hardware threads. */
+void setNumThreads(int numThreads);
+int getNumThreads();
+/* Minimum amount of work (element operations, or multiply-adds for
+a GEMM) given to each thread. Smaller ops run serially. */
+void setGrainSize(long grain);
+long getGrainSize();
+
+/* Call fn(begin, end) over [0, n) where each item costs costPerItem
+operations, in parallel if the total cost is large enough. */
+void parallelFor(Eigen::Index n, Eigen::Index costPerItem, const Range &fn);
+
+/* Sum of partial(begin, end) over [0, n), the partial results are
+combined in a fixed order so the result only depends on the thread count. */
+double parallelSum(Eigen::Index n, Eigen::Index costPerItem, const std::function<double(Eigen::Index, Eigen::Index)> &partial);
+
+/* Flat array view over the coefficients [begin, end) of a matrix. */
+inline Eigen::Map<Eigen::ArrayXd> flat(Eigen::MatrixXd &m, Eigen::Index begin, Eigen::Index end)
+{
+    return Eigen::Map<Eigen::ArrayXd>(m.data() + begin, end - begin);
+}
+inline Eigen::Map<const Eigen::ArrayXd> flat(const Eigen::MatrixXd &m, Eigen::Index begin, Eigen::Index end)
+{
+    return Eigen::Map<const Eigen::ArrayXd>(m.data() + begin, end - begin);
+}
+
+/* C = A * B, computing row blocks of C in parallel.
+A and B can be expressions such as transposes. */
+template <typename DerivedA, typename DerivedB>
+Eigen::MatrixXd matmul(const Eigen::MatrixBase<DerivedA> &A, const Eigen::MatrixBase<DerivedB> &B)
+{
+    Eigen::MatrixXd C(A.rows(), B.cols());
+    parallelFor(A.rows(), A.cols() * B.cols(), [&](Eigen::Index begin, Eigen::Index end){
+        C.middleRows(begin, end - begin).noalias() = A.middleRows(begin, end - begin) * B;
+    });
+    return C;
+}
+}
+
+#endif
@@ -0,0 +1,153 @@
+#include "prune.h"
+#include "nn.h"
+#include "node.h"
+#include "optimizer.h"
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#include <cassert>
+
+namespace Deep::Prune
+{
+namespace
+{
+/* Name of the weights within Model::namedParameters() for every FullyConnected layer. */
+std::vector<std::pair<std::string, NSP>> namedWeights(Model &model)
+{
+    std::vector<std::pair<std::string, NSP>> ret {};
+    for (auto it=model.layers.begin(); it!=model.layers.end(); ++it)
+    {
+        FullyConnected *fc { dynamic_cast<FullyConnected*>(it->second.get()) };
+        if (fc != nullptr)
+            ret.push_back({it->first + ".1", fc->weights});
+    }
+    return ret;
+}
+
+/* Magnitude below which a fraction sparsity of the values fall. */
+double threshold(std::vector<double> magnitudes, double sparsity)
+{
+    const size_t k { static_cast<size_t>(std::floor(sparsity * static_cast<double>(magnitudes.size()))) };
+    if (k == 0)
+        return -1.0; // Nothing to prune.
+    std::nth_element(magnitudes.begin(), magnitudes.begin() + static_cast<long>(k - 1), magnitudes.end());
+    return magnitudes[k - 1];
+}
+
+std::vector<double> magnitudesOf(const Eigen::MatrixXd &W)
+{
+    std::vector<double> ret(static_cast<size_t>(W.size()));
+    Eigen::Map<Eigen::MatrixXd>(ret.data(), W.rows(), W.cols()) = W.cwiseAbs();
+    return ret;
+}
+}
+
+std::unordered_map<std::string, Eigen::MatrixXd> magnitudePrune(Model &model, double sparsity, bool global)
+{
+    if (sparsity < 0 || sparsity >= 1)
+        throw std::invalid_argument("Sparsity should be within [0, 1).");
+    std::vector<std::pair<std::string, NSP>> weights { namedWeights(model) };
+    double globalThreshold { -1.0 };
+    if (global)
+    {
+        std::vector<double> all {};
+        for (const auto &w: weights)
+        {
+            std::vector<double> m { magnitudesOf(w.second->data) };
+            all.insert(all.end(), m.begin(), m.end());
+        }
+        globalThreshold = threshold(all, sparsity);
+    }
+    std::unordered_map<std::string, Eigen::MatrixXd> masks {};
+    for (const auto &w: weights)
+    {
+        const double t { global ? globalThreshold : threshold(magnitudesOf(w.second->data), sparsity) };
+        Eigen::MatrixXd mask { (w.second->data.cwiseAbs().array() > t).cast<double>() };
+        w.second->data = w.second->data.cwiseProduct(mask);
+        masks[w.first] = mask;
+    }
+    return masks;
+}
+
+double weightSparsity(Model &model)
+{
+    double zeros { 0 };
+    double total { 0 };
+    for (const auto &w: namedWeights(model))
+    {
+        zeros += static_cast<double>((w.second->data.array() == 0.0).count());
+        total += static_cast<double>(w.second->data.size());
+    }
+    return (total > 0) ? zeros / total : 0.0;
+}
+
+GradualPruner::GradualPruner(Model &prunedModel, double finalSparsity, int beginStep, int endStep, 
+    int frequency, bool global):
+    model(prunedModel), finalTarget(finalSparsity), begin(beginStep), end(endStep), 
+    every(frequency), useGlobal(global), stepCount(0)
+{
+    if (endStep <= beginStep || frequency <= 0)
+        throw std::invalid_argument("Pruning should end after it begins, with a positive frequency.");
+}
+
+double GradualPruner::currentTarget()
+{
+    if (stepCount < begin)
+        return 0.0;
+    if (stepCount >= end)
+        return finalTarget;
+    const double progress { static_cast<double>(stepCount - begin) / (end - begin) };
+    return finalTarget * (1.0 - std::pow(1.0 - progress, 3));
+}
+
+void GradualPruner::step(Optim::Optimizer &optimizer)
+{
+    ++stepCount;
+    if (stepCount < begin || stepCount > end)
+        return;
+    if ((stepCount - begin) % every == 0 || stepCount == end)
+        optimizer.setMasks(magnitudePrune(model, currentTarget(), useGlobal));
+}
+
+SparseFullyConnected::SparseFullyConnected(FullyConnected &fc):
+    in_c(static_cast<int>(fc.weights->data.cols())), out_c(static_cast<int>(fc.weights->data.rows())),
+    weightsT(fc.weights->data.transpose().sparseView()), bias(Eigen::RowVectorXd::Zero(out_c))
+{
+    weightsT.makeCompressed();
+    if (fc.biases != nullptr)
+        bias = fc.biases->data.col(0).transpose();
+}
+
+NSP SparseFullyConnected::forward(NSP in)
+{
+    in->materialize();
+    assert(in->data.cols() == in_c && "Input data dimension doesn't match FC Layer's in_c.");
+    Eigen::MatrixXd out(in->data.rows(), out_c);
+    out.noalias() = in->data * weightsT;
+    out.rowwise() += bias;
+    return std::make_shared<Node>(out, gradFn::none);
+}
+
+std::vector<NSP> SparseFullyConnected::params()
+{
+    return std::vector<NSP> {};
+}
+
+int SparseFullyConnected::nonZeros()
+{
+    return static_cast<int>(weightsT.nonZeros());
+}
+
+void sparsifyModel(Model &model)
+{
+    for (auto it=model.layers.begin(); it!=model.layers.end(); ++it)
+    {
+        FullyConnected *fc { dynamic_cast<FullyConnected*>(it->second.get()) };
+        if (fc != nullptr)
+            it->second = std::unique_ptr<Layer>(new SparseFullyConnected(*fc));
+    }
+}
+}
@@ -0,0 +1,71 @@
+/* Magnitude pruning of FullyConnected weights, and a FullyConnected 
+variant storing the pruned weights in compressed sparse row form 
+so that inference time scales with the number of non-zeros. */
+#ifndef PRUNE_H
+#define PRUNE_H
+#include "base.h"
+#include "nn.h"
+#include "optimizer.h"
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <unordered_map>
+#include <string>
+
+namespace Deep::Prune
+{
+/* Zero the smallest weights of every FullyConnected layer so that a 
+fraction sparsity of them is zero. With global set, one threshold is 
+shared by all layers, otherwise each layer reaches the target on its own. 
+Biases are never pruned. Return the {0, 1} masks keyed by the parameter 
+names of Model::namedParameters(), ready for Optimizer::setMasks(). */
+std::unordered_map<std::string, Eigen::MatrixXd> magnitudePrune(Model &model, double sparsity, bool global = true);
+
+/* Fraction of zeros among the FullyConnected weights of a model. */
+double weightSparsity(Model &model);
+
+/* Gradual pruning (Zhu & Gupta, 2017): the sparsity target follows
+s_t = s_f * (1 - (1 - (t - t_0) / (t_n - t_0))^3), re-pruning every 
+frequency steps. Call step() after every Optimizer::step(). */
+class GradualPruner
+{
+    public:
+        GradualPruner(Model &prunedModel, double finalSparsity, int beginStep, int endStep, 
+            int frequency = 10, bool global = true);
+        void step(Optim::Optimizer &optimizer);
+        /* Sparsity target at the current step. */
+        double currentTarget();
+    private:
+        Model &model;
+        const double finalTarget;
+        const int begin;
+        const int end;
+        const int every;
+        const bool useGlobal;
+        int stepCount;
+};
+
+/* Inference only FullyConnected layer with CSR weights. 
+The output node does not track gradient. */
+class SparseFullyConnected: public Layer
+{
+    private:
+        int in_c;
+        int out_c;
+        /* Column-major [in_c, out_c] storage of W^T, which is the CSR form of W,
+        so x * W^T runs one axpy over a contiguous input column per non-zero. */
+        Eigen::SparseMatrix<double, Eigen::ColMajor> weightsT;
+        Eigen::RowVectorXd bias;
+    public:
+        /* Keep only the non-zero weights of fc. */
+        SparseFullyConnected(FullyConnected &fc);
+        NSP forward(NSP in) override;
+        /* No trainable parameters. */
+        std::vector<NSP> params() override;
+        int nonZeros();
+};
+
+/* Replace every FullyConnected layer of a model by its sparse form. */
+void sparsifyModel(Model &model);
+}
+
+#endif
@@ -0,0 +1,162 @@
+#include "quantize.h"
+#include "trace.h"
+#include "nn.h"
+#include "node.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <cassert>
+
+namespace Deep::Quant
+{
+namespace
+{
+inline int8_t quantizeValue(double x, double inverseScale)
+{
+    double q { std::round(x * inverseScale) };
+    q = std::min(127.0, std::max(-127.0, q));
+    return static_cast<int8_t>(q);
+}
+
+/* Dot product of two rows widened to int16, accumulated in int32. 
+The int16 form lets the compiler use multiply-add instructions 
+(pmaddwd) which have no int8 counterpart before AVX512-VNNI. */
+inline int32_t dotInt16(const int16_t *a, const int16_t *b, int K)
+{
+    int32_t sum { 0 };
+    for (int k=0; k<K; ++k)
+        sum += static_cast<int32_t>(a[k]) * static_cast<int32_t>(b[k]);
+    return sum;
+}
+
+/* Depth padded to a multiple of 8, so that the dot products 
+vectorize without a remainder loop. */
+inline int paddedDepth(int K)
+{
+    return (K + 7) / 8 * 8;
+}
+
+/* Copy rows of int8 into int16, padding every row with zeros to Kp. */
+std::vector<int16_t> widenRows(const int8_t *X, int rows, int K, int Kp)
+{
+    std::vector<int16_t> ret(static_cast<size_t>(rows) * Kp, 0);
+    for (int r=0; r<rows; ++r)
+    {
+        for (int k=0; k<K; ++k)
+            ret[static_cast<size_t>(r) * Kp + k] = X[static_cast<size_t>(r) * K + k];
+    }
+    return ret;
+}
+
+/* Same product as gemmInt8 on operands already widened and padded to Kp. */
+void gemmInt16(const int16_t *A, const int16_t *B, int32_t *C, int M, int N, int Kp)
+{
+    for (int i=0; i<M; ++i)
+    {
+        const int16_t *a { A + static_cast<size_t>(i) * Kp };
+        int32_t *c { C + static_cast<size_t>(i) * N };
+        for (int o=0; o<N; ++o)
+            c[o] = dotInt16(a, B + static_cast<size_t>(o) * Kp, Kp);
+    }
+}
+}
+
+void gemmInt8(const int8_t *A, const int8_t *B, int32_t *C, int M, int N, int K)
+{
+    /* Operands are widened once per call, which costs O((M+N)K) 
+    against the O(MNK) products. */
+    const int Kp { paddedDepth(K) };
+    const std::vector<int16_t> A16 { widenRows(A, M, K, Kp) };
+    const std::vector<int16_t> B16 { widenRows(B, N, K, Kp) };
+    gemmInt16(A16.data(), B16.data(), C, M, N, Kp);
+}
+
+QuantizedFullyConnected::QuantizedFullyConnected(FullyConnected &fc, double inScale, bool fuse_relu):
+    in_c(static_cast<int>(fc.weights->data.cols())), out_c(static_cast<int>(fc.weights->data.rows())),
+    fuseRelu(fuse_relu), inputScale(inScale), 
+    wideWeights(static_cast<size_t>(out_c) * static_cast<size_t>(paddedDepth(in_c)), 0),
+    weightScales(Eigen::VectorXd::Zero(out_c)), bias(Eigen::VectorXd::Zero(out_c))
+{
+    if (inputScale <= 0)
+        throw std::invalid_argument("Input scale must be positive.");
+    const Eigen::MatrixXd &W { fc.weights->data };
+    const int Kp { paddedDepth(in_c) };
+    for (int o=0; o<out_c; ++o)
+    {
+        // Symmetric per output channel scale, guard all-zero rows.
+        const double maxAbs { W.row(o).cwiseAbs().maxCoeff() };
+        weightScales(o) = (maxAbs > 0) ? maxAbs / 127.0 : 1.0;
+        const double inverse { 1.0 / weightScales(o) };
+        for (int k=0; k<in_c; ++k)
+            wideWeights[static_cast<size_t>(o) * Kp + k] = quantizeValue(W(o, k), inverse);
+    }
+    if (fc.biases != nullptr)
+        bias = fc.biases->data.col(0);
+}
+
+Eigen::MatrixXd QuantizedFullyConnected::forward(const Eigen::MatrixXd &in)
+{
+    using RowMajorInt16 = Eigen::Matrix<int16_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+    using RowMajorInt32 = Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+    assert(in.cols() == in_c && "Input data dimension doesn't match FC Layer's in_c.");
+    const int B { static_cast<int>(in.rows()) };
+    const int Kp { paddedDepth(in_c) };
+    /* Quantize the input in its column-major order, where the expression 
+    vectorizes, then transpose into padded int16 rows for the kernel. */
+    using ColMajorInt16 = Eigen::Matrix<int16_t, Eigen::Dynamic, Eigen::Dynamic>;
+    const ColMajorInt16 quantized { (in.array() * (1.0 / inputScale)).cwiseMax(-127.0).cwiseMin(127.0)
+        .unaryExpr([](double q){ return q + std::copysign(0.5, q); }).cast<int32_t>().cast<int16_t>() };
+    std::vector<int16_t> qInput(static_cast<size_t>(B) * Kp, 0);
+    Eigen::Map<RowMajorInt16, 0, Eigen::OuterStride<>> qInputMap(qInput.data(), B, in_c, Eigen::OuterStride<>(Kp));
+    qInputMap = quantized;
+    std::vector<int32_t> acc(static_cast<size_t>(B) * out_c);
+    gemmInt16(qInput.data(), wideWeights.data(), acc.data(), B, out_c, Kp);
+
+    // Fused dequantization, bias and ReLU.
+    Eigen::Map<const RowMajorInt32> accMap(acc.data(), B, out_c);
+    const Eigen::RowVectorXd outScales { (inputScale * weightScales).transpose() };
+    Eigen::MatrixXd out { (accMap.cast<double>().array().rowwise() * outScales.array()).rowwise() 
+        + bias.transpose().array() };
+    if (fuseRelu)
+        out = out.cwiseMax(0.0);
+    return out;
+}
+
+NSP QuantizedFullyConnected::forward(NSP in)
+{
+    in->materialize();
+    return std::make_shared<Node>(forward(in->data), gradFn::none);
+}
+
+std::vector<NSP> QuantizedFullyConnected::params()
+{
+    return std::vector<NSP> {};
+}
+
+size_t QuantizedFullyConnected::weightBytes()
+{
+    return wideWeights.size() * sizeof(int16_t);
+}
+
+size_t QuantizedFullyConnected::scaleBytes()
+{
+    return static_cast<size_t>(weightScales.size()) * sizeof(double);
+}
+
+void quantizeModel(Model &model, const Eigen::MatrixXd &calibration)
+{
+    std::vector<TracedLayer> traced { traceSequential(model, calibration) };
+    for (const TracedLayer &t: traced)
+    {
+        FullyConnected *fc { dynamic_cast<FullyConnected*>(model.layers[t.name].get()) };
+        if (fc == nullptr)
+            continue; // Only FullyConnected layers are quantized.
+        const double maxAbs { t.input.cwiseAbs().maxCoeff() };
+        const double inScale { (maxAbs > 0) ? maxAbs / 127.0 : 1.0 };
+        model.layers[t.name] = std::unique_ptr<Layer>(
+            new QuantizedFullyConnected(*fc, inScale, t.reluAfter)
+        );
+    }
+}
+}
@@ -0,0 +1,55 @@
+/* Int8 post-training quantization of FullyConnected layers for inference.
+Weights are quantized to the int8 range with one scale per output channel,
+inputs with a per-tensor scale calibrated on a sample batch. The kernel
+multiplies them widened to int16, so weights are kept in that form only,
+and accumulates in int32, then dequantization, bias and ReLU are fused 
+into a single pass over the output. */
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+#include "base.h"
+#include "nn.h"
+#include <Eigen/Dense>
+#include <vector>
+#include <cstdint>
+
+namespace Deep::Quant
+{
+/* C[M, N] = A[M, K] * B[N, K]^T, with row-major int8 A and B,
+accumulating in int32. */
+void gemmInt8(const int8_t *A, const int8_t *B, int32_t *C, int M, int N, int K);
+
+/* Inference only replacement of a FullyConnected layer, 
+the output node does not track gradient. */
+class QuantizedFullyConnected: public Layer
+{
+    private:
+        int in_c;
+        int out_c;
+        bool fuseRelu;
+        double inputScale;
+        /* Row-major [out_c, in_c] weights quantized to [-127, 127], widened
+        to int16 rows padded for the kernel, the only copy kept. */
+        std::vector<int16_t> wideWeights;
+        Eigen::VectorXd weightScales;
+        Eigen::VectorXd bias;
+    public:
+        /* inScale maps the int8 input range to real values, 
+        typically max(|calibration input|) / 127. */
+        QuantizedFullyConnected(FullyConnected &fc, double inScale, bool fuse_relu = false);
+        NSP forward(NSP in) override;
+        Eigen::MatrixXd forward(const Eigen::MatrixXd &in);
+        /* No trainable parameters. */
+        std::vector<NSP> params() override;
+        /* Bytes resident for the quantized weights, two per weight with the
+        row padding, and for their per-channel scales. */
+        size_t weightBytes();
+        size_t scaleBytes();
+};
+
+/* Quantize every FullyConnected layer of a sequential model in place,
+calibrating input scales on the given batch. Layers followed by a ReLU 
+get it fused into their output pass. */
+void quantizeModel(Model &model, const Eigen::MatrixXd &calibration);
+}
+
+#endif
@@ -0,0 +1,324 @@
+#include "rnn.h"
+#include "base.h"
+#include "node.h"
+#include "parallel.h"
+#include <Eigen/Dense>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+namespace Deep
+{
+namespace Rnn
+{
+namespace
+{
+/* Logistic function in place, element-wise so a block can be its own input. */
+template <typename Derived>
+void sigmoid(Eigen::ArrayBase<Derived> &&a)
+{
+    a = 1.0 / (1.0 + (-a).exp());
+}
+
+/* x [B, L * I] to the feature-major [I, B * L], step after step. */
+T toSteps(const T &x, Eigen::Index features)
+{
+    const Eigen::Index B { x.rows() };
+    const Eigen::Index L { x.cols() / features };
+    T steps(features, B * L);
+    for (Eigen::Index t=0; t<L; ++t)
+        steps.middleCols(t * B, B) = x.middleCols(t * features, features).transpose();
+    return steps;
+}
+
+/* Inverse of toSteps, [F, B * L] to [B, L * F]. */
+T fromSteps(const Eigen::Ref<const T> &steps, Eigen::Index batch)
+{
+    const Eigen::Index F { steps.rows() };
+    const Eigen::Index L { steps.cols() / batch };
+    T x(batch, L * F);
+    for (Eigen::Index t=0; t<L; ++t)
+        x.middleCols(t * F, F) = steps.middleCols(t * batch, batch).transpose();
+    return x;
+}
+
+/* Into a preallocated [G * H, B], out = Whh * h. */
+void hiddenGemm(const T &Whh, const Eigen::Ref<const T> &h, T &out)
+{
+    Parallel::parallelFor(Whh.rows(), Whh.cols() * h.cols(), [&](Eigen::Index begin, Eigen::Index end){
+        out.middleRows(begin, end - begin).noalias() = Whh.middleRows(begin, end - begin) * h;
+    });
+}
+
+/* Into a preallocated [H, B], out = Whh^T * g. */
+void hiddenGemmT(const T &Whh, const Eigen::Ref<const T> &g, T &out)
+{
+    Parallel::parallelFor(Whh.cols(), Whh.rows() * g.cols(), [&](Eigen::Index begin, Eigen::Index end){
+        out.middleRows(begin, end - begin).noalias() = Whh.middleCols(begin, end - begin).transpose() * g;
+    });
+}
+
+std::shared_ptr<Node> recurrent(Cell cell, std::shared_ptr<Node> x, std::shared_ptr<Node> Wih,
+    std::shared_ptr<Node> Whh, std::shared_ptr<Node> bih, std::shared_ptr<Node> bhh)
+{
+    for (const std::shared_ptr<Node> &operand: {x, Wih, Whh, bih, bhh})
+        operand->materialize();
+    const Eigen::Index G { gateCount(cell) };
+    const Eigen::Index H { Whh->data.cols() };
+    const Eigen::Index I { Wih->data.cols() };
+    if (H == 0 || Whh->data.rows() != G * H || Wih->data.rows() != G * H)
+        throw std::invalid_argument("Weights of a recurrent layer must be [" + std::to_string(G)
+            + " * H, I] and [" + std::to_string(G) + " * H, H].");
+    if (bih->data.rows() != G * H || bih->data.cols() != 1 || bhh->data.rows() != G * H || bhh->data.cols() != 1)
+        throw std::invalid_argument("Biases of a recurrent layer must be [" + std::to_string(G) + " * H, 1].");
+    if (I == 0 || x->data.cols() == 0 || x->data.cols() % I != 0)
+        throw std::invalid_argument("Input of a recurrent layer must be [B, L * " + std::to_string(I) + "], got "
+            + std::to_string(x->data.cols()) + " columns.");
+    const Eigen::Index B { x->data.rows() };
+    const Eigen::Index L { x->data.cols() / I };
+    std::shared_ptr<Cache> cache { std::make_shared<Cache>(cell, L, B) };
+
+    // Input projection of every step in one GEMM, with the biases that are
+    // simply added, every one but b_hn of GRU which r multiplies.
+    T &gates { cache->gates };
+    gates = Parallel::matmul(Wih->data, toSteps(x->data, I));
+    Eigen::VectorXd bias { bih->data.col(0) + bhh->data.col(0) };
+    if (cell == Cell::gru)
+        bias.tail(H) = bih->data.col(0).tail(H);
+    gates.colwise() += bias;
+    const Eigen::ArrayXd hiddenBias { bhh->data.col(0).tail(H) };
+
+    T &states { cache->states };
+    T &cells { cache->cells };
+    states.setZero(H, B * (L + 1));
+    if (cell == Cell::lstm)
+        cells.setZero(H, B * (L + 1));
+    else
+        cells.resize(H, B * L);
+    T hiddenGates(G * H, B);
+    for (Eigen::Index t=0; t<L; ++t)
+    {
+        hiddenGemm(Whh->data, states.middleCols(t * B, B), hiddenGates);
+        // Every gate of a sample in one pass, overwriting its projection with its activation.
+        Parallel::parallelFor(B, 10 * G * H, [&](Eigen::Index begin, Eigen::Index end){
+            for (Eigen::Index b=begin; b<end; ++b)
+            {
+                const Eigen::Index j { t * B + b };
+                auto a = gates.col(j).array();
+                const auto hh = hiddenGates.col(b).array();
+                if (cell == Cell::lstm)
+                {
+                    a += hh;
+                    sigmoid(a.head(2 * H));
+                    a.segment(2 * H, H) = a.segment(2 * H, H).tanh();
+                    sigmoid(a.tail(H));
+                    cells.col(j + B).array() = a.segment(H, H) * cells.col(j).array() + a.head(H) * a.segment(2 * H, H);
+                    states.col(j + B).array() = a.tail(H) * cells.col(j + B).array().tanh();
+                }
+                else
+                {
+                    a.head(2 * H) += hh.head(2 * H);
+                    sigmoid(a.head(2 * H));
+                    cells.col(j).array() = hh.tail(H) + hiddenBias;
+                    a.tail(H) = (a.tail(H) + a.head(H) * cells.col(j).array()).tanh();
+                    states.col(j + B).array() = (1.0 - a.segment(H, H)) * a.tail(H)
+                        + a.segment(H, H) * states.col(j).array();
+                }
+            }
+        });
+    }
+
+    std::shared_ptr<Node> out { std::make_shared<Node>(
+        fromSteps(states.rightCols(B * L), B),
+        false,
+        std::vector<std::shared_ptr<Node>> {x, Wih, Whh, bih, bhh},
+        cell == Cell::lstm ? gradFn::lstmBackward : gradFn::gruBackward
+    ) };
+    // Not recording, nothing will walk the steps back.
+    if (out->gradientFunction != gradFn::none)
+        out->saved = cache;
+    return out;
+}
+
+/* Gradients of the gate projections of every step into cache, walking
+the steps backward from the gradient of the hidden states [B, L * H]. */
+void throughTime(Node &node, Cache &cache, const T &fromGradient)
+{
+    node.checkVersion(2);
+    const T &Whh { node.nextNodes[2]->data };
+    const Eigen::Index G { gateCount(cache.cell) };
+    const Eigen::Index H { Whh.cols() };
+    const Eigen::Index B { cache.batch };
+    const Eigen::Index L { cache.steps };
+    const T &gates { cache.gates };
+    const T &states { cache.states };
+    const T &cells { cache.cells };
+    T &inputGradient { cache.inputGradient };
+    T &hiddenGradient { cache.hiddenGradient };
+    inputGradient.resize(G * H, B * L);
+    if (cache.cell == Cell::gru)
+        hiddenGradient.resize(G * H, B * L);
+    // Gradient of h carried to the previous step, and of c for LSTM.
+    T carried { T::Zero(H, B) };
+    T carriedCell { T::Zero(H, B) };
+    // GRU gradient of the previous h through z * h, before the hidden GEMM.
+    T direct(H, B);
+    for (Eigen::Index t=L-1; t>=0; --t)
+    {
+        Parallel::parallelFor(B, 20 * G * H, [&](Eigen::Index begin, Eigen::Index end){
+            for (Eigen::Index b=begin; b<end; ++b)
+            {
+                const Eigen::Index j { t * B + b };
+                const Eigen::ArrayXd dh { fromGradient.block(b, t * H, 1, H).transpose().array() + carried.col(b).array() };
+                const auto a = gates.col(j).array();
+                auto g = inputGradient.col(j).array();
+                if (cache.cell == Cell::lstm)
+                {
+                    const auto i = a.head(H);
+                    const auto f = a.segment(H, H);
+                    const auto candidate = a.segment(2 * H, H);
+                    const auto o = a.tail(H);
+                    const Eigen::ArrayXd tanhCell { cells.col(j + B).array().tanh() };
+                    const Eigen::ArrayXd dc { carriedCell.col(b).array() + dh * o * (1.0 - tanhCell.square()) };
+                    g.head(H) = dc * candidate * i * (1.0 - i);
+                    g.segment(H, H) = dc * cells.col(j).array() * f * (1.0 - f);
+                    g.segment(2 * H, H) = dc * i * (1.0 - candidate.square());
+                    g.tail(H) = dh * tanhCell * o * (1.0 - o);
+                    carriedCell.col(b).array() = dc * f;
+                }
+                else
+                {
+                    const auto r = a.head(H);
+                    const auto z = a.segment(H, H);
+                    const auto n = a.tail(H);
+                    const Eigen::ArrayXd dn { dh * (1.0 - z) * (1.0 - n.square()) };
+                    g.head(H) = dn * cells.col(j).array() * r * (1.0 - r);
+                    g.segment(H, H) = dh * (states.col(j).array() - n) * z * (1.0 - z);
+                    g.tail(H) = dn;
+                    auto gh = hiddenGradient.col(j).array();
+                    gh.head(2 * H) = g.head(2 * H);
+                    gh.tail(H) = dn * r;
+                    direct.col(b).array() = dh * z;
+                }
+            }
+        });
+        if (t == 0)
+            break;
+        const T &projected { cache.cell == Cell::lstm ? inputGradient : hiddenGradient };
+        hiddenGemmT(Whh, projected.middleCols(t * B, B), carried);
+        if (cache.cell == Cell::gru)
+            carried += direct;
+    }
+}
+}
+
+Cache::Cache(Cell type, Eigen::Index numSteps, Eigen::Index batchSize):
+    cell(type), steps(numSteps), batch(batchSize), gates(), states(), cells(),
+    mutex(), pending(0), inputGradient(), hiddenGradient()
+{
+}
+
+Eigen::Index gateCount(Cell cell)
+{
+    return cell == Cell::lstm ? 4 : 3;
+}
+
+T Cache::gradient(Node &node, size_t operand, const T &fromGradient)
+{
+    // Concurrent operands wait for the first one to walk the steps.
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pending == 0)
+    {
+        throughTime(node, *this, fromGradient);
+        for (const std::shared_ptr<Node> &next: node.nextNodes)
+            pending += next->gradientFunction != gradFn::none ? 1 : 0;
+    }
+    // Both projections of LSTM gates have the same gradient.
+    const T &hiddenProjection { cell == Cell::lstm ? inputGradient : hiddenGradient };
+    const Eigen::Index B { batch };
+    T toGradient {};
+    switch (operand)
+    {
+        case 0:
+            node.checkVersion(1);
+            toGradient = fromSteps(Parallel::matmul(node.nextNodes[1]->data.transpose(), inputGradient), B);
+            break;
+        case 1:
+            node.checkVersion(0);
+            toGradient = Parallel::matmul(inputGradient, toSteps(node.nextNodes[0]->data, node.nextNodes[1]->data.cols()).transpose());
+            break;
+        case 2:
+            toGradient = Parallel::matmul(hiddenProjection, states.leftCols(B * steps).transpose());
+            break;
+        case 3:
+            toGradient = inputGradient.rowwise().sum();
+            break;
+        default:
+            toGradient = hiddenProjection.rowwise().sum();
+    }
+    if (--pending <= 0)
+    {
+        pending = 0;
+        T().swap(inputGradient);
+        T().swap(hiddenGradient);
+    }
+    return toGradient;
+}
+}
+
+std::shared_ptr<Node> lstm(std::shared_ptr<Node> x, std::shared_ptr<Node> Wih, std::shared_ptr<Node> Whh,
+    std::shared_ptr<Node> bih, std::shared_ptr<Node> bhh)
+{
+    return Rnn::recurrent(Rnn::Cell::lstm, x, Wih, Whh, bih, bhh);
+}
+
+std::shared_ptr<Node> gru(std::shared_ptr<Node> x, std::shared_ptr<Node> Wih, std::shared_ptr<Node> Whh,
+    std::shared_ptr<Node> bih, std::shared_ptr<Node> bhh)
+{
+    return Rnn::recurrent(Rnn::Cell::gru, x, Wih, Whh, bih, bhh);
+}
+
+RecurrentLayer::RecurrentLayer(Rnn::Cell type, int input_size, int hidden_size, bool requires_grad):
+    cell(type), in_c(input_size), hidden(hidden_size),
+    weightsIh(nullptr), weightsHh(nullptr), biasesIh(nullptr), biasesHh(nullptr)
+{
+    if (input_size <= 0 || hidden_size <= 0)
+        throw std::invalid_argument("Input size and hidden size must both be positive. ");
+    gradFn mode { requires_grad ? gradFn::accumulateGrad : gradFn::none };
+    const Eigen::Index G { Rnn::gateCount(cell) };
+    std::uniform_real_distribution<double> weightDis(-std::pow(hidden, -0.5), std::pow(hidden, -0.5));
+    auto draw = [&](Eigen::Index rows, Eigen::Index cols){
+        return std::make_shared<Node>(T(T::NullaryExpr(rows, cols, [&](){return weightDis(Deep::gen);})), mode);
+    };
+    weightsIh = draw(G * hidden, in_c);
+    weightsHh = draw(G * hidden, hidden);
+    biasesIh = draw(G * hidden, 1);
+    biasesHh = draw(G * hidden, 1);
+}
+
+NSP RecurrentLayer::forward(NSP in)
+{
+    return Rnn::recurrent(cell, in, weightsIh, weightsHh, biasesIh, biasesHh);
+}
+
+std::vector<NSP> RecurrentLayer::params()
+{
+    return std::vector<NSP> {weightsIh, weightsHh, biasesIh, biasesHh};
+}
+
+int RecurrentLayer::hiddenSize() const
+{
+    return hidden;
+}
+
+LSTM::LSTM(int input_size, int hidden_size, bool requires_grad):
+    RecurrentLayer(Rnn::Cell::lstm, input_size, hidden_size, requires_grad)
+{
+}
+
+GRU::GRU(int input_size, int hidden_size, bool requires_grad):
+    RecurrentLayer(Rnn::Cell::gru, input_size, hidden_size, requires_grad)
+{
+}
+}
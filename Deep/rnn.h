@@ -0,0 +1,102 @@
+/* Recurrent layers over batches of sequences.
+A batch of L-step sequences with I features per step is [B, L * I], step t
+in the columns [t * I, (t + 1) * I), the layout of the Embedding output.
+The output holds the hidden state of every step in the same layout, [B, L * H].
+A whole sequence is one node instead of a chain of small ops per step and gate:
+- the input projection of every step is a single GEMM, [G * H, I] * [I, B * L],
+- each step is one GEMM against the gate weights stacked [G * H, H], G = 4
+  for LSTM and 3 for GRU, then a single pass over its gates applies their
+  activations and updates the state,
+- the activations of every step go to buffers allocated once per sequence,
+  which backward through time walks in reverse, the weight gradients are
+  then GEMMs over every step at once.
+Gates and states are stored feature-major, [G * H, B] per step, so the
+columns of a step are contiguous. Sequences start from zero states. */
+#ifndef RNN_H
+#define RNN_H
+#include "base.h"
+#include "node.h"
+#include <Eigen/Dense>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Deep
+{
+namespace Rnn
+{
+/* Gates in the order of PyTorch: i f g o for LSTM, r z n for GRU. */
+enum class Cell { lstm, gru };
+
+/* Kept by the forward of a recurrent node for its backward, column
+t * B + b of every buffer is step t of sample b. */
+struct Cache: SavedState
+{
+    Cell cell;
+    Eigen::Index steps;
+    Eigen::Index batch;
+    // Activated gates [G * H, B * L].
+    T gates;
+    // Hidden states [H, B * (L + 1)], the first B columns are the zero initial state.
+    T states;
+    // LSTM cell states [H, B * (L + 1)], GRU hidden projection of n, W_hn h + b_hn [H, B * L].
+    T cells;
+    /* Gradients of the input and hidden projections of the gates [G * H, B * L],
+    the same for LSTM. Computed by the first operand asking for its gradient,
+    released once every operand has been served. */
+    std::mutex mutex;
+    int pending;
+    T inputGradient;
+    T hiddenGradient;
+    Cache(Cell type, Eigen::Index numSteps, Eigen::Index batchSize);
+    /* Gradient passed to operand of the lstmBackward or gruBackward node,
+    whose operands are x, Wih, Whh, bih and bhh. */
+    T gradient(Node &node, size_t operand, const T &fromGradient) override;
+};
+
+/* Number of gates of a cell. */
+Eigen::Index gateCount(Cell cell);
+}
+
+/* x [B, L * I], Wih [G * H, I], Whh [G * H, H], bih and bhh [G * H, 1] as
+in PyTorch, returns the hidden states [B, L * H]. Throws std::invalid_argument
+for other shapes. */
+std::shared_ptr<Node> lstm(std::shared_ptr<Node> x, std::shared_ptr<Node> Wih, std::shared_ptr<Node> Whh,
+    std::shared_ptr<Node> bih, std::shared_ptr<Node> bhh);
+std::shared_ptr<Node> gru(std::shared_ptr<Node> x, std::shared_ptr<Node> Wih, std::shared_ptr<Node> Whh,
+    std::shared_ptr<Node> bih, std::shared_ptr<Node> bhh);
+
+/* Weights and biases shared by LSTM and GRU, initialized like PyTorch
+from U(-1 / sqrt(H), 1 / sqrt(H)). */
+class RecurrentLayer: public Layer
+{
+    protected:
+        Rnn::Cell cell;
+        int in_c;
+        int hidden;
+        RecurrentLayer(Rnn::Cell type, int input_size, int hidden_size, bool requires_grad);
+    public:
+        NSP weightsIh;
+        NSP weightsHh;
+        NSP biasesIh;
+        NSP biasesHh;
+        /* in [B, L * input_size], returns [B, L * hidden_size]. */
+        NSP forward(NSP in) override;
+        std::vector<NSP> params() override;
+        int hiddenSize() const;
+};
+
+class LSTM: public RecurrentLayer
+{
+    public:
+        LSTM(int input_size, int hidden_size, bool requires_grad = true);
+};
+
+class GRU: public RecurrentLayer
+{
+    public:
+        GRU(int input_size, int hidden_size, bool requires_grad = true);
+};
+}
+
+#endif
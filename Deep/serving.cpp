@@ -0,0 +1,394 @@
+#include "serving.h"
+#include "base.h"
+#include "node.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace Deep::Serving
+{
+BatchingServer::BatchingServer(Model &servedModel, ServerOptions opts):
+    model(servedModel), options(opts), width(opts.inputSize), queue(), queueMutex(), queueCv(),
+    stopping(false), workers(), statsMutex(), latencies(), batchCount(0),
+    statsStart(Clock::now())
+{
+    if (options.maxBatchSize <= 0 || options.numWorkers <= 0 || options.maxWaitMicros < 0)
+        throw std::invalid_argument("Batch size and number of workers must be positive, waiting time must be non-negative.");
+    if (options.inputSize < 0)
+        throw std::invalid_argument("Input size must be non-negative.");
+    for (int i=0; i<options.numWorkers; ++i)
+        workers.push_back(std::thread(&BatchingServer::workerLoop, this));
+}
+
+BatchingServer::~BatchingServer()
+{
+    stop();
+}
+
+std::future<Eigen::RowVectorXd> BatchingServer::submit(Eigen::RowVectorXd row)
+{
+    // Rows of a batch must agree, so a wrong row is refused here rather than failing its batch.
+    Eigen::Index expected { 0 };
+    if (row.size() == 0)
+        throw std::invalid_argument("Request has no features.");
+    if (!width.compare_exchange_strong(expected, row.size()) && expected != row.size())
+    {
+        throw std::invalid_argument("Request has " + std::to_string(row.size())
+            + " features, the server expects " + std::to_string(expected) + ".");
+    }
+    Request request {row, std::promise<Eigen::RowVectorXd>{}, Clock::now()};
+    std::future<Eigen::RowVectorXd> ret { request.result.get_future() };
+    bool batchFull { false };
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (stopping)
+            throw std::runtime_error("Cannot submit to a stopped server.");
+        queue.push_back(std::move(request));
+        batchFull = static_cast<int>(queue.size()) >= options.maxBatchSize;
+    }
+    // A full batch should wake the worker which is waiting for it to fill up.
+    if (batchFull)
+        queueCv.notify_all();
+    else
+        queueCv.notify_one();
+    return ret;
+}
+
+Eigen::RowVectorXd BatchingServer::predict(Eigen::RowVectorXd row)
+{
+    return submit(row).get();
+}
+
+void BatchingServer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueCv.notify_all();
+    for (std::thread &worker: workers)
+    {
+        if (worker.joinable())
+            worker.join();
+    }
+    workers.clear();
+}
+
+void BatchingServer::workerLoop()
+{
+    const std::chrono::microseconds maxWait(options.maxWaitMicros);
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while (true)
+    {
+        queueCv.wait(lock, [this]{ return stopping || !queue.empty(); });
+        if (queue.empty())
+            return; // Stopping and nothing left to serve.
+        // Let the batch fill up until the oldest request reaches its deadline.
+        const Clock::time_point deadline { queue.front().arrival + maxWait };
+        while (!stopping && !queue.empty()
+            && static_cast<int>(queue.size()) < options.maxBatchSize
+            && Clock::now() < deadline)
+        {
+            queueCv.wait_until(lock, deadline);
+        }
+        // Another worker might have taken the requests meanwhile.
+        if (queue.empty())
+            continue;
+        const size_t n { std::min(queue.size(), static_cast<size_t>(options.maxBatchSize)) };
+        std::vector<Request> batch {};
+        batch.reserve(n);
+        for (size_t i=0; i<n; ++i)
+        {
+            batch.push_back(std::move(queue.front()));
+            queue.pop_front();
+        }
+        lock.unlock();
+        runBatch(batch);
+        lock.lock();
+    }
+}
+
+void BatchingServer::runBatch(std::vector<Request> &batch)
+{
+    const Eigen::Index n { static_cast<Eigen::Index>(batch.size()) };
+    try
+    {
+        // submit() only queues rows of the input size.
+        Eigen::MatrixXd features(n, batch[0].row.size());
+        for (Eigen::Index i=0; i<n; ++i)
+            features.row(i) = batch[i].row;
+        // Nothing is trained here, intermediate outputs are freed as they go.
+        Deep::NoGradGuard noGrad;
+        NSP in { std::make_shared<Deep::Node>(features) };
+        NSP out { model.forward(in) };
+        for (Eigen::Index i=0; i<n; ++i)
+            batch[i].result.set_value(out->data.row(i));
+    }
+    catch (...)
+    {
+        for (Request &request: batch)
+        {
+            try { request.result.set_exception(std::current_exception()); }
+            catch (const std::future_error&) {} // Already satisfied.
+        }
+    }
+    const Clock::time_point done { Clock::now() };
+    std::lock_guard<std::mutex> lock(statsMutex);
+    for (const Request &request: batch)
+    {
+        latencies.push_back(
+            std::chrono::duration<double, std::micro>(done - request.arrival).count()
+        );
+    }
+    ++batchCount;
+}
+
+ServerStats BatchingServer::stats()
+{
+    std::vector<double> sorted {};
+    long batches { 0 };
+    double elapsed { 0.0 };
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        sorted = latencies;
+        batches = batchCount;
+        elapsed = std::chrono::duration<double>(Clock::now() - statsStart).count();
+    }
+    const long requests { static_cast<long>(sorted.size()) };
+    ServerStats ret {requests, batches, 0.0, 0.0, 0.0, 0.0};
+    if (requests == 0)
+        return ret;
+    auto percentile = [&sorted](double p){
+        size_t k { static_cast<size_t>(p * static_cast<double>(sorted.size() - 1)) };
+        std::nth_element(sorted.begin(), sorted.begin() + static_cast<long>(k), sorted.end());
+        return sorted[k];
+    };
+    ret.meanBatchSize = static_cast<double>(requests) / static_cast<double>(batches);
+    ret.p50Micros = percentile(0.50);
+    ret.p99Micros = percentile(0.99);
+    ret.throughput = static_cast<double>(requests) / elapsed;
+    return ret;
+}
+
+Eigen::Index BatchingServer::inputSize() const
+{
+    return width;
+}
+
+void BatchingServer::resetStats()
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    latencies.clear();
+    batchCount = 0;
+    statsStart = Clock::now();
+}
+
+/* Read or write exactly len bytes, false if the peer has gone. */
+static bool readAll(int fd, char *buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t got { ::read(fd, buffer, len) };
+        if (got <= 0)
+            return false;
+        buffer += got;
+        len -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const char *buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t sent { ::send(fd, buffer, len, MSG_NOSIGNAL) };
+        if (sent <= 0)
+            return false;
+        buffer += sent;
+        len -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+bool readFrame(int fd, std::vector<double> &values, uint32_t maxCount)
+{
+    uint32_t count { 0 };
+    if (!readAll(fd, reinterpret_cast<char*>(&count), sizeof(count)))
+        return false;
+    if (count == errorFrame)
+    {
+        uint32_t len { 0 };
+        if (!readAll(fd, reinterpret_cast<char*>(&len), sizeof(len)) || len > maxErrorBytes)
+            throw std::runtime_error("Malformed error frame.");
+        std::string message(len, '\0');
+        if (!readAll(fd, &message[0], len))
+            return false;
+        throw std::runtime_error(message);
+    }
+    // Checked before resizing, the count comes from the peer.
+    if (count > maxCount)
+    {
+        throw std::length_error("Frame of " + std::to_string(count) + " values, at most "
+            + std::to_string(maxCount) + " are accepted.");
+    }
+    values.resize(count);
+    return readAll(fd, reinterpret_cast<char*>(values.data()), count * sizeof(double));
+}
+
+bool writeFrame(int fd, const std::vector<double> &values)
+{
+    // Send header and payload together to avoid an extra round of Nagle-like delays.
+    const uint32_t count { static_cast<uint32_t>(values.size()) };
+    std::vector<char> buffer(sizeof(count) + count * sizeof(double));
+    std::memcpy(buffer.data(), &count, sizeof(count));
+    std::memcpy(buffer.data() + sizeof(count), values.data(), count * sizeof(double));
+    return writeAll(fd, buffer.data(), buffer.size());
+}
+
+bool writeError(int fd, const std::string &message)
+{
+    const uint32_t header[2] { errorFrame,
+        static_cast<uint32_t>(std::min(message.size(), static_cast<size_t>(maxErrorBytes))) };
+    std::vector<char> buffer(sizeof(header) + header[1]);
+    std::memcpy(buffer.data(), header, sizeof(header));
+    std::memcpy(buffer.data() + sizeof(header), message.data(), header[1]);
+    return writeAll(fd, buffer.data(), buffer.size());
+}
+
+static sockaddr_un socketAddress(const std::string &path)
+{
+    sockaddr_un address {};
+    if (path.size() >= sizeof(address.sun_path))
+        throw std::invalid_argument("Socket path is too long.");
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+int connectSocket(std::string socketPath)
+{
+    sockaddr_un address { socketAddress(socketPath) };
+    int fd { ::socket(AF_UNIX, SOCK_STREAM, 0) };
+    if (fd < 0)
+        throw std::runtime_error("Failed to create socket.");
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("Failed to connect to " + socketPath + ".");
+    }
+    return fd;
+}
+
+SocketFrontend::SocketFrontend(BatchingServer &batchingServer, std::string path):
+    server(batchingServer), socketPath(path), listenFd(-1), running(false),
+    connectionsMutex(), connectionsCv(), connectionFds(), connections()
+{
+    sockaddr_un address { socketAddress(socketPath) };
+    listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+        throw std::runtime_error("Failed to create socket.");
+    ::unlink(socketPath.c_str());
+    if (::bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+        || ::listen(listenFd, 128) != 0)
+    {
+        ::close(listenFd);
+        throw std::runtime_error("Failed to listen on " + socketPath + ".");
+    }
+    running = true;
+}
+
+SocketFrontend::~SocketFrontend()
+{
+    shutdown();
+    ::close(listenFd);
+    ::unlink(socketPath.c_str());
+}
+
+void SocketFrontend::serve()
+{
+    while (running)
+    {
+        int fd { ::accept(listenFd, nullptr, nullptr) };
+        if (fd < 0)
+            break;
+        // The thread can't remove itself before it's registered, it needs the lock.
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        connectionFds.push_back(fd);
+        std::thread connection(&SocketFrontend::handleConnection, this, fd);
+        const std::thread::id id { connection.get_id() };
+        connections.emplace(id, std::move(connection));
+    }
+    // Wake connection threads blocked on reading, then wait for them to end.
+    std::unique_lock<std::mutex> lock(connectionsMutex);
+    for (int fd: connectionFds)
+        ::shutdown(fd, SHUT_RDWR);
+    connectionsCv.wait(lock, [this]{ return connections.empty(); });
+}
+
+void SocketFrontend::shutdown()
+{
+    running = false;
+    ::shutdown(listenFd, SHUT_RDWR);
+}
+
+void SocketFrontend::handleConnection(int fd)
+{
+    std::vector<double> request {};
+    while (true)
+    {
+        // A single request is at most the input size, once the server knows it.
+        const Eigen::Index width { server.inputSize() };
+        try
+        {
+            if (!readFrame(fd, request, width > 0 ? static_cast<uint32_t>(width) : maxFrameValues))
+                break;
+        }
+        catch (const std::exception &e)
+        {
+            // The rest of the frame can't be skipped reliably, answer then drop the connection.
+            writeError(fd, e.what());
+            break;
+        }
+        std::vector<double> response {};
+        std::string error {};
+        if (request.empty())
+        {
+            ServerStats s { server.stats() };
+            response = {static_cast<double>(s.requests), static_cast<double>(s.batches),
+                s.meanBatchSize, s.p50Micros, s.p99Micros, s.throughput};
+        }
+        else
+        {
+            Eigen::RowVectorXd row { Eigen::Map<Eigen::RowVectorXd>(request.data(),
+                static_cast<Eigen::Index>(request.size())) };
+            try
+            {
+                Eigen::RowVectorXd out { server.predict(row) };
+                response.assign(out.data(), out.data() + out.size());
+            }
+            catch (const std::exception &e)
+            {
+                // Only this request failed, the connection can go on.
+                error = e.what();
+            }
+        }
+        if (!(error.empty() ? writeFrame(fd, response) : writeError(fd, error)))
+            break;
+    }
+    std::unique_lock<std::mutex> lock(connectionsMutex);
+    connectionFds.erase(std::remove(connectionFds.begin(), connectionFds.end(), fd), connectionFds.end());
+    ::close(fd);
+    // Detach rather than wait for serve() to join, so finished threads don't pile up.
+    std::unordered_map<std::thread::id, std::thread>::iterator self { connections.find(std::this_thread::get_id()) };
+    self->second.detach();
+    connections.erase(self);
+    // Notified once this thread is done with the frontend, serve() may then return.
+    std::notify_all_at_thread_exit(connectionsCv, std::move(lock));
+}
+}
@@ -0,0 +1,144 @@
+/* Dynamic-batching inference server for a trained Model.
+Single-row requests are queued and grouped into batches of up to
+maxBatchSize rows, or whatever arrived within maxWaitMicros of the
+oldest queued request, then run through Model::forward on a pool of
+worker threads. Model::forward must be safe to call concurrently,
+which holds for models that only read their layers in forward. */
+#ifndef SERVING_H
+#define SERVING_H
+#include "base.h"
+#include <Eigen/Dense>
+#include <vector>
+#include <deque>
+#include <string>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <cstdint>
+
+namespace Deep::Serving
+{
+using Clock = std::chrono::steady_clock;
+
+struct ServerOptions
+{
+    int maxBatchSize {64};
+    int maxWaitMicros {1000};
+    int numWorkers {2};
+    // Number of features of a request, 0 to take it from the first request.
+    int inputSize {0};
+};
+
+/* Counters collected since construction or the last resetStats().
+Latency is measured from submit() until the result is ready. */
+struct ServerStats
+{
+    long requests;
+    long batches;
+    double meanBatchSize;
+    double p50Micros;
+    double p99Micros;
+    double throughput; // Requests per second.
+};
+
+class BatchingServer
+{
+    public:
+        BatchingServer(Model &servedModel, ServerOptions opts = ServerOptions());
+        BatchingServer(const BatchingServer&) = delete;
+        BatchingServer& operator=(const BatchingServer&) = delete;
+        ~BatchingServer();
+        /* Queue a single row of features [1, in_c],
+        the future holds the corresponding output row.
+        Throws std::invalid_argument if in_c isn't the input size. */
+        std::future<Eigen::RowVectorXd> submit(Eigen::RowVectorXd row);
+        /* Blocking convenience wrapper of submit(). */
+        Eigen::RowVectorXd predict(Eigen::RowVectorXd row);
+        /* Finish queued requests then join the workers. */
+        void stop();
+        ServerStats stats();
+        void resetStats();
+        /* Number of features of a request, 0 until the first request. */
+        Eigen::Index inputSize() const;
+
+    private:
+        struct Request
+        {
+            Eigen::RowVectorXd row;
+            std::promise<Eigen::RowVectorXd> result;
+            Clock::time_point arrival;
+        };
+        Model &model;
+        const ServerOptions options;
+        std::atomic<Eigen::Index> width;
+        std::deque<Request> queue;
+        std::mutex queueMutex;
+        std::condition_variable queueCv;
+        bool stopping;
+        std::vector<std::thread> workers;
+        // Statistics, guarded by statsMutex.
+        std::mutex statsMutex;
+        std::vector<double> latencies;
+        long batchCount;
+        Clock::time_point statsStart;
+
+        void workerLoop();
+        void runBatch(std::vector<Request> &batch);
+};
+
+/* Length-prefixed framing used over the Unix domain socket:
+a uint32 count followed by count doubles. A request frame with
+count 0 asks for the server statistics in the order of ServerStats.
+A response frame with count errorFrame reports a failed request instead,
+followed by a uint32 length and that many bytes of message. */
+constexpr uint32_t errorFrame { 0xFFFFFFFF };
+// Largest frame accepted when the input size isn't known yet, 8 MB of doubles.
+constexpr uint32_t maxFrameValues { 1 << 20 };
+/* False if the peer has gone. Throws std::length_error, before reading
+the payload, if count exceeds maxCount and std::runtime_error with its
+message for an error frame. */
+bool readFrame(int fd, std::vector<double> &values, uint32_t maxCount = maxFrameValues);
+bool writeFrame(int fd, const std::vector<double> &values);
+/* Messages longer than maxErrorBytes are truncated. */
+constexpr uint32_t maxErrorBytes { 4096 };
+bool writeError(int fd, const std::string &message);
+/* Connect to a server listening at socketPath, return the file descriptor. */
+int connectSocket(std::string socketPath);
+
+/* Accept connections on a Unix domain socket and forward every
+request frame to a BatchingServer. Each connection is served by its
+own thread, one request in flight per connection. A failed request
+is answered with an error frame and the connection stays open, only
+malformed frames close it. */
+class SocketFrontend
+{
+    public:
+        SocketFrontend(BatchingServer &batchingServer, std::string path);
+        SocketFrontend(const SocketFrontend&) = delete;
+        SocketFrontend& operator=(const SocketFrontend&) = delete;
+        ~SocketFrontend();
+        /* Blocks until shutdown() is called. */
+        void serve();
+        /* Only touches atomics and file descriptors, safe to call from a signal handler. */
+        void shutdown();
+
+    private:
+        BatchingServer &server;
+        const std::string socketPath;
+        int listenFd;
+        std::atomic<bool> running;
+        std::mutex connectionsMutex;
+        std::condition_variable connectionsCv;
+        std::vector<int> connectionFds;
+        // Running connection threads, each detaches and removes itself as it ends.
+        std::unordered_map<std::thread::id, std::thread> connections;
+
+        void handleConnection(int fd);
+};
+}
+
+#endif
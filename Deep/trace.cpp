@@ -0,0 +1,142 @@
+#include "trace.h"
+#include "base.h"
+#include "node.h"
+#include "nn.h"
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
+
+namespace Deep
+{
+namespace
+{
+/* Record of a single layer call. The nodes are only identified, not
+owned, so the model can still apply in-place ops to layer outputs. */
+struct LayerCall
+{
+    std::string name;
+    std::weak_ptr<Node> in;
+    std::weak_ptr<Node> out;
+    Eigen::MatrixXd input;
+};
+
+/* Wrap a layer, forwarding every call while recording its input and output. */
+class TraceLayer: public Layer
+{
+    public:
+        std::unique_ptr<Layer> inner;
+        TraceLayer(std::unique_ptr<Layer> wrapped, std::string layerName, std::vector<LayerCall> &callList):
+            inner(std::move(wrapped)), name(layerName), calls(callList) {}
+        NSP forward(NSP in) override
+        {
+            NSP out { inner->forward(in) };
+            calls.push_back(LayerCall {name, in, out, in->data});
+            return out;
+        }
+        std::vector<NSP> params() override
+        {
+            return inner->params();
+        }
+        std::vector<NSP> buffers() override
+        {
+            return inner->buffers();
+        }
+    private:
+        std::string name;
+        std::vector<LayerCall> &calls;
+};
+}
+
+std::vector<TracedLayer> traceSequential(Model &model, const Eigen::MatrixXd &sample)
+{
+    std::vector<LayerCall> calls {};
+    for (auto it=model.layers.begin(); it!=model.layers.end(); ++it)
+    {
+        it->second = std::unique_ptr<Layer>(new TraceLayer(std::move(it->second), it->first, calls));
+    }
+    NSP root { nullptr };
+    std::exception_ptr failure { nullptr };
+    try
+    {
+        root = model.forward(std::make_shared<Node>(sample));
+    }
+    catch (...)
+    {
+        failure = std::current_exception();
+    }
+    // Always put the original layers back.
+    for (auto it=model.layers.begin(); it!=model.layers.end(); ++it)
+    {
+        it->second = std::move(static_cast<TraceLayer*>(it->second.get())->inner);
+    }
+    if (failure)
+        std::rethrow_exception(failure);
+
+    // Map every ReLU input in the graph to the ReLU node consuming it.
+    std::unordered_map<Node*, Node*> reluOf {};
+    std::unordered_set<Node*> visited {};
+    std::vector<Node*> stack {root.get()};
+    while (!stack.empty())
+    {
+        Node *curr { stack.back() };
+        stack.pop_back();
+        if (!visited.insert(curr).second)
+            continue;
+        if (curr->gradientFunction == gradFn::reluBackward)
+            reluOf[curr->nextNodes[0].get()] = curr;
+        for (const NSP &next: curr->nextNodes)
+            stack.push_back(next.get());
+    }
+
+    std::vector<TracedLayer> ret {};
+    Node *previous { nullptr };
+    Node *previousOut { nullptr };
+    for (const LayerCall &call: calls)
+    {
+        // Nodes of a sequential stack are all kept alive by root.
+        Node *in { call.in.lock().get() };
+        Node *out { call.out.lock().get() };
+        // A pass-through layer such as Identity returns its input, so a ReLU
+        // after it already looked like a ReLU after the layer before.
+        const bool passThrough { in == out && in == previousOut };
+        if (in == nullptr || out == nullptr || (previous != nullptr && in != previous && !passThrough))
+            throw std::invalid_argument("Layer " + call.name + " does not consume the previous layer, "
+                "the model is not a sequential stack.");
+        auto relu { reluOf.find(out) };
+        const bool reluAfter { relu != reluOf.end() };
+        ret.push_back(TracedLayer {call.name, reluAfter, call.input});
+        previous = reluAfter ? relu->second : out;
+        previousOut = out;
+    }
+    if (previous != root.get())
+        throw std::invalid_argument("The model output is not produced by its last layer, "
+            "the model is not a sequential stack.");
+    return ret;
+}
+
+std::vector<TracedAffine> traceAffineStack(Model &model, const Eigen::MatrixXd &sample)
+{
+    std::vector<TracedAffine> ret {};
+    for (const TracedLayer &t: traceSequential(model, sample))
+    {
+        Layer *layer { model.layers[t.name].get() };
+        if (dynamic_cast<Identity*>(layer) != nullptr)
+        {
+            // A ReLU after an Identity is a ReLU after the layer before it.
+            if (t.reluAfter && ret.empty())
+                throw std::invalid_argument("The model cannot start with a ReLU.");
+            if (t.reluAfter)
+                ret.back().reluAfter = true;
+            continue;
+        }
+        FullyConnected *fc { dynamic_cast<FullyConnected*>(layer) };
+        if (fc == nullptr)
+            throw std::invalid_argument("Layer " + t.name + " is not a FullyConnected layer.");
+        ret.push_back(TracedAffine {t.name, fc, t.reluAfter});
+    }
+    if (ret.empty())
+        throw std::invalid_argument("The model has no FullyConnected layer.");
+    return ret;
+}
+}
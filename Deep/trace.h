@@ -0,0 +1,46 @@
+/* Trace a Model's forward pass to recover its layer structure,
+used by the inference passes that rewrite a trained model. */
+#ifndef TRACE_H
+#define TRACE_H
+#include "base.h"
+#include "node.h"
+#include <Eigen/Dense>
+#include <vector>
+#include <string>
+
+namespace Deep
+{
+/* A layer call observed while tracing, in execution order. */
+struct TracedLayer
+{
+    std::string name;
+    // Whether the layer output is directly consumed by a ReLU.
+    bool reluAfter;
+    // The input the layer received on the sample batch, useful for calibration.
+    Eigen::MatrixXd input;
+};
+
+/* Run model.forward once on a sample batch and return the layers in 
+the order they were called. The model must be a sequential stack, 
+every layer consumes the output (or its ReLU) of the previous one, 
+otherwise std::invalid_argument is thrown. The model is left unchanged. */
+std::vector<TracedLayer> traceSequential(Model &model, const Eigen::MatrixXd &sample);
+
+class FullyConnected;
+
+/* A FullyConnected layer of a traced stack. */
+struct TracedAffine
+{
+    std::string name;
+    FullyConnected *layer;
+    // Whether its output goes through a ReLU, possibly after Identities.
+    bool reluAfter;
+};
+
+/* The FullyConnected layers of a sequential model in the order they are
+called, see traceSequential. Identity layers, such as the ones left by
+Fold::foldBatchNorm, are skipped. Any other layer throws std::invalid_argument. */
+std::vector<TracedAffine> traceAffineStack(Model &model, const Eigen::MatrixXd &sample);
+}
+
+#endif
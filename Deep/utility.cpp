@@ -1,15 +1,22 @@
 #include "node.h"
+#include "parallel.h"
+#include "fusion.h"
 #include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
 
 namespace Deep
 {
 
 std::shared_ptr<Node> operator*(std::shared_ptr<Node> a, std::shared_ptr<Node> b)
 {
+    a->materialize();
+    b->materialize();
     assert(a->data.cols() == b->data.rows());
     std::shared_ptr<Node> matmulPtr(
         std::make_shared<Node>(
-            a->data * b->data, 
+            Parallel::matmul(a->data, b->data), 
             false, 
             std::vector<std::shared_ptr<Node>> {a, b}, 
             Deep::gradFn::matMulBackward
@@ -21,11 +28,19 @@ std::shared_ptr<Node> operator*(std::shared_ptr<Node> a, std::shared_ptr<Node> b
 
 std::shared_ptr<Node> operator+(std::shared_ptr<Node> a, std::shared_ptr<Node> b)
 {
+    if (Fusion::isLazy())
+        return Fusion::defer(Fusion::Op::add, a, b);
+    a->materialize();
+    b->materialize();
     assert(a->data.rows() == b->data.rows());
     assert(a->data.cols() == b->data.cols());
+    Eigen::MatrixXd newData(a->data.rows(), a->data.cols());
+    Parallel::parallelFor(newData.size(), 1, [&](Eigen::Index begin, Eigen::Index end){
+        Parallel::flat(newData, begin, end) = Parallel::flat(a->data, begin, end) + Parallel::flat(b->data, begin, end);
+    });
     std::shared_ptr<Node> addPtr(
         std::make_shared<Node>(
-            a->data + b->data, 
+            newData, 
             false, 
             std::vector<std::shared_ptr<Node>> {a, b}, 
             Deep::gradFn::addBackward
@@ -36,11 +51,19 @@ std::shared_ptr<Node> operator+(std::shared_ptr<Node> a, std::shared_ptr<Node> b
 
 std::shared_ptr<Node> operator-(std::shared_ptr<Node> a, std::shared_ptr<Node> b)
 {
+    if (Fusion::isLazy())
+        return Fusion::defer(Fusion::Op::subtract, a, b);
+    a->materialize();
+    b->materialize();
     assert(a->data.rows() == b->data.rows());
     assert(a->data.cols() == b->data.cols());
+    Eigen::MatrixXd newData(a->data.rows(), a->data.cols());
+    Parallel::parallelFor(newData.size(), 1, [&](Eigen::Index begin, Eigen::Index end){
+        Parallel::flat(newData, begin, end) = Parallel::flat(a->data, begin, end) - Parallel::flat(b->data, begin, end);
+    });
     std::shared_ptr<Node> subPtr(
         std::make_shared<Node>(
-            a->data - b->data, 
+            newData, 
             false, 
             std::vector<std::shared_ptr<Node>> {a, b}, 
             Deep::gradFn::subtractBackward
@@ -49,6 +72,57 @@ std::shared_ptr<Node> operator-(std::shared_ptr<Node> a, std::shared_ptr<Node> b
     return subPtr;
 }
 
+std::shared_ptr<Node> add_(std::shared_ptr<Node> a, std::shared_ptr<Node> b)
+{
+    // Deferred, the sum doesn't need a buffer of its own.
+    if (Fusion::isLazy())
+        return a + b;
+    b->materialize();
+    assert(a->data.rows() == b->data.rows());
+    assert(a->data.cols() == b->data.cols());
+    Eigen::MatrixXd newData { a->takeData(a == b ? 2 : 1) };
+    // a + a reads the buffer it writes to.
+    const Eigen::MatrixXd &other { (a == b) ? newData : b->data };
+    Parallel::parallelFor(newData.size(), 1, [&](Eigen::Index begin, Eigen::Index end){
+        Parallel::flat(newData, begin, end) += Parallel::flat(other, begin, end);
+    });
+    return std::make_shared<Node>(
+        std::move(newData), 
+        false, 
+        std::vector<std::shared_ptr<Node>> {a, b}, 
+        Deep::gradFn::addBackward
+    );
+}
+
+std::shared_ptr<Node> sub_(std::shared_ptr<Node> a, std::shared_ptr<Node> b)
+{
+    if (Fusion::isLazy())
+        return a - b;
+    b->materialize();
+    assert(a->data.rows() == b->data.rows());
+    assert(a->data.cols() == b->data.cols());
+    Eigen::MatrixXd newData { a->takeData(a == b ? 2 : 1) };
+    if (a == b)
+        newData.setZero();
+    else
+    {
+        Parallel::parallelFor(newData.size(), 1, [&](Eigen::Index begin, Eigen::Index end){
+            Parallel::flat(newData, begin, end) -= Parallel::flat(b->data, begin, end);
+        });
+    }
+    return std::make_shared<Node>(
+        std::move(newData), 
+        false, 
+        std::vector<std::shared_ptr<Node>> {a, b}, 
+        Deep::gradFn::subtractBackward
+    );
+}
+
+std::shared_ptr<Node> relu_(std::shared_ptr<Node> a)
+{
+    return a->relu_();
+}
+
 std::shared_ptr<Node> transpose(std::shared_ptr<Node> a)
 {
     return a->transpose();
@@ -65,13 +139,22 @@ std::shared_ptr<Node> sum(std::shared_ptr<Node> a)
 
 std::shared_ptr<Node> affine(std::shared_ptr<Node> b, std::shared_ptr<Node> x, std::shared_ptr<Node> W)
 {
+    b->materialize();
+    x->materialize();
+    W->materialize();
     /* Some routine dimensional checks */
     assert(x->data.cols() == W->data.rows());
     assert(W->data.cols() == b->data.rows());
     assert(b->data.cols() == 1);
 
-    Eigen::MatrixXd newData {x->data * W->data};
-    newData.rowwise() += Eigen::RowVectorXd(b->data.col(0));
+    const Eigen::RowVectorXd bias { b->data.col(0) };
+    Eigen::MatrixXd newData(x->data.rows(), W->data.cols());
+    /* Row blocks of the batch, the bias is added while the block is still in cache. */
+    Parallel::parallelFor(newData.rows(), W->data.rows() * W->data.cols(), [&](Eigen::Index begin, Eigen::Index end){
+        auto block = newData.middleRows(begin, end - begin);
+        block.noalias() = x->data.middleRows(begin, end - begin) * W->data;
+        block.rowwise() += bias;
+    });
     std::shared_ptr<Node> retPtr {std::make_shared<Node>(
         newData,
         false,
@@ -81,16 +164,41 @@ std::shared_ptr<Node> affine(std::shared_ptr<Node> b, std::shared_ptr<Node> x, s
     return retPtr;
 }
 
+std::shared_ptr<Node> affineT(std::shared_ptr<Node> b, std::shared_ptr<Node> x, std::shared_ptr<Node> W)
+{
+    b->materialize();
+    x->materialize();
+    W->materialize();
+    assert(x->data.cols() == W->data.cols());
+    assert(W->data.rows() == b->data.rows());
+    assert(b->data.cols() == 1);
+
+    const Eigen::RowVectorXd bias { b->data.col(0) };
+    Eigen::MatrixXd newData(x->data.rows(), W->data.rows());
+    Parallel::parallelFor(newData.rows(), W->data.rows() * W->data.cols(), [&](Eigen::Index begin, Eigen::Index end){
+        auto block = newData.middleRows(begin, end - begin);
+        block.noalias() = x->data.middleRows(begin, end - begin) * W->data.transpose();
+        block.rowwise() += bias;
+    });
+    return std::make_shared<Node>(
+        newData,
+        false,
+        std::vector<std::shared_ptr<Node>> {b,x,W},
+        Deep::gradFn::addMmTBackward
+    );
+}
+
 std::shared_ptr<Node> MSE(std::shared_ptr<Node> a, std::shared_ptr<Node> b)
 {
+    a->materialize();
+    b->materialize();
     assert(a->data.rows() == b->data.rows());
     assert(a->data.cols() == b->data.cols());
-    Eigen::MatrixXd diffSquare { a->data - b->data };
-    diffSquare = diffSquare.unaryExpr([](double num){
-        return num * num;
-    });
+    const double squaredSum { Parallel::parallelSum(a->data.size(), 2, [&](Eigen::Index begin, Eigen::Index end){
+        return (Parallel::flat(a->data, begin, end) - Parallel::flat(b->data, begin, end)).square().sum();
+    }) };
     Eigen::MatrixXd result(1,1);
-    result << diffSquare.mean();
+    result << squaredSum / static_cast<double>(a->data.size());
     std::shared_ptr<Node> retPtr {std::make_shared<Node>(
         result,
         false,
@@ -106,4 +214,148 @@ std::shared_ptr<Node> MSE(std::shared_ptr<Node> a, Eigen::MatrixXd b)
     return MSE(a, bPtr);
 }
 
-}
\ No newline at end of file
+namespace
+{
+/* y = (x - mean) * invStd * gamma + beta column by column. With
+computeStats, mean and var are the batch statistics written by the same
+pass over each column, otherwise they are read. */
+std::shared_ptr<Node> normalizeColumns(std::shared_ptr<Node> x, std::shared_ptr<Node> gamma, 
+    std::shared_ptr<Node> beta, Eigen::MatrixXd &mean, Eigen::MatrixXd &var, bool computeStats, double eps)
+{
+    x->materialize();
+    gamma->materialize();
+    beta->materialize();
+    const Eigen::MatrixXd &in { x->data };
+    const Eigen::Index B { in.rows() };
+    const Eigen::Index C { in.cols() };
+    if (gamma->data.rows() != C || gamma->data.cols() != 1 || beta->data.rows() != C || beta->data.cols() != 1)
+        throw std::invalid_argument("gamma and beta of batchNorm must be [C, 1].");
+    if (computeStats)
+    {
+        if (B < 2)
+            throw std::invalid_argument("batchNorm needs more than one row to compute batch statistics.");
+        mean.resize(C, 1);
+        var.resize(C, 1);
+    }
+    else if (mean.rows() != C || mean.cols() != 1 || var.rows() != C || var.cols() != 1)
+        throw std::invalid_argument("mean and var of batchNormEval must be [C, 1].");
+    Eigen::MatrixXd invStd(C, 1);
+    Eigen::MatrixXd out(B, C);
+    Parallel::parallelFor(C, 3 * B, [&](Eigen::Index begin, Eigen::Index end){
+        for (Eigen::Index j=begin; j<end; ++j)
+        {
+            if (computeStats)
+            {
+                /* Sum and sum of squares in one pass, shifted by the first value
+                so the variance doesn't cancel out for columns far from zero. */
+                const double *column { in.col(j).data() };
+                const double shift { column[0] };
+                double sum { 0.0 };
+                double squares { 0.0 };
+                for (Eigen::Index i=0; i<B; ++i)
+                {
+                    const double d { column[i] - shift };
+                    sum += d;
+                    squares += d * d;
+                }
+                const double shiftedMean { sum / static_cast<double>(B) };
+                mean(j, 0) = shift + shiftedMean;
+                var(j, 0) = std::max(squares / static_cast<double>(B) - shiftedMean * shiftedMean, 0.0);
+            }
+            invStd(j, 0) = 1.0 / std::sqrt(var(j, 0) + eps);
+            const double scale { gamma->data(j, 0) * invStd(j, 0) };
+            const double offset { beta->data(j, 0) - mean(j, 0) * scale };
+            out.col(j) = (in.col(j).array() * scale + offset).matrix();
+        }
+    });
+    std::shared_ptr<Node> retPtr {std::make_shared<Node>(
+        out,
+        false,
+        std::vector<std::shared_ptr<Node>> {x, gamma, beta},
+        Deep::gradFn::batchNormBackward
+    )};
+    retPtr->savedTensors = {mean, invStd, Eigen::MatrixXd::Constant(1, 1, computeStats ? 1.0 : 0.0)};
+    return retPtr;
+}
+}
+
+std::shared_ptr<Node> batchNorm(std::shared_ptr<Node> x, std::shared_ptr<Node> gamma, std::shared_ptr<Node> beta,
+    Eigen::MatrixXd &batchMean, Eigen::MatrixXd &batchVar, double eps)
+{
+    return normalizeColumns(x, gamma, beta, batchMean, batchVar, true, eps);
+}
+
+std::shared_ptr<Node> batchNormEval(std::shared_ptr<Node> x, std::shared_ptr<Node> gamma, std::shared_ptr<Node> beta,
+    const Eigen::MatrixXd &mean, const Eigen::MatrixXd &var, double eps)
+{
+    Eigen::MatrixXd meanCopy { mean };
+    Eigen::MatrixXd varCopy { var };
+    return normalizeColumns(x, gamma, beta, meanCopy, varCopy, false, eps);
+}
+
+std::shared_ptr<Node> CrossEntropy(std::shared_ptr<Node> logits, const Eigen::MatrixXd &labels)
+{
+    logits->materialize();
+    const Eigen::MatrixXd &x { logits->data };
+    assert(labels.rows() == x.rows() && labels.cols() == 1);
+    for (Eigen::Index i=0; i<labels.rows(); ++i)
+    {
+        if (labels(i, 0) < 0 || labels(i, 0) >= static_cast<double>(x.cols()) 
+            || labels(i, 0) != std::floor(labels(i, 0)))
+            throw std::invalid_argument("Labels must be class indices in [0, number of columns).");
+    }
+    /* Stable log-sum-exp per row, max(x) + log(sum(exp(x - max(x)))).
+    Its rows are kept for the backward, which rebuilds the softmax from them. */
+    Eigen::MatrixXd logSumExp(x.rows(), 1);
+    const double nllSum { Parallel::parallelSum(x.rows(), 2 * x.cols(), [&](Eigen::Index begin, Eigen::Index end){
+        const Eigen::Index n { end - begin };
+        const Eigen::VectorXd rowMax { x.middleRows(begin, n).rowwise().maxCoeff() };
+        logSumExp.middleRows(begin, n) = rowMax.array() 
+            + (x.middleRows(begin, n).colwise() - rowMax).array().exp().rowwise().sum().log();
+        double partial { 0.0 };
+        for (Eigen::Index i=begin; i<end; ++i)
+            partial += logSumExp(i, 0) - x(i, static_cast<Eigen::Index>(labels(i, 0)));
+        return partial;
+    }) };
+    Eigen::MatrixXd result(1,1);
+    result << nllSum / static_cast<double>(x.rows());
+    std::shared_ptr<Node> retPtr {std::make_shared<Node>(
+        result,
+        false,
+        std::vector<std::shared_ptr<Node>> {logits},
+        Deep::gradFn::crossEntropyBackward
+    )};
+    retPtr->savedTensors = {labels, logSumExp};
+    return retPtr;
+}
+
+std::shared_ptr<Node> embedding(std::shared_ptr<Node> table, const Eigen::MatrixXd &ids)
+{
+    table->materialize();
+    const Eigen::MatrixXd &E { table->data };
+    const Eigen::Index D { E.rows() };
+    for (Eigen::Index i=0; i<ids.size(); ++i)
+    {
+        const double id { ids.data()[i] };
+        if (id < 0 || id >= static_cast<double>(E.cols()) || id != std::floor(id))
+            throw std::invalid_argument("Ids must be indices in [0, number of embeddings).");
+    }
+    Eigen::MatrixXd newData(ids.rows(), ids.cols() * D);
+    Parallel::parallelFor(ids.rows(), ids.cols() * D, [&](Eigen::Index begin, Eigen::Index end){
+        for (Eigen::Index j=0; j<ids.cols(); ++j)
+        {
+            for (Eigen::Index b=begin; b<end; ++b)
+                newData.block(b, j * D, 1, D) = E.col(static_cast<Eigen::Index>(ids(b, j))).transpose();
+        }
+    });
+    std::shared_ptr<Node> retPtr {std::make_shared<Node>(
+        newData,
+        false,
+        std::vector<std::shared_ptr<Node>> {table},
+        Deep::gradFn::embeddingBackward
+    )};
+    retPtr->savedTensors = {ids};
+    return retPtr;
+}
+
+}
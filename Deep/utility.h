@@ -1,4 +1,7 @@
-/* Functions such as Batchnorm, Maxpool, so on, are defined here. 
+/* Functions such as Batchnorm, so on, are defined here, convolution
+and pooling live in cnn.h. 
+Under a Fusion::LazyGuard, +, -, relu and their in-place variants
+return deferred nodes, see fusion.h.
 */
 #ifndef UTILITY_H
 #define UTILITY_H
@@ -14,6 +17,14 @@ std::shared_ptr<Node> operator*(std::shared_ptr<Node> a, std::shared_ptr<Node> b
 std::shared_ptr<Node> operator+(std::shared_ptr<Node> a, std::shared_ptr<Node> b);
 /* Overload Matrix Subtraction */
 std::shared_ptr<Node> operator-(std::shared_ptr<Node> a, std::shared_ptr<Node> b);
+/* In-place variants, the result takes over the buffer of a, which must
+be a temporary not used afterwards: they throw std::invalid_argument if
+anything else holds a, pass std::move(a) to give up a variable. Ops
+later reading a node whose data was taken throw std::runtime_error, so
+does backward if a saved input has been overwritten meanwhile. */
+std::shared_ptr<Node> add_(std::shared_ptr<Node> a, std::shared_ptr<Node> b);
+std::shared_ptr<Node> sub_(std::shared_ptr<Node> a, std::shared_ptr<Node> b);
+std::shared_ptr<Node> relu_(std::shared_ptr<Node> a);
 /* Overload Transpose */  
 std::shared_ptr<Node> transpose(std::shared_ptr<Node> a);
 /* Overload ReLU */
@@ -22,10 +33,32 @@ std::shared_ptr<Node> relu(std::shared_ptr<Node> a);
 std::shared_ptr<Node> sum(std::shared_ptr<Node> a);
 /* Affine transformation b + x * W. */
 std::shared_ptr<Node> affine(std::shared_ptr<Node> b, std::shared_ptr<Node> x, std::shared_ptr<Node> W);
+/* Affine transformation b + x * W^T with W stored [out_c, in_c] like the
+FullyConnected weights. Its column-major storage is W^T in row-major, which
+the GEMM reads in place, so no transposed copy is made, nor differentiated. */
+std::shared_ptr<Node> affineT(std::shared_ptr<Node> b, std::shared_ptr<Node> x, std::shared_ptr<Node> W);
 /* Mean Square Error, return a scalar (1,1) matrix. */
 std::shared_ptr<Node> MSE(std::shared_ptr<Node> a, std::shared_ptr<Node> b);
 /* Overload Mean Square Error, return a scalar (1,1) matrix. */
 std::shared_ptr<Node> MSE(std::shared_ptr<Node> a, Eigen::MatrixXd b);
+/* Batch normalization of the columns of x [B, C], gamma * xhat + beta
+with gamma and beta [C, 1]. Mean and biased variance of every column
+are computed in a single pass over the batch and written to batchMean
+and batchVar [C, 1]. Throws std::invalid_argument if B < 2. */
+std::shared_ptr<Node> batchNorm(std::shared_ptr<Node> x, std::shared_ptr<Node> gamma, std::shared_ptr<Node> beta,
+    Eigen::MatrixXd &batchMean, Eigen::MatrixXd &batchVar, double eps = 1e-5);
+/* Same normalization with given statistics, such as running ones. */
+std::shared_ptr<Node> batchNormEval(std::shared_ptr<Node> x, std::shared_ptr<Node> gamma, std::shared_ptr<Node> beta,
+    const Eigen::MatrixXd &mean, const Eigen::MatrixXd &var, double eps = 1e-5);
+/* Softmax followed by the mean negative log likelihood, return a scalar (1,1) matrix.
+logits is [B, C], labels is [B, 1] holding class indices in [0, C). */
+std::shared_ptr<Node> CrossEntropy(std::shared_ptr<Node> logits, const Eigen::MatrixXd &labels);
+/* Lookup of the columns of table [D, V] at ids [B, k], holding indices in
+[0, V): row b of the [B, k * D] output is the columns ids(b, 0), ...,
+ids(b, k - 1) side by side. If table has a sparse gradient (see
+Node::setSparseGradient), the backward only records the columns that
+were read. Throws std::invalid_argument for other ids. */
+std::shared_ptr<Node> embedding(std::shared_ptr<Node> table, const Eigen::MatrixXd &ids);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,423 @@
+// Benchmarks of the inference and training paths against their baselines
+// on the Wine Quality regressor trained by ./firstModel, or on random data.
+// Each flag runs one comparison, e.g. ./benchmark --quantize --graph.
+#include "../Deep/utility.h"
+#include "../Deep/base.h"
+#include "../Deep/nn.h"
+#include "../Deep/optimizer.h"
+#include "../Deep/data.h"
+#include "../Deep/quantize.h"
+#include "../Deep/trace.h"
+#include "../Deep/prune.h"
+#include "../Deep/graph.h"
+#include "../Deep/half.h"
+#include "../Deep/eval.h"
+#include "../Deep/ensemble.h"
+#include "../Deep/rnn.h"
+#include "../Deep/attention.h"
+#include "../Deep/parallel.h"
+#include "common.h"
+#include <Eigen/Dense>
+#include <iostream>
+#include <cassert>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+
+using Deep::Data::loadData;
+using Deep::Data::DataLoader1D;
+
+/* Average wall time of fn over repeats calls, in seconds. */
+template <typename Fn>
+double secondsPerCall(int repeats, Fn &&fn)
+{
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (int i=0; i<repeats; ++i)
+        fn();
+    auto t2 = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(t2 - t1).count() / repeats;
+}
+
+std::unordered_map<std::string, double> test(MyReg &model, std::vector<Eigen::MatrixXd> dataset)
+{
+    return Deep::Eval::evaluate(model, dataset[0], dataset[1], evalOptions()).summary();
+}
+
+void compareEval(MyReg &model, std::vector<Eigen::MatrixXd> testDataset, int rows)
+{
+    // A large holdout set made of copies of the test set.
+    const Eigen::Index copies { std::max<Eigen::Index>(1, rows / testDataset[0].rows()) };
+    const Eigen::MatrixXd features { testDataset[0].replicate(copies, 1) };
+    const Eigen::MatrixXd labels { testDataset[1].replicate(copies, 1) };
+    Deep::Eval::EvalOptions serial { evalOptions() };
+    serial.numShards = 1;
+    const Deep::Eval::Metrics one { Deep::Eval::evaluate(model, features, labels, serial) };
+    const Deep::Eval::Metrics sharded { Deep::Eval::evaluate(model, features, labels, evalOptions()) };
+    std::cout << "Evaluated " << sharded.rows << " rows: " << one.rowsPerSecond() << " rows/s on 1 shard, "
+        << sharded.rowsPerSecond() << " rows/s on " << Deep::Parallel::getNumThreads() << " shards ("
+        << one.seconds / sharded.seconds << "x), same metrics: "
+        << (one.correct == sharded.correct && one.confusion == sharded.confusion ? "yes" : "no") << ".\n";
+}
+
+double forwardSeconds(MyReg &model, const Eigen::MatrixXd &features, int repeats = 200)
+{
+    // Average wall time of a forward pass over the whole feature matrix.
+    return secondsPerCall(repeats, [&]{
+        NSP in { std::make_shared<Deep::Node>(features) };
+        NSP out { model.forward(in) };
+    });
+}
+
+void compareQuantized(MyReg &model, std::vector<Eigen::MatrixXd> testDataset, std::string modelPath)
+{
+    MyReg quantModel {};
+    quantModel.loadStateDict(modelPath);
+    // Weight memory of the double precision path.
+    size_t doubleBytes { 0 };
+    for (auto it=quantModel.layers.begin(); it!=quantModel.layers.end(); ++it)
+        doubleBytes += static_cast<size_t>(it->second->params()[0]->data.size()) * sizeof(double);
+
+    // Calibrate on a random batch of the training set.
+    std::vector<Eigen::MatrixXd> trainDataset {loadData("./datasets/winequality/winequality-white-train.csv")};
+    DataLoader1D calibrationLoader(trainDataset, 512, true);
+    Deep::Quant::quantizeModel(quantModel, calibrationLoader.nextBatch()[0]);
+    size_t quantBytes { 0 };
+    size_t scaleBytes { 0 };
+    for (auto it=quantModel.layers.begin(); it!=quantModel.layers.end(); ++it)
+    {
+        Deep::Quant::QuantizedFullyConnected *layer { 
+            static_cast<Deep::Quant::QuantizedFullyConnected*>(it->second.get()) 
+        };
+        quantBytes += layer->weightBytes();
+        scaleBytes += layer->scaleBytes();
+    }
+
+    std::unordered_map<std::string, double> base { test(model, testDataset) };
+    std::unordered_map<std::string, double> quant { test(quantModel, testDataset) };
+    std::cout << "Int8 accuracy is " << quant["accuracy"] << "% (delta " 
+        << quant["accuracy"] - base["accuracy"] << ").\n";
+    std::cout << "Int8 accuracy (Off By One) is " << quant["accuracyOffOne"] << "% (delta " 
+        << quant["accuracyOffOne"] - base["accuracyOffOne"] << ").\n";
+    const double doubleTime { forwardSeconds(model, testDataset[0]) };
+    const double int8Time { forwardSeconds(quantModel, testDataset[0]) };
+    std::cout << "Forward over the test set takes " << doubleTime << "s in double, " 
+        << int8Time << "s in int8 (" << doubleTime / int8Time << "x speedup).\n";
+    // Same comparison restricted to the layers, on their traced inputs.
+    for (const Deep::TracedLayer &t: Deep::traceSequential(model, testDataset[0]))
+    {
+        Deep::Quant::QuantizedFullyConnected *layer { 
+            static_cast<Deep::Quant::QuantizedFullyConnected*>(quantModel.layers[t.name].get()) 
+        };
+        NSP in { std::make_shared<Deep::Node>(t.input) };
+        const double doubleLayerTime { secondsPerCall(200, [&]{ model.layers[t.name]->forward(in); }) };
+        const double int8LayerTime { secondsPerCall(200, [&]{ layer->forward(t.input); }) };
+        std::cout << '\t' << t.name << ": " << doubleLayerTime / int8LayerTime << "x speedup.\n";
+    }
+    std::cout << "Weights take " << doubleBytes << " bytes in double, " << quantBytes 
+        << " bytes quantized, kept as padded int16 rows (" << static_cast<double>(doubleBytes) / static_cast<double>(quantBytes) 
+        << "x smaller) plus " << scaleBytes << " bytes of per-channel scales.\n";
+}
+
+void compareSparse(MyReg &model, std::vector<Eigen::MatrixXd> testDataset, std::string modelPath, double sparsity)
+{
+    MyReg sparseModel {};
+    sparseModel.loadStateDict(modelPath);
+    // One-shot pruning when the stored model is not sparse enough yet.
+    if (sparsity > Deep::Prune::weightSparsity(sparseModel))
+        Deep::Prune::magnitudePrune(sparseModel, sparsity);
+    std::cout << "Weight sparsity is " << 100.0 * Deep::Prune::weightSparsity(sparseModel) << "%.\n";
+    std::unordered_map<std::string, double> base { test(model, testDataset) };
+    [[maybe_unused]] std::unordered_map<std::string, double> pruned { test(sparseModel, testDataset) };
+    Deep::Prune::sparsifyModel(sparseModel);
+    std::unordered_map<std::string, double> sparse { test(sparseModel, testDataset) };
+    assert(std::abs(sparse["accuracy"] - pruned["accuracy"]) < 1e-9);
+    std::cout << "Sparse accuracy is " << sparse["accuracy"] << "% (delta " 
+        << sparse["accuracy"] - base["accuracy"] << ").\n";
+    std::cout << "Sparse accuracy (Off By One) is " << sparse["accuracyOffOne"] << "% (delta " 
+        << sparse["accuracyOffOne"] - base["accuracyOffOne"] << ").\n";
+    const double denseTime { forwardSeconds(model, testDataset[0]) };
+    const double sparseTime { forwardSeconds(sparseModel, testDataset[0]) };
+    std::cout << "Forward over the test set takes " << denseTime << "s dense, " 
+        << sparseTime << "s sparse (" << denseTime / sparseTime << "x speedup).\n";
+}
+
+void compareFixed(MyReg &model, std::vector<Eigen::MatrixXd> testDataset)
+{
+    // Heap allocated once, inference itself does not allocate.
+    std::unique_ptr<FixedMyReg> fixedModel { new FixedMyReg() };
+    Deep::Fixed::loadFixedMLP(*fixedModel, model);
+    const Eigen::MatrixXd &features { testDataset[0] };
+    const int rows { static_cast<int>(features.rows()) };
+    Eigen::VectorXd dynamicOut(rows);
+    Eigen::VectorXd fixedOut(rows);
+
+    // One call per row, in microseconds.
+    int i { 0 };
+    const double dynamicTime { 1e6 * secondsPerCall(rows, [&]{
+        NSP in { std::make_shared<Deep::Node>(features.row(i)) };
+        dynamicOut(i) = model.forward(in)->data(0, 0);
+        ++i;
+    }) };
+    i = 0;
+    const double fixedTime { 1e6 * secondsPerCall(rows, [&]{
+        FixedMyReg::Input x { features.row(i).transpose() };
+        fixedOut(i) = fixedModel->forward(x)(0);
+        ++i;
+    }) };
+    std::cout << "Batch-1 inference takes " << dynamicTime << "us per row dynamic, " 
+        << fixedTime << "us per row fixed (" << dynamicTime / fixedTime << "x speedup), "
+        << "max difference " << (dynamicOut - fixedOut).cwiseAbs().maxCoeff() << ".\n";
+}
+
+void compareGraph(MyReg &model, std::vector<Eigen::MatrixXd> testDataset)
+{
+    const Eigen::MatrixXd &features { testDataset[0] };
+    NSP in { std::make_shared<Deep::Node>(features) };
+    NSP out { model.forward(in) };
+    Deep::Graph::CapturedGraph graph({in}, {out});
+    std::cout << "Captured " << graph.size() << " nodes, optimizing:\n";
+    Deep::Graph::PassManager::defaultPipeline().run(graph, true);
+    const double eagerTime { forwardSeconds(model, features) };
+    const double graphTime { secondsPerCall(200, [&]{ graph.run(features); }) };
+    std::cout << "Forward over the test set takes " << eagerTime << "s eager, " 
+        << graphTime << "s optimized graph (" << eagerTime / graphTime << "x speedup), "
+        << "max difference " << (graph.run(features) - out->data).cwiseAbs().maxCoeff() << ".\n";
+}
+
+void compareHalf(MyReg &model, std::vector<Eigen::MatrixXd> testDataset, std::string modelPath)
+{
+    const Eigen::MatrixXd &features { testDataset[0] };
+    const Eigen::MatrixXd doubleOut { model.forward(std::make_shared<Deep::Node>(features))->data };
+    std::unordered_map<std::string, double> base { test(model, testDataset) };
+    const double doubleTime { forwardSeconds(model, features) };
+    size_t doubleBytes { 0 };
+    for (auto it=model.layers.begin(); it!=model.layers.end(); ++it)
+        doubleBytes += static_cast<size_t>(it->second->params()[0]->data.size()) * sizeof(double);
+    for (Deep::Half::Format format: {Deep::Half::Format::bf16, Deep::Half::Format::fp16})
+    {
+        MyReg halfModel {};
+        halfModel.loadStateDict(modelPath);
+        Deep::Half::convertModel(halfModel, format);
+        size_t halfBytes { 0 };
+        for (auto it=halfModel.layers.begin(); it!=halfModel.layers.end(); ++it)
+            halfBytes += static_cast<Deep::Half::HalfFullyConnected*>(it->second.get())->weightBytes();
+        std::unordered_map<std::string, double> half { test(halfModel, testDataset) };
+        const Eigen::MatrixXd halfOut { halfModel.forward(std::make_shared<Deep::Node>(features))->data };
+        const double halfTime { forwardSeconds(halfModel, features) };
+        const char *name { Deep::Half::ToString(format) };
+        std::cout << name << " accuracy is " << half["accuracy"] << "% (delta " 
+            << half["accuracy"] - base["accuracy"] << "), off by one " << half["accuracyOffOne"] 
+            << "% (delta " << half["accuracyOffOne"] - base["accuracyOffOne"] << "), "
+            << "max difference " << (halfOut - doubleOut).cwiseAbs().maxCoeff() << ".\n";
+        std::cout << "\tForward over the test set takes " << doubleTime << "s in double, " 
+            << halfTime << "s in " << name << " (" << doubleTime / halfTime << "x speedup), weights take "
+            << halfBytes << " bytes (" << static_cast<double>(doubleBytes) / static_cast<double>(halfBytes) 
+            << "x smaller).\n";
+    }
+}
+
+void compareEnsemble(std::vector<Eigen::MatrixXd> testDataset, std::string modelPath, int numMembers)
+{
+    // Stand-ins for models trained with different seeds: the trained
+    // model with seeded noise on its parameters.
+    std::vector<std::unique_ptr<MyReg>> owned {};
+    std::vector<Deep::Model*> members {};
+    std::normal_distribution<double> noise(0.0, 0.01);
+    for (int k=0; k<numMembers; ++k)
+    {
+        owned.push_back(std::unique_ptr<MyReg>(new MyReg()));
+        owned.back()->loadStateDict(modelPath);
+        Deep::gen.seed(static_cast<unsigned>(k));
+        for (NSP &p: owned.back()->parameters())
+            p->data = p->data.unaryExpr([&noise](double w){ return w + noise(Deep::gen); });
+        members.push_back(owned.back().get());
+    }
+    const Eigen::MatrixXd &features { testDataset[0] };
+    Deep::Ensemble::StackedEnsemble ensemble(members, features);
+
+    Eigen::MatrixXd separate { Eigen::MatrixXd::Zero(features.rows(), 1) };
+    double separateTime { 0.0 };
+    for (const std::unique_ptr<MyReg> &member: owned)
+    {
+        separate += member->forward(std::make_shared<Deep::Node>(features))->data / static_cast<double>(numMembers);
+        separateTime += forwardSeconds(*member, features);
+    }
+    const double stackedTime { secondsPerCall(200, [&]{ ensemble.forwardMean(features); }) };
+    const Deep::Eval::Metrics result { Deep::Eval::evaluate(ensemble, features, testDataset[1], evalOptions()) };
+    std::cout << "Ensemble of " << numMembers << " accuracy is " << result.accuracy() << "%, off by one "
+        << result.accuracyOffOne() << "%, MSE " << result.mse() << ".\n";
+    std::cout << "\tForward over the test set takes " << separateTime << "s for separate models, "
+        << stackedTime << "s stacked (" << separateTime / stackedTime << "x speedup), max difference "
+        << (ensemble.forwardMean(features) - separate).cwiseAbs().maxCoeff() << ".\n";
+    // Single-row requests, as served.
+    const Eigen::MatrixXd row { features.topRows(1) };
+    double separateRowTime { 0.0 };
+    for (const std::unique_ptr<MyReg> &member: owned)
+        separateRowTime += forwardSeconds(*member, row, 20000);
+    const double stackedRowTime { secondsPerCall(20000, [&]{ ensemble.forwardMean(row); }) };
+    std::cout << "\tForward of a single row takes " << separateRowTime << "s for separate models, "
+        << stackedRowTime << "s stacked (" << separateRowTime / stackedRowTime << "x speedup).\n";
+}
+
+void compareEmbedding(int vocab)
+{
+    // Training steps of an embedding table against random targets, with a
+    // sparse gradient and with a dense table-sized one.
+    const int dim { 32 };
+    const Eigen::Index batch { 64 };
+    std::uniform_int_distribution<int> idDis(0, vocab - 1);
+    const Eigen::MatrixXd ids { Eigen::MatrixXd::NullaryExpr(batch, 1, [&](){ return idDis(Deep::gen); }) };
+    const Eigen::MatrixXd target { Eigen::MatrixXd::Random(batch, dim) };
+    NSP in { std::make_shared<Deep::Node>(ids) };
+    auto stepSeconds = [&](bool sparse){
+        Deep::Embedding table(vocab, dim, sparse);
+        Deep::Optim::SGD optimizer(std::vector<std::pair<std::string, NSP>> {{"weights", table.weights}}, 0.1);
+        return secondsPerCall(200, [&]{
+            optimizer.zeroGrad();
+            Deep::MSE(table.forward(in), target)->backward();
+            optimizer.step();
+        });
+    };
+    const double sparseTime { stepSeconds(true) };
+    const double denseTime { stepSeconds(false) };
+    std::cout << "Embedding of " << vocab << " ids, " << dim << " dimensions, a training step on " << batch
+        << " ids takes " << denseTime << "s with a dense gradient, " << sparseTime << "s with a sparse one ("
+        << denseTime / sparseTime << "x speedup).\n";
+}
+
+void compareRecurrent(int steps)
+{
+    // Training steps of LSTM and GRU layers on random sequences, every
+    // sequence is a single node of the graph whatever its length.
+    const int batch { 64 };
+    const int features { 32 };
+    const int hidden { 64 };
+    NSP in { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(batch, steps * features)) };
+    const Eigen::MatrixXd target { Eigen::MatrixXd::Random(batch, steps * hidden) };
+    auto stepSeconds = [&](Deep::RecurrentLayer &layer){
+        std::vector<std::pair<std::string, NSP>> params {};
+        for (const NSP &p: layer.params())
+            params.push_back({std::to_string(params.size()), p});
+        Deep::Optim::SGD optimizer(params, 0.01);
+        return secondsPerCall(20, [&]{
+            optimizer.zeroGrad();
+            Deep::MSE(layer.forward(in), target)->backward();
+            optimizer.step();
+        });
+    };
+    Deep::LSTM lstm(features, hidden);
+    Deep::GRU gru(features, hidden);
+    const double lstmTime { stepSeconds(lstm) };
+    const double gruTime { stepSeconds(gru) };
+    const double tokens { static_cast<double>(batch) * steps };
+    std::cout << "Recurrent training step on " << batch << " sequences of " << steps << " steps, "
+        << features << " features, " << hidden << " hidden: LSTM " << lstmTime << "s ("
+        << tokens / lstmTime << " steps/s), GRU " << gruTime << "s (" << tokens / gruTime << " steps/s).\n";
+}
+
+void compareAttention(int length)
+{
+    // Self-attention over random sequences, tiled against the whole [L, L]
+    // scores of every head computed with plain Eigen.
+    const int batch { 4 };
+    const int embed { 64 };
+    const int heads { 4 };
+    const int d { embed / heads };
+    Deep::MultiHeadAttention attention(embed, heads);
+    NSP in { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(batch, length * embed)) };
+    const Eigen::MatrixXd target { Eigen::MatrixXd::Random(batch, length * embed) };
+    const int repeats { 5 };
+    const double tiledTime { secondsPerCall(repeats, [&]{
+        Deep::NoGradGuard guard {};
+        attention.forward(in);
+    }) };
+    const double trainTime { secondsPerCall(repeats, [&]{ Deep::MSE(attention.forward(in), target)->backward(); }) };
+
+    Eigen::MatrixXd output(batch, length * embed);
+    const double fullTime { secondsPerCall(repeats, [&]{
+        for (int b=0; b<batch; ++b)
+        {
+            Eigen::MatrixXd tokens(length, embed);
+            for (int t=0; t<length; ++t)
+                tokens.row(t) = in->data.block(b, t * embed, 1, embed);
+            const Eigen::MatrixXd qkv { (tokens * attention.weightsIn->data.transpose()).rowwise()
+                + attention.biasesIn->data.col(0).transpose() };
+            Eigen::MatrixXd concatenated(length, embed);
+            for (int h=0; h<heads; ++h)
+            {
+                Eigen::MatrixXd scores { qkv.middleCols(h * d, d) * qkv.middleCols(embed + h * d, d).transpose()
+                    / std::sqrt(static_cast<double>(d)) };
+                scores = (scores.colwise() - scores.rowwise().maxCoeff()).array().exp();
+                scores = scores.array().colwise() / scores.rowwise().sum().array();
+                concatenated.middleCols(h * d, d) = scores * qkv.middleCols(2 * embed + h * d, d);
+            }
+            const Eigen::MatrixXd y { (concatenated * attention.weightsOut->data.transpose()).rowwise()
+                + attention.biasesOut->data.col(0).transpose() };
+            for (int t=0; t<length; ++t)
+                output.block(b, t * embed, 1, embed) = y.row(t);
+        }
+    }) };
+    std::cout << "Attention over " << batch << " sequences of " << length << " tokens, " << embed << " features, "
+        << heads << " heads: forward takes " << fullTime << "s with the whole scores ("
+        << static_cast<double>(length) * length * 8 / 1e6 << " MB per head), " << tiledTime
+        << "s tiled (" << 64.0 * 64 * 8 / 1e3 << " KB tiles), forward and backward take " << trainTime << "s, "
+        << "max difference " << (output - attention.forward(in)->data).cwiseAbs().maxCoeff() << ".\n";
+}
+
+std::unordered_map<std::string, std::string> simpleParser(int argc, char **argv)
+{
+    std::unordered_map<std::string, std::string> ret {parseArguments(argc, argv)};
+    // Every benchmark is off unless asked for.
+    for (const char *flag: {"quantize", "sparse", "fixed", "graph", "half", "eval-bench",
+        "ensemble", "embedding", "recurrent", "attention"})
+    {
+        if (ret.find(flag) == ret.end())
+            ret[flag] = "false";
+    }
+    if (ret.find("sparsity") == ret.end())
+        ret["sparsity"] = "0";
+    if (ret.find("eval-rows") == ret.end())
+        ret["eval-rows"] = "1000000";
+    if (ret.find("members") == ret.end())
+        ret["members"] = "8";
+    if (ret.find("vocab") == ret.end())
+        ret["vocab"] = "100000";
+    if (ret.find("steps") == ret.end())
+        ret["steps"] = "100";
+    if (ret.find("length") == ret.end())
+        ret["length"] = "1024";
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    std::unordered_map<std::string, std::string> args {simpleParser(argc, argv)};
+    std::vector<Eigen::MatrixXd> testDataset{loadData("./datasets/winequality/winequality-white-test.csv")};
+    const std::string modelPath {"./models/cpp-model.json"};
+    MyReg model {};
+    model.loadStateDict(modelPath);
+    if (args["quantize"] == "true")
+        compareQuantized(model, testDataset, modelPath);
+    if (args["sparse"] == "true")
+        compareSparse(model, testDataset, modelPath, std::stod(args["sparsity"]));
+    if (args["fixed"] == "true")
+        compareFixed(model, testDataset);
+    if (args["graph"] == "true")
+        compareGraph(model, testDataset);
+    if (args["half"] == "true")
+        compareHalf(model, testDataset, modelPath);
+    if (args["eval-bench"] == "true")
+        compareEval(model, testDataset, std::stoi(args["eval-rows"]));
+    if (args["ensemble"] == "true")
+        compareEnsemble(testDataset, modelPath, std::stoi(args["members"]));
+    if (args["embedding"] == "true")
+        compareEmbedding(std::stoi(args["vocab"]));
+    if (args["recurrent"] == "true")
+        compareRecurrent(std::stoi(args["steps"]));
+    if (args["attention"] == "true")
+        compareAttention(std::stoi(args["length"]));
+    return 0;
+}
@@ -0,0 +1,107 @@
+// Shared pieces of the executables built from tests/: 
+// the wine quality regressor and a simple command line parser.
+#ifndef TESTS_COMMON_H
+#define TESTS_COMMON_H
+#include "../Deep/base.h"
+#include "../Deep/nn.h"
+#include "../Deep/utility.h"
+#include "../Deep/fixed.h"
+#include "../Deep/eval.h"
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+
+#define PTR_LAYER(DERIVED) std::unique_ptr<Deep::Layer>(new DERIVED)
+
+// Node Shared Pointer
+using NSP = std::shared_ptr<Deep::Node>;
+
+class MyReg: public Deep::Model
+{
+    public:
+        MyReg()
+        {
+            // Add layers
+            layers["fc1"] = PTR_LAYER(Deep::FullyConnected(11,64));
+            layers["fc2"] = PTR_LAYER(Deep::FullyConnected(64,64));
+            layers["fc3"] = PTR_LAYER(Deep::FullyConnected(64,32));
+            layers["fc4"] = PTR_LAYER(Deep::FullyConnected(32,1));
+        }
+        NSP forward(NSP in) override
+        {
+            // Forward pass, layer outputs are temporaries so ReLU can reuse them.
+            NSP x1 { Deep::relu_(layers["fc1"]->forward(in)) };
+            NSP x2 { Deep::relu_(layers["fc2"]->forward(x1)) };
+            NSP x3 { Deep::relu_(layers["fc3"]->forward(x2)) };
+            NSP y { layers["fc4"]->forward(x3) };
+            return y;
+        }
+
+};
+
+// Wine quality labels go from 3 to 9.
+inline Deep::Eval::EvalOptions evalOptions()
+{
+    Deep::Eval::EvalOptions options {};
+    options.minClass = 3;
+    options.maxClass = 9;
+    return options;
+}
+
+/* Compile-time shaped copy of MyReg for inference, see Deep/fixed.h. */
+using FixedMyReg = Deep::Fixed::FixedMLP<11, 64, 64, 32, 1>;
+
+/* Parse "--flag", "--no-flag" and "-key value" arguments, 
+no default values are provided here. */
+inline std::unordered_map<std::string, std::string> parseArguments(int argc, char **argv)
+{
+    std::vector<std::vector<std::string>> argPairs {};
+    for (int i=1; i<argc; ++i)
+    {
+        // Record double-hyphen argument
+        if (std::string(argv[i]).substr(0, 2) == "--")
+        {
+            argPairs.push_back({std::string(argv[i])});
+        }
+        else if (argv[i][0] == '-' && (i<argc-1))
+        {
+            argPairs.push_back({std::string(argv[i]), std::string(argv[i+1])});
+            ++i;
+        }
+        else
+        {
+            throw std::invalid_argument("Arguments are not valid. ");
+        }
+    }
+    std::unordered_map<std::string, std::string> ret {};
+    for (auto p: argPairs)
+    {
+        if (p.size() == 1)
+        {
+            // boolean flag
+            std::string flag { p[0] };
+            if (flag.length() >=5 && flag.substr(0,5) == "--no-")
+            {
+                ret[flag.substr(5)] = "false";
+            }
+            else
+            {
+                ret[flag.substr(2)] = "true";
+            }
+        }
+        else if (p.size() == 2) 
+        {   
+            // flag with value.
+            ret[p[0].substr(1)] = p[1];
+        }
+        else
+        {
+            throw std::invalid_argument("Parsing 3 or more arguments is not implemented yet.");
+        }
+    }
+    return ret;
+}
+
+#endif
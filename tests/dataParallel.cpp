@@ -0,0 +1,169 @@
+// Data-parallel training of the wine quality regressor over processes.
+// Without -rank, the launcher starts ranks 1 to world - 1 as child
+// processes of this executable and runs rank 0 itself. Every rank trains
+// a replica on its shard of the training set, gradients are averaged by
+// a ring all-reduce over shared memory (-backend shm) or TCP (-backend tcp),
+// so the replicas stay identical, and rank 0 saves the model for ./firstModel.
+#define NDEBUG
+#include "../Deep/base.h"
+#include "../Deep/utility.h"
+#include "../Deep/optimizer.h"
+#include "../Deep/data.h"
+#include "../Deep/distributed.h"
+#include "common.h"
+#include <Eigen/Dense>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+using Deep::Data::DataLoader1D;
+
+std::unordered_map<std::string, std::string> dataParallelParser(int argc, char **argv)
+{
+    std::unordered_map<std::string, std::string> ret {parseArguments(argc, argv)};
+    // Provide default arguments
+    if (ret.find("world") == ret.end())
+        ret["world"] = "2";
+    if (ret.find("backend") == ret.end())
+        ret["backend"] = "shm";
+    if (ret.find("port") == ret.end())
+        ret["port"] = "29500";
+    if (ret.find("host") == ret.end())
+        ret["host"] = "127.0.0.1";
+    if (ret.find("epochs") == ret.end())
+        ret["epochs"] = "20";
+    if (ret.find("lr") == ret.end())
+        ret["lr"] = "0.00005";
+    if (ret.find("bs") == ret.end())
+        ret["bs"] = "64";
+    if (ret.find("seed") == ret.end())
+        ret["seed"] = "0";
+    return ret;
+}
+
+/* Start ranks 1 to world - 1 with the same arguments plus -rank, -run and -nonce. */
+std::vector<pid_t> launchRanks(int argc, char **argv, int world, const std::string &run, const std::string &nonce)
+{
+    std::vector<pid_t> children {};
+    for (int rank=1; rank<world; ++rank)
+    {
+        std::vector<std::string> args(argv, argv + argc);
+        args.insert(args.end(), {"-rank", std::to_string(rank), "-run", run, "-nonce", nonce});
+        std::vector<char*> childArgv {};
+        for (std::string &arg: args)
+            childArgv.push_back(&arg[0]);
+        childArgv.push_back(nullptr);
+        pid_t pid;
+        if (posix_spawn(&pid, argv[0], nullptr, nullptr, childArgv.data(), environ) != 0)
+            throw std::runtime_error("Cannot start rank " + std::to_string(rank));
+        children.push_back(pid);
+    }
+    return children;
+}
+
+int trainRank(std::unordered_map<std::string, std::string> args, int rank)
+{
+    const int world { std::stoi(args["world"]) };
+    const int epochs { std::stoi(args["epochs"]) };
+    const int bs { std::stoi(args["bs"]) };
+    const double lr { std::stod(args["lr"]) };
+    std::unique_ptr<Deep::Dist::Transport> transport {};
+    if (args["backend"] == "shm")
+    {
+        transport.reset(new Deep::Dist::SharedMemoryTransport("/deep-data-parallel-" + args["run"], rank, world,
+            std::stoull(args["nonce"])));
+    }
+    else if (args["backend"] == "tcp")
+        transport.reset(new Deep::Dist::TcpTransport(rank, world, std::stoi(args["port"]), args["host"]));
+    else
+        throw std::invalid_argument("Unknown backend " + args["backend"] + ", use shm or tcp.");
+    Deep::Dist::ProcessGroup group(std::move(transport));
+
+    // Rows rank, rank + world, ... of the training set, every rank runs
+    // the same number of steps per epoch, that of the smallest shard.
+    std::vector<Eigen::MatrixXd> all { Deep::Data::loadData("./datasets/winequality/winequality-white-train.csv") };
+    std::vector<int> indices {};
+    for (int i=rank; i<static_cast<int>(all[0].rows()); i+=world)
+        indices.push_back(i);
+    const int steps { std::max(1, static_cast<int>(all[0].rows()) / world / bs) };
+    // Replicas start from different weights on purpose, the broadcast aligns them.
+    Deep::gen.seed(static_cast<unsigned>(std::stoul(args["seed"])) + static_cast<unsigned>(rank));
+    MyReg model {};
+    group.broadcastParameters(model);
+    Deep::Optim::SGD optimizer(model.namedParameters(), lr);
+    DataLoader1D dl(Deep::Data::selectRows(all, indices), bs, true);
+
+    auto t1 = std::chrono::steady_clock::now();
+    for (int epoch = 1; epoch <= epochs; ++epoch)
+    {
+        std::vector<double> runningLoss { 0.0 };
+        for (int step=0; step<steps; ++step)
+        {
+            optimizer.zeroGrad();
+            std::vector<Eigen::MatrixXd> thisBatch {dl.nextBatch()};
+            NSP trainNode { std::make_shared<Deep::Node>(thisBatch[0]) };
+            NSP LPtr { Deep::MSE(model.forward(trainNode), thisBatch[1]) };
+            LPtr->backward();
+            group.allReduceGradients(model);
+            optimizer.step();
+            runningLoss[0] += LPtr->data(0,0);
+        }
+        dl.reInitialize();
+        group.allReduce(runningLoss);
+        if (rank == 0)
+            std::cout << "Training on epoch " << epoch << ": Loss is " << runningLoss[0] / (steps * world) << ".\n";
+    }
+    const double seconds { std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count() };
+
+    // Compare every replica with rank 0.
+    std::vector<double> local {};
+    for (const std::pair<std::string, NSP> &p: Deep::Dist::sortedParameters(model))
+        local.insert(local.end(), p.second->data.data(), p.second->data.data() + p.second->data.size());
+    std::vector<double> reference { local };
+    group.broadcast(reference);
+    std::vector<double> difference { 0.0 };
+    for (size_t i=0; i<local.size(); ++i)
+        difference[0] = std::max(difference[0], std::abs(local[i] - reference[i]));
+    group.allReduce(difference);
+    if (rank == 0)
+    {
+        std::cout << seconds / epochs << "s per epoch on " << world << " ranks (" << args["backend"]
+            << "), replicas differ by at most " << difference[0] << ".\n";
+        model.saveStateDict("./models/cpp-model.json");
+    }
+    return difference[0] == 0.0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    std::unordered_map<std::string, std::string> args {dataParallelParser(argc, argv)};
+    const int world { std::stoi(args["world"]) };
+    if (args.find("rank") != args.end())
+        return trainRank(args, std::stoi(args["rank"]));
+
+    // Launcher, rank 0 runs here.
+    args["run"] = std::to_string(getpid());
+    // Pids are reused, the nonce tells this run from a crashed one of the same name.
+    std::random_device seed {};
+    args["nonce"] = std::to_string((static_cast<uint64_t>(seed()) << 32) | seed());
+    std::vector<pid_t> children { launchRanks(argc, argv, world, args["run"], args["nonce"]) };
+    int status { trainRank(args, 0) };
+    for (pid_t child: children)
+    {
+        int childStatus { 0 };
+        waitpid(child, &childStatus, 0);
+        if (!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0)
+            status = 1;
+    }
+    return status;
+}
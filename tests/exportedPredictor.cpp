@@ -0,0 +1,63 @@
+// Evaluate the header written by ./firstModel --no-train --export on the
+// test set, using nothing but the standard library: no Eigen, no json, no
+// state dict to load. Build it after exporting with make exportedPredictor.
+#include "../models/cpp-model.h"
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv)
+{
+    const std::string path { argc > 1 ? argv[1] : "./datasets/winequality/winequality-white-test.csv" };
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "Cannot open " << path << ".\n";
+        return 1;
+    }
+    // Rows are index, 11 features, quality.
+    std::vector<double> features {};
+    std::vector<double> labels {};
+    std::string line;
+    std::getline(file, line); // ignore header
+    while (std::getline(file, line))
+    {
+        std::istringstream tokens(line);
+        std::string token;
+        std::getline(tokens, token, ',');
+        for (std::size_t j=0; j<wine::inputSize; ++j)
+        {
+            std::getline(tokens, token, ',');
+            features.push_back(std::stod(token));
+        }
+        std::getline(tokens, token, ',');
+        labels.push_back(std::stod(token));
+    }
+
+    const std::size_t rows { labels.size() };
+    std::vector<double> out(rows * wine::outputSize);
+    const int repeats { 200 };
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (int i=0; i<repeats; ++i)
+        wine::predict(features.data(), out.data(), rows);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    const double seconds { std::chrono::duration<double>(t2 - t1).count() / repeats };
+
+    std::size_t correct { 0 };
+    std::size_t correctOffOne { 0 };
+    for (std::size_t i=0; i<rows; ++i)
+    {
+        const double diff { std::abs(std::round(out[i]) - labels[i]) };
+        correct += diff < 0.5 ? 1 : 0;
+        correctOffOne += diff < 1.5 ? 1 : 0;
+    }
+    std::cout << "Accuracy is " << 100.0 * static_cast<double>(correct) / static_cast<double>(rows) << "%.\n";
+    std::cout << "Accuracy (Off By One) is " << 100.0 * static_cast<double>(correctOffOne) / static_cast<double>(rows) << "%.\n";
+    std::cout << "Forward over the test set takes " << seconds << "s, "
+        << static_cast<double>(rows) / seconds << " rows/s.\n";
+    return 0;
+}
@@ -0,0 +1,214 @@
+// Grid search over the training flags of ./firstModel (lr, bs, epochs).
+// The CSV is parsed once and shared read-only by every run, runs train
+// concurrently on a pool of threads, each with its own model, optimizer
+// and seeded generator, then are ranked by their validation loss.
+#define NDEBUG
+#include "../Deep/base.h"
+#include "../Deep/utility.h"
+#include "../Deep/optimizer.h"
+#include "../Deep/data.h"
+#include "../Deep/parallel.h"
+#include "common.h"
+#include <nlohmann/json.hpp>
+#include <Eigen/Dense>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <chrono>
+
+using Deep::Data::DataLoader1D;
+using Dataset = std::shared_ptr<const std::vector<Eigen::MatrixXd>>;
+
+struct RunConfig
+{
+    double lr;
+    int bs;
+    int epochs;
+    unsigned seed;
+};
+
+struct RunResult
+{
+    RunConfig config;
+    double trainLoss;
+    double validationLoss;
+    double accuracy;
+    double accuracyOffOne;
+    double seconds;
+};
+
+std::unordered_map<std::string, std::string> sweepParser(int argc, char **argv)
+{
+    std::unordered_map<std::string, std::string> ret {parseArguments(argc, argv)};
+    // Provide default arguments
+    if (ret.find("data") == ret.end())
+        ret["data"] = "./datasets/winequality/winequality-white-train.csv";
+    if (ret.find("lr") == ret.end())
+        ret["lr"] = "0.00002,0.00005,0.0001";
+    if (ret.find("bs") == ret.end())
+        ret["bs"] = "32,64,128";
+    if (ret.find("epochs") == ret.end())
+        ret["epochs"] = "20";
+    if (ret.find("validation") == ret.end())
+        ret["validation"] = "0.2";
+    if (ret.find("jobs") == ret.end())
+        ret["jobs"] = std::to_string(std::max(1u, std::thread::hardware_concurrency()));
+    if (ret.find("seed") == ret.end())
+        ret["seed"] = "0";
+    if (ret.find("report") == ret.end())
+        ret["report"] = "./models/sweep-report.json";
+    return ret;
+}
+
+/* Parse a comma separated list such as "32,64,128". */
+std::vector<double> parseList(const std::string &list)
+{
+    std::vector<double> ret {};
+    for (const std::string &token: Deep::Data::split(list))
+        ret.push_back(std::stod(token));
+    return ret;
+}
+
+/* Mean square error and rounded accuracies of model over dataset. */
+RunResult evaluate(MyReg &model, const Dataset &dataset, RunResult result)
+{
+    NSP in { std::make_shared<Deep::Node>((*dataset)[0]) };
+    const Eigen::MatrixXd prediction { model.forward(in)->data };
+    const Eigen::ArrayXd diff { (prediction - (*dataset)[1]).array() };
+    const Eigen::ArrayXd roundedDiff { (prediction.array().round() - (*dataset)[1].array()).abs() };
+    const double n { static_cast<double>(diff.size()) };
+    result.validationLoss = diff.square().mean();
+    result.accuracy = 100.0 * static_cast<double>((roundedDiff < 0.5).count()) / n;
+    result.accuracyOffOne = 100.0 * static_cast<double>((roundedDiff < 1.5).count()) / n;
+    return result;
+}
+
+RunResult trainRun(const RunConfig &config, const Dataset &train, const Dataset &validation)
+{
+    auto t1 = std::chrono::steady_clock::now();
+    // Weights and shuffling both draw from this thread's generator.
+    Deep::gen.seed(config.seed);
+    MyReg model {};
+    Deep::Optim::SGD optimizer(model.namedParameters(), config.lr);
+    DataLoader1D dl(train, config.bs, true);
+    double epochLoss { 0.0 };
+    for (int epoch = 1; epoch <= config.epochs; ++epoch)
+    {
+        double runningLoss { 0.0 };
+        while (dl.hasNext())
+        {
+            optimizer.zeroGrad();
+            std::vector<Eigen::MatrixXd> thisBatch {dl.nextBatch()};
+            NSP trainNode { std::make_shared<Deep::Node>(thisBatch[0]) };
+            NSP LPtr { Deep::MSE(model.forward(trainNode), thisBatch[1]) };
+            LPtr->backward();
+            optimizer.step();
+            runningLoss += LPtr->data(0,0) * static_cast<double>(thisBatch[0].rows());
+        }
+        epochLoss = runningLoss / dl.length;
+        dl.reInitialize();
+    }
+    RunResult result {config, epochLoss, 0.0, 0.0, 0.0, 0.0};
+    result = evaluate(model, validation, result);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    std::unordered_map<std::string, std::string> args {sweepParser(argc, argv)};
+    const std::vector<double> lrs { parseList(args["lr"]) };
+    const std::vector<double> batchSizes { parseList(args["bs"]) };
+    const std::vector<double> epochList { parseList(args["epochs"]) };
+    const double validationRatio { std::stod(args["validation"]) };
+    const unsigned baseSeed { static_cast<unsigned>(std::stoul(args["seed"])) };
+    const int hardwareThreads { static_cast<int>(std::max(1u, std::thread::hardware_concurrency())) };
+
+    // Parse once, then split into train and validation with a fixed permutation.
+    std::vector<Eigen::MatrixXd> all { Deep::Data::loadData(args["data"]) };
+    const int rows { static_cast<int>(all[0].rows()) };
+    const int validationRows { static_cast<int>(validationRatio * rows) };
+    if (validationRows <= 0 || validationRows >= rows)
+        throw std::invalid_argument("Validation ratio leaves no train or validation rows.");
+    std::vector<int> perm(static_cast<size_t>(rows));
+    std::iota(perm.begin(), perm.end(), 0);
+    std::mt19937 splitGen(baseSeed);
+    std::shuffle(perm.begin(), perm.end(), splitGen);
+    const std::vector<int> validationIndices(perm.begin(), perm.begin() + validationRows);
+    const std::vector<int> trainIndices(perm.begin() + validationRows, perm.end());
+    const Dataset train { std::make_shared<const std::vector<Eigen::MatrixXd>>(Deep::Data::selectRows(all, trainIndices)) };
+    const Dataset validation { std::make_shared<const std::vector<Eigen::MatrixXd>>(Deep::Data::selectRows(all, validationIndices)) };
+
+    std::vector<RunConfig> configs {};
+    for (double lr: lrs)
+        for (double bs: batchSizes)
+            for (double epochs: epochList)
+                configs.push_back({lr, static_cast<int>(bs), static_cast<int>(epochs),
+                    baseSeed + static_cast<unsigned>(configs.size())});
+    const int jobs { std::max(1, std::min(std::stoi(args["jobs"]), static_cast<int>(configs.size()))) };
+    // Split the cores between concurrent runs rather than oversubscribing them.
+    Deep::Parallel::setNumThreads(std::max(1, hardwareThreads / jobs));
+    std::cout << "Running " << configs.size() << " configurations on " << jobs << " threads ("
+        << trainIndices.size() << " train rows, " << validationIndices.size() << " validation rows).\n";
+
+    auto t1 = std::chrono::steady_clock::now();
+    std::vector<RunResult> results(configs.size());
+    std::atomic<size_t> next { 0 };
+    std::mutex printMutex;
+    std::vector<std::thread> workers {};
+    for (int j=0; j<jobs; ++j)
+    {
+        workers.push_back(std::thread([&]{
+            for (size_t i=next++; i<configs.size(); i=next++)
+            {
+                results[i] = trainRun(configs[i], train, validation);
+                std::lock_guard<std::mutex> lock(printMutex);
+                std::cout << "lr " << configs[i].lr << " bs " << configs[i].bs
+                    << " epochs " << configs[i].epochs << ": validation loss "
+                    << results[i].validationLoss << " (" << results[i].seconds << "s)\n";
+            }
+        }));
+    }
+    for (std::thread &worker: workers)
+        worker.join();
+    const double wallSeconds { std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count() };
+    double runSeconds { 0.0 };
+    for (const RunResult &result: results)
+        runSeconds += result.seconds;
+
+    std::sort(results.begin(), results.end(), [](const RunResult &a, const RunResult &b){
+        return a.validationLoss < b.validationLoss;
+    });
+    json report {
+        {"data", args["data"]}, {"trainRows", trainIndices.size()},
+        {"validationRows", validationIndices.size()}, {"jobs", jobs},
+        {"wallSeconds", wallSeconds}, {"runSeconds", runSeconds}, {"runs", json::array()}
+    };
+    std::cout << "\nRank  lr          bs    epochs  val loss   accuracy  off-by-one\n";
+    for (size_t rank=0; rank<results.size(); ++rank)
+    {
+        const RunResult &r { results[rank] };
+        report["runs"].push_back({
+            {"rank", rank + 1}, {"lr", r.config.lr}, {"bs", r.config.bs},
+            {"epochs", r.config.epochs}, {"seed", r.config.seed},
+            {"trainLoss", r.trainLoss}, {"validationLoss", r.validationLoss},
+            {"accuracy", r.accuracy}, {"accuracyOffOne", r.accuracyOffOne},
+            {"seconds", r.seconds}
+        });
+        std::cout << std::left << std::setw(6) << rank + 1 << std::setw(12) << r.config.lr
+            << std::setw(6) << r.config.bs << std::setw(8) << r.config.epochs
+            << std::setw(11) << r.validationLoss << std::setw(10) << r.accuracy
+            << r.accuracyOffOne << '\n';
+    }
+    std::ofstream out(args["report"]);
+    out << report.dump(4);
+    std::cout << "Wall time " << wallSeconds << "s for " << runSeconds
+        << "s of training, report written to " << args["report"] << ".\n";
+    return 0;
+}
@@ -0,0 +1,73 @@
+// Serve the wine quality regressor over a Unix domain socket.
+// Run ./firstModel --train first so that a state dict exists.
+#define NDEBUG
+#include "../Deep/base.h"
+#include "../Deep/serving.h"
+#include "common.h"
+#include <iostream>
+#include <csignal>
+
+static Deep::Serving::SocketFrontend *activeFrontend { nullptr };
+
+void handleSignal(int)
+{
+    if (activeFrontend != nullptr)
+        activeFrontend->shutdown();
+}
+
+std::unordered_map<std::string, std::string> serverParser(int argc, char **argv)
+{
+    std::unordered_map<std::string, std::string> ret {parseArguments(argc, argv)};
+    // Provide default arguments
+    if (ret.find("model") == ret.end())
+        ret["model"] = "./models/cpp-model.json";
+    if (ret.find("socket") == ret.end())
+        ret["socket"] = "/tmp/deep-serving.sock";
+    if (ret.find("maxbs") == ret.end())
+        ret["maxbs"] = "64";
+    if (ret.find("wait") == ret.end())
+        ret["wait"] = "1000";
+    if (ret.find("workers") == ret.end())
+        ret["workers"] = "2";
+    return ret;
+}
+
+void printStats(const Deep::Serving::ServerStats &s)
+{
+    std::cout << "Served " << s.requests << " requests in " << s.batches << " batches "
+        << "(mean batch size " << s.meanBatchSize << ").\n"
+        << "Latency p50 " << s.p50Micros << "us, p99 " << s.p99Micros << "us, "
+        << "throughput " << s.throughput << " requests/s.\n";
+}
+
+int main(int argc, char **argv)
+{
+    std::unordered_map<std::string, std::string> args {serverParser(argc, argv)};
+    std::cout << "Accepted arguments as below:\n";
+    for (auto it=args.begin(); it!=args.end(); ++it)
+    {
+        std::cout << '\t' << (*it).first << ": " << (*it).second << '\n';
+    }
+
+    MyReg model {};
+    model.loadStateDict(args["model"]);
+
+    Deep::Serving::ServerOptions options {};
+    options.maxBatchSize = std::stoi(args["maxbs"]);
+    options.maxWaitMicros = std::stoi(args["wait"]);
+    options.numWorkers = std::stoi(args["workers"]);
+    options.inputSize = 11; // Features of the dataset MyReg is trained on.
+    Deep::Serving::BatchingServer server(model, options);
+    Deep::Serving::SocketFrontend frontend(server, args["socket"]);
+
+    activeFrontend = &frontend;
+    std::signal(SIGINT, handleSignal);
+    std::signal(SIGTERM, handleSignal);
+    std::cout << "Listening on " << args["socket"] << ", press Ctrl+C to stop.\n";
+    frontend.serve();
+    activeFrontend = nullptr;
+
+    server.stop();
+    printStats(server.stats());
+    return 0;
+}
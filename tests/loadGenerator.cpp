@@ -0,0 +1,122 @@
+// Benchmark a running ./inferenceServer with concurrent clients, 
+// every client sends rows of the test set one request at a time.
+#define NDEBUG
+#include "../Deep/serving.h"
+#include "../Deep/data.h"
+#include "common.h"
+#include <Eigen/Dense>
+#include <iostream>
+#include <thread>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <unistd.h>
+
+std::unordered_map<std::string, std::string> loadParser(int argc, char **argv)
+{
+    std::unordered_map<std::string, std::string> ret {parseArguments(argc, argv)};
+    // Provide default arguments
+    if (ret.find("socket") == ret.end())
+        ret["socket"] = "/tmp/deep-serving.sock";
+    if (ret.find("data") == ret.end())
+        ret["data"] = "./datasets/winequality/winequality-white-test.csv";
+    if (ret.find("connections") == ret.end())
+        ret["connections"] = "16";
+    if (ret.find("requests") == ret.end())
+        ret["requests"] = "20000";
+    return ret;
+}
+
+double percentile(std::vector<double> &values, double p)
+{
+    size_t k { static_cast<size_t>(p * static_cast<double>(values.size() - 1)) };
+    std::nth_element(values.begin(), values.begin() + static_cast<long>(k), values.end());
+    return values[k];
+}
+
+int main(int argc, char **argv)
+{
+    using Clock = std::chrono::steady_clock;
+    std::unordered_map<std::string, std::string> args {loadParser(argc, argv)};
+    const int connections { std::stoi(args["connections"]) };
+    const int totalRequests { std::stoi(args["requests"]) };
+    const Eigen::MatrixXd features { Deep::Data::loadData(args["data"])[0] };
+    const int rows { static_cast<int>(features.rows()) };
+
+    std::vector<std::vector<double>> latencies(static_cast<size_t>(connections));
+    // Why a client could not connect, empty when it did.
+    std::vector<std::string> failures(static_cast<size_t>(connections));
+    std::vector<std::thread> clients {};
+    const Clock::time_point start { Clock::now() };
+    for (int c=0; c<connections; ++c)
+    {
+        clients.push_back(std::thread([&, c](){
+            int fd { -1 };
+            try
+            {
+                fd = Deep::Serving::connectSocket(args["socket"]);
+            }
+            catch (const std::exception &e)
+            {
+                failures[static_cast<size_t>(c)] = e.what();
+                return;
+            }
+            std::vector<double> request(static_cast<size_t>(features.cols()));
+            std::vector<double> response {};
+            for (int i=c; i<totalRequests; i+=connections)
+            {
+                for (Eigen::Index j=0; j<features.cols(); ++j)
+                    request[static_cast<size_t>(j)] = features(i % rows, j);
+                const Clock::time_point sent { Clock::now() };
+                try
+                {
+                    if (!Deep::Serving::writeFrame(fd, request) || !Deep::Serving::readFrame(fd, response))
+                        break;
+                }
+                catch (const std::exception &e)
+                {
+                    // An error frame, the server refused the request.
+                    std::cout << "Request failed: " + std::string(e.what()) + '\n';
+                    break;
+                }
+                latencies[static_cast<size_t>(c)].push_back(
+                    std::chrono::duration<double, std::micro>(Clock::now() - sent).count()
+                );
+            }
+            ::close(fd);
+        }));
+    }
+    for (std::thread &client: clients)
+        client.join();
+    const double elapsed { std::chrono::duration<double>(Clock::now() - start).count() };
+    const auto failed { std::find_if(failures.begin(), failures.end(), [](const std::string &f){ return !f.empty(); }) };
+    if (failed != failures.end())
+        std::cout << std::count_if(failures.begin(), failures.end(), [](const std::string &f){ return !f.empty(); })
+            << " of " << connections << " connections failed: " << *failed << '\n';
+
+    std::vector<double> all {};
+    for (const std::vector<double> &l: latencies)
+        all.insert(all.end(), l.begin(), l.end());
+    if (all.empty())
+    {
+        std::cout << "No request succeeded, is the server running?\n";
+        return 1;
+    }
+    std::cout << "Client side: " << all.size() << " requests over " << connections 
+        << " connections in " << elapsed << "s.\n"
+        << "Latency p50 " << percentile(all, 0.50) << "us, p99 " << percentile(all, 0.99) 
+        << "us, throughput " << static_cast<double>(all.size()) / elapsed << " requests/s.\n";
+
+    // An empty frame asks for the server side counters.
+    int fd { Deep::Serving::connectSocket(args["socket"]) };
+    std::vector<double> stats {};
+    if (Deep::Serving::writeFrame(fd, std::vector<double>{}) && Deep::Serving::readFrame(fd, stats)
+        && stats.size() == 6)
+    {
+        std::cout << "Server side: " << stats[0] << " requests in " << stats[1] << " batches "
+            << "(mean batch size " << stats[2] << "), latency p50 " << stats[3] 
+            << "us, p99 " << stats[4] << "us.\n";
+    }
+    ::close(fd);
+    return 0;
+}
@@ -0,0 +1,40 @@
+// Checks that single-sample inference of the fixed-size layers never
+// touches the heap. EIGEN_RUNTIME_NO_MALLOC changes the definition of
+// Eigen's allocation functions, so it must be seen by every translation
+// unit using Eigen: this executable is a single one, linking no other
+// object, and only the header-only Deep/fixed.h is used.
+#define EIGEN_RUNTIME_NO_MALLOC
+#include "../Deep/fixed.h"
+#include <Eigen/Dense>
+#include <iostream>
+#include <cassert>
+#include <cmath>
+
+int testFixedNoMalloc()
+{
+    Deep::Fixed::FixedMLP<5, 3, 2, 10, 1> fixedModel {};
+    fixedModel.head.weights.setRandom();
+    fixedModel.head.biases.setRandom();
+    fixedModel.tail.head.weights.setRandom();
+    fixedModel.tail.tail.head.weights.setRandom();
+    fixedModel.tail.tail.tail.layer.weights.setRandom();
+    // The batched forward allocates, it gives the expected outputs.
+    Eigen::Matrix<double, 5, Eigen::Dynamic> x { Eigen::Matrix<double, 5, Eigen::Dynamic>::Random(5, 6) };
+    Eigen::Matrix<double, 1, Eigen::Dynamic> expected { fixedModel.forward(x) };
+    for (Eigen::Index i=0; i<x.cols(); ++i)
+    {
+        Eigen::Matrix<double, 5, 1> sample { x.col(i) };
+        Eigen::internal::set_is_malloc_allowed(false);
+        [[maybe_unused]] Eigen::Matrix<double, 1, 1> single { fixedModel.forward(sample) };
+        Eigen::internal::set_is_malloc_allowed(true);
+        assert(std::abs(single(0) - expected(i)) < 1e-9);
+    }
+    std::cout << "Fixed-size layers allocation unittest passed.\n";
+    return 0;
+}
+
+int main()
+{
+    testFixedNoMalloc();
+    return 0;
+}
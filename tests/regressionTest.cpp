@@ -4,6 +4,13 @@
 #include "../Deep/base.h"
 #include "../Deep/nn.h"
 #include "../Deep/optimizer.h"
+#include "../Deep/data.h"
+#include "../Deep/prune.h"
+#include "../Deep/autograd.h"
+#include "../Deep/eval.h"
+#include "../Deep/hogwild.h"
+#include "../Deep/export.h"
+#include "common.h"
 #include <Eigen/Dense>
 #include <sstream>
 #include <fstream>
@@ -12,79 +19,10 @@
 #include <numeric>
 #include <algorithm>
 #include <chrono>
+#include <iomanip>
 
-#define PTR_LAYER(DERIVED) std::unique_ptr<Deep::Layer>(new DERIVED)
-
-// Node Shared Pointer
-using NSP = std::shared_ptr<Deep::Node>;
-
-class MyReg: public Deep::Model
-{
-    public:
-        MyReg()
-        {
-            // Add layers
-            layers["fc1"] = PTR_LAYER(Deep::FullyConnected(11,64));
-            layers["fc2"] = PTR_LAYER(Deep::FullyConnected(64,64));
-            layers["fc3"] = PTR_LAYER(Deep::FullyConnected(64,32));
-            layers["fc4"] = PTR_LAYER(Deep::FullyConnected(32,1));
-        }
-        NSP forward(NSP in) override
-        {
-            // Forward pass
-            NSP x1 { Deep::relu(layers["fc1"]->forward(in)) };
-            NSP x2 { Deep::relu(layers["fc2"]->forward(x1)) };
-            NSP x3 { Deep::relu(layers["fc3"]->forward(x2)) };
-            NSP y { layers["fc4"]->forward(x3) };
-            return y;
-        }
-
-};
-
-std::vector<std::string> split(std::string s, char sep = ',')
-{
-    std::stringstream ss( s );
-    std::vector<std::string> result {};
-
-    while( ss.good() )
-    {
-        std::string substr;
-        getline( ss, substr, sep );
-        result.push_back( substr );
-    }
-    return result;
-}   
-
-std::vector<Eigen::MatrixXd> loadData(std::string filepath)
-{
-    // Count number of rows
-    int rowCount { 0 };
-    std::ifstream file;
-    file.open(filepath);
-    std::string line;
-    getline(file, line); // ignore header
-    while (getline(file, line))
-        ++rowCount;
-    file.close();
-    
-    Eigen::MatrixXd feature(rowCount, 11);
-    Eigen::MatrixXd label(rowCount, 1);
-    file.open(filepath);
-    getline(file, line); // ignore header
-    for (int i=0; i<rowCount; ++i)
-    {
-        getline(file, line);
-        std::vector<std::string> tokens {split(line)};
-        for (int j=1; j<12; ++j)
-        {
-            feature(i, j-1) = std::stod(tokens[j]);
-        }
-        label(i, 0) = std::stod(tokens[12]);
-    }
-    file.close();
-
-    return {feature, label};
-}
+using Deep::Data::loadData;
+using Deep::Data::DataLoader1D;
 
 Eigen::MatrixXd postProcess(Eigen::MatrixXd rawPrediction)
 {
@@ -102,62 +40,6 @@ Eigen::MatrixXd postProcess(NSP rawPrediction)
     return postProcess(rawPrediction->data);
 }
 
-class DataLoader1D 
-{
-    public:
-        std::vector<Eigen::MatrixXd> allData;
-        const int batchSize;
-        const bool shuffle; 
-        const int length;
-        int counter;
-        std::vector<int> perm;
-        DataLoader1D(std::vector<Eigen::MatrixXd> dataset, int batchsize = 1, bool shuf = true):
-            allData(dataset), batchSize(batchsize), shuffle(shuf), 
-            length(static_cast<int>(dataset[0].rows())), counter(0),
-            perm(std::vector<int>(length))
-        {
-            resetPermutation();
-        };
-
-        void resetPermutation()
-        {
-            std::iota(perm.begin(), perm.end(), 0);
-            if (shuffle)
-                std::shuffle(perm.begin(), perm.end(), Deep::gen);
-        }
-
-        std::vector<Eigen::MatrixXd> nextBatch()
-        {
-            int initial = counter*batchSize;
-            std::vector<int> indices(
-                perm.begin()+initial, 
-                perm.begin()+std::min(initial+batchSize, length)
-            );
-            ++counter;
-
-            // Perform indexing            
-            std::vector<Eigen::MatrixXd> ret {};
-            for (Eigen::MatrixXd thisData: allData)
-            {
-                ret.push_back(thisData(indices, Eigen::all));
-            }
-            return ret;  
-        }
-
-        bool hasNext()
-        {
-            return (counter * batchSize) < length;
-        }
-
-        void reInitialize()
-        {
-            // Refresh the dataloader into its initial state, ready to resample again.
-            resetPermutation();
-            counter = 0;
-        }
-        
-};
-
 int testForward()
 {
     MyReg model {};
@@ -173,7 +55,7 @@ int testForward()
     NSP LPtr {Deep::MSE(yPtr, labelPtr)};
     [[maybe_unused]] int count { LPtr->descendents() };
     Deep::Optim::SGD optimizer(model.namedParameters());
-    assert(count == 22);
+    assert(count == 18);
 
     Eigen::MatrixXd prediction { postProcess(yPtr) };
     return 0;
@@ -192,9 +74,16 @@ void train(MyReg &model, std::vector<Eigen::MatrixXd> dataset, std::unordered_ma
     const int epochs { std::stoi(trainArgs["epochs"]) };
     const int bs { std::stoi(trainArgs["bs"]) };
     const double lr { std::stod(trainArgs["lr"]) };
+    const double sparsity { std::stod(trainArgs["sparsity"]) };
+    const bool parallelBackward { trainArgs["parallel-backward"] == "true" };
 
     Deep::Optim::SGD optimizer(model.namedParameters(), lr);
     DataLoader1D dl(dataset, bs, true);
+    // Gradual pruning reaches the target sparsity after three quarters of the steps.
+    const int totalSteps { epochs * ((dl.length + bs - 1) / bs) };
+    std::unique_ptr<Deep::Prune::GradualPruner> pruner { nullptr };
+    if (sparsity > 0)
+        pruner.reset(new Deep::Prune::GradualPruner(model, sparsity, 0, std::max(1, 3 * totalSteps / 4)));
 
     for (int epoch = 1; epoch <= epochs; ++epoch)
     {
@@ -211,8 +100,13 @@ void train(MyReg &model, std::vector<Eigen::MatrixXd> dataset, std::unordered_ma
             NSP trainNode { std::make_shared<Deep::Node>(trainFeature) };
             NSP yPtr { model.forward(trainNode) };
             NSP LPtr { Deep::MSE(yPtr, trainLabel) } ;
-            LPtr->backward();
+            if (parallelBackward)
+                Deep::Autograd::backward(LPtr);
+            else
+                LPtr->backward();
             optimizer.step();
+            if (pruner)
+                pruner->step(optimizer);
             runningLoss += LPtr->data(0,0) * currBatchSize ;
         }
         double epochLoss {runningLoss / dl.length};
@@ -230,6 +124,8 @@ void train(MyReg &model, std::vector<Eigen::MatrixXd> dataset, std::unordered_ma
     duration<double, std::milli> ms_double = t2 - t1;
 
     std::cout << ms_double.count()/(1000*epochs) << "s\n";
+    if (pruner)
+        std::cout << "Weight sparsity is " << 100.0 * Deep::Prune::weightSparsity(model) << "%.\n";
     // Without optimization: get 0.582737s per epoch, one eighth performance of Python.
     // O1: 0.0275281s
     // O2: 0.0277896s
@@ -237,93 +133,52 @@ void train(MyReg &model, std::vector<Eigen::MatrixXd> dataset, std::unordered_ma
     // Using any optimization makes C++ almost 3x faster than Python.
 }
 
-std::unordered_map<std::string, double> test(MyReg &model, std::vector<Eigen::MatrixXd> dataset)
+void trainHogwild(MyReg &model, std::vector<Eigen::MatrixXd> dataset, std::unordered_map<std::string, std::string> trainArgs)
 {
-    const int bs { 64 };
-    DataLoader1D  dl(dataset, bs, false);
+    Deep::Hogwild::HogwildOptions options {};
+    options.numThreads = std::stoi(trainArgs["threads"]);
+    options.batchSize = std::stoi(trainArgs["bs"]);
+    options.epochs = std::stoi(trainArgs["epochs"]);
+    options.lr = std::stod(trainArgs["lr"]);
+    options.maxStaleness = std::stol(trainArgs["staleness"]);
+    auto makeReplica = []{ return std::unique_ptr<Deep::Model>(new MyReg()); };
+    // The synchronous baseline, one worker and so no staleness, from the same weights.
+    MyReg baseline {};
+    Deep::Hogwild::SharedParameters(model).read(baseline);
+    Deep::Hogwild::HogwildOptions serial { options };
+    serial.numThreads = 1;
+    const Deep::Hogwild::HogwildReport sync { Deep::Hogwild::train(baseline, makeReplica, dataset, serial) };
+    const Deep::Hogwild::HogwildReport async { Deep::Hogwild::train(model, makeReplica, dataset, options) };
+    for (int epoch = 1; epoch <= options.epochs; ++epoch)
+        std::cout << "Training on epoch " << epoch << ": Loss is " << async.epochLoss[static_cast<size_t>(epoch - 1)]
+            << " (synchronous " << sync.epochLoss[static_cast<size_t>(epoch - 1)] << ").\n";
+    std::vector<Eigen::MatrixXd> testDataset{loadData("./datasets/winequality/winequality-white-test.csv")};
+    const double syncMSE { Deep::Eval::evaluate(baseline, testDataset[0], testDataset[1], evalOptions()).mse() };
+    const double asyncMSE { Deep::Eval::evaluate(model, testDataset[0], testDataset[1], evalOptions()).mse() };
+    std::cout << "Hogwild on " << options.numThreads << " threads: " << async.rowsPerSecond << " rows/s, test MSE "
+        << asyncMSE << ", " << async.droppedSteps << " of " << async.steps << " steps dropped, staleness up to "
+        << async.maxObservedStaleness << ".\nSynchronous: " << sync.rowsPerSecond << " rows/s, test MSE "
+        << syncMSE << ".\n" << async.seconds / options.epochs << "s\n";
+}
 
-    int total { 0 };
-    int correct { 0 };
-    int correctOffOne { 0 };
-    while (dl.hasNext())
+void printConfusion(const Deep::Eval::Metrics &metrics)
+{
+    std::cout << "Confusion matrix (rows are labels, columns predictions):\n     ";
+    for (Eigen::Index j=0; j<metrics.confusion.cols(); ++j)
+        std::cout << std::setw(6) << metrics.minClass + j;
+    std::cout << '\n';
+    for (Eigen::Index i=0; i<metrics.confusion.rows(); ++i)
     {
-        std::vector<Eigen::MatrixXd> thisBatch {dl.nextBatch()};
-        Eigen::MatrixXd testFeature { thisBatch[0] };
-        Eigen::MatrixXd testLabel { thisBatch[1] };
-        NSP testNode { std::make_shared<Deep::Node>(testFeature) };
-        NSP yPtr { model.forward(testNode) };
-        // Round yPtr then compare with int labels.
-        Eigen::MatrixXd prediction { postProcess(yPtr) };
-        Eigen::ArrayXd diff {(prediction - testLabel).cwiseAbs().array()};
-        for (double num: diff)
-        {
-            ++total;
-            if (num < 0.5)
-                ++correct;
-            if (num < 1.5)
-                ++correctOffOne;
-        }
+        std::cout << std::setw(5) << metrics.minClass + i;
+        for (Eigen::Index j=0; j<metrics.confusion.cols(); ++j)
+            std::cout << std::setw(6) << metrics.confusion(i, j);
+        std::cout << '\n';
     }
-    std::unordered_map<std::string, double> ret {
-        {"accuracy", 100.0 * static_cast<double>(correct)/total },
-        {"accuracyOffOne", 100.0 * static_cast<double>(correctOffOne)/total }
-    };
-    return ret;
 }
 
 std::unordered_map<std::string, std::string> simpleParser(int argc, char **argv)
 {
-    std::vector<std::vector<std::string>> argPairs {};
-    for (int i=1; i<argc; ++i)
-    {
-        // Record double-hyphen argument
-        if (std::string(argv[i]).substr(0, 2) == "--")
-        {
-            argPairs.push_back({std::string(argv[i])});
-        }
-        else if (argv[i][0] == '-' && (i<argc-1))
-        {
-            argPairs.push_back({std::string(argv[i]), std::string(argv[i+1])});
-            ++i;
-        }
-        else
-        {
-            throw std::invalid_argument("Arguments are not valid. ");
-        }
-    }
-    // for (auto p: argPairs)
-    // {
-    //     std::cout << p[0] << ' ' ;
-    //     if (p.size() > 1)
-    //         std::cout << p[1] << ' ' ;
-    //     std::cout << '\n';
-    // }
-    std::unordered_map<std::string, std::string> ret {};
-    for (auto p: argPairs)
-    {
-        if (p.size() == 1)
-        {
-            // boolean flag
-            std::string flag { p[0] };
-            if (flag.length() >=5 && flag.substr(0,5) == "--no-")
-            {
-                ret[flag.substr(5)] = "false";
-            }
-            else
-            {
-                ret[flag.substr(2)] = "true";
-            }
-        }
-        else if (p.size() == 2) 
-        {   
-            // flag with value.
-            ret[p[0].substr(1)] = p[1];
-        }
-        else
-        {
-            throw std::invalid_argument("Parsing 3 or more arguments is not implemented yet.");
-        }
-    }
+    std::unordered_map<std::string, std::string> ret {parseArguments(argc, argv)};
     // Provide default arguments
     if (ret.find("train") == ret.end())
         ret["train"] = "true";
@@ -333,6 +188,18 @@ std::unordered_map<std::string, std::string> simpleParser(int argc, char **argv)
         ret["lr"] = "0.00005";
     if (ret.find("bs") == ret.end())
         ret["bs"] = "64";
+    if (ret.find("hogwild") == ret.end())
+        ret["hogwild"] = "false";
+    if (ret.find("threads") == ret.end())
+        ret["threads"] = "4";
+    if (ret.find("staleness") == ret.end())
+        ret["staleness"] = "-1";
+    if (ret.find("export") == ret.end())
+        ret["export"] = "false";
+    if (ret.find("sparsity") == ret.end())
+        ret["sparsity"] = "0";
+    if (ret.find("parallel-backward") == ret.end())
+        ret["parallel-backward"] = "false";
     
     return ret;
 }
@@ -353,16 +220,27 @@ int main(int argc, char **argv)
     if (args["train"] == "true")
     {
         std::vector<Eigen::MatrixXd> dataset{loadData("./datasets/winequality/winequality-white-train.csv")};
-        train(model, dataset, args);
+        if (args["hogwild"] == "true")
+            trainHogwild(model, dataset, args);
+        else
+            train(model, dataset, args);
         model.saveStateDict(modelPath);
     }
     else
     {
         std::vector<Eigen::MatrixXd> testDataset{loadData("./datasets/winequality/winequality-white-test.csv")};
         model.loadStateDict(modelPath);
-        std::unordered_map<std::string, double> result { test(model, testDataset) };
-        std::cout << "Accuracy is " <<  result["accuracy"] << "%.\n";
-        std::cout << "Accuracy (Off By One) is " <<  result["accuracyOffOne"] << "%.\n";
+        const Deep::Eval::Metrics result { Deep::Eval::evaluate(model, testDataset[0], testDataset[1], evalOptions()) };
+        std::cout << "Accuracy is " <<  result.accuracy() << "%.\n";
+        std::cout << "Accuracy (Off By One) is " <<  result.accuracyOffOne() << "%.\n";
+        std::cout << "MSE is " << result.mse() << ", MAE is " << result.mae() << ", "
+            << result.rowsPerSecond() << " rows/s.\n";
+        printConfusion(result);
+        if (args["export"] == "true")
+        {
+            Deep::Export::exportHeader(model, testDataset[0], "./models/cpp-model.h", "wine");
+            std::cout << "Exported the model to ./models/cpp-model.h, build it with make exportedPredictor.\n";
+        }
     }
     
     
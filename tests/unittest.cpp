@@ -2,8 +2,42 @@
 #include "Deep/base.h"
 #include "Deep/utility.h"
 #include "Deep/nn.h"
+#include "Deep/serving.h"
+#include "Deep/trace.h"
+#include "Deep/quantize.h"
+#include "Deep/prune.h"
+#include "Deep/optimizer.h"
+#include "Deep/data.h"
+#include "Deep/fixed.h"
+#include "Deep/parallel.h"
+#include "Deep/autograd.h"
+#include "Deep/graph.h"
+#include "Deep/half.h"
+#include "Deep/cnn.h"
+#include "Deep/fold.h"
+#include "Deep/distributed.h"
+#include "Deep/fusion.h"
+#include "Deep/eval.h"
+#include "Deep/hogwild.h"
+#include "Deep/ensemble.h"
+#include "Deep/export.h"
+#include "Deep/rnn.h"
+#include "Deep/attention.h"
 #include <nlohmann/json.hpp>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <unordered_map>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <exception>
+#include <unistd.h>
 #include <Eigen/Dense>
 // #define NDEBUG
 #include <cassert>
@@ -35,6 +69,52 @@ class MyReg: public Deep::Model
         }
 }; 
 
+// The same model with its ReLUs applied in place.
+class InplaceReg: public MyReg
+{
+    public:
+        NSP forward(NSP in) override
+        {
+            NSP x1 { Deep::relu_(layers["fc1"]->forward(in)) };
+            NSP x2 { Deep::relu_(layers["fc2"]->forward(x1)) };
+            NSP x3 { Deep::relu_(layers["fc3"]->forward(x2)) };
+            return layers["fc4"]->forward(x3);
+        }
+};
+
+class BNNet: public Deep::Model
+{
+    public:
+        BNNet()
+        {
+            layers["fc1"] = std::unique_ptr<Deep::Layer>(new Deep::FullyConnected(5,8));
+            layers["bn1"] = std::unique_ptr<Deep::Layer>(new Deep::BatchNorm1d(8));
+            layers["fc2"] = std::unique_ptr<Deep::Layer>(new Deep::FullyConnected(8,3,false));
+            layers["bn2"] = std::unique_ptr<Deep::Layer>(new Deep::BatchNorm1d(3));
+        }
+        NSP forward(NSP in) override
+        {
+            NSP x { Deep::relu(layers["bn1"]->forward(layers["fc1"]->forward(in))) };
+            return layers["bn2"]->forward(layers["fc2"]->forward(x));
+        }
+};
+
+// BNNet with a single output, as the evaluation expects.
+class BNReg: public Deep::Model
+{
+    public:
+        BNReg()
+        {
+            layers["fc1"] = std::unique_ptr<Deep::Layer>(new Deep::FullyConnected(5,8));
+            layers["bn1"] = std::unique_ptr<Deep::Layer>(new Deep::BatchNorm1d(8));
+            layers["fc2"] = std::unique_ptr<Deep::Layer>(new Deep::FullyConnected(8,1));
+        }
+        NSP forward(NSP in) override
+        {
+            return layers["fc2"]->forward(Deep::relu(layers["bn1"]->forward(layers["fc1"]->forward(in))));
+        }
+};
+
 int testNode()
 {
     // Test Node size 
@@ -151,7 +231,7 @@ int testNode()
     assert( ySum->data(0,0) == trueValue );
 
     // Backward without argument
-    ySum->backward(); // use grad=1 by default
+    ySum->backward(1.0, true); // Keep the graph for the second backward.
     Eigen::MatrixXd trueGrad1(3,4);
     trueGrad1.fill(1);
     assert( yPtr->gradient.isApprox(trueGrad1, 1e-6) );
@@ -175,11 +255,11 @@ int testNode()
     NSP y1Ptr {std::make_shared<Deep::Node>(y1, Deep::gradFn::accumulateGrad)};
     NSP y2Ptr {std::make_shared<Deep::Node>(y2, Deep::gradFn::accumulateGrad)};
     NSP LPtr { Deep::MSE(y1Ptr, y2Ptr) };
+    assert(LPtr->descendents() == 3);
     LPtr->backward();
     Eigen::MatrixXd trueLeft(2,3);
     trueLeft << -1.0/3, 0.0, 1.0/3,
                 0.0, 0.0, -4.0/3;
-    assert(LPtr->descendents() == 3);
     assert(y1Ptr->gradient.isApprox(trueLeft, 1e-6));
     assert(y2Ptr->gradient.isApprox(-trueLeft, 1e-6));
     }
@@ -317,7 +397,7 @@ int testFC()
             1, 1, 1, 1, 1,
             1, 1, 1, 1, 1;
             
-    outPtr->backward(endGradient);
+    outPtr->backward(endGradient, true); // The graph is inspected below.
     Eigen::MatrixXd expectGradient(5,3);
     expectGradient << 14,16,18,
                     15.5,17.5,19.5,
@@ -346,7 +426,7 @@ int testFC()
                 1, 1, 1, 1, 1,
                 1, 1, 1, 1, 1;
             
-    outPtr->backward(endGradient);
+    outPtr->backward(endGradient, true); // The graph is inspected below.
     Eigen::MatrixXd expectWeightGradient(5,3);
     expectWeightGradient << 14,16,18,
                     15.5,17.5,19.5,
@@ -356,7 +436,7 @@ int testFC()
     Eigen::MatrixXd expectBiasGradient(5,1);
     expectBiasGradient << 2, 2, 1.5, 2.5, 2.8;
     assert(outPtr->nextNodes[0]->gradient == expectBiasGradient);
-    assert(outPtr->nextNodes[2]->nextNodes[0]->gradient == expectWeightGradient);
+    assert(outPtr->nextNodes[2]->gradient == expectWeightGradient);
 
     // Use layer's parameters, no bias layer should only have one element.
     std::vector<NSP> wbList { fcLayer.params() };
@@ -382,7 +462,8 @@ int testFC()
             fc2.forward(Deep::relu(fc1.forward(xPtr)))
         )
     };
-    assert(LPtr->descendents() == 11);
+    // sum, relu, two affines reading their weights in place and five leaves.
+    assert(LPtr->descendents() == 9);
     }
 
     std::cout << "Fully Connected Layer unittest passed.\n";
@@ -414,10 +495,1671 @@ int testLayer()
     return 0;
 }
 
+int testServing()
+{
+    // Batched results must match the unbatched forward pass.
+    MyReg model {};
+    Deep::Serving::ServerOptions options {};
+    options.maxBatchSize = 4;
+    options.maxWaitMicros = 200;
+    options.numWorkers = 2;
+    Deep::Serving::BatchingServer server(model, options);
+    Eigen::MatrixXd x(10, 5);
+    for (int i=0; i<10; ++i)
+        x.row(i).fill(0.1 * i - 0.5);
+    std::vector<std::future<Eigen::RowVectorXd>> futures {};
+    for (int i=0; i<10; ++i)
+        futures.push_back(server.submit(x.row(i)));
+    NSP expected {model.forward(std::make_shared<Deep::Node>(x))};
+    for (int i=0; i<10; ++i)
+    {
+        [[maybe_unused]] Eigen::RowVectorXd out { futures[i].get() };
+        assert(out.isApprox(expected->data.row(i), 1e-9));
+    }
+    // A row of another width is refused by submit() and doesn't reach a batch.
+    assert(server.inputSize() == 5);
+    bool thrown { false };
+    try
+    {
+        server.submit(Eigen::RowVectorXd::Zero(3));
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    [[maybe_unused]] Deep::Serving::ServerStats stats { server.stats() };
+    assert(stats.requests == 10);
+    assert(stats.batches >= 3); // At most 4 rows per batch.
+    assert(stats.p50Micros <= stats.p99Micros);
+    std::cout << "Serving unittest passed.\n";
+    return 0;
+}
+
+int testQuantize()
+{
+    // Int8 GEMM against a hand computed product.
+    {
+    std::vector<int8_t> A {1, -2, 3, 
+                           -4, 5, 127};
+    std::vector<int8_t> B {1, 1, 1, 
+                           2, 0, -1, 
+                           -127, 3, 0,
+                           0, 0, 1,
+                           5, 5, 5};
+    std::vector<int32_t> C(10);
+    Deep::Quant::gemmInt8(A.data(), B.data(), C.data(), 2, 5, 3);
+    [[maybe_unused]] std::vector<int32_t> expected {2, -1, -133, 3, 10, 
+                                                    128, -135, 523, 127, 640};
+    assert(C == expected);
+    }
+
+    // Tracing recovers the layer order and ReLU placement.
+    // Fixed seed, with some initializations the toy outputs are so small
+    // that the int8 error of the hidden layers dominates them.
+    Deep::gen.seed(7);
+    MyReg model {};
+    Eigen::MatrixXd x { Eigen::MatrixXd::Random(32, 5) };
+    std::vector<Deep::TracedLayer> traced { Deep::traceSequential(model, x) };
+    assert(traced.size() == 4);
+    assert(traced[0].name == "fc1" && traced[3].name == "fc4");
+    assert(traced[0].reluAfter && traced[2].reluAfter && !traced[3].reluAfter);
+    assert(traced[0].input == x);
+    // Tracing doesn't hold the layer outputs, in-place ReLUs can take them.
+    InplaceReg inplaceModel {};
+    std::vector<Deep::TracedLayer> inplaceTraced { Deep::traceSequential(inplaceModel, x) };
+    assert(inplaceTraced.size() == 4 && inplaceTraced[0].reluAfter && !inplaceTraced[3].reluAfter);
+
+    // Quantized model stays close to the double model.
+    std::string modelPath {"./models/cpp-model.json"};
+    model.saveStateDict(modelPath);
+    MyReg quantModel {};
+    quantModel.loadStateDict(modelPath);
+    Deep::Quant::quantizeModel(quantModel, x);
+    assert(quantModel.parameters().size() == 0);
+    // fc1 [3, 5] is a single copy of int16 rows padded to 8.
+    assert(static_cast<Deep::Quant::QuantizedFullyConnected*>(quantModel.layers["fc1"].get())->weightBytes() == 3 * 8 * 2);
+    [[maybe_unused]] Eigen::MatrixXd expected { model.forward(std::make_shared<Deep::Node>(x))->data };
+    [[maybe_unused]] Eigen::MatrixXd actual { quantModel.forward(std::make_shared<Deep::Node>(x))->data };
+    assert((expected - actual).cwiseAbs().maxCoeff() < 0.05 * (expected.cwiseAbs().maxCoeff() + 1e-3));
+    std::cout << "Quantization unittest passed.\n";
+    return 0;
+}
+
+int testPrune()
+{
+    // Per-layer pruning reaches the target in every layer.
+    {
+    MyReg model {};
+    Deep::Prune::magnitudePrune(model, 0.5, false);
+    for (NSP p: model.parameters())
+    {
+        if (p->data.cols() == 1)
+            continue; // Biases are not pruned.
+        [[maybe_unused]] long zeros { (p->data.array() == 0.0).count() };
+        assert(zeros == p->data.size() / 2);
+    }
+    }
+    // Global pruning reaches the target overall, masks keep pruned weights at zero.
+    {
+    MyReg model {};
+    std::unordered_map<std::string, Eigen::MatrixXd> masks { Deep::Prune::magnitudePrune(model, 0.6) };
+    assert(masks.size() == 4);
+    assert(std::abs(Deep::Prune::weightSparsity(model) - 0.6) < 0.02);
+    Deep::Optim::SGD optimizer(model.namedParameters(), 0.1);
+    optimizer.setMasks(masks);
+    Eigen::MatrixXd x(4,5);
+    x.fill(0.5);
+    Eigen::MatrixXd label(4,1);
+    label.fill(1.5);
+    for (int i=0; i<3; ++i)
+    {
+        optimizer.zeroGrad();
+        Deep::MSE(model.forward(std::make_shared<Deep::Node>(x)), label)->backward();
+        optimizer.step();
+    }
+    assert(std::abs(Deep::Prune::weightSparsity(model) - 0.6) < 0.02);
+
+    // Sparse layers give the same output as the pruned dense layers.
+    NSP xPtr { std::make_shared<Deep::Node>(x) };
+    Eigen::MatrixXd dense { model.forward(xPtr)->data };
+    Deep::Prune::sparsifyModel(model);
+    assert(model.forward(xPtr)->data.isApprox(dense, 1e-9));
+    }
+    // Gradual pruning ramps up to the final sparsity.
+    {
+    MyReg model {};
+    Deep::Optim::SGD optimizer(model.namedParameters(), 0.1);
+    Deep::Prune::GradualPruner pruner(model, 0.8, 0, 20, 5);
+    for (int i=0; i<10; ++i)
+        pruner.step(optimizer);
+    assert(pruner.currentTarget() > 0.5 && pruner.currentTarget() < 0.8);
+    for (int i=0; i<10; ++i)
+        pruner.step(optimizer);
+    assert(std::abs(Deep::Prune::weightSparsity(model) - 0.8) < 0.02);
+    }
+    std::cout << "Pruning unittest passed.\n";
+    return 0;
+}
+
+int testFixed()
+{
+    MyReg model {};
+    Deep::Fixed::FixedMLP<5, 3, 2, 10, 1> fixedModel {};
+    Deep::Fixed::loadFixedMLP(fixedModel, model);
+    Eigen::MatrixXd x { Eigen::MatrixXd::Random(6, 5) };
+    Eigen::MatrixXd expected { model.forward(std::make_shared<Deep::Node>(x))->data };
+    // Batched forward takes one sample per column.
+    Eigen::Matrix<double, 5, Eigen::Dynamic> xT { x.transpose() };
+    [[maybe_unused]] Eigen::Matrix<double, 1, Eigen::Dynamic> batched { fixedModel.forward(xT) };
+    assert(batched.transpose().isApprox(expected, 1e-9));
+    // Single sample forward, tests/noMallocTest.cpp checks it doesn't allocate.
+    Eigen::Matrix<double, 5, 1> sample { x.row(2).transpose() };
+    [[maybe_unused]] Eigen::Matrix<double, 1, 1> single { fixedModel.forward(sample) };
+    assert(std::abs(single(0) - expected(2, 0)) < 1e-9);
+    // Shape mismatch is refused.
+    bool thrown { false };
+    try
+    {
+        Deep::Fixed::FixedFullyConnected<3, 3> wrongShape {};
+        wrongShape.load(*static_cast<Deep::FullyConnected*>(model.layers["fc1"].get()));
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "Fixed-size layers unittest passed.\n";
+    return 0;
+}
+
+int testParallel()
+{
+    const int oldThreads { Deep::Parallel::getNumThreads() };
+    const long oldGrain { Deep::Parallel::getGrainSize() };
+    // Gradients of a model computed serially.
+    MyReg model {};
+    Eigen::MatrixXd x { Eigen::MatrixXd::Random(37, 5) };
+    Eigen::MatrixXd y { Eigen::MatrixXd::Random(37, 1) };
+    Deep::Parallel::setNumThreads(1);
+    NSP serialLoss { Deep::MSE(model.forward(std::make_shared<Deep::Node>(x)), y) };
+    serialLoss->backward();
+    std::vector<Eigen::MatrixXd> serialGrads {};
+    for (NSP param: model.parameters())
+    {
+        serialGrads.push_back(param->gradient);
+        param->zeroGrad();
+    }
+    // The same with tiny grains, so every kernel is split across threads.
+    Deep::Parallel::setNumThreads(4);
+    Deep::Parallel::setGrainSize(1);
+    NSP parallelLoss { Deep::MSE(model.forward(std::make_shared<Deep::Node>(x)), y) };
+    parallelLoss->backward();
+    assert(std::abs(parallelLoss->data(0,0) - serialLoss->data(0,0)) < 1e-12);
+    std::vector<NSP> params { model.parameters() };
+    for (size_t i=0; i<params.size(); ++i)
+        assert(params[i]->gradient.isApprox(serialGrads[i], 1e-12));
+    // Sums of odd lengths and nested calls.
+    [[maybe_unused]] double total { Deep::Parallel::parallelSum(1001, 1, [](Eigen::Index begin, Eigen::Index end){
+        double partial { 0.0 };
+        for (Eigen::Index i=begin; i<end; ++i)
+            partial += static_cast<double>(i);
+        return partial;
+    }) };
+    assert(total == 1000.0 * 1001.0 / 2.0);
+    std::vector<int> hits(100, 0);
+    Deep::Parallel::parallelFor(10, 1, [&hits](Eigen::Index outerBegin, Eigen::Index outerEnd){
+        for (Eigen::Index i=outerBegin; i<outerEnd; ++i)
+        {
+            Deep::Parallel::parallelFor(10, 1, [&hits, i](Eigen::Index begin, Eigen::Index end){
+                for (Eigen::Index j=begin; j<end; ++j)
+                    ++hits[static_cast<size_t>(i * 10 + j)];
+            });
+        }
+    });
+    for ([[maybe_unused]] int hit: hits)
+        assert(hit == 1);
+    // Exceptions thrown by a block reach the caller.
+    bool thrown { false };
+    try
+    {
+        Deep::Parallel::parallelFor(8, 1, [](Eigen::Index begin, Eigen::Index){
+            if (begin > 0)
+                throw std::runtime_error("Failing block.");
+        });
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    Deep::Parallel::setNumThreads(oldThreads);
+    Deep::Parallel::setGrainSize(oldGrain);
+    std::cout << "Parallel kernels unittest passed.\n";
+    return 0;
+}
+
+int testAutograd()
+{
+    const int oldThreads { Deep::Parallel::getNumThreads() };
+    Deep::Parallel::setNumThreads(4);
+    // Two towers sharing their input and one weight, joined by an add.
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(9, 4), Deep::gradFn::accumulateGrad) };
+    NSP W1 { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(4, 6), Deep::gradFn::accumulateGrad) };
+    NSP W2 { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(6, 3), Deep::gradFn::accumulateGrad) };
+    NSP b { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(6, 1), Deep::gradFn::accumulateGrad) };
+    NSP V { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(4, 3), Deep::gradFn::accumulateGrad) };
+    NSP target { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(9, 3)) };
+    NSP left { Deep::relu(Deep::affine(b, x, W1)) * W2 };
+    NSP right { Deep::relu(x * V) - Deep::transpose(Deep::transpose(x * V)) };
+    NSP loss { Deep::MSE(left + right, target) + Deep::sum(x * W1) };
+    std::vector<NSP> leaves {x, W1, W2, b, V};
+    loss->backward(2.0, true);
+    std::vector<Eigen::MatrixXd> expected {};
+    for (NSP leaf: leaves)
+    {
+        expected.push_back(leaf->gradient);
+        leaf->zeroGrad();
+    }
+    Deep::Autograd::backward(loss, 2.0 * Eigen::MatrixXd::Ones(1, 1), true);
+    for (size_t i=0; i<leaves.size(); ++i)
+        assert(leaves[i]->gradient.isApprox(expected[i], 1e-12));
+    // Gradients accumulate over calls, like Node::backward.
+    Deep::Autograd::backward(loss, 2.0 * Eigen::MatrixXd::Ones(1, 1));
+    assert(W1->gradient.isApprox(2.0 * expected[1], 1e-12));
+    Deep::Parallel::setNumThreads(oldThreads);
+    std::cout << "Parallel backward unittest passed.\n";
+    return 0;
+}
+
+int testCrossEntropy()
+{
+    // Large logits would overflow a naive exp.
+    Eigen::MatrixXd logits { 50.0 * Eigen::MatrixXd::Random(7, 4) };
+    logits(0, 0) = 1000.0;
+    Eigen::MatrixXd labels(7, 1);
+    labels << 0, 1, 2, 3, 3, 1, 0;
+    NSP x { std::make_shared<Deep::Node>(logits, Deep::gradFn::accumulateGrad) };
+    NSP loss { Deep::CrossEntropy(x, labels) };
+    double expected { 0.0 };
+    Eigen::MatrixXd expectedGrad { Eigen::MatrixXd::Zero(7, 4) };
+    for (Eigen::Index i=0; i<7; ++i)
+    {
+        const double rowMax { logits.row(i).maxCoeff() };
+        const Eigen::RowVectorXd p { (logits.row(i).array() - rowMax).exp().matrix() };
+        const Eigen::RowVectorXd softmax { p / p.sum() };
+        const Eigen::Index label { static_cast<Eigen::Index>(labels(i, 0)) };
+        expected -= std::log(softmax(label)) / 7.0;
+        expectedGrad.row(i) = softmax / 7.0;
+        expectedGrad(i, label) -= 1.0 / 7.0;
+    }
+    assert(std::isfinite(loss->data(0,0)));
+    assert(std::abs(loss->data(0,0) - expected) < 1e-9);
+    loss->backward(3.0);
+    assert(x->gradient.isApprox(3.0 * expectedGrad, 1e-9));
+    // Labels must be valid class indices.
+    bool thrown { false };
+    try
+    {
+        labels(2, 0) = 4;
+        Deep::CrossEntropy(x, labels);
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "Cross entropy unittest passed.\n";
+    return 0;
+}
+
+int testInplace()
+{
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(6, 4)) };
+    NSP W { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(4, 3), Deep::gradFn::accumulateGrad) };
+    NSP c { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(6, 3), Deep::gradFn::accumulateGrad) };
+    // Out of place reference.
+    (Deep::sum(Deep::relu(x * W + c)) + Deep::sum(x * W - c))->backward();
+    Eigen::MatrixXd expectedW { W->gradient };
+    Eigen::MatrixXd expectedC { c->gradient };
+    W->zeroGrad();
+    c->zeroGrad();
+    NSP h { x * W };
+    const double* buffer { h->data.data() };
+    // Kept alive by the graph of y.
+    const Deep::Node &taken { *h };
+    NSP y { Deep::relu_(Deep::add_(std::move(h), c)) };
+    // The buffer is handed over, not copied.
+    assert(y->data.data() == buffer && taken.data.size() == 0 && taken.version == 1);
+    NSP loss { Deep::sum(y) + Deep::sum(Deep::sub_(x * W, c)) };
+    loss->backward();
+    assert(W->gradient.isApprox(expectedW, 1e-12));
+    assert(c->gradient.isApprox(expectedC, 1e-12));
+    // A node still used by another node can't be taken.
+    bool thrown { false };
+    NSP h2 { x * W };
+    NSP saved { h2 * Deep::transpose(W) };
+    try
+    {
+        Deep::relu_(std::move(h2));
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    // Nor one the caller keeps, which stays usable.
+    thrown = false;
+    Deep::FullyConnected fc(4, 3);
+    NSP z { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(6, 3)) };
+    NSP fcOut { fc.forward(x) };
+    try
+    {
+        Deep::relu_(fcOut);
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    assert((fcOut + z)->data.isApprox(fcOut->data + z->data));
+    // Once taken through the caller's only pointer, reading it again throws.
+    thrown = false;
+    NSP activated { fcOut->relu_() };
+    try
+    {
+        fcOut + z;
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    // Backward refuses the output ReLU needs once it is overwritten.
+    thrown = false;
+    NSP r { Deep::relu(x * W) };
+    NSP r2 { Deep::add_(std::move(r), c) };
+    try
+    {
+        Deep::sum(r2)->backward();
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    // Leaves that require gradient cannot be overwritten.
+    thrown = false;
+    try
+    {
+        Deep::relu_(W);
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "In-place operations unittest passed.\n";
+    return 0;
+}
+
+int testReleaseGraph()
+{
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(5, 4)) };
+    NSP W { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(4, 3), Deep::gradFn::accumulateGrad) };
+    NSP h { Deep::relu(x * W) };
+    NSP loss { Deep::sum(h) };
+    // Retained graphs can be traversed again, gradients accumulate.
+    loss->backward(1.0, true);
+    const Eigen::MatrixXd once { W->gradient };
+    assert(h->nextNodes.size() == 1 && !h->graphReleased);
+    loss->backward();
+    assert(W->gradient.isApprox(2 * once, 1e-12));
+    // The default backward frees intermediate nodes on the way.
+    assert(loss->graphReleased && loss->nextNodes.empty());
+    assert(h->graphReleased && h->nextNodes.empty() && h->gradient.size() == 0);
+    assert(!W->graphReleased && W->gradient.size() == once.size());
+    bool thrown { false };
+    try
+    {
+        loss->backward();
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    // Same for the parallel executor.
+    W->zeroGrad();
+    NSP loss2 { Deep::sum(Deep::relu(x * W)) };
+    Deep::Autograd::backward(loss2);
+    assert(W->gradient.isApprox(once, 1e-12));
+    assert(loss2->graphReleased && loss2->nextNodes.empty());
+    thrown = false;
+    try
+    {
+        Deep::Autograd::backward(loss2);
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "Graph release unittest passed.\n";
+    return 0;
+}
+
+int testGraphExport()
+{
+    // A deep chain, recursive traversals or destructors would overflow the stack.
+    const int depth { 100000 };
+    NSP w { std::make_shared<Deep::Node>(Eigen::MatrixXd::Constant(1, 1, 2.0), Deep::gradFn::accumulateGrad) };
+    NSP chain { w };
+    for (int i=0; i<depth; ++i)
+        chain = Deep::relu(chain);
+    assert(chain->descendents() == depth + 1);
+    std::ostringstream dot {};
+    chain->exportDot(dot);
+    const std::string dotStr { dot.str() };
+    assert(dotStr.rfind("digraph", 0) == 0);
+    assert(std::count(dotStr.begin(), dotStr.end(), '\n') == 2 * depth + 4);
+    chain->visualizeGraph("unittest3.svg");
+    assert(std::ifstream("unittest3.svg").good());
+    std::remove("unittest3.svg");
+    chain->backward();
+    assert(w->gradient(0, 0) == 1.0);
+    chain.reset();
+
+    // Shared nodes are counted and written once, every edge is kept.
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Ones(2, 2), Deep::gradFn::accumulateGrad) };
+    NSP r { Deep::relu(x) };
+    NSP loss { Deep::sum(r + r) };
+    assert(loss->descendents() == 4);
+    std::ostringstream diamond {};
+    loss->exportDot(diamond);
+    const std::string diamondStr { diamond.str() };
+    assert(std::count(diamondStr.begin(), diamondStr.end(), '>') == 4);
+    assert(diamondStr.find("n1 -> n2;\n    n1 -> n2;") != std::string::npos);
+    std::cout << "Graph export unittest passed.\n";
+    return 0;
+}
+
+int testGraphPasses()
+{
+    using Deep::Graph::Op;
+    /* The regressor, its GEMMs read the weights transposed already,
+    ReLUs become their epilogues. */
+    {
+    Deep::gen.seed(7);
+    MyReg model {};
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(6, 5)) };
+    Deep::Graph::CapturedGraph graph({x}, {model.forward(x)});
+    assert(graph.size() == 16 && graph.count(Op::transpose) == 0);
+    for (const Deep::Graph::GraphNode &node: graph.nodes)
+        assert(node.op != Op::addMm || (!node.transposeA && node.transposeB));
+    std::vector<Deep::Graph::PassReport> reports { Deep::Graph::PassManager::defaultPipeline().run(graph) };
+    assert(reports.size() == 5);
+    assert(reports[2].name == "foldTransposes" && reports[2].nodesBefore - reports[2].nodesAfter == 0);
+    assert(reports[4].name == "fuseElementwise" && reports[4].nodesBefore - reports[4].nodesAfter == 3);
+    assert(graph.size() == 13 && graph.count(Op::transpose) == 0 && graph.count(Op::fused) == 0);
+    const Eigen::MatrixXd batch { Eigen::MatrixXd::Random(9, 5) };
+    assert(graph.run(batch).isApprox(model.forward(std::make_shared<Deep::Node>(batch))->data, 1e-12));
+    }
+
+    /* Transposes of other operands still fold into the GEMM flags. */
+    {
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(4, 3)) };
+    NSP W { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(2, 3), Deep::gradFn::accumulateGrad) };
+    Deep::Graph::CapturedGraph graph({x}, {x * Deep::transpose(W)});
+    assert(graph.size() == 4 && graph.count(Op::transpose) == 1);
+    std::vector<Deep::Graph::PassReport> reports { Deep::Graph::PassManager::defaultPipeline().run(graph) };
+    assert(reports[2].name == "foldTransposes" && reports[2].nodesBefore - reports[2].nodesAfter == 1);
+    assert(graph.size() == 3 && graph.count(Op::transpose) == 0);
+    const Eigen::MatrixXd batch { Eigen::MatrixXd::Random(5, 3) };
+    assert(graph.run(batch).isApprox(batch * W->data.transpose(), 1e-12));
+    }
+
+    /* Constant subgraphs, duplicates and what only the loss reads. */
+    {
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(4, 3)) };
+    NSP W { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(3, 3), Deep::gradFn::accumulateGrad) };
+    NSP c { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(3, 3)) };
+    NSP out { (Deep::relu(x * W) + Deep::relu(x * W)) - x * (Deep::transpose(c) * c) };
+    NSP loss { Deep::sum(out) };
+    Deep::Graph::CapturedGraph graph({x}, {out}, loss);
+    assert(graph.size() == 13);
+    std::vector<Deep::Graph::PassReport> reports { Deep::Graph::PassManager::defaultPipeline().run(graph) };
+    const std::vector<int> removed { 1, 2, 0, 2, 3 };
+    for (size_t i=0; i<reports.size(); ++i)
+        assert(reports[i].nodesBefore - reports[i].nodesAfter == removed[i]);
+    // x, W, the folded constant and two GEMMs, one with the whole element-wise chain.
+    assert(graph.size() == 5 && graph.count(Op::constant) == 1 && graph.count(Op::matMul) == 2);
+    const Eigen::MatrixXd batch { Eigen::MatrixXd::Random(7, 3) };
+    const Eigen::MatrixXd cData { c->data };
+    Eigen::MatrixXd expected { 2 * (batch * W->data).cwiseMax(0.0) - batch * (cData.transpose() * cData) };
+    assert(graph.run(batch).isApprox(expected, 1e-12));
+    // Parameters are read on every run.
+    W->data *= -1.0;
+    expected = 2 * (batch * W->data).cwiseMax(0.0) - batch * (cData.transpose() * cData);
+    assert(graph.run(batch).isApprox(expected, 1e-12));
+    // Released graphs cannot be captured.
+    loss->backward();
+    bool thrown { false };
+    try
+    {
+        Deep::Graph::CapturedGraph released({x}, {out}, loss);
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    }
+    std::cout << "Graph passes unittest passed.\n";
+    return 0;
+}
+
+int testHalf()
+{
+    using Deep::Half::Format;
+    // Bit patterns of exactly representable values and rounding to nearest even.
+    assert(Deep::Half::toBf16(1.0f) == 0x3f80 && Deep::Half::toFp16(1.0f) == 0x3c00);
+    assert(Deep::Half::toBf16(-2.0f) == 0xc000 && Deep::Half::toFp16(-2.0f) == 0xc000);
+    assert(Deep::Half::toFp16(65504.0f) == 0x7bff && Deep::Half::toFp16(65536.0f) == 0x7c00);
+    // Halfway between 1 and the next value rounds to the even 1.
+    assert(Deep::Half::toBf16(1.0f + 1.0f / 256) == 0x3f80 && Deep::Half::toBf16(1.0f + 3.0f / 256) == 0x3f82);
+    assert(Deep::Half::toFp16(1.0f + 1.0f / 2048) == 0x3c00 && Deep::Half::toFp16(1.0f + 3.0f / 2048) == 0x3c02);
+    // Subnormal halves, infinity and NaN.
+    assert(Deep::Half::toFp16(std::ldexp(1.0f, -24)) == 0x0001 && Deep::Half::fromFp16(0x0001) == std::ldexp(1.0f, -24));
+    assert(Deep::Half::fromFp16(0x03ff) == std::ldexp(1023.0f, -24));
+    assert(std::isinf(Deep::Half::fromFp16(Deep::Half::toFp16(1e6f))));
+    assert(std::isinf(Deep::Half::fromBf16(Deep::Half::toBf16(-INFINITY))));
+    assert(std::isnan(Deep::Half::fromFp16(Deep::Half::toFp16(NAN))) && std::isnan(Deep::Half::fromBf16(Deep::Half::toBf16(NAN))));
+    // Every 16-bit value survives a round trip through float.
+    for (uint32_t h=0; h<0x10000u; ++h)
+    {
+        const uint16_t bits { static_cast<uint16_t>(h) };
+        if (!std::isnan(Deep::Half::fromBf16(bits)))
+            assert(Deep::Half::toBf16(Deep::Half::fromBf16(bits)) == bits);
+        if (!std::isnan(Deep::Half::fromFp16(bits)))
+            assert(Deep::Half::toFp16(Deep::Half::fromFp16(bits)) == bits);
+    }
+
+    // Converted models stay within the precision of the format.
+    Deep::gen.seed(7);
+    MyReg model {};
+    Eigen::MatrixXd x { Eigen::MatrixXd::Random(33, 5) };
+    [[maybe_unused]] const Eigen::MatrixXd expected { model.forward(std::make_shared<Deep::Node>(x))->data };
+    std::string modelPath {"./models/cpp-model.json"};
+    model.saveStateDict(modelPath);
+    for (Format format: {Format::bf16, Format::fp16})
+    {
+        MyReg halfModel {};
+        halfModel.loadStateDict(modelPath);
+        Deep::Half::convertModel(halfModel, format, true);
+        assert(halfModel.parameters().size() == 0);
+        [[maybe_unused]] Eigen::MatrixXd actual { halfModel.forward(std::make_shared<Deep::Node>(x))->data };
+        [[maybe_unused]] const double tolerance { format == Format::bf16 ? 0.03 : 0.005 };
+        assert((expected - actual).cwiseAbs().maxCoeff() < tolerance * (expected.cwiseAbs().maxCoeff() + 1e-3));
+    }
+    // A layer with fused ReLU, padded depth and no bias.
+    {
+    Deep::FullyConnected fc(13, 4, false);
+    Deep::Half::HalfFullyConnected half(fc, Format::fp16, false, true);
+    assert(half.weightBytes() == 13 * 4 * 2);
+    Eigen::MatrixXd in { Eigen::MatrixXd::Random(3, 13) };
+    [[maybe_unused]] Eigen::MatrixXd reference { (in * fc.weights->data.transpose()).cwiseMax(0.0) };
+    assert((half.forward(in) - reference).cwiseAbs().maxCoeff() < 1e-2);
+    }
+
+    // The 16-bit state dict loads the rounded weights back exactly.
+    const std::string halfPath {"./models/cpp-model-bf16.json"};
+    Deep::Half::saveHalfStateDict(model, halfPath, Format::bf16);
+    MyReg loaded {};
+    Deep::Half::loadHalfStateDict(loaded, halfPath);
+    std::remove(halfPath.c_str());
+    std::unordered_map<std::string, NSP> originals {};
+    for (const std::pair<std::string, NSP> &p: model.namedParameters())
+        originals[p.first] = p.second;
+    for (const std::pair<std::string, NSP> &p: loaded.namedParameters())
+    {
+        [[maybe_unused]] const Eigen::MatrixXd rounded { originals[p.first]->data.unaryExpr([](double v){
+            return static_cast<double>(Deep::Half::fromBf16(Deep::Half::toBf16(static_cast<float>(v))));
+        }) };
+        assert(p.second->data == rounded);
+    }
+    std::cout << "Half precision unittest passed.\n";
+    return 0;
+}
+
+int testConv()
+{
+    // A 2x2 kernel of ones over a 3x3 image sums each window.
+    {
+    Eigen::MatrixXd image(1, 9);
+    image << 1, 2, 3, 
+             4, 5, 6, 
+             7, 8, 9;
+    NSP x { std::make_shared<Deep::Node>(image) };
+    NSP W { std::make_shared<Deep::Node>(Eigen::MatrixXd::Ones(1, 4)) };
+    NSP b { std::make_shared<Deep::Node>(Eigen::MatrixXd::Constant(1, 1, 0.5)) };
+    Eigen::MatrixXd expected(1, 4);
+    expected << 12.5, 16.5, 24.5, 28.5;
+    assert(Deep::conv2d(x, W, b, Deep::ConvGeometry {1, 3, 3, 2, 1, 0})->data == expected);
+    // Zero padding keeps the size.
+    Eigen::MatrixXd padded { Deep::conv2d(x, W, nullptr, Deep::ConvGeometry {1, 3, 3, 2, 1, 1})->data };
+    assert(padded.cols() == 16 && padded(0, 0) == 1 && padded(0, 5) == 12 && padded(0, 15) == 9);
+    }
+
+    // Several channels, batches, stride and padding against a direct convolution.
+    Deep::gen.seed(3);
+    const Deep::ConvGeometry g {3, 7, 6, 3, 2, 1};
+    Deep::Conv2D conv(3, 4, 3, 7, 6, 2, 1);
+    assert(conv.outHeight() == 4 && conv.outWidth() == 3);
+    conv.biases->data = Eigen::MatrixXd::Random(4, 1);
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(5, 3 * 7 * 6), Deep::gradFn::accumulateGrad) };
+    NSP y { conv.forward(x) };
+    assert(y->data.rows() == 5 && y->data.cols() == 4 * 4 * 3);
+    for (int n=0; n<5; ++n)
+    {
+        for (int o=0; o<4; ++o)
+        {
+            for (int p=0; p<12; ++p)
+            {
+                double direct { conv.biases->data(o, 0) };
+                for (int c=0; c<3; ++c)
+                    for (int ki=0; ki<3; ++ki)
+                        for (int kj=0; kj<3; ++kj)
+                        {
+                            const int h { p / 3 * 2 + ki - 1 };
+                            const int w { p % 3 * 2 + kj - 1 };
+                            if (h >= 0 && h < 7 && w >= 0 && w < 6)
+                                direct += conv.weights->data(o, (c * 3 + ki) * 3 + kj) * x->data(n, (c * 7 + h) * 6 + w);
+                        }
+                assert(std::abs(y->data(n, o * 12 + p) - direct) < 1e-12);
+            }
+        }
+    }
+    // col2im is the adjoint of im2col, <im2col(a), c> == <a, col2im(c)>.
+    {
+    const Eigen::MatrixXd a { Eigen::MatrixXd::Random(2, 3 * 7 * 6) };
+    const Eigen::MatrixXd columns { Deep::im2col(a, g) };
+    const Eigen::MatrixXd c { Eigen::MatrixXd::Random(columns.rows(), columns.cols()) };
+    assert(std::abs(columns.cwiseProduct(c).sum() - a.cwiseProduct(Deep::col2im(c, g, 2)).sum()) < 1e-10);
+    }
+    // Batches large enough to be split across the pool give the same columns.
+    {
+    const int oldThreads { Deep::Parallel::getNumThreads() };
+    const Deep::ConvGeometry big {3, 32, 32, 3, 1, 1};
+    const Eigen::MatrixXd a { Eigen::MatrixXd::Random(64, 3 * 32 * 32) };
+    Deep::Parallel::setNumThreads(1);
+    const Eigen::MatrixXd serial { Deep::im2col(a, big) };
+    Deep::Parallel::setNumThreads(4);
+    const Eigen::MatrixXd parallel { Deep::im2col(a, big) };
+    Deep::Parallel::setNumThreads(oldThreads);
+    assert(serial.cols() == 64 * 32 * 32 && parallel == serial);
+    }
+    // Gradients of x, W and b against central differences.
+    const Eigen::MatrixXd target { Eigen::MatrixXd::Random(5, 48) };
+    NSP loss { Deep::MSE(conv.forward(x), target) };
+    loss->backward();
+    std::vector<NSP> checked { x, conv.weights, conv.biases };
+    for (NSP &param: checked)
+    {
+        for (Eigen::Index i=0; i<param->data.size(); i+=7)
+        {
+            const double saved { param->data(i) };
+            param->data(i) = saved + 1e-6;
+            const double up { Deep::MSE(conv.forward(x), target)->data(0, 0) };
+            param->data(i) = saved - 1e-6;
+            const double down { Deep::MSE(conv.forward(x), target)->data(0, 0) };
+            param->data(i) = saved;
+            [[maybe_unused]] const double numeric { (up - down) / 2e-6 };
+            assert(std::abs(param->gradient(i) - numeric) < 1e-6);
+        }
+    }
+
+    // Max pooling picks the largest of each window, backward routes to it.
+    {
+    Eigen::MatrixXd image(1, 16);
+    image << 1, 5, 2, 0,
+             3, 4, 8, 1,
+             0, 0, -1, -2,
+             9, 0, -3, -4;
+    NSP in { std::make_shared<Deep::Node>(image, Deep::gradFn::accumulateGrad) };
+    Deep::MaxPool2D pool(1, 4, 4, 2);
+    assert(pool.outHeight() == 2 && pool.outWidth() == 2);
+    NSP pooled { pool.forward(in) };
+    Eigen::MatrixXd expected(1, 4);
+    expected << 5, 8, 9, -1;
+    assert(pooled->data == expected);
+    Deep::sum(pooled)->backward();
+    Eigen::MatrixXd routed { Eigen::MatrixXd::Zero(1, 16) };
+    routed(0, 1) = routed(0, 6) = routed(0, 12) = routed(0, 10) = 1;
+    assert(in->gradient == routed);
+    // Overlapping windows, the 8 wins four of them.
+    in->zeroGrad();
+    Deep::sum(Deep::MaxPool2D(1, 4, 4, 3, 1).forward(in))->backward();
+    assert(in->gradient(0, 6) == 3 && in->gradient(0, 12) == 1 && in->gradient.sum() == 4);
+    }
+    // Channels and batches pool independently.
+    {
+    NSP in { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(3, 2 * 4 * 6)) };
+    Eigen::MatrixXd pooled { Deep::MaxPool2D(2, 4, 6, 2).forward(in)->data };
+    assert(pooled.rows() == 3 && pooled.cols() == 2 * 2 * 3);
+    assert(pooled(2, 6 + 5) == in->data.row(2).segment(24 + 2 * 6 + 4, 2).cwiseMax(in->data.row(2).segment(24 + 3 * 6 + 4, 2)).maxCoeff());
+    }
+    // Geometries that don't fit are refused.
+    bool thrown { false };
+    try
+    {
+        Deep::Conv2D tooLarge(1, 1, 5, 3, 3);
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "Convolution and pooling unittest passed.\n";
+    return 0;
+}
+
+int testBatchNorm()
+{
+    // Training mode normalizes every column to mean beta and variance gamma^2.
+    Deep::gen.seed(11);
+    Deep::BatchNorm1d bn(4);
+    bn.gamma->data << 1, 2, 0.5, 3;
+    bn.beta->data << 0, -1, 4, 0.25;
+    NSP x { std::make_shared<Deep::Node>(
+        (Eigen::MatrixXd::Random(16, 4).array() * 3.0 + 1e4).matrix(), Deep::gradFn::accumulateGrad) };
+    NSP y { bn.forward(x) };
+    for (Eigen::Index j=0; j<4; ++j)
+    {
+        [[maybe_unused]] const Eigen::ArrayXd column { y->data.col(j).array() };
+        assert(std::abs(column.mean() - bn.beta->data(j, 0)) < 1e-9);
+        const double var { (column - column.mean()).square().mean() };
+        [[maybe_unused]] const double batchVar { (x->data.col(j).array() - x->data.col(j).mean()).square().mean() };
+        assert(std::abs(var - std::pow(bn.gamma->data(j, 0), 2) * batchVar / (batchVar + 1e-5)) < 1e-8);
+    }
+    // Running statistics moved by momentum, with the unbiased variance.
+    const Eigen::VectorXd mean { x->data.colwise().mean().transpose() };
+    const Eigen::VectorXd unbiased { (x->data.rowwise() - mean.transpose()).colwise().squaredNorm().transpose() / 15.0 };
+    assert(bn.runningMean->data.col(0).isApprox(0.1 * mean, 1e-12));
+    assert(bn.runningVar->data.col(0).isApprox(Eigen::VectorXd::Constant(4, 0.9) + 0.1 * unbiased, 1e-12));
+
+    // Analytic gradients against central differences, in both modes.
+    const Eigen::MatrixXd target { Eigen::MatrixXd::Random(16, 4) };
+    x->data = Eigen::MatrixXd::Random(16, 4);
+    bn.runningMean->data = Eigen::MatrixXd::Random(4, 1);
+    bn.runningVar->data = Eigen::MatrixXd::Constant(4, 1, 0.5);
+    for (bool training: {true, false})
+    {
+        bn.training = training;
+        x->zeroGrad();
+        bn.gamma->zeroGrad();
+        bn.beta->zeroGrad();
+        const Eigen::MatrixXd runningMean { bn.runningMean->data };
+        const Eigen::MatrixXd runningVar { bn.runningVar->data };
+        auto loss = [&](){
+            NSP L { Deep::MSE(bn.forward(x), target) };
+            bn.runningMean->data = runningMean;
+            bn.runningVar->data = runningVar;
+            return L;
+        };
+        loss()->backward();
+        std::vector<NSP> checked { x, bn.gamma, bn.beta };
+        for (NSP &param: checked)
+        {
+            for (Eigen::Index i=0; i<param->data.size(); i+=3)
+            {
+                const double saved { param->data(i) };
+                param->data(i) = saved + 1e-6;
+                const double up { loss()->data(0, 0) };
+                param->data(i) = saved - 1e-6;
+                const double down { loss()->data(0, 0) };
+                param->data(i) = saved;
+                [[maybe_unused]] const double numeric { (up - down) / 2e-6 };
+                assert(std::abs(param->gradient(i) - numeric) < 1e-6);
+            }
+        }
+    }
+    // A single row has no batch statistics.
+    bn.training = true;
+    bool thrown { false };
+    try
+    {
+        bn.forward(std::make_shared<Deep::Node>(Eigen::MatrixXd::Ones(1, 4)));
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // Folding leaves the FullyConnected GEMMs only, with the eval mode output.
+    BNNet model {};
+    Deep::Optim::SGD optimizer(model.namedParameters(), 0.05);
+    const Eigen::MatrixXd batch { Eigen::MatrixXd::Random(32, 5) };
+    for (int step=0; step<20; ++step)
+    {
+        optimizer.zeroGrad();
+        Deep::MSE(model.forward(std::make_shared<Deep::Node>(batch)), Eigen::MatrixXd::Random(32, 3))->backward();
+        optimizer.step();
+    }
+    assert(model.namedParameters().size() == 7 && model.namedBuffers().size() == 4);
+    // Buffers go through the state dict.
+    const std::string modelPath {"./models/cpp-model-bn.json"};
+    model.saveStateDict(modelPath);
+    BNNet loaded {};
+    loaded.loadStateDict(modelPath);
+    std::remove(modelPath.c_str());
+    assert(static_cast<Deep::BatchNorm1d*>(loaded.layers["bn2"].get())->runningVar->data 
+        == static_cast<Deep::BatchNorm1d*>(model.layers["bn2"].get())->runningVar->data);
+
+    const Eigen::MatrixXd test { Eigen::MatrixXd::Random(9, 5) };
+    Deep::setTraining(model, false);
+    [[maybe_unused]] const Eigen::MatrixXd expected { model.forward(std::make_shared<Deep::Node>(test))->data };
+    assert(Deep::Fold::foldBatchNorm(model, batch) == 2);
+    assert(model.parameters().size() == 4 && model.namedBuffers().size() == 0);
+    NSP in { std::make_shared<Deep::Node>(test) };
+    NSP out { model.forward(in) };
+    assert(out->data.isApprox(expected, 1e-12));
+    Deep::Graph::CapturedGraph graph({in}, {out});
+    assert(graph.count(Deep::Graph::Op::addMm) == 2 && graph.size() == 8);
+    std::cout << "Batch normalization unittest passed.\n";
+    return 0;
+}
+
+/* Run body on worldSize ranks, each a thread with its own transport,
+as separate processes would. */
+void runRanks(int worldSize, std::function<Deep::Dist::Transport*(int)> makeTransport,
+    std::function<void(Deep::Dist::ProcessGroup&)> body)
+{
+    std::vector<std::thread> ranks {};
+    std::vector<std::exception_ptr> errors(static_cast<size_t>(worldSize));
+    for (int r=0; r<worldSize; ++r)
+    {
+        ranks.emplace_back([&, r](){
+            try
+            {
+                Deep::Dist::ProcessGroup group { std::unique_ptr<Deep::Dist::Transport>(makeTransport(r)) };
+                body(group);
+            }
+            catch (...)
+            {
+                errors[static_cast<size_t>(r)] = std::current_exception();
+            }
+        });
+    }
+    for (std::thread &t: ranks)
+        t.join();
+    for (std::exception_ptr &e: errors)
+    {
+        if (e)
+            std::rethrow_exception(e);
+    }
+}
+
+int testDistributed()
+{
+    const int worldSize { 3 };
+    auto collectives = [worldSize](Deep::Dist::ProcessGroup &group){
+        const int r { group.rank() };
+        // Lengths shorter than, not divisible by and larger than the ring.
+        for (size_t length: {size_t(1), size_t(2), size_t(7), size_t(100000)})
+        {
+            std::vector<double> data(length);
+            for (size_t i=0; i<length; ++i)
+                data[i] = 1000.0 * r + static_cast<double>(i);
+            group.allReduce(data);
+            for (size_t i=0; i<length; ++i)
+                assert(data[i] == worldSize * static_cast<double>(i) + 1000.0 * worldSize * (worldSize - 1) / 2);
+        }
+        std::vector<double> data(40000, 0.0);
+        if (r == 1)
+            std::iota(data.begin(), data.end(), 0.0);
+        group.broadcast(data, 1);
+        for (size_t i=0; i<data.size(); ++i)
+            assert(data[i] == static_cast<double>(i));
+
+        // Averaged gradients of equal shards are the gradient of the whole batch.
+        Deep::gen.seed(5);
+        MyReg replica {};
+        Deep::gen.seed(5);
+        MyReg whole {};
+        std::mt19937 dataGen(9);
+        std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+        Eigen::MatrixXd features { Eigen::MatrixXd::NullaryExpr(4 * worldSize, 5, [&](){ return uniform(dataGen); }) };
+        Eigen::MatrixXd labels { Eigen::MatrixXd::NullaryExpr(4 * worldSize, 1, [&](){ return uniform(dataGen); }) };
+        NSP shard { std::make_shared<Deep::Node>(features.middleRows(4 * r, 4)) };
+        Deep::MSE(replica.forward(shard), labels.middleRows(4 * r, 4))->backward();
+        group.allReduceGradients(replica);
+        Deep::MSE(whole.forward(std::make_shared<Deep::Node>(features)), labels)->backward();
+        std::vector<std::pair<std::string, NSP>> averaged { Deep::Dist::sortedParameters(replica) };
+        std::vector<std::pair<std::string, NSP>> expected { Deep::Dist::sortedParameters(whole) };
+        for (size_t i=0; i<averaged.size(); ++i)
+            assert(averaged[i].second->gradient.isApprox(expected[i].second->gradient, 1e-12));
+
+        // Differently initialized replicas all take the weights of rank 0.
+        Deep::gen.seed(static_cast<unsigned>(r));
+        MyReg model {};
+        group.broadcastParameters(model);
+        Deep::gen.seed(0);
+        MyReg reference {};
+        for (const std::pair<std::string, NSP> &p: model.namedParameters())
+            assert(p.second->data == reference.layers[p.first.substr(0, 3)]->params()[p.first.back() == '1' ? 0 : 1]->data);
+    };
+    const std::string name { "/deep-unittest-" + std::to_string(getpid()) };
+    runRanks(worldSize, [&](int r){ return new Deep::Dist::SharedMemoryTransport(name, r, worldSize, 7, 1000); }, collectives);
+    // Ranks of different runs don't attach to each other's segment.
+    bool thrown { false };
+    try
+    {
+        runRanks(2, [&](int r){ return new Deep::Dist::SharedMemoryTransport(name, r, 2, r == 0 ? 7 : 8, 1000, 0.3); },
+            [](Deep::Dist::ProcessGroup&){});
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    // A rank waiting on a neighbour which never sends gives up.
+    thrown = false;
+    try
+    {
+        runRanks(2, [&](int r){ return new Deep::Dist::SharedMemoryTransport(name, r, 2, 9, 1000, 0.3); },
+            [](Deep::Dist::ProcessGroup &group){
+                std::vector<double> data { 1.0 };
+                if (group.rank() == 0)
+                    group.allReduce(data);
+            });
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    const int basePort { 20000 + static_cast<int>(getpid() % 20000) };
+    runRanks(worldSize, [&](int r){ return new Deep::Dist::TcpTransport(r, worldSize, basePort); }, collectives);
+    // A ring of one connects to itself.
+    runRanks(1, [&](int r){ return new Deep::Dist::TcpTransport(r, 1, basePort + worldSize); }, [](Deep::Dist::ProcessGroup &group){
+        std::vector<double> data { 1.0, 2.0 };
+        group.allReduce(data);
+        group.broadcast(data);
+        assert(data[0] == 1.0 && data[1] == 2.0);
+    });
+    std::cout << "Distributed collectives unittest passed.\n";
+    return 0;
+}
+
+int testFusion()
+{
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(50, 40), Deep::gradFn::accumulateGrad) };
+    NSP W { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(40, 40), Deep::gradFn::accumulateGrad) };
+    NSP c { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(50, 40), Deep::gradFn::accumulateGrad) };
+    // Eager reference.
+    NSP eager { Deep::relu(Deep::relu(x * W) + x) - (c + c) };
+    Deep::sum(eager * W)->backward();
+    const std::vector<Eigen::MatrixXd> expected { x->gradient, W->gradient, c->gradient };
+    for (const NSP &p: {x, W, c})
+        p->zeroGrad();
+    {
+    Deep::Fusion::LazyGuard lazy;
+    NSP h { x * W };
+    NSP y { Deep::relu(Deep::relu(h) + x) - (c + c) };
+    // One node reading h, x and c once each, nothing computed yet.
+    assert(y->deferred && y->data.size() == 0 && y->program.size() == 5);
+    assert(y->nextNodes.size() == 3 && y->shape() == std::vector<int>({50, 40}));
+    assert(y->gradientFunction == Deep::gradFn::fusedBackward && y->saved != nullptr);
+    NSP loss { Deep::sum(y * W) };
+    assert(!y->deferred && y->data.isApprox(eager->data, 1e-12));
+    loss->backward();
+    // The gradients of h, x and c come from one pass, released with the graph.
+    assert(y->saved == nullptr);
+    }
+    assert(!Deep::Fusion::isLazy());
+    assert(x->gradient.isApprox(expected[0], 1e-12));
+    assert(W->gradient.isApprox(expected[1], 1e-12));
+    assert(c->gradient.isApprox(expected[2], 1e-12));
+
+    // In-place variants defer too, the parallel executor runs the fused backward.
+    for (const NSP &p: {x, W, c})
+        p->zeroGrad();
+    {
+    Deep::Fusion::LazyGuard lazy;
+    NSP y { Deep::sub_(Deep::relu_(Deep::add_(Deep::relu(x * W), x)), c + c) };
+    Deep::Autograd::backward(Deep::sum(y * W));
+    }
+    assert(x->gradient.isApprox(expected[0], 1e-12));
+    assert(W->gradient.isApprox(expected[1], 1e-12));
+    assert(c->gradient.isApprox(expected[2], 1e-12));
+
+    // Reusing a deferred node doubles its program, operands are materialized past maxSteps.
+    {
+    Deep::Fusion::LazyGuard lazy;
+    NSP t { x };
+    Eigen::MatrixXd reference { x->data };
+    for (int i=0; i<20; ++i)
+    {
+        t = t + Deep::relu(t);
+        reference = reference + reference.cwiseMax(0.0);
+    }
+    assert(t->program.size() <= Deep::Fusion::maxSteps);
+    t->materialize();
+    assert(t->data.isApprox(reference, 1e-12));
+    /* Overwritten operands are detected when materializing. In-place ops
+    refuse shared nodes, so the take counts both owners of h as its own. */
+    NSP h { x * W };
+    NSP y { Deep::relu(h) + c };
+    bool thrown { false };
+    try
+    {
+        h->takeData(2);
+        y->materialize();
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    // Deferred expressions are captured as fused kernels.
+    NSP in { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(6, 40)) };
+    NSP out { Deep::relu(in * W) - in };
+    Deep::Graph::CapturedGraph graph({in}, {out});
+    assert(graph.count(Deep::Graph::Op::fused) == 1);
+    const Eigen::MatrixXd batch { Eigen::MatrixXd::Random(3, 40) };
+    assert(graph.run(batch).isApprox((batch * W->data).cwiseMax(0.0) - batch, 1e-12));
+    }
+    std::cout << "Fusion unittest passed.\n";
+    return 0;
+}
+
+int testEval()
+{
+    // Without gradient, results hold no operand and need no backward.
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(4, 3)) };
+    NSP W { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(3, 2), Deep::gradFn::accumulateGrad) };
+    {
+    Deep::NoGradGuard noGrad;
+    {
+    Deep::NoGradGuard nested;
+    }
+    assert(!Deep::isGradEnabled());
+    NSP y { Deep::relu(x * W) };
+    assert(y->gradientFunction == Deep::gradFn::none && y->nextNodes.empty() && y->isLeaf);
+    assert(y->data.isApprox((x->data * W->data).cwiseMax(0.0), 1e-12));
+    }
+    assert(Deep::isGradEnabled());
+    assert((x * W)->gradientFunction == Deep::gradFn::matMulBackward);
+
+    // Sharded metrics match a serial reference.
+    Deep::gen.seed(3);
+    MyReg model {};
+    const Eigen::Index N { 1000 };
+    const Eigen::MatrixXd features { Eigen::MatrixXd::Random(N, 5) };
+    const Eigen::MatrixXd raw { model.forward(std::make_shared<Deep::Node>(features))->data };
+    // Labels around the predictions, so every kind of error shows up.
+    Eigen::MatrixXd labels(N, 1);
+    for (Eigen::Index i=0; i<N; ++i)
+        labels(i, 0) = std::round(raw(i, 0)) + static_cast<double>(i % 4) - 1.0;
+    Deep::Eval::EvalOptions options {};
+    options.minClass = static_cast<int>(labels.minCoeff());
+    options.maxClass = static_cast<int>(labels.maxCoeff());
+    options.batchSize = 64;
+    options.numShards = 1;
+    const Deep::Eval::Metrics serial { Deep::Eval::evaluate(model, features, labels, options) };
+    options.numShards = 7;
+    const Deep::Eval::Metrics sharded { Deep::Eval::evaluate(model, features, labels, options) };
+    assert(serial.rows == N && sharded.rows == N);
+    assert(serial.correct == N / 4 && serial.correctOffOne == 3 * N / 4);
+    assert(sharded.correct == serial.correct && sharded.correctOffOne == serial.correctOffOne);
+    assert(sharded.confusion == serial.confusion && sharded.confusion.sum() == N);
+    assert(std::abs(sharded.accuracy() - 25.0) < 1e-12 && std::abs(sharded.accuracyOffOne() - 75.0) < 1e-12);
+    const Eigen::ArrayXd error { (raw - labels).array() };
+    assert(std::abs(sharded.mse() - error.square().mean()) < 1e-9);
+    assert(std::abs(sharded.mae() - error.abs().mean()) < 1e-9);
+    assert(sharded.summary().at("rowsPerSecond") > 0.0);
+    // Labels out of the class range are refused.
+    options.maxClass = options.minClass;
+    bool thrown { false };
+    try
+    {
+        Deep::Eval::evaluate(model, features, labels, options);
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    // Models still training are evaluated with their running statistics, left untouched.
+    {
+    BNReg bnModel {};
+    Deep::BatchNorm1d *bn { static_cast<Deep::BatchNorm1d*>(bnModel.layers["bn1"].get()) };
+    bn->runningMean->data = Eigen::MatrixXd::Random(8, 1);
+    const Eigen::MatrixXd runningMean { bn->runningMean->data };
+    Deep::setTraining(bnModel, false);
+    const Eigen::MatrixXd bnRaw { bnModel.forward(std::make_shared<Deep::Node>(features))->data };
+    Deep::setTraining(bnModel, true);
+    const Eigen::MatrixXd bnLabels { bnRaw.unaryExpr([](double v){ return std::round(v); }) };
+    Deep::Eval::EvalOptions bnOptions {};
+    bnOptions.minClass = static_cast<int>(bnLabels.minCoeff());
+    bnOptions.maxClass = static_cast<int>(bnLabels.maxCoeff());
+    bnOptions.batchSize = 64;
+    bnOptions.numShards = 4;
+    const Deep::Eval::Metrics bnMetrics { Deep::Eval::evaluate(bnModel, features, bnLabels, bnOptions) };
+    assert(bnMetrics.correct == N && bn->training && bn->runningMean->data == runningMean);
+    }
+    std::cout << "Evaluation unittest passed.\n";
+    return 0;
+}
+
+int testHogwild()
+{
+    Deep::gen.seed(5);
+    const int N { 512 };
+    const Eigen::MatrixXd features { Eigen::MatrixXd::Random(N, 5) };
+    const Eigen::MatrixXd labels { (features * Eigen::VectorXd::LinSpaced(5, -1.0, 1.0)).array() + 0.5 };
+    const std::vector<Eigen::MatrixXd> dataset { features, labels };
+    auto makeReplica = [](){ return std::unique_ptr<Deep::Model>(new MyReg()); };
+    auto loss = [&](MyReg &model){
+        return Deep::MSE(model.forward(std::make_shared<Deep::Node>(features)), labels)->data(0, 0);
+    };
+    Deep::Hogwild::HogwildOptions options {};
+    options.batchSize = 32;
+    options.epochs = 3;
+    options.lr = 1e-3;
+    options.seed = 11;
+
+    // A single worker is plain SGD with momentum over the same shuffles.
+    MyReg initial {};
+    MyReg reference {};
+    Deep::Hogwild::SharedParameters(initial).read(reference);
+    {
+    Deep::Optim::SGD optimizer(reference.namedParameters(), options.lr, options.momentum);
+    std::mt19937 shuffleGen(options.seed);
+    std::vector<int> perm(N);
+    for (int e=0; e<options.epochs; ++e)
+    {
+        std::iota(perm.begin(), perm.end(), 0);
+        std::shuffle(perm.begin(), perm.end(), shuffleGen);
+        for (int b=0; b+options.batchSize<=N; b+=options.batchSize)
+        {
+            const std::vector<Eigen::MatrixXd> batch { Deep::Data::selectRows(dataset,
+                std::vector<int>(perm.begin() + b, perm.begin() + b + options.batchSize)) };
+            optimizer.zeroGrad();
+            Deep::MSE(reference.forward(std::make_shared<Deep::Node>(batch[0])), batch[1])->backward();
+            optimizer.step();
+        }
+    }
+    }
+    MyReg single {};
+    Deep::Hogwild::SharedParameters(initial).read(single);
+    options.numThreads = 1;
+    const Deep::Hogwild::HogwildReport serial { Deep::Hogwild::train(single, makeReplica, dataset, options) };
+    assert(serial.steps == options.epochs * (N / options.batchSize));
+    assert(serial.droppedSteps == 0 && serial.maxObservedStaleness == 0);
+    assert(serial.epochLoss.size() == static_cast<size_t>(options.epochs));
+    assert(std::abs(loss(single) - loss(reference)) < 1e-12);
+
+    // Several workers race on the shared parameters and still learn.
+    MyReg racing {};
+    Deep::Hogwild::SharedParameters(initial).read(racing);
+    options.numThreads = 4;
+    options.epochs = 10;
+    const double before { loss(racing) };
+    const Deep::Hogwild::HogwildReport async { Deep::Hogwild::train(racing, makeReplica, dataset, options) };
+    assert(async.steps == options.epochs * (N / options.batchSize));
+    assert(async.droppedSteps == 0);
+    assert(loss(racing) < before);
+
+    // Stale steps are dropped, but always counted.
+    options.maxStaleness = 0;
+    const Deep::Hogwild::HogwildReport bounded { Deep::Hogwild::train(racing, makeReplica, dataset, options) };
+    assert(bounded.steps == async.steps);
+    assert(bounded.droppedSteps >= 0 && bounded.droppedSteps < bounded.steps);
+    assert((bounded.droppedSteps > 0) == (bounded.maxObservedStaleness > 0));
+
+    bool thrown { false };
+    options.numThreads = 0;
+    try
+    {
+        Deep::Hogwild::train(racing, makeReplica, dataset, options);
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "Hogwild unittest passed.\n";
+    return 0;
+}
+
+int testEnsemble()
+{
+    Deep::gen.seed(9);
+    const Eigen::MatrixXd x { Eigen::MatrixXd::Random(50, 5) };
+    std::vector<std::unique_ptr<Deep::Model>> owned {};
+    std::vector<Deep::Model*> members {};
+    for (int k=0; k<3; ++k)
+    {
+        owned.push_back(std::unique_ptr<Deep::Model>(new MyReg()));
+        members.push_back(owned.back().get());
+    }
+    Deep::Ensemble::StackedEnsemble ensemble(members, x);
+    assert(ensemble.size() == 3);
+    const Eigen::MatrixXd all { ensemble.forwardAll(x) };
+    assert(all.rows() == 50 && all.cols() == 3);
+    Eigen::MatrixXd mean { Eigen::MatrixXd::Zero(50, 1) };
+    for (int k=0; k<3; ++k)
+    {
+        const Eigen::MatrixXd y { members[static_cast<size_t>(k)]->forward(std::make_shared<Deep::Node>(x))->data };
+        assert(all.col(k).isApprox(y, 1e-12));
+        mean += y / 3.0;
+    }
+    assert(ensemble.forwardMean(x).isApprox(mean, 1e-12));
+    NSP out { ensemble.forward(std::make_shared<Deep::Node>(x)) };
+    assert(out->gradientFunction == Deep::gradFn::none && out->data.isApprox(mean, 1e-12));
+
+    // Folded BatchNorm layers leave Identities, and outputs with several columns.
+    std::vector<std::unique_ptr<BNNet>> nets {};
+    std::vector<Deep::Model*> folded {};
+    for (int k=0; k<4; ++k)
+    {
+        nets.push_back(std::unique_ptr<BNNet>(new BNNet()));
+        Deep::setTraining(*nets.back(), true);
+        nets.back()->forward(std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(20, 5)));
+        Deep::Fold::foldBatchNorm(*nets.back(), x);
+        folded.push_back(nets.back().get());
+    }
+    Deep::Ensemble::StackedEnsemble bnEnsemble(folded, x);
+    const Eigen::MatrixXd bnAll { bnEnsemble.forwardAll(x) };
+    Eigen::MatrixXd bnMean { Eigen::MatrixXd::Zero(50, 3) };
+    for (int k=0; k<4; ++k)
+    {
+        const Eigen::MatrixXd y { folded[static_cast<size_t>(k)]->forward(std::make_shared<Deep::Node>(x))->data };
+        assert(bnAll.middleCols(3 * k, 3).isApprox(y, 1e-12));
+        bnMean += y / 4.0;
+    }
+    assert(bnEnsemble.forwardMean(x).isApprox(bnMean, 1e-12));
+
+    // Members must share one FullyConnected architecture.
+    int thrown { 0 };
+    BNNet unfolded {};
+    members.push_back(&unfolded);
+    try
+    {
+        Deep::Ensemble::StackedEnsemble mixed(members, x);
+    }
+    catch (const std::invalid_argument&)
+    {
+        ++thrown;
+    }
+    try
+    {
+        ensemble.forwardAll(Eigen::MatrixXd::Random(2, 4));
+    }
+    catch (const std::invalid_argument&)
+    {
+        ++thrown;
+    }
+    assert(thrown == 2);
+    std::cout << "Stacked ensemble unittest passed.\n";
+    return 0;
+}
+
+int testExport()
+{
+    Deep::gen.seed(13);
+    MyReg model {};
+    const Eigen::MatrixXd x { Eigen::MatrixXd::Random(4, 5) };
+    const std::string path { "./export-unittest.h" };
+    Deep::Export::exportHeader(model, x, path, "exported_reg");
+    std::ifstream file(path);
+    std::stringstream buffer {};
+    buffer << file.rdbuf();
+    const std::string header { buffer.str() };
+    std::remove(path.c_str());
+    assert(header.find("namespace exported_reg") != std::string::npos);
+    assert(header.find("constexpr std::size_t inputSize { 5 };") != std::string::npos);
+    assert(header.find("constexpr std::size_t outputSize { 1 };") != std::string::npos);
+    assert(header.find("#include <Eigen") == std::string::npos && header.find("#include <nlohmann") == std::string::npos);
+    // The layers in call order, ReLUs fused in all but the last one.
+    const size_t fc1 { header.find("detail::affine<5, 3, true>(detail::weights0, detail::biases0, in, h0);") };
+    const size_t fc4 { header.find("detail::affine<10, 1, false>(detail::weights3, detail::biases3, h2, out);") };
+    assert(fc1 != std::string::npos && fc4 != std::string::npos && fc1 < fc4);
+
+    // Weights are row-major and read back as the same doubles.
+    const Eigen::MatrixXd &W { static_cast<Deep::FullyConnected*>(model.layers["fc2"].get())->weights->data };
+    std::string values { header.substr(header.find("weights1[6] = {") + 15) };
+    values = values.substr(0, values.find('}'));
+    std::replace(values.begin(), values.end(), ',', ' ');
+    std::istringstream parsed(values);
+    for (Eigen::Index o=0; o<W.rows(); ++o)
+    {
+        for (Eigen::Index i=0; i<W.cols(); ++i)
+        {
+            std::string token;
+            parsed >> token;
+            assert(std::strtod(token.c_str(), nullptr) == W(o, i));
+        }
+    }
+
+    bool thrown { false };
+    try
+    {
+        Deep::Export::exportHeader(model, x, path, "1model");
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "Header export unittest passed.\n";
+    return 0;
+}
+
+int testAffineT()
+{
+    // affineT reads W [out_c, in_c] in place and matches affine on its transposed copy.
+    NSP x1 { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(6, 4), Deep::gradFn::accumulateGrad) };
+    NSP W1 { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(3, 4), Deep::gradFn::accumulateGrad) };
+    NSP b1 { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(3, 1), Deep::gradFn::accumulateGrad) };
+    NSP x2 { std::make_shared<Deep::Node>(x1->data, Deep::gradFn::accumulateGrad) };
+    NSP W2 { std::make_shared<Deep::Node>(W1->data, Deep::gradFn::accumulateGrad) };
+    NSP b2 { std::make_shared<Deep::Node>(b1->data, Deep::gradFn::accumulateGrad) };
+    NSP y1 { Deep::affineT(b1, x1, W1) };
+    NSP y2 { Deep::affine(b2, x2, Deep::transpose(W2)) };
+    assert(y1->gradientFunction == Deep::gradFn::addMmTBackward && y1->nextNodes[2] == W1);
+    assert(y1->data.isApprox(y2->data, 1e-12));
+    Deep::sum(Deep::relu(y1))->backward();
+    Deep::sum(Deep::relu(y2))->backward();
+    assert(x1->gradient.isApprox(x2->gradient, 1e-12));
+    assert(W1->gradient.isApprox(W2->gradient, 1e-12) && W1->gradient.rows() == 3);
+    assert(b1->gradient.isApprox(b2->gradient, 1e-12));
+    std::cout << "Transposed affine unittest passed.\n";
+    return 0;
+}
+
+int testEmbedding()
+{
+    // Row b of the output holds the columns ids(b, 0), ids(b, 1) side by side.
+    Deep::gen.seed(23);
+    Deep::Embedding sparse(10, 3);
+    Deep::Embedding dense(10, 3, false);
+    dense.weights->data = sparse.weights->data;
+    assert(sparse.weights->sparseGradient && !dense.weights->sparseGradient);
+    assert(sparse.weights->gradient.size() == 0 && dense.weights->gradient.rows() == 3);
+    Eigen::MatrixXd ids(4, 2);
+    ids << 1, 7,
+           7, 0,
+           9, 1,
+           1, 1;
+    NSP in { std::make_shared<Deep::Node>(ids, Deep::gradFn::none) };
+    NSP y1 { sparse.forward(in) };
+    NSP y2 { dense.forward(in) };
+    assert(y1->data.rows() == 4 && y1->data.cols() == 6);
+    assert(y1->data.block(2, 0, 1, 3) == sparse.weights->data.col(9).transpose());
+    assert(y1->data.block(1, 3, 1, 3) == sparse.weights->data.col(0).transpose());
+
+    // The sparse gradient records one column per id, and scatters to the dense one.
+    const Eigen::MatrixXd target { Eigen::MatrixXd::Random(4, 6) };
+    Deep::MSE(y1, target)->backward();
+    Deep::MSE(y2, target)->backward();
+    assert(sparse.weights->gradient.size() == 0);
+    assert(sparse.weights->sparseColumns.size() == 8 && sparse.weights->sparseValues.cols() == 8);
+    assert(sparse.weights->denseGradient().isApprox(dense.weights->gradient, 1e-12));
+    assert(dense.weights->gradient.col(4).isZero());
+
+    // Same through the parallel executor.
+    sparse.weights->zeroGrad();
+    assert(sparse.weights->sparseColumns.empty());
+    Deep::Autograd::backward(Deep::MSE(sparse.forward(in), target));
+    assert(sparse.weights->denseGradient().isApprox(dense.weights->gradient, 1e-12));
+
+    // Without momentum the sparse step is the dense one, untouched columns stay as they are.
+    const Eigen::MatrixXd before { sparse.weights->data };
+    Deep::Optim::SGD sparseOptimizer(std::vector<std::pair<std::string, NSP>> {{"weights", sparse.weights}}, 0.1, 0.0);
+    Deep::Optim::SGD denseOptimizer(std::vector<std::pair<std::string, NSP>> {{"weights", dense.weights}}, 0.1, 0.0);
+    for (int i=0; i<2; ++i)
+    {
+        sparseOptimizer.zeroGrad();
+        denseOptimizer.zeroGrad();
+        Deep::MSE(sparse.forward(in), target)->backward();
+        Deep::MSE(dense.forward(in), target)->backward();
+        sparseOptimizer.step();
+        denseOptimizer.step();
+    }
+    assert(sparse.weights->data.isApprox(dense.weights->data, 1e-12));
+    assert(sparse.weights->data.col(4) == before.col(4) && sparse.weights->data.col(1) != before.col(1));
+
+    // With momentum the velocity of a column only moves when it is hit.
+    Deep::Optim::SGD momentumOptimizer(std::vector<std::pair<std::string, NSP>> {{"weights", sparse.weights}}, 0.1, 0.9);
+    momentumOptimizer.zeroGrad();
+    Deep::MSE(sparse.forward(in), target)->backward();
+    momentumOptimizer.step();
+    const Eigen::MatrixXd &velocity { momentumOptimizer.prevParameters["weights"] };
+    assert(velocity.col(4).isZero() && velocity.col(1).isApprox(sparse.weights->denseGradient().col(1), 1e-12));
+
+    // A dense gradient reaching the table only lasts until the next zeroGrad.
+    momentumOptimizer.zeroGrad();
+    Deep::MSE(sparse.weights, Eigen::MatrixXd::Zero(3, 10))->backward();
+    assert(sparse.weights->gradient.size() == 30);
+    momentumOptimizer.step();
+    momentumOptimizer.zeroGrad();
+    assert(sparse.weights->gradient.size() == 0);
+    Deep::MSE(sparse.forward(in), target)->backward();
+    assert(sparse.weights->gradient.size() == 0 && sparse.weights->sparseColumns.size() == 8);
+
+    // Ids must be indices of the table.
+    bool thrown { false };
+    try
+    {
+        sparse.forward(std::make_shared<Deep::Node>(Eigen::MatrixXd::Constant(1, 1, 10.0), Deep::gradFn::none));
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "Embedding unittest passed.\n";
+    return 0;
+}
+
+int testRecurrent()
+{
+    Deep::gen.seed(29);
+    const int B { 3 };
+    const int L { 4 };
+    const int I { 2 };
+    const int H { 3 };
+    Deep::LSTM lstm(I, H);
+    Deep::GRU gru(I, H);
+    assert(lstm.weightsIh->data.rows() == 4 * H && gru.weightsHh->data.rows() == 3 * H);
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(B, L * I), Deep::gradFn::accumulateGrad) };
+    auto sigmoid = [](const Eigen::ArrayXd &a) -> Eigen::ArrayXd { return 1.0 / (1.0 + (-a).exp()); };
+
+    // The first step starts from zero states, h = o * tanh(i * g) and h = (1 - z) * n.
+    NSP h { lstm.forward(x) };
+    assert(h->gradientFunction == Deep::gradFn::lstmBackward && h->data.rows() == B && h->data.cols() == L * H);
+    const Eigen::VectorXd x0 { x->data.block(1, 0, 1, I).transpose() };
+    const Eigen::ArrayXd a { lstm.weightsIh->data * x0 + lstm.biasesIh->data + lstm.biasesHh->data };
+    const Eigen::ArrayXd lstmFirst { sigmoid(a.tail(H)) * (sigmoid(a.head(H)) * a.segment(2 * H, H).tanh()).tanh() };
+    assert(h->data.block(1, 0, 1, H).transpose().isApprox(lstmFirst.matrix(), 1e-12));
+    const Eigen::ArrayXd p { gru.weightsIh->data * x0 + gru.biasesIh->data };
+    const Eigen::ArrayXd q { gru.biasesHh->data };
+    const Eigen::ArrayXd r { sigmoid(p.head(H) + q.head(H)) };
+    const Eigen::ArrayXd z { sigmoid(p.segment(H, H) + q.segment(H, H)) };
+    const Eigen::ArrayXd gruFirst { (1.0 - z) * (p.tail(H) + r * q.tail(H)).tanh() };
+    assert(gru.forward(x)->data.block(1, 0, 1, H).transpose().isApprox(gruFirst.matrix(), 1e-12));
+
+    // Backward through time against central differences, for every operand.
+    const Eigen::MatrixXd target { Eigen::MatrixXd::Random(B, L * H) };
+    std::vector<Deep::RecurrentLayer*> layers { &lstm, &gru };
+    for (Deep::RecurrentLayer *layer: layers)
+    {
+        x->zeroGrad();
+        Deep::MSE(layer->forward(x), target)->backward();
+        std::vector<NSP> checked { x, layer->weightsIh, layer->weightsHh, layer->biasesIh, layer->biasesHh };
+        for (NSP &param: checked)
+        {
+            for (Eigen::Index i=0; i<param->data.size(); i+=2)
+            {
+                const double saved { param->data(i) };
+                param->data(i) = saved + 1e-6;
+                const double up { Deep::MSE(layer->forward(x), target)->data(0, 0) };
+                param->data(i) = saved - 1e-6;
+                const double down { Deep::MSE(layer->forward(x), target)->data(0, 0) };
+                param->data(i) = saved;
+                [[maybe_unused]] const double numeric { (up - down) / 2e-6 };
+                assert(std::abs(param->gradient(i) - numeric) < 1e-6);
+            }
+        }
+
+        // The parallel executor serves the operands from the same walk, and
+        // a retained graph walks the steps again on the next backward.
+        const Eigen::MatrixXd expected { layer->weightsHh->gradient };
+        layer->weightsHh->zeroGrad();
+        NSP loss { Deep::MSE(layer->forward(x), target) };
+        Deep::Autograd::backward(loss, true);
+        assert(layer->weightsHh->gradient.isApprox(expected, 1e-12));
+        Deep::Autograd::backward(loss);
+        assert(layer->weightsHh->gradient.isApprox(2.0 * expected, 1e-12));
+        layer->weightsHh->zeroGrad();
+    }
+
+    // Without recording, no step is kept.
+    {
+    Deep::NoGradGuard guard {};
+    NSP y { gru.forward(x) };
+    assert(y->gradientFunction == Deep::gradFn::none && y->saved == nullptr);
+    }
+    bool thrown { false };
+    try
+    {
+        lstm.forward(std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(B, 5)));
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "Recurrent layers unittest passed.\n";
+    return 0;
+}
+
+int testAttention()
+{
+    Deep::gen.seed(31);
+    const int B { 2 };
+    const int L { 7 };
+    const int E { 6 };
+    const int H { 2 };
+    // Blocks of 3 leave a partial tile at the end of every sequence.
+    Deep::MultiHeadAttention attention(E, H, 3);
+    attention.biasesIn->data.setRandom();
+    attention.biasesOut->data.setRandom();
+    NSP x { std::make_shared<Deep::Node>(Eigen::MatrixXd::Random(B, L * E), Deep::gradFn::accumulateGrad) };
+    NSP y { attention.forward(x) };
+    assert(y->gradientFunction == Deep::gradFn::attentionBackward && y->data.rows() == B && y->data.cols() == L * E);
+
+    // Same as softmax(Q K^T / sqrt(d)) V over the whole [L, L] scores of every head.
+    const int d { E / H };
+    for (int b=0; b<B; ++b)
+    {
+        Eigen::MatrixXd tokens(L, E);
+        for (int t=0; t<L; ++t)
+            tokens.row(t) = x->data.block(b, t * E, 1, E);
+        const Eigen::MatrixXd qkv { (tokens * attention.weightsIn->data.transpose()).rowwise()
+            + attention.biasesIn->data.col(0).transpose() };
+        Eigen::MatrixXd heads(L, E);
+        for (int h=0; h<H; ++h)
+        {
+            Eigen::MatrixXd scores { qkv.middleCols(h * d, d) * qkv.middleCols(E + h * d, d).transpose() / std::sqrt(d) };
+            scores = (scores.colwise() - scores.rowwise().maxCoeff()).array().exp();
+            scores = scores.array().colwise() / scores.rowwise().sum().array();
+            heads.middleCols(h * d, d) = scores * qkv.middleCols(2 * E + h * d, d);
+        }
+        const Eigen::MatrixXd expected { (heads * attention.weightsOut->data.transpose()).rowwise()
+            + attention.biasesOut->data.col(0).transpose() };
+        for (int t=0; t<L; ++t)
+            assert(y->data.block(b, t * E, 1, E).isApprox(expected.row(t), 1e-12));
+    }
+
+    // Gradients of every operand against central differences.
+    const Eigen::MatrixXd target { Eigen::MatrixXd::Random(B, L * E) };
+    Deep::MSE(y, target)->backward();
+    std::vector<NSP> checked { x, attention.weightsIn, attention.biasesIn, attention.weightsOut, attention.biasesOut };
+    for (NSP &param: checked)
+    {
+        for (Eigen::Index i=0; i<param->data.size(); i+=3)
+        {
+            const double saved { param->data(i) };
+            param->data(i) = saved + 1e-6;
+            const double up { Deep::MSE(attention.forward(x), target)->data(0, 0) };
+            param->data(i) = saved - 1e-6;
+            const double down { Deep::MSE(attention.forward(x), target)->data(0, 0) };
+            param->data(i) = saved;
+            [[maybe_unused]] const double numeric { (up - down) / 2e-6 };
+            assert(std::abs(param->gradient(i) - numeric) < 1e-6);
+        }
+    }
+    // The tile size doesn't change the result, and the parallel executor
+    // serves x, Win and bIn from the same backward of the tiles.
+    const Eigen::MatrixXd expected { x->gradient };
+    x->zeroGrad();
+    NSP single { Deep::multiHeadAttention(x, attention.weightsIn, attention.biasesIn,
+        attention.weightsOut, attention.biasesOut, H, L) };
+    assert(single->data.isApprox(y->data, 1e-12));
+    Deep::Autograd::backward(Deep::MSE(single, target));
+    assert(x->gradient.isApprox(expected, 1e-12));
+
+    {
+    Deep::NoGradGuard guard {};
+    assert(attention.forward(x)->saved == nullptr);
+    }
+    bool thrown { false };
+    try
+    {
+        Deep::MultiHeadAttention(E, 4);
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "Blockwise attention unittest passed.\n";
+    return 0;
+}
+
 int main()
 {
     testNode();
     testLayer();
+    testServing();
+    testQuantize();
+    testPrune();
+    testFixed();
+    testParallel();
+    testAutograd();
+    testCrossEntropy();
+    testInplace();
+    testReleaseGraph();
+    testGraphExport();
+    testGraphPasses();
+    testHalf();
+    testConv();
+    testBatchNorm();
+    testDistributed();
+    testFusion();
+    testEval();
+    testHogwild();
+    testEnsemble();
+    testExport();
+    testAffineT();
+    testEmbedding();
+    testRecurrent();
+    testAttention();
 
     return 0;
 }
\ No newline at end of file